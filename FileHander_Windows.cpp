@@ -1,6 +1,12 @@
 #include "FileHandler_Windows.h"
 
 #include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 WindowsFileHandler::WindowsFileHandler() : _file(NULL) {
     _currentFilename[0] = '\0';
@@ -79,3 +85,27 @@ bool WindowsFileHandler::seekToEnd() {
         return false;
     return (fseek(_file, 0, SEEK_END) == 0);
 }
+
+bool WindowsFileHandler::remove(const char* filename) {
+    return (::remove(filename) == 0);
+}
+
+// Replaces newName in one step, so a crash leaves either the old or the new file.
+bool WindowsFileHandler::rename(const char* oldName, const char* newName) {
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows.
+    return MoveFileExA(oldName, newName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return (::rename(oldName, newName) == 0);
+#endif
+}
+
+bool WindowsFileHandler::truncate(uint32_t size) {
+    if (_file == NULL || fflush(_file) != 0)
+        return false;
+#ifdef _WIN32
+    return (_chsize(_fileno(_file), (long)size) == 0);
+#else
+    return (ftruncate(fileno(_file), (off_t)size) == 0);
+#endif
+}
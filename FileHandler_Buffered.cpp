@@ -0,0 +1,132 @@
+#include "FileHandler_Buffered.h"
+
+#include <string.h>
+
+BufferedFileHandler::BufferedFileHandler(IFileHandler& inner, uint8_t* buffer, size_t bufferSize,
+    uint32_t commitIntervalMs, MillisFunction millis)
+    : _inner(inner), _buffer(buffer), _capacity(bufferSize), _used(0), _bufferStart(0),
+    _position(0), _commitInterval(millis ? commitIntervalMs : 0), _millis(millis), _firstWriteTime(0) {
+}
+
+BufferedFileHandler::~BufferedFileHandler() {
+    close();
+}
+
+bool BufferedFileHandler::open(const char* filename, const char* mode) {
+    if (!flushBuffer())
+        return false;
+    if (!_inner.open(filename, mode))
+        return false;
+    _position = 0;
+    return true;
+}
+
+void BufferedFileHandler::close() {
+    flushBuffer();
+    _inner.close();
+    _position = 0;
+}
+
+bool BufferedFileHandler::seek(uint32_t offset) {
+    // Staying at the end of the buffered range keeps the pending data.
+    if (_used > 0 && offset != _bufferStart + _used && !flushBuffer())
+        return false;
+    _position = offset;
+    return true;
+}
+
+bool BufferedFileHandler::seekToEnd() {
+    if (!_inner.seekToEnd())
+        return false;
+    uint32_t end = _inner.tell();
+    // Buffered bytes past the end of the file extend it.
+    if (_used > 0 && _bufferStart + _used > end)
+        end = _bufferStart + static_cast<uint32_t>(_used);
+    return seek(end);
+}
+
+uint32_t BufferedFileHandler::tell() {
+    return _position;
+}
+
+bool BufferedFileHandler::read(uint8_t* buffer, size_t size, size_t& bytesRead) {
+    bytesRead = 0;
+    if (!flushBuffer() || !_inner.seek(_position))
+        return false;
+    bool ok = _inner.read(buffer, size, bytesRead);
+    _position += static_cast<uint32_t>(bytesRead);
+    return ok;
+}
+
+bool BufferedFileHandler::write(const uint8_t* buffer, size_t size, size_t& bytesWritten) {
+    bytesWritten = 0;
+    if (_capacity == 0) {
+        // No buffer: pass straight through.
+        if (!_inner.seek(_position))
+            return false;
+        bool ok = _inner.write(buffer, size, bytesWritten);
+        _position += static_cast<uint32_t>(bytesWritten);
+        return ok;
+    }
+
+    while (bytesWritten < size) {
+        if (_used > 0 && _position != _bufferStart + _used && !flushBuffer())
+            return false;
+        if (_used == 0) {
+            _bufferStart = _position;
+            if (_commitInterval)
+                _firstWriteTime = _millis();
+        }
+        // Fill up to the next multiple of the buffer size in the file.
+        size_t limit = _capacity - (_bufferStart % _capacity);
+        size_t chunk = size - bytesWritten;
+        if (chunk > limit - _used)
+            chunk = limit - _used;
+        memcpy(&_buffer[_used], &buffer[bytesWritten], chunk);
+        _used += chunk;
+        _position += static_cast<uint32_t>(chunk);
+        bytesWritten += chunk;
+        if (_used == limit && !flushBuffer())
+            return false;
+    }
+    return poll();
+}
+
+bool BufferedFileHandler::flush() {
+    if (!flushBuffer())
+        return false;
+    return _inner.flush();
+}
+
+const uint8_t* BufferedFileHandler::map(uint32_t offset, size_t length) {
+    if (!flushBuffer())
+        return nullptr;
+    return _inner.map(offset, length);
+}
+
+bool BufferedFileHandler::truncate(uint32_t size) {
+    if (!flushBuffer() || !_inner.truncate(size))
+        return false;
+    if (_position > size)
+        _position = size;
+    return true;
+}
+
+bool BufferedFileHandler::poll() {
+    if (_used == 0 || _commitInterval == 0)
+        return true;
+    if (_millis() - _firstWriteTime < _commitInterval)
+        return true;
+    return flushBuffer();
+}
+
+bool BufferedFileHandler::flushBuffer() {
+    if (_used == 0)
+        return true;
+    size_t bytesWritten = 0;
+    if (!_inner.seek(_bufferStart) ||
+        !_inner.write(_buffer, _used, bytesWritten) || bytesWritten != _used)
+        return false;
+    _used = 0;
+    return true;
+}
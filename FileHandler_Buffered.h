@@ -0,0 +1,88 @@
+#ifndef FILEHANDLER_BUFFERED_H
+#define FILEHANDLER_BUFFERED_H
+
+#include "IFileHandler.h"
+
+// Write-behind decorator for any IFileHandler.
+//
+// Sequential writes are collected in a caller-supplied RAM buffer and handed
+// to the wrapped handler in one piece. The buffer is written when it reaches
+// the next multiple of its own size in the file (so a 512-byte or 4 KiB buffer
+// produces sector-aligned programs once the first partial sector is out), when
+// a write or seek leaves the buffered range, before any read, on flush() or
+// close(), and once the optional commit interval has passed since the oldest
+// buffered byte was written.
+//
+// With DBEngine use DB_MODE_SESSION: safe mode closes the file after every
+// operation, which also flushes the buffer.
+class BufferedFileHandler : public IFileHandler {
+public:
+    // Returns a millisecond tick count; used for the commit interval.
+    typedef uint32_t (*MillisFunction)(void);
+
+    // buffer/bufferSize: RAM used for pending writes; bufferSize should be a
+    // multiple of the media's sector size. A commitIntervalMs of 0 disables the
+    // time limit (millis may then be nullptr).
+    BufferedFileHandler(IFileHandler& inner, uint8_t* buffer, size_t bufferSize,
+        uint32_t commitIntervalMs = 0, MillisFunction millis = nullptr);
+    virtual ~BufferedFileHandler();
+
+    // Open the file with the given mode (e.g., "rb", "wb", "rb+", "ab").
+    virtual bool open(const char* filename, const char* mode) override;
+
+    // Flush pending writes and close the file.
+    virtual void close() override;
+
+    // Seek to the specified offset. Pending writes are kept if the offset is
+    // where the next buffered write would go.
+    virtual bool seek(uint32_t offset) override;
+
+    // Seek to the end of the file, counting bytes that are still buffered.
+    virtual bool seekToEnd() override;
+
+    // Return the current file position.
+    virtual uint32_t tell() override;
+
+    // Read 'size' bytes into buffer. Pending writes are flushed first.
+    virtual bool read(uint8_t* buffer, size_t size, size_t& bytesRead) override;
+
+    // Write 'size' bytes from buffer into the write-behind buffer.
+    virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override;
+
+    // Write pending data and flush the wrapped handler.
+    virtual bool flush() override;
+
+    // Maps through the wrapped handler after writing pending data.
+    virtual const uint8_t* map(uint32_t offset, size_t length) override;
+
+    // File management is passed through to the wrapped handler.
+    virtual bool remove(const char* filename) override { return _inner.remove(filename); }
+    virtual bool rename(const char* oldName, const char* newName) override { return _inner.rename(oldName, newName); }
+
+    // Writes pending data, then truncates through the wrapped handler.
+    virtual bool truncate(uint32_t size) override;
+
+    // Writes pending data if the commit interval has expired. Call this from
+    // the application's idle loop so that data does not sit in RAM indefinitely
+    // when no further writes arrive.
+    bool poll();
+
+    // Number of bytes currently waiting in the buffer.
+    size_t pendingBytes() const { return _used; }
+
+private:
+    // Hands the buffered bytes to the wrapped handler.
+    bool flushBuffer();
+
+    IFileHandler& _inner;
+    uint8_t* _buffer;
+    size_t _capacity;
+    size_t _used;             // Bytes waiting in _buffer.
+    uint32_t _bufferStart;    // File offset of _buffer[0].
+    uint32_t _position;       // Logical file position seen by the caller.
+    uint32_t _commitInterval; // Milliseconds; 0 = no time limit.
+    MillisFunction _millis;
+    uint32_t _firstWriteTime; // _millis() when the oldest pending byte was written.
+};
+
+#endif // FILEHANDLER_BUFFERED_H
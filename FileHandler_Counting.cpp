@@ -0,0 +1,71 @@
+#include "FileHandler_Counting.h"
+
+CountingFileHandler::CountingFileHandler(IFileHandler& inner) : _inner(inner) {
+    resetStats();
+}
+
+void CountingFileHandler::getStats(FileIOStats& stats) const {
+    stats.opens = _opens;
+    stats.seeks = _seeks;
+    stats.reads = _reads;
+    stats.writes = _writes;
+    stats.flushes = _flushes;
+    stats.bytesRead = _bytesRead;
+    stats.bytesWritten = _bytesWritten;
+}
+
+void CountingFileHandler::resetStats() {
+    _opens = 0;
+    _seeks = 0;
+    _reads = 0;
+    _writes = 0;
+    _flushes = 0;
+    _bytesRead = 0;
+    _bytesWritten = 0;
+}
+
+bool CountingFileHandler::open(const char* filename, const char* mode) {
+    if (!_inner.open(filename, mode))
+        return false;
+    _opens++;
+    return true;
+}
+
+bool CountingFileHandler::seek(uint32_t offset) {
+    _seeks++;
+    return _inner.seek(offset);
+}
+
+bool CountingFileHandler::seekToEnd() {
+    _seeks++;
+    return _inner.seekToEnd();
+}
+
+bool CountingFileHandler::read(uint8_t* buffer, size_t size, size_t& bytesRead) {
+    bool ok = _inner.read(buffer, size, bytesRead);
+    _reads++;
+    _bytesRead += bytesRead;
+    return ok;
+}
+
+bool CountingFileHandler::write(const uint8_t* buffer, size_t size, size_t& bytesWritten) {
+    bool ok = _inner.write(buffer, size, bytesWritten);
+    _writes++;
+    _bytesWritten += bytesWritten;
+    return ok;
+}
+
+bool CountingFileHandler::flush() {
+    _flushes++;
+    return _inner.flush();
+}
+
+// A handler without positional reads returns false and the engine falls back
+// to seek() and read(), which are counted then.
+bool CountingFileHandler::readAt(uint32_t offset, uint8_t* buffer, size_t size, size_t& bytesRead) {
+    if (!_inner.readAt(offset, buffer, size, bytesRead))
+        return false;
+    _reads++;
+    _bytesRead += bytesRead;
+    return true;
+}
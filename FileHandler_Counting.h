@@ -0,0 +1,71 @@
+#ifndef FILEHANDLER_COUNTING_H
+#define FILEHANDLER_COUNTING_H
+
+#include "IFileHandler.h"
+
+#if DB_THREAD_SAFE
+#include <atomic>
+#endif
+
+// Calls and bytes that passed a CountingFileHandler, i.e. the work DBEngine
+// asked of the medium. Counts wrap around at 2^32, byte totals at 2^64.
+struct FileIOStats {
+    uint32_t opens;         // Successful open() calls.
+    uint32_t seeks;         // seek() and seekToEnd() calls.
+    uint32_t reads;         // read() and successful readAt() calls.
+    uint32_t writes;        // write() calls.
+    uint32_t flushes;       // flush() calls.
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+};
+
+// Counting decorator for any IFileHandler, e.g. around the SD card handler of
+// a device or between DBEngine and the handler under test. Each call costs one
+// or two additions; nothing is allocated. With DB_THREAD_SAFE the counters are
+// atomic, as DBEngine readers may call readAt() from several threads.
+class CountingFileHandler : public IFileHandler {
+public:
+    explicit CountingFileHandler(IFileHandler& inner);
+
+    // Returns the counters accumulated since construction or resetStats().
+    void getStats(FileIOStats& stats) const;
+
+    // Sets all counters to zero.
+    void resetStats();
+
+    virtual bool open(const char* filename, const char* mode) override;
+    virtual void close() override { _inner.close(); }
+    virtual bool seek(uint32_t offset) override;
+    virtual bool seekToEnd() override;
+    virtual uint32_t tell() override { return _inner.tell(); }
+    virtual bool read(uint8_t* buffer, size_t size, size_t& bytesRead) override;
+    virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override;
+    virtual bool flush() override;
+    virtual const uint8_t* map(uint32_t offset, size_t length) override { return _inner.map(offset, length); }
+    virtual bool readAt(uint32_t offset, uint8_t* buffer, size_t size, size_t& bytesRead) override;
+
+    // File management is passed through to the wrapped handler.
+    virtual bool remove(const char* filename) override { return _inner.remove(filename); }
+    virtual bool rename(const char* oldName, const char* newName) override { return _inner.rename(oldName, newName); }
+    virtual bool truncate(uint32_t size) override { return _inner.truncate(size); }
+
+private:
+#if DB_THREAD_SAFE
+    typedef std::atomic<uint32_t> Count;
+    typedef std::atomic<uint64_t> Bytes;
+#else
+    typedef uint32_t Count;
+    typedef uint64_t Bytes;
+#endif
+
+    IFileHandler& _inner;
+    Count _opens;
+    Count _seeks;
+    Count _reads;
+    Count _writes;
+    Count _flushes;
+    Bytes _bytesRead;
+    Bytes _bytesWritten;
+};
+
+#endif // FILEHANDLER_COUNTING_H
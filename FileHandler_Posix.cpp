@@ -0,0 +1,210 @@
+#include "FileHandler_Posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PosixFileHandler::PosixFileHandler(AccessPattern pattern)
+    : _fd(-1), _append(false), _position(0), _pattern(pattern), _mapping(NULL), _mappingSize(0) {
+    _currentFilename[0] = '\0';
+}
+
+PosixFileHandler::~PosixFileHandler() {
+    close();
+}
+
+bool PosixFileHandler::open(const char* filename, const char* mode) {
+    // If a file is already open and the filename matches, reuse it.
+    if (_fd >= 0 && strcmp(_currentFilename, filename) == 0)
+        return true;
+    if (_fd >= 0)
+        close();
+
+    // Translate the fopen() mode string; 'b' has no meaning here.
+    bool update = strchr(mode, '+') != NULL;
+    int flags;
+    switch (mode[0]) {
+    case 'r': flags = update ? O_RDWR : O_RDONLY; break;
+    case 'w': flags = (update ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC; break;
+    case 'a': flags = (update ? O_RDWR : O_WRONLY) | O_CREAT; break;
+    default: return false;
+    }
+
+    int fd;
+    do {
+        fd = ::open(filename, flags, 0644);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return false;
+
+    _fd = fd;
+    _append = (mode[0] == 'a');
+    _position = 0;
+    strncpy(_currentFilename, filename, MAX_PATH_LENGTH - 1);
+    _currentFilename[MAX_PATH_LENGTH - 1] = '\0';
+    applyAccessPattern();
+    return true;
+}
+
+void PosixFileHandler::close() {
+    if (_fd >= 0) {
+        unmap();
+        ::close(_fd);
+        _fd = -1;
+        _position = 0;
+        _currentFilename[0] = '\0';
+    }
+}
+
+bool PosixFileHandler::seek(uint32_t offset) {
+    if (_fd < 0)
+        return false;
+    _position = offset;
+    return true;
+}
+
+bool PosixFileHandler::seekToEnd() {
+    if (_fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+        return false;
+    _position = (uint32_t)st.st_size;
+    return true;
+}
+
+uint32_t PosixFileHandler::tell() {
+    if (_fd < 0)
+        return 0;
+    return _position;
+}
+
+bool PosixFileHandler::read(uint8_t* buffer, size_t size, size_t& bytesRead) {
+    bytesRead = 0;
+    if (_fd < 0)
+        return false;
+    while (bytesRead < size) {
+        ssize_t n = pread(_fd, buffer + bytesRead, size - bytesRead, (off_t)_position);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;  // Error or end of file.
+        bytesRead += (size_t)n;
+        _position += (uint32_t)n;
+    }
+    return (bytesRead == size);
+}
+
+bool PosixFileHandler::readAt(uint32_t offset, uint8_t* buffer, size_t size, size_t& bytesRead) {
+    bytesRead = 0;
+    if (_fd < 0)
+        return false;
+    while (bytesRead < size) {
+        ssize_t n = pread(_fd, buffer + bytesRead, size - bytesRead, (off_t)offset + (off_t)bytesRead);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;  // End of file.
+        bytesRead += (size_t)n;
+    }
+    return true;
+}
+
+bool PosixFileHandler::write(const uint8_t* buffer, size_t size, size_t& bytesWritten) {
+    bytesWritten = 0;
+    if (_fd < 0)
+        return false;
+    if (_append && !seekToEnd())
+        return false;
+    while (bytesWritten < size) {
+        ssize_t n = pwrite(_fd, buffer + bytesWritten, size - bytesWritten, (off_t)_position);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        bytesWritten += (size_t)n;
+        _position += (uint32_t)n;
+    }
+    return (bytesWritten == size);
+}
+
+bool PosixFileHandler::flush() {
+    if (_fd < 0)
+        return false;
+#if defined(__APPLE__)
+    return (fsync(_fd) == 0);
+#else
+    return (fdatasync(_fd) == 0);
+#endif
+}
+
+const uint8_t* PosixFileHandler::map(uint32_t offset, size_t length) {
+    if (_fd < 0 || length == 0)
+        return NULL;
+    size_t end = (size_t)offset + length;
+    if (end > _mappingSize) {
+        // The file has grown past the mapping (or nothing is mapped yet).
+        struct stat st;
+        if (fstat(_fd, &st) != 0 || (size_t)st.st_size < end)
+            return NULL;
+        unmap();
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        _mapping = (uint8_t*)p;
+        _mappingSize = (size_t)st.st_size;
+    }
+    return _mapping + offset;
+}
+
+bool PosixFileHandler::remove(const char* filename) {
+    return (unlink(filename) == 0);
+}
+
+bool PosixFileHandler::rename(const char* oldName, const char* newName) {
+    return (::rename(oldName, newName) == 0);
+}
+
+bool PosixFileHandler::truncate(uint32_t size) {
+    if (_fd < 0)
+        return false;
+    // Pages past the new end must not stay mapped.
+    unmap();
+    if (ftruncate(_fd, (off_t)size) != 0)
+        return false;
+    if (_position > size)
+        _position = size;
+    return true;
+}
+
+void PosixFileHandler::setAccessPattern(AccessPattern pattern) {
+    _pattern = pattern;
+    if (_fd >= 0)
+        applyAccessPattern();
+}
+
+void PosixFileHandler::applyAccessPattern() {
+#if defined(POSIX_FADV_NORMAL)
+    int advice = POSIX_FADV_NORMAL;
+    if (_pattern == ACCESS_SEQUENTIAL)
+        advice = POSIX_FADV_SEQUENTIAL;
+    else if (_pattern == ACCESS_RANDOM)
+        advice = POSIX_FADV_RANDOM;
+    // Only a hint; failure is harmless.
+    (void)posix_fadvise(_fd, 0, 0, advice);
+#endif
+}
+
+void PosixFileHandler::unmap() {
+    if (_mapping != NULL) {
+        munmap(_mapping, _mappingSize);
+        _mapping = NULL;
+        _mappingSize = 0;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef FILEHANDLER_POSIX_H
+#define FILEHANDLER_POSIX_H
+
+#include "IFileHandler.h"
+
+#ifndef MAX_PATH_LENGTH
+#define MAX_PATH_LENGTH 13  // 8.3 filename: 8+1+3+1
+#endif
+
+// IFileHandler for POSIX hosts (Linux gateways) built on open/pread/pwrite.
+// The file position is kept in the handler, so seek() and tell() never reach
+// the kernel and there is no stdio buffering in between. flush() calls
+// fdatasync(); close() does not, matching the engine's sync() contract.
+// map() maps the whole file read-only and serves DBEngine::getView().
+class PosixFileHandler : public IFileHandler {
+public:
+    // Access pattern hint passed to posix_fadvise() whenever a file is opened.
+    enum AccessPattern {
+        ACCESS_NORMAL,
+        ACCESS_SEQUENTIAL, // Log scans and replays.
+        ACCESS_RANDOM      // Index probes and keyed lookups.
+    };
+
+    explicit PosixFileHandler(AccessPattern pattern = ACCESS_NORMAL);
+    virtual ~PosixFileHandler();
+
+    // Open the file with the given mode (e.g., "rb", "wb", "rb+", "ab").
+    virtual bool open(const char* filename, const char* mode) override;
+
+    // Close the file.
+    virtual void close() override;
+
+    // Seek to the specified offset.
+    virtual bool seek(uint32_t offset) override;
+
+    // Seek to the end of the file.
+    virtual bool seekToEnd() override;
+
+    // Return the current file position.
+    virtual uint32_t tell() override;
+
+    // Read 'size' bytes into buffer. Returns true if successful; bytesRead is updated.
+    virtual bool read(uint8_t* buffer, size_t size, size_t& bytesRead) override;
+
+    // Positional read (pread); thread-safe, leaves the file position alone.
+    virtual bool readAt(uint32_t offset, uint8_t* buffer, size_t size, size_t& bytesRead) override;
+
+    // Write 'size' bytes from buffer. Returns true if successful; bytesWritten is updated.
+    virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override;
+
+    // Commit written data to the storage medium (fdatasync).
+    virtual bool flush() override;
+
+    // Map [offset, offset + length) of the file; remaps when the file has grown.
+    virtual const uint8_t* map(uint32_t offset, size_t length) override;
+
+    // Delete a file.
+    virtual bool remove(const char* filename) override;
+
+    // Atomically rename a file, replacing newName if it exists.
+    virtual bool rename(const char* oldName, const char* newName) override;
+
+    // Shorten the open file to 'size' bytes (ftruncate); drops the mapping.
+    virtual bool truncate(uint32_t size) override;
+
+    // Changes the access hint; applied to the open file immediately.
+    void setAccessPattern(AccessPattern pattern);
+
+private:
+    void applyAccessPattern();
+    void unmap();
+
+    int _fd;
+    bool _append;          // Opened with "a": every write goes to the end.
+    uint32_t _position;
+    AccessPattern _pattern;
+    uint8_t* _mapping;
+    size_t _mappingSize;
+    char _currentFilename[MAX_PATH_LENGTH];
+};
+
+#endif // FILEHANDLER_POSIX_H
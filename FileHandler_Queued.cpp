@@ -0,0 +1,118 @@
+#include "FileHandler_Queued.h"
+
+QueuedFileHandler::QueuedFileHandler(IFileHandler& inner)
+    : _inner(inner), _first(0), _count(0) {
+}
+
+QueuedFileHandler::~QueuedFileHandler() {
+    finish();
+}
+
+bool QueuedFileHandler::open(const char* filename, const char* mode) {
+    finish();
+    return _inner.open(filename, mode);
+}
+
+void QueuedFileHandler::close() {
+    finish();
+    _inner.close();
+}
+
+bool QueuedFileHandler::seek(uint32_t offset) {
+    finish();
+    return _inner.seek(offset);
+}
+
+bool QueuedFileHandler::seekToEnd() {
+    finish();
+    return _inner.seekToEnd();
+}
+
+uint32_t QueuedFileHandler::tell() {
+    finish();
+    return _inner.tell();
+}
+
+bool QueuedFileHandler::read(uint8_t* buffer, size_t size, size_t& bytesRead) {
+    finish();
+    return _inner.read(buffer, size, bytesRead);
+}
+
+bool QueuedFileHandler::write(const uint8_t* buffer, size_t size, size_t& bytesWritten) {
+    finish();
+    return _inner.write(buffer, size, bytesWritten);
+}
+
+bool QueuedFileHandler::flush() {
+    finish();
+    return _inner.flush();
+}
+
+const uint8_t* QueuedFileHandler::map(uint32_t offset, size_t length) {
+    finish();
+    return _inner.map(offset, length);
+}
+
+bool QueuedFileHandler::remove(const char* filename) {
+    finish();
+    return _inner.remove(filename);
+}
+
+bool QueuedFileHandler::rename(const char* oldName, const char* newName) {
+    finish();
+    return _inner.rename(oldName, newName);
+}
+
+bool QueuedFileHandler::truncate(uint32_t size) {
+    finish();
+    return _inner.truncate(size);
+}
+
+bool QueuedFileHandler::submitWrite(uint32_t offset, const uint8_t* data, size_t size,
+    Completion done, void* context) {
+    // The buffer is only read for a write.
+    return submit(true, offset, const_cast<uint8_t*>(data), size, done, context);
+}
+
+bool QueuedFileHandler::submitRead(uint32_t offset, uint8_t* buffer, size_t size,
+    Completion done, void* context) {
+    return submit(false, offset, buffer, size, done, context);
+}
+
+bool QueuedFileHandler::submit(bool write, uint32_t offset, uint8_t* buffer, size_t size,
+    Completion done, void* context) {
+    if (_count == QUEUE_DEPTH)
+        return false;
+    Request& request = _queue[(_first + _count) % QUEUE_DEPTH];
+    request.write = write;
+    request.offset = offset;
+    request.buffer = buffer;
+    request.size = size;
+    request.done = done;
+    request.context = context;
+    _count++;
+    return true;
+}
+
+bool QueuedFileHandler::poll() {
+    if (_count == 0)
+        return false;
+    // Taken off the queue first, so the completion sees the handler idle.
+    Request request = _queue[_first];
+    _first = (_first + 1) % QUEUE_DEPTH;
+    _count--;
+
+    size_t bytes = 0;
+    bool ok = _inner.seek(request.offset) &&
+        (request.write ? _inner.write(request.buffer, request.size, bytes)
+            : _inner.read(request.buffer, request.size, bytes)) &&
+        bytes == request.size;
+    if (request.done)
+        request.done(request.context, ok);
+    return _count > 0;
+}
+
+void QueuedFileHandler::finish() {
+    while (poll()) {
+    }
+}
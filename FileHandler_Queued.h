@@ -0,0 +1,69 @@
+#ifndef FILEHANDLER_QUEUED_H
+#define FILEHANDLER_QUEUED_H
+
+#include "IAsyncFileHandler.h"
+
+// IAsyncFileHandler on top of any blocking IFileHandler.
+//
+// Requests are queued and carried out one per poll() call, the way a DMA
+// driver finishes its transfers in the background while the application goes
+// on. On a host this lets the asynchronous paths of DBEngine (appendAsync())
+// run against ordinary files; on a target it is the reference for a driver
+// that starts each transfer on the SPI/DMA channel and completes it from its
+// own poll().
+//
+// The blocking calls finish all outstanding requests first.
+class QueuedFileHandler : public IAsyncFileHandler {
+public:
+    static const size_t QUEUE_DEPTH = 4;
+
+    explicit QueuedFileHandler(IFileHandler& inner);
+    virtual ~QueuedFileHandler();
+
+    virtual bool open(const char* filename, const char* mode) override;
+    virtual void close() override;
+    virtual bool seek(uint32_t offset) override;
+    virtual bool seekToEnd() override;
+    virtual uint32_t tell() override;
+    virtual bool read(uint8_t* buffer, size_t size, size_t& bytesRead) override;
+    virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override;
+    virtual bool flush() override;
+    virtual const uint8_t* map(uint32_t offset, size_t length) override;
+    virtual bool remove(const char* filename) override;
+    virtual bool rename(const char* oldName, const char* newName) override;
+    virtual bool truncate(uint32_t size) override;
+
+    // Queue a request; false if QUEUE_DEPTH requests are already outstanding.
+    virtual bool submitWrite(uint32_t offset, const uint8_t* data, size_t size,
+        Completion done, void* context) override;
+    virtual bool submitRead(uint32_t offset, uint8_t* buffer, size_t size,
+        Completion done, void* context) override;
+
+    // Carries out the oldest outstanding request and runs its completion.
+    virtual bool poll() override;
+
+    // Number of requests not yet completed.
+    size_t outstanding() const { return _count; }
+
+private:
+    struct Request {
+        bool write;
+        uint32_t offset;
+        uint8_t* buffer;
+        size_t size;
+        Completion done;
+        void* context;
+    };
+
+    bool submit(bool write, uint32_t offset, uint8_t* buffer, size_t size, Completion done, void* context);
+
+    // Completes every outstanding request.
+    void finish();
+
+    IFileHandler& _inner;
+    Request _queue[QUEUE_DEPTH];
+    size_t _first;            // Index of the oldest request in _queue.
+    size_t _count;            // Requests in _queue.
+};
+
+#endif // FILEHANDLER_QUEUED_H
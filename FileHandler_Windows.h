@@ -33,8 +33,17 @@ public:
     // Write 'size' bytes from buffer. Returns true if successful; bytesWritten is updated.
     virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override;
 
-    // Optionally flush the file.
-    bool flush();
+    // Flush buffered writes to the file.
+    virtual bool flush() override;
+
+    // Delete a file.
+    virtual bool remove(const char* filename) override;
+
+    // Rename a file, replacing newName if it exists.
+    virtual bool rename(const char* oldName, const char* newName) override;
+
+    // Shorten the open file to 'size' bytes.
+    virtual bool truncate(uint32_t size) override;
 
 private:
     FILE* _file;
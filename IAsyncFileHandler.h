@@ -0,0 +1,38 @@
+#ifndef IASYNCFILEHANDLER_H
+#define IASYNCFILEHANDLER_H
+
+#include "IFileHandler.h"
+
+// Asynchronous extension of IFileHandler for media driven in the background,
+// e.g. an SD card on a DMA-SPI channel. A request is queued with
+// submitWrite()/submitRead() and returns at once; poll() advances the transfers
+// and runs the completion of each finished request.
+//
+// The blocking IFileHandler calls are only made while no request is
+// outstanding; DBEngine waits for its queued writes before it uses them.
+class IAsyncFileHandler : public IFileHandler {
+public:
+    // Completion of one request; 'ok' tells whether all of its bytes were
+    // transferred. Completions run from poll(), in submission order, never from
+    // an interrupt handler, and may not submit new requests.
+    typedef void (*Completion)(void* context, bool ok);
+
+    // Queue a write of 'size' bytes at 'offset' of the open file. 'data' must
+    // stay valid and unchanged until the completion has run. Returns false if
+    // the request cannot be queued; the completion is not called then.
+    virtual bool submitWrite(uint32_t offset, const uint8_t* data, size_t size,
+        Completion done, void* context) = 0;
+
+    // Queue a read of 'size' bytes at 'offset' into 'buffer', which belongs to
+    // the handler until the completion has run. Returns false if the request
+    // cannot be queued.
+    virtual bool submitRead(uint32_t offset, uint8_t* buffer, size_t size,
+        Completion done, void* context) = 0;
+
+    // Advance the outstanding requests and run the completions of those that
+    // have finished. Returns true while requests are still outstanding.
+    virtual bool poll() = 0;
+};
+
+
+#endif // IASYNCFILEHANDLER_H
@@ -30,6 +30,34 @@ public:
     // Write 'size' bytes from buffer. Returns true if successful;
     // bytesWritten is updated.
     virtual bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) = 0;
+
+    // Commit any buffered writes to the storage medium. Handlers without
+    // their own buffering can rely on the default, which does nothing.
+    virtual bool flush() { return true; }
+
+    // Optional memory mapping. Returns a pointer to 'length' bytes of the file
+    // starting at 'offset', or nullptr if the range is not mapped (the default,
+    // and the right answer for handlers that cannot map). The pointer stays
+    // valid until the next call to map, write or close.
+    virtual const uint8_t* map(uint32_t /*offset*/, size_t /*length*/) { return nullptr; }
+
+    // Optional positional read: like seek(offset) followed by read(), but the
+    // file position is left alone and several threads may call it at once on
+    // the open file. Reaching the end of the file is not an error (bytesRead
+    // tells how much was read). Used by DBEngine lookups in DB_THREAD_SAFE
+    // builds; the default returns false, and the engine then reads under a lock.
+    virtual bool readAt(uint32_t /*offset*/, uint8_t* /*buffer*/, size_t /*size*/, size_t& /*bytesRead*/) { return false; }
+
+    // Optional file management, used by DBEngine::compact() to replace the log.
+    // rename() replaces newName if it exists. Neither file may be open in this
+    // handler. The defaults report failure.
+    virtual bool remove(const char* /*filename*/) { return false; }
+    virtual bool rename(const char* /*oldName*/, const char* /*newName*/) { return false; }
+
+    // Optional: shorten the open file to 'size' bytes, used by
+    // DBEngine::rebuildIndex() to cut off a record torn by a power loss.
+    // The position afterwards is unspecified. The default reports failure.
+    virtual bool truncate(uint32_t /*size*/) { return false; }
 };
 
 
@@ -1,65 +1,256 @@
 // Instrumentation.h
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if DB_THREAD_SAFE
+#include <atomic>
+#endif
+
+// -----------------------------------------------------------------------------
+// Scope timers
+//
+// Every SCOPE_TIMER site owns a static TimerSlot, registered on first use, so
+// timing a call costs two cycle counter reads and a few additions: no string,
+// no lock, no lookup. With DB_THREAD_SAFE the accumulators are relaxed
+// atomics, otherwise plain integers (the SAMD21 has no atomic instructions).
+// PrintInstrumentationReport() merges the slots that share a label.
+//
+// Times are in cycles of DB_PROFILE_CYCLES(): the time stamp counter on x86,
+// the virtual counter on AArch64 and DWT->CYCCNT on ARMv7-M/ARMv8-M Mainline.
+// Elsewhere (e.g. the Cortex-M0+ of the SAMD21, which has no DWT cycle
+// counter) define DB_PROFILE_CYCLES() to a free-running counter such as a
+// TC/TCC timer before including this header; hosted builds fall back to
+// std::chrono nanoseconds.
+// -----------------------------------------------------------------------------
+
+#ifndef DB_PROFILE_CYCLES
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define DB_PROFILE_CYCLES() static_cast<uint64_t>(__rdtsc())
+#elif defined(__aarch64__)
+static inline uint64_t dbProfileCycles() {
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+}
+#define DB_PROFILE_CYCLES() dbProfileCycles()
+#elif defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+// DWT->CYCCNT; InstrumentationStart() enables it.
+#define DB_PROFILE_CYCLES() static_cast<uint64_t>(*reinterpret_cast<volatile uint32_t*>(0xE0001004u))
+#define DB_PROFILE_DWT 1
+#else
 #include <chrono>
-#include <string>
-#include <unordered_map>
-#include <mutex>
-#include <cstdio>
-
-// Structure to hold timing information for one function.
-struct FunctionStats {
-    unsigned int count = 0;
-    double totalTimeMs = 0.0;
+#define DB_PROFILE_CYCLES() static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>( \
+    std::chrono::steady_clock::now().time_since_epoch()).count())
+#define DB_PROFILE_NANOSECONDS 1
+#endif
+#endif
+
+// Histogram buckets: bucket b counts calls of [2^b, 2^(b+1)) cycles.
+#define TIMER_BUCKETS 32
+
+// Accumulators of one SCOPE_TIMER site.
+struct TimerSlot {
+#if DB_THREAD_SAFE
+    typedef std::atomic<uint64_t> Counter;
+#else
+    typedef uint64_t Counter;
+#endif
+
+    const char* label;
+    Counter count;
+    Counter totalCycles;
+    Counter minCycles;
+    Counter maxCycles;
+    Counter buckets[TIMER_BUCKETS];
+    TimerSlot* next;  // Registry link, see timerSlots().
+
+    explicit TimerSlot(const char* name);
+
+    void add(uint64_t cycles) {
+#if defined(__GNUC__)
+        unsigned bucket = 63 - __builtin_clzll(cycles | 1);
+#else
+        unsigned bucket = 0;
+        for (uint64_t rest = cycles >> 1; rest != 0; rest >>= 1)
+            bucket++;
+#endif
+        if (bucket >= TIMER_BUCKETS)
+            bucket = TIMER_BUCKETS - 1;
+#if DB_THREAD_SAFE
+        count.fetch_add(1, std::memory_order_relaxed);
+        totalCycles.fetch_add(cycles, std::memory_order_relaxed);
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = minCycles.load(std::memory_order_relaxed);
+        while (cycles < seen && !minCycles.compare_exchange_weak(seen, cycles, std::memory_order_relaxed)) {}
+        seen = maxCycles.load(std::memory_order_relaxed);
+        while (cycles > seen && !maxCycles.compare_exchange_weak(seen, cycles, std::memory_order_relaxed)) {}
+#else
+        count++;
+        totalCycles += cycles;
+        buckets[bucket]++;
+        if (cycles < minCycles)
+            minCycles = cycles;
+        if (cycles > maxCycles)
+            maxCycles = cycles;
+#endif
+    }
+
+    void reset() {
+        count = 0;
+        totalCycles = 0;
+        minCycles = UINT64_MAX;
+        maxCycles = 0;
+        for (unsigned b = 0; b < TIMER_BUCKETS; b++)
+            buckets[b] = 0;
+    }
 };
 
-// Global registry for instrumentation data.
-inline std::unordered_map<std::string, FunctionStats> gFunctionStats;
-inline std::mutex gStatsMutex;
+// Head of the list of registered slots. Slots are only ever added.
+#if DB_THREAD_SAFE
+inline std::atomic<TimerSlot*>& timerSlots() {
+    static std::atomic<TimerSlot*> head(nullptr);
+    return head;
+}
+#else
+inline TimerSlot*& timerSlots() {
+    static TimerSlot* head = nullptr;
+    return head;
+}
+#endif
 
-// RAII class that records function execution time.
+inline TimerSlot::TimerSlot(const char* name) : label(name), next(nullptr) {
+    reset();
+#if DB_THREAD_SAFE
+    next = timerSlots().load(std::memory_order_relaxed);
+    while (!timerSlots().compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed)) {}
+#else
+    next = timerSlots();
+    timerSlots() = this;
+#endif
+}
+
+// Adds the cycles from construction to destruction to a slot.
 class ScopedTimer {
 public:
-    // Start the timer with the given function name.
-    ScopedTimer(const std::string& funcName)
-        : m_funcName(funcName),
-        m_start(std::chrono::high_resolution_clock::now()) {
-    }
+    explicit ScopedTimer(TimerSlot& slot) : m_slot(slot), m_start(DB_PROFILE_CYCLES()) {}
+    ~ScopedTimer() { m_slot.add(DB_PROFILE_CYCLES() - m_start); }
 
-    // On destruction, update the global stats.
-    ~ScopedTimer() {
-        auto end = std::chrono::high_resolution_clock::now();
-        double elapsedMs =
-            std::chrono::duration<double, std::milli>(end - m_start).count();
-        std::lock_guard<std::mutex> lock(gStatsMutex);
-        auto& stats = gFunctionStats[m_funcName];
-        stats.count++;
-        stats.totalTimeMs += elapsedMs;
-    }
 private:
-    std::string m_funcName;
-    std::chrono::time_point<std::chrono::high_resolution_clock> m_start;
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+
+    TimerSlot& m_slot;
+    uint64_t m_start;
 };
 
-// Utility function to print a timing report.
-inline void PrintInstrumentationReport() {
-    std::lock_guard<std::mutex> lock(gStatsMutex);
+#define DB_TIMER_CONCAT2(a, b) a##b
+#define DB_TIMER_CONCAT(a, b) DB_TIMER_CONCAT2(a, b)
 
-    if (gFunctionStats.empty()) {
-        std::printf("Instrumentation report: No stats collected.\n");
-        return;
-    }
+// Times the rest of the enclosing scope under 'name' (a string literal).
+#define DB_SCOPE_TIMER(name) \
+    static TimerSlot DB_TIMER_CONCAT(timerSlot, __LINE__)(name); \
+    ScopedTimer DB_TIMER_CONCAT(scopeTimer, __LINE__)(DB_TIMER_CONCAT(timerSlot, __LINE__))
 
-    std::printf("=== Instrumentation Timing Report ===\n");
-    std::printf("%-40s %10s %15s %15s\n", "Function", "Calls", "Total Time (ms)", "Avg Time (ms)");
+// Enables the cycle counter where it has to be switched on.
+inline void InstrumentationStart() {
+#ifdef DB_PROFILE_DWT
+    *reinterpret_cast<volatile uint32_t*>(0xE000EDFCu) |= 1u << 24;  // DEMCR.TRCENA
+    *reinterpret_cast<volatile uint32_t*>(0xE0001004u) = 0;          // DWT->CYCCNT
+    *reinterpret_cast<volatile uint32_t*>(0xE0001000u) |= 1u;        // DWT->CTRL.CYCCNTENA
+#endif
+}
+
+// Clears every slot; the slots stay registered.
+inline void ResetInstrumentation() {
+    for (TimerSlot* slot = timerSlots(); slot; slot = slot->next)
+        slot->reset();
+}
+
+// Totals of all slots with one label.
+struct TimerTotals {
+    uint64_t count;
+    uint64_t totalCycles;
+    uint64_t minCycles;
+    uint64_t maxCycles;
+    uint64_t buckets[TIMER_BUCKETS];
+};
 
-    for (const auto& pair : gFunctionStats) {
-        const std::string& name = pair.first;
-        const FunctionStats& stats = pair.second;
-        double avg = stats.count ? stats.totalTimeMs / stats.count : 0.0;
-        std::printf("%-40s %10u %15.3f %15.3f\n", name.c_str(), stats.count, stats.totalTimeMs, avg);
+// Merges every slot labelled 'label' into 'totals'. Returns false if none is.
+inline bool CollectTimer(const char* label, TimerTotals& totals) {
+    memset(&totals, 0, sizeof(totals));
+    totals.minCycles = UINT64_MAX;
+    bool found = false;
+    for (TimerSlot* slot = timerSlots(); slot; slot = slot->next) {
+        if (strcmp(slot->label, label) != 0)
+            continue;
+        found = true;
+        totals.count += slot->count;
+        totals.totalCycles += slot->totalCycles;
+        uint64_t value = slot->minCycles;
+        if (value < totals.minCycles)
+            totals.minCycles = value;
+        value = slot->maxCycles;
+        if (value > totals.maxCycles)
+            totals.maxCycles = value;
+        for (unsigned b = 0; b < TIMER_BUCKETS; b++)
+            totals.buckets[b] += slot->buckets[b];
     }
+    return found;
+}
 
-    std::printf("=====================================\n");
+// Upper bound of the histogram bucket holding quantile q (0..1) of the calls.
+inline uint64_t TimerQuantile(const TimerTotals& totals, double q) {
+    uint64_t rank = static_cast<uint64_t>(q * totals.count);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < TIMER_BUCKETS; b++) {
+        seen += totals.buckets[b];
+        if (seen > rank)
+            return (static_cast<uint64_t>(2) << b) - 1;
+    }
+    return totals.maxCycles;
 }
 
+// Utility function to print a timing report, one line per label. Quantiles
+// are bucket bounds, so they are exact to a factor of two.
+inline void PrintInstrumentationReport() {
+    bool any = false;
+    for (TimerSlot* slot = timerSlots(); slot; slot = slot->next)
+        any = any || slot->count != 0;
+    if (!any) {
+        printf("Instrumentation report: No stats collected.\n");
+        return;
+    }
+
+#ifdef DB_PROFILE_NANOSECONDS
+    const char* unit = "ns";
+#else
+    const char* unit = "cycles";
+#endif
+    printf("=== Instrumentation Timing Report (%s) ===\n", unit);
+    printf("%-40s %10s %14s %10s %10s %10s %10s %10s\n", "Function", "Calls", "Total", "Avg", "Min", "p50<", "p99<", "Max");
+    for (TimerSlot* slot = timerSlots(); slot; slot = slot->next) {
+        // Print each label once, at its first slot in the list.
+        TimerSlot* first = timerSlots();
+        while (strcmp(first->label, slot->label) != 0)
+            first = first->next;
+        TimerTotals totals;
+        if (first != slot || !CollectTimer(slot->label, totals) || totals.count == 0)
+            continue;
+        printf("%-40s %10llu %14llu %10llu %10llu %10llu %10llu %10llu\n", slot->label,
+            static_cast<unsigned long long>(totals.count), static_cast<unsigned long long>(totals.totalCycles),
+            static_cast<unsigned long long>(totals.totalCycles / totals.count),
+            static_cast<unsigned long long>(totals.minCycles),
+            static_cast<unsigned long long>(TimerQuantile(totals, 0.50)),
+            static_cast<unsigned long long>(TimerQuantile(totals, 0.99)),
+            static_cast<unsigned long long>(totals.maxCycles));
+    }
+    printf("=====================================\n");
+}
@@ -0,0 +1,356 @@
+// dbbench.cpp : Reproducible benchmarks for DBEngine.
+//
+// Runs a fixed set of workloads for every combination of record count and
+// payload size given on the command line and prints one JSON object per
+// workload to stdout (JSON Lines), e.g.
+//
+//   dbbench --records 1000,100000,10000000 --payloads 16,116 > results.jsonl
+//
+// MAX_INDEX_ENTRIES is fixed at compile time; the build makes one binary per
+// value in DBBENCH_INDEX_ENTRIES (dbbench_<entries>), and every result names
+// the page size it was measured with. Keys, payloads and the order of the
+// operations come from a seeded generator, so two runs do the same work.
+//
+// Workloads:
+//   seq_append   ascending keys into an empty database (the ascending fast path)
+//   rand_append  scattered keys into an empty database (inserts and splits)
+//   get_hit      get() of random keys that exist
+//   get_miss     get() of random keys that do not exist
+//   find_status  findByStatus() for a status carried by 1 in 1024 records
+//   cursor_scan  DBCursor::seek() to a random key and read DBBENCH_SCAN_LENGTH records
+//   churn        deleteRecord() and append() of the same random key
+//
+// Latencies are per operation; "seconds" and the I/O counts also include the
+// sync() that ends a workload. Bytes and calls are counted by a
+// CountingFileHandler, i.e. what the engine asks of the medium, separately for
+// the log and the index file; page loads, flushes and splits by getStats().
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "dbengine.h"
+#include "FileHandler_Windows.h"
+#include "FileHandler_Counting.h"
+
+#define DBBENCH_SCAN_LENGTH 100     // Records read per cursor_scan operation.
+#define DBBENCH_STATUS_EVERY 1024   // One record in this many carries the scanned status.
+#define DBBENCH_STATUS 0x01
+
+struct BenchConfig {
+    std::vector<uint32_t> records;
+    std::vector<uint16_t> payloads;
+    uint32_t ops;          // Operations of the lookup and churn workloads.
+    uint32_t scanOps;      // Operations of find_status and cursor_scan.
+    uint8_t mode;
+    const char* only;      // Comma-separated workload names, or nullptr for all.
+};
+
+// xorshift32: small, fast and the same on every platform.
+struct BenchRandom {
+    uint32_t state;
+    explicit BenchRandom(uint32_t seed) : state(seed ? seed : 1) {}
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    uint32_t below(uint32_t limit) { return static_cast<uint32_t>((static_cast<uint64_t>(next()) * limit) >> 32); }
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+// One workload run: per-operation latencies plus totals.
+class BenchRun {
+public:
+    BenchRun(const char* name, DBEngine& db, CountingFileHandler& log, CountingFileHandler& index, uint32_t ops)
+        : _name(name), _db(db), _log(log), _index(index), _failures(0) {
+        _latencies.reserve(ops);
+        _db.resetStats();
+        _log.resetStats();
+        _index.resetStats();
+        _start = BenchClock::now();
+    }
+
+    // Times one operation; op() returns false on failure.
+    template <typename Op>
+    void time(Op op) {
+        BenchClock::time_point begin = BenchClock::now();
+        bool ok = op();
+        BenchClock::time_point end = BenchClock::now();
+        _latencies.push_back(static_cast<uint32_t>(
+            std::min<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(), 0xFFFFFFFFll)));
+        if (!ok)
+            _failures++;
+    }
+
+    void finish(uint32_t records, uint16_t payload, uint8_t mode) {
+        if (!_db.sync())
+            _failures++;
+        double seconds = std::chrono::duration<double>(BenchClock::now() - _start).count();
+        DBStats stats;
+        FileIOStats log, index;
+        _db.getStats(stats);
+        _log.getStats(log);
+        _index.getStats(index);
+        size_t ops = _latencies.size();
+        double perOp = ops ? 1.0 / ops : 0.0;
+        std::sort(_latencies.begin(), _latencies.end());
+        std::printf("{\"workload\":\"%s\",\"records\":%u,\"payload\":%u,\"page_entries\":%u,\"cache_pages\":%u,"
+            "\"mode\":\"%s\",\"ops\":%zu,\"failures\":%u,\"seconds\":%.6f,\"ops_per_s\":%.1f,"
+            "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,"
+            "\"log_read_bytes_per_op\":%.1f,\"log_write_bytes_per_op\":%.1f,"
+            "\"index_read_bytes_per_op\":%.1f,\"index_write_bytes_per_op\":%.1f,"
+            "\"log_reads_per_op\":%.2f,\"index_reads_per_op\":%.2f,\"page_loads_per_op\":%.2f,"
+            "\"page_flushes_per_op\":%.2f,\"splits\":%u}\n",
+            _name, records, static_cast<unsigned>(payload), static_cast<unsigned>(MAX_INDEX_ENTRIES),
+            static_cast<unsigned>(INDEX_CACHE_PAGES), (mode == DB_MODE_SESSION) ? "session" : "safe",
+            ops, _failures, seconds, seconds > 0 ? ops / seconds : 0.0,
+            percentile(0.50), percentile(0.99), percentile(0.999),
+            log.bytesRead * perOp, log.bytesWritten * perOp, index.bytesRead * perOp, index.bytesWritten * perOp,
+            log.reads * perOp, index.reads * perOp, stats.pageLoads * perOp, stats.pageFlushes * perOp,
+            stats.leafSplits + stats.interiorSplits);
+        std::fflush(stdout);
+        if (_failures)
+            std::fprintf(stderr, "%s: %u operations failed\n", _name, _failures);
+    }
+
+private:
+    uint32_t percentile(double p) const {
+        if (_latencies.empty())
+            return 0;
+        size_t at = static_cast<size_t>(p * (_latencies.size() - 1) + 0.5);
+        return _latencies[at];
+    }
+
+    const char* _name;
+    DBEngine& _db;
+    CountingFileHandler& _log;
+    CountingFileHandler& _index;
+    std::vector<uint32_t> _latencies;
+    uint32_t _failures;
+    BenchClock::time_point _start;
+};
+
+static bool selected(const BenchConfig& config, const char* name) {
+    if (!config.only)
+        return true;
+    size_t length = strlen(name);
+    for (const char* p = config.only; (p = strstr(p, name)) != nullptr; p += length) {
+        bool starts = (p == config.only || p[-1] == ',');
+        bool ends = (p[length] == '\0' || p[length] == ',');
+        if (starts && ends)
+            return true;
+    }
+    return false;
+}
+
+// Payload of a key: distinct per record, so a wrong read would show as a failure.
+static void fillPayload(uint8_t* payload, uint16_t size, uint32_t key) {
+    for (uint16_t i = 0; i < size; i++)
+        payload[i] = static_cast<uint8_t>(key * 31 + i);
+    if (size >= sizeof(key))
+        memcpy(payload, &key, sizeof(key));
+}
+
+static bool checkPayload(const uint8_t* payload, uint16_t size, uint32_t key) {
+    uint32_t stored = key;
+    if (size >= sizeof(stored))
+        memcpy(&stored, payload, sizeof(stored));
+    return stored == key;
+}
+
+static void removeFiles(const char* logName, const char* indexName) {
+    std::remove(logName);
+    std::remove(indexName);
+}
+
+// Sequential keys are even, so every odd key is a miss.
+static uint32_t seqKey(uint32_t i) { return 2 * i; }
+
+// Multiplication by an odd constant is a bijection on 32 bits: distinct keys
+// in a scattered order.
+static uint32_t randKey(uint32_t i) { return i * 2654435761u; }
+
+static void runConfig(const BenchConfig& config, uint32_t records, uint16_t payloadSize) {
+    WindowsFileHandler logFile, indexFile;
+    CountingFileHandler log(logFile), index(indexFile);
+    std::vector<uint8_t> payload(payloadSize), readBack(payloadSize);
+    uint16_t size = 0;
+
+    if (selected(config, "rand_append")) {
+        removeFiles("RNDLOG.BIN", "RNDIDX.BIN");
+        DBEngine db(log, index);
+        if (db.open("RNDLOG.BIN", "RNDIDX.BIN", config.mode)) {
+            BenchRun run("rand_append", db, log, index, records);
+            for (uint32_t i = 0; i < records; i++) {
+                uint32_t key = randKey(i);
+                fillPayload(payload.data(), payloadSize, key);
+                run.time([&] { return db.append(key, 1, payload.data(), payloadSize); });
+            }
+            run.finish(records, payloadSize, config.mode);
+            db.close();
+        }
+        else {
+            std::fprintf(stderr, "rand_append: unable to create the database\n");
+        }
+        removeFiles("RNDLOG.BIN", "RNDIDX.BIN");
+    }
+
+    // The other workloads share one database of sequential keys.
+    removeFiles("SEQLOG.BIN", "SEQIDX.BIN");
+    DBEngine db(log, index);
+    if (!db.open("SEQLOG.BIN", "SEQIDX.BIN", config.mode)) {
+        std::fprintf(stderr, "seq_append: unable to create the database\n");
+        return;
+    }
+    {
+        BenchRun run("seq_append", db, log, index, records);
+        for (uint32_t i = 0; i < records; i++) {
+            uint32_t key = seqKey(i);
+            fillPayload(payload.data(), payloadSize, key);
+            run.time([&] { return db.append(key, 1, payload.data(), payloadSize); });
+        }
+        if (selected(config, "seq_append"))
+            run.finish(records, payloadSize, config.mode);
+        else
+            db.sync();
+    }
+
+    BenchRandom random(records ^ (static_cast<uint32_t>(payloadSize) << 24));
+    if (selected(config, "get_hit")) {
+        BenchRun run("get_hit", db, log, index, config.ops);
+        for (uint32_t n = 0; n < config.ops; n++) {
+            uint32_t key = seqKey(random.below(records));
+            run.time([&] {
+                return db.get(key, readBack.data(), payloadSize, &size) && size == payloadSize &&
+                    checkPayload(readBack.data(), payloadSize, key);
+            });
+        }
+        run.finish(records, payloadSize, config.mode);
+    }
+
+    if (selected(config, "get_miss")) {
+        BenchRun run("get_miss", db, log, index, config.ops);
+        for (uint32_t n = 0; n < config.ops; n++) {
+            uint32_t key = seqKey(random.below(records)) + 1;
+            run.time([&] { return !db.get(key, readBack.data(), payloadSize, &size); });
+        }
+        run.finish(records, payloadSize, config.mode);
+    }
+
+    if (selected(config, "find_status")) {
+        // Not timed: mark the records the scans look for.
+        uint32_t marked = 0;
+        for (uint32_t position = 0; position < records; position += DBBENCH_STATUS_EVERY, marked++)
+            db.updateStatus(position, DBBENCH_STATUS);
+        db.sync();
+        std::vector<uint32_t> results(marked + 1);
+        BenchRun run("find_status", db, log, index, config.scanOps);
+        for (uint32_t n = 0; n < config.scanOps; n++)
+            run.time([&] { return db.findByStatus(DBBENCH_STATUS, results.data(), results.size()) == marked; });
+        run.finish(records, payloadSize, config.mode);
+    }
+
+    if (selected(config, "cursor_scan")) {
+        DBCursor cursor(db);
+        BenchRun run("cursor_scan", db, log, index, config.scanOps);
+        for (uint32_t n = 0; n < config.scanOps; n++) {
+            uint32_t first = random.below(records);
+            uint32_t length = std::min<uint32_t>(DBBENCH_SCAN_LENGTH, records - first);
+            run.time([&] {
+                uint32_t read = 0;
+                for (bool more = cursor.seek(seqKey(first)); more && read < length; more = cursor.next()) {
+                    if (!cursor.readPayload(readBack.data(), payloadSize, &size) ||
+                        !checkPayload(readBack.data(), payloadSize, seqKey(first + read)))
+                        return false;
+                    read++;
+                }
+                return read == length;
+            });
+        }
+        run.finish(records, payloadSize, config.mode);
+    }
+
+    if (selected(config, "churn")) {
+        BenchRun run("churn", db, log, index, config.ops);
+        for (uint32_t n = 0; n < config.ops; n++) {
+            uint32_t key = seqKey(random.below(records));
+            fillPayload(payload.data(), payloadSize, key);
+            run.time([&] { return db.deleteRecord(key) && db.append(key, 1, payload.data(), payloadSize); });
+        }
+        run.finish(records, payloadSize, config.mode);
+    }
+
+    db.close();
+    removeFiles("SEQLOG.BIN", "SEQIDX.BIN");
+}
+
+template <typename T>
+static bool parseList(const char* text, std::vector<T>& values, unsigned long limit) {
+    values.clear();
+    while (*text) {
+        char* end = nullptr;
+        unsigned long value = std::strtoul(text, &end, 10);
+        if (end == text || value == 0 || value > limit)
+            return false;
+        values.push_back(static_cast<T>(value));
+        text = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return false;
+    }
+    return !values.empty();
+}
+
+static void usage(void) {
+    std::fprintf(stderr,
+        "usage: dbbench [--records N,...] [--payloads N,...] [--ops N] [--scan-ops N]\n"
+        "               [--mode session|safe] [--only workload,...]\n"
+        "workloads: seq_append rand_append get_hit get_miss find_status cursor_scan churn\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    config.records = { 1000, 10000, 100000 };
+    config.payloads = { 16, 116 };
+    config.ops = 100000;
+    config.scanOps = 100;
+    config.mode = DB_MODE_SESSION;
+    config.only = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool ok = value != nullptr;
+        if (strcmp(argv[i], "--records") == 0)
+            ok = ok && parseList(value, config.records, 0x7FFFFFFFul);
+        else if (strcmp(argv[i], "--payloads") == 0)
+            ok = ok && parseList(value, config.payloads, 0xFFFFul);
+        else if (strcmp(argv[i], "--ops") == 0)
+            ok = ok && (config.ops = static_cast<uint32_t>(std::strtoul(value, nullptr, 10))) > 0;
+        else if (strcmp(argv[i], "--scan-ops") == 0)
+            ok = ok && (config.scanOps = static_cast<uint32_t>(std::strtoul(value, nullptr, 10))) > 0;
+        else if (strcmp(argv[i], "--mode") == 0) {
+            ok = ok && (strcmp(value, "session") == 0 || strcmp(value, "safe") == 0);
+            if (ok)
+                config.mode = (strcmp(value, "safe") == 0) ? DB_MODE_SAFE : DB_MODE_SESSION;
+        }
+        else if (strcmp(argv[i], "--only") == 0)
+            config.only = value;
+        else
+            ok = false;
+        if (!ok) {
+            usage();
+            return 1;
+        }
+        i++;
+    }
+
+    for (uint32_t records : config.records) {
+        for (uint16_t payload : config.payloads)
+            runConfig(config, records, payload);
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// Asynchronous appends
+//
+// appendAsync() does everything append() does except wait for the log write:
+// the key is checked and the index entry created at once, with the offset the
+// record will have, and the record is copied into the caller's staging buffer.
+// The buffer is used as two halves. While the log handler writes one half with
+// a single submitWrite(), new records fill the other; pollAsync() runs the
+// handler and submits the filled half once the previous write is done. Only
+// this code writes the log while records are queued: every other path opens
+// the log through openLog(), which first waits for the queue to drain.
+// ---------------------------------------------------------------------------
+
+bool DBEngine::appendAsync(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize) {
+    DB_WRITE_LOCK(_lock);
+    if (!_asyncLog || _asyncHalf == 0 || !_isOpen || _mode != DB_MODE_SESSION ||
+        _segmentCount > 0 || _bulkLoading || _compacting) {
+        DEBUG_PRINT("appendAsync: Needs an asynchronous log in session mode, without segments, "
+            "bulk load or compaction.\n");
+        return false;
+    }
+    if (logHeaderSize() + recordSize > _asyncHalf) {
+        DEBUG_PRINT("appendAsync: Record of %u bytes does not fit half of the staging buffer.\n",
+            static_cast<unsigned>(recordSize));
+        return false;
+    }
+    return appendRecord(key, recordType, record, recordSize, true);
+}
+
+bool DBEngine::pollAsync(void) {
+    DB_WRITE_LOCK(_lock);
+    if (!_asyncLog)
+        return false;
+    if (_asyncWriting > 0)
+        _asyncLog->poll();
+    if (_asyncWriting == 0 && _asyncStaged > 0)
+        submitAsync();
+    return _asyncStaged + _asyncWriting > 0;
+}
+
+size_t DBEngine::pendingAsyncBytes(void) const {
+    DB_READ_LOCK(_lock);
+    return _asyncStaged + _asyncWriting;
+}
+
+bool DBEngine::stageAsyncRecord(LogEntryHeader& header, const void* record, uint32_t& offset) {
+    size_t headerBytes = logHeaderSize();
+    uint16_t recordSize = header.length;
+    size_t recordBytes = headerBytes + recordSize;
+    if (!_asyncEndValid) {
+        // Nothing is queued here, so the end of the log file is current. This
+        // also creates a new log with its header.
+        if (!beginLogAppend(_asyncEnd, recordBytes))
+            return false;
+        endLogAppend();
+        _asyncEndValid = true;
+    }
+    if (_asyncStaged + recordBytes > _asyncHalf) {
+        // The filling half is full; it can only go once the other is written.
+        if (_asyncWriting > 0)
+            _asyncLog->poll();
+        if (_asyncWriting > 0) {
+            DEBUG_PRINT("appendAsync: Staging buffer full; call pollAsync().\n");
+            return false;
+        }
+        submitAsync();
+    }
+    offset = _asyncEnd;
+    uint8_t encoded[DB_CODEC_MAX_RECORD];
+    const void* payload = encodeLogRecord(header, record, offset, encoded);
+    recordBytes = headerBytes + header.length;
+    uint8_t* half = _asyncBuffer + _asyncFill * _asyncHalf;
+    memcpy(&half[_asyncStaged], &header, headerBytes);
+    memcpy(&half[_asyncStaged + headerBytes], payload, header.length);
+    _asyncStaged += recordBytes;
+    _asyncEnd += static_cast<uint32_t>(recordBytes);
+    noteLogRecord(header, record, recordSize, offset);
+    // An idle handler starts on the record right away.
+    if (_asyncWriting == 0)
+        submitAsync();
+    return true;
+}
+
+void DBEngine::submitAsync(void) {
+    if (_asyncStaged == 0)
+        return;
+    const uint8_t* data = _asyncBuffer + _asyncFill * _asyncHalf;
+    size_t size = _asyncStaged;
+    uint32_t offset = _asyncEnd - static_cast<uint32_t>(size);
+    _asyncFill ^= 1;
+    _asyncStaged = 0;
+    _asyncWriting = size;
+    if (_asyncLog->submitWrite(offset, data, size, asyncWriteDone, this))
+        return;
+    // The handler's queue is full or it cannot start the request: write now.
+    DEBUG_PRINT("submitAsync: Request refused; writing %u bytes at %u directly.\n",
+        static_cast<unsigned>(size), offset);
+    _asyncWriting = 0;
+    size_t bytesWritten = 0;
+    if (!_logHandler.seek(offset) || !_logHandler.write(data, size, bytesWritten) || bytesWritten != size)
+        _asyncFailed = true;
+}
+
+void DBEngine::drainAsync(void) {
+    while (_asyncStaged + _asyncWriting > 0) {
+        if (_asyncWriting > 0)
+            _asyncLog->poll();
+        else
+            submitAsync();
+    }
+    // Other writers may extend the log from here on.
+    _asyncEndValid = false;
+}
+
+void DBEngine::asyncWriteDone(void* context, bool ok) {
+    DBEngine* db = static_cast<DBEngine*>(context);
+    if (!ok) {
+        DEBUG_PRINT("asyncWriteDone: Log write of %u bytes failed.\n", static_cast<unsigned>(db->_asyncWriting));
+        db->_asyncFailed = true;
+    }
+    db->_asyncWriting = 0;
+}
+
+DB_NAMESPACE_END
@@ -0,0 +1,98 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// Bulk load
+//
+// Between beginBulk() and endBulk(), append() and appendBatch() only write the
+// log: records are staged back to back in _batchBuffer and written whenever it
+// fills, with no index search, insert or page split. endBulk() then builds the
+// whole index from the log with rebuildIndex(), i.e. an external sort and one
+// sequential, bottom-up pass that leaves every leaf packed. A header flag
+// (DB_IDX_FLAG_BULK) marks the index as incomplete meanwhile, so open() after
+// a power loss rebuilds it as well.
+// ---------------------------------------------------------------------------
+
+bool DBEngine::beginBulk(void) {
+    DB_WRITE_LOCK(_lock);
+    if (!_isOpen || _bulkLoading) {
+        DEBUG_PRINT("beginBulk: Database not open or bulk load already running.\n");
+        return false;
+    }
+    // The flag has to be on disk before the first record is written.
+    _bulkLoading = true;
+    _bulkStaged = 0;
+    if (!saveIndexHeader() || !syncFiles()) {
+        _bulkLoading = false;
+        return false;
+    }
+    return true;
+}
+
+bool DBEngine::endBulk(void) {
+    DB_WRITE_LOCK(_lock);
+    return finishBulk();
+}
+
+bool DBEngine::finishBulk(void) {
+    if (!_isOpen || !_bulkLoading) {
+        DEBUG_PRINT("endBulk: No bulk load running.\n");
+        return false;
+    }
+    // rebuildIndex() writes the staged records and clears the flag.
+    return rebuildIndexFromLog();
+}
+
+bool DBEngine::isBulkLoading(void) const {
+    DB_READ_LOCK(_lock);
+    return _bulkLoading;
+}
+
+bool DBEngine::appendBulkRecord(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize) {
+    LogEntryHeader header;
+    header.recordType = recordType;
+    header.length = recordSize;
+    header.key = key;
+    header.status = 0;
+    header.internal_status = 0;
+    header.crc = logRecordCrc(header, record);
+
+    // A staged write must also fit into one segment of a segmented log.
+    size_t limit = sizeof(_batchBuffer);
+    if (_segmentCount > 0 && _segmentSize - sizeof(DBHeader) < limit)
+        limit = _segmentSize - sizeof(DBHeader);
+    size_t headerBytes = logHeaderSize();
+    size_t recordBytes = headerBytes + recordSize;
+    if (_bulkStaged + recordBytes > limit && !flushBulkRecords())
+        return false;
+    if (recordBytes > limit) {
+        // Too large to stage: write this record directly.
+        uint32_t offset = 0;
+        if (!beginLogAppend(offset, recordBytes))
+            return false;
+        bool ok = writeLogBytes(&header, headerBytes) && writeLogBytes(record, recordSize);
+        endLogAppend();
+        return ok;
+    }
+    memcpy(&_batchBuffer[_bulkStaged], &header, headerBytes);
+    memcpy(&_batchBuffer[_bulkStaged + headerBytes], record, recordSize);
+    _bulkStaged += static_cast<uint16_t>(recordBytes);
+    return true;
+}
+
+bool DBEngine::flushBulkRecords(void) {
+    // Cleared first: a segment rollover inside beginLogAppend() calls sync().
+    size_t staged = _bulkStaged;
+    _bulkStaged = 0;
+    if (staged == 0)
+        return true;
+    uint32_t offset = 0;
+    if (!beginLogAppend(offset, staged))
+        return false;
+    bool ok = writeLogBytes(_batchBuffer, staged);
+    endLogAppend();
+    return ok;
+}
+
+DB_NAMESPACE_END
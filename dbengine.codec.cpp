@@ -0,0 +1,216 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// Record codec
+//
+// An encoded payload is the difference to the type's reference record, an
+// earlier record of the same type and size that is stored in full:
+//
+//   varint   distance from the reference record's log offset to this record's
+//   bitmap   one bit per 32-bit word of the payload, set if the word changed
+//   varints  zigzag(word - reference word) for every changed word
+//
+// The last word of a payload whose size is not a multiple of 4 is padded with
+// zeros. Taking the difference of the raw words works for counters and for
+// floats alike: the bit patterns of two nearby floats with the same exponent
+// differ by a small integer. The reference lies in the same file (and segment)
+// as the records that refer to it; compact() stores every record it moves in
+// full, so records never refer across files.
+// ---------------------------------------------------------------------------
+
+static size_t putVarint(uint8_t* out, uint32_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+static bool getVarint(const uint8_t* in, size_t size, size_t& pos, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && pos < size; shift += 7) {
+        uint8_t byte = in[pos++];
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+static uint32_t loadWord(const uint8_t* data, size_t length, size_t word) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4 && word * 4 + i < length; i++)
+        value |= static_cast<uint32_t>(data[word * 4 + i]) << (8 * i);
+    return value;
+}
+
+static void storeWord(uint8_t* data, size_t length, size_t word, uint32_t value) {
+    for (size_t i = 0; i < 4 && word * 4 + i < length; i++)
+        data[word * 4 + i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+bool DBEngine::setRecordCodec(uint8_t recordType, bool enabled) {
+    DB_WRITE_LOCK(_lock);
+    CodecSlot* slot = codecSlot(recordType);
+    if (!enabled) {
+        if (slot)
+            slot->used = false;
+        return true;
+    }
+    if (slot)
+        return true;
+#if DB_CODEC_TYPES > 0
+    for (uint32_t i = 0; i < DB_CODEC_TYPES; i++) {
+        if (!_codecs[i].used) {
+            _codecs[i].used = true;
+            _codecs[i].recordType = recordType;
+            _codecs[i].haveRef = false;
+            return true;
+        }
+    }
+#endif
+    DEBUG_PRINT("setRecordCodec: All %u codec slots are in use.\n", static_cast<unsigned>(DB_CODEC_TYPES));
+    return false;
+}
+
+// With DB_CODEC_TYPES 0 the single _codecs entry is never used.
+DBEngine::CodecSlot* DBEngine::codecSlot(uint8_t recordType) const {
+#if DB_CODEC_TYPES > 0
+    for (uint32_t i = 0; i < DB_CODEC_TYPES; i++) {
+        if (_codecs[i].used && _codecs[i].recordType == recordType)
+            return const_cast<CodecSlot*>(&_codecs[i]);
+    }
+#else
+    (void)recordType;
+#endif
+    return nullptr;
+}
+
+void DBEngine::resetRecordCodecs(void) {
+#if DB_CODEC_TYPES > 0
+    for (uint32_t i = 0; i < DB_CODEC_TYPES; i++)
+        _codecs[i].haveRef = false;
+#endif
+}
+
+const void* DBEngine::encodeLogRecord(LogEntryHeader& header, const void* record, uint32_t offset, uint8_t* encoded) {
+    CodecSlot* slot = codecSlot(header.recordType);
+    // Records appended during a compaction go to the other file.
+    bool encode = slot && slot->haveRef && !_compacting && _logChecksums &&
+        header.length == slot->refLength && slot->sinceRef < DB_CODEC_KEYFRAME_INTERVAL &&
+        offset > slot->refOffset &&
+        (_segmentCount == 0 || offset / _segmentSize == slot->refOffset / _segmentSize);
+    if (encode) {
+        const uint8_t* data = static_cast<const uint8_t*>(record);
+        size_t words = (header.length + 3) / 4;
+        size_t bitmapBytes = (words + 7) / 8;
+        size_t size = putVarint(encoded, offset - slot->refOffset);
+        uint8_t* bitmap = &encoded[size];
+        memset(bitmap, 0, bitmapBytes);
+        size += bitmapBytes;
+        for (size_t word = 0; word < words && encode; word++) {
+            uint32_t delta = loadWord(data, header.length, word) - loadWord(slot->ref, header.length, word);
+            if (delta == 0)
+                continue;
+            bitmap[word / 8] |= static_cast<uint8_t>(1u << (word % 8));
+            // Zigzag: small negative differences become small numbers too.
+            uint32_t zigzag = (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+            // A varint takes at most 5 bytes; stop once the delta is no smaller.
+            if (size + 5 >= header.length)
+                encode = false;
+            else
+                size += putVarint(&encoded[size], zigzag);
+        }
+        if (encode && size < header.length) {
+            header.length = static_cast<uint16_t>(size);
+            header.internal_status |= INTERNAL_STATUS_ENCODED;
+            header.crc = logRecordCrc(header, encoded);
+            return encoded;
+        }
+    }
+    header.crc = logRecordCrc(header, record);
+    return record;
+}
+
+void DBEngine::noteLogRecord(const LogEntryHeader& header, const void* record, uint16_t recordSize, uint32_t offset) {
+    CodecSlot* slot = codecSlot(header.recordType);
+    if (!slot)
+        return;
+    if (header.internal_status & INTERNAL_STATUS_ENCODED) {
+        slot->sinceRef++;
+        return;
+    }
+    if (_compacting || recordSize > DB_CODEC_MAX_RECORD) {
+        slot->haveRef = false;
+        return;
+    }
+    memcpy(slot->ref, record, recordSize);
+    slot->refLength = recordSize;
+    slot->refOffset = offset;
+    slot->sinceRef = 0;
+    slot->haveRef = true;
+}
+
+bool DBEngine::decodeLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize) {
+    uint8_t encoded[DB_CODEC_MAX_RECORD];
+    size_t size = header.length;
+    if (size > sizeof(encoded))
+        return false;
+    memcpy(encoded, payloadBuffer, size);
+    size_t pos = 0;
+    uint32_t distance = 0;
+    if (!getVarint(encoded, size, pos, distance) || distance == 0 || distance > entry.offset)
+        return false;
+
+    // The reference is usually the type's current one, still in RAM.
+    IndexEntry refEntry = entry;
+    refEntry.offset = entry.offset - distance;
+    const uint8_t* ref = nullptr;
+    uint16_t refLength = 0;
+    uint8_t refBuffer[DB_CODEC_MAX_RECORD];
+    const CodecSlot* slot = codecSlot(header.recordType);
+    if (slot && slot->haveRef && slot->refOffset == refEntry.offset && !inCompactFile(entry)) {
+        ref = slot->ref;
+        refLength = slot->refLength;
+    }
+    else {
+        LogEntryHeader refHeader;
+        if (!readRawLogRecord(refEntry, refHeader, refBuffer, sizeof(refBuffer)) ||
+            refHeader.recordType != header.recordType || (refHeader.internal_status & INTERNAL_STATUS_ENCODED)) {
+            DEBUG_PRINT("decodeLogRecord: Reference of key %u at %u is unusable.\n", header.key, refEntry.offset);
+            return false;
+        }
+        ref = refBuffer;
+        refLength = refHeader.length;
+    }
+    if (refLength > bufferSize)
+        return false;
+
+    size_t words = (refLength + 3) / 4;
+    size_t bitmapBytes = (words + 7) / 8;
+    if (pos + bitmapBytes > size)
+        return false;
+    const uint8_t* bitmap = &encoded[pos];
+    pos += bitmapBytes;
+    uint8_t* out = static_cast<uint8_t*>(payloadBuffer);
+    for (size_t word = 0; word < words; word++) {
+        uint32_t value = loadWord(ref, refLength, word);
+        if (bitmap[word / 8] & (1u << (word % 8))) {
+            uint32_t zigzag = 0;
+            if (!getVarint(encoded, size, pos, zigzag))
+                return false;
+            value += (zigzag >> 1) ^ (0u - (zigzag & 1));
+        }
+        storeWord(out, refLength, word, value);
+    }
+    if (pos != size)
+        return false;
+    header.length = refLength;
+    return true;
+}
+
+DB_NAMESPACE_END
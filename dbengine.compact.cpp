@@ -0,0 +1,230 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// Log compaction
+//
+// compact() copies the live records, in key order, from the log to the
+// compaction file and points their index entries at the copies. Each index
+// entry carries the generation of the file that holds its record
+// (INTERNAL_STATUS_LOG_GEN); while a compaction runs, entries whose generation
+// differs from the log's are in the compaction file, and that is also where new
+// records are appended. When every entry has been visited the compaction file
+// is renamed over the log and the log generation flips, so all entries are in
+// the log again. The generation and the in-progress flag are kept in the index
+// header, which lets open() finish or resume an interrupted compaction.
+// ---------------------------------------------------------------------------
+
+void DBEngine::setCompactionFile(IFileHandler& handler, const char fileName[MAX_FILENAME_LENGTH]) {
+    DB_WRITE_LOCK(_lock);
+    _compactHandler = &handler;
+    strncpy(_compactFileName, fileName, MAX_FILENAME_LENGTH - 1);
+    _compactFileName[MAX_FILENAME_LENGTH - 1] = '\0';
+}
+
+bool DBEngine::isCompacting(void) const {
+    DB_READ_LOCK(_lock);
+    return _compacting;
+}
+
+bool DBEngine::compact(uint32_t budget, bool* finished) {
+    DB_WRITE_LOCK(_lock);
+    SCOPE_TIMER("DBEngine::compact");
+    if (finished)
+        *finished = false;
+    if (!_isOpen || !_compactHandler || _segmentCount > 0 || _bulkLoading) {
+        DEBUG_PRINT("compact: Database not open, no compaction file set, segmented log, or bulk load.\n");
+        return false;
+    }
+    if (!_compacting && !beginCompaction())
+        return false;
+
+    // Resume at the first key not visited yet. Keys inserted since the last step
+    // went to the compaction file and are skipped like the ones already copied.
+    uint32_t position = _indexCount;
+    if (!_compactKeysDone && budget > 0 && !lowerBound(_compactNextKey, &position))
+        return false;
+    for (uint32_t visited = 0; visited < budget && !_compactKeysDone; visited++, position++) {
+        if (position >= _indexCount) {
+            _compactKeysDone = true;
+            break;
+        }
+        IndexEntry entry;
+        if (!entryAt(position, entry))
+            return false;
+        if (entry.key == 0xFFFFFFFFu)
+            _compactKeysDone = true;
+        else
+            _compactNextKey = entry.key + 1;
+        if (inCompactFile(entry))
+            continue;
+
+        if (entry.internal_status & INTERNAL_STATUS_DELETED) {
+            // Not copied: the record's space goes away with the old log.
+            entry.offset = DB_NO_OFFSET;
+        }
+        else {
+            uint32_t newOffset;
+            if (!copyLogRecord(entry.offset, newOffset))
+                return false;
+            entry.offset = newOffset;
+        }
+        // Moved records are stored in full.
+        entry.internal_status = static_cast<uint8_t>((entry.internal_status ^ INTERNAL_STATUS_LOG_GEN) &
+            ~INTERNAL_STATUS_ENCODED);
+        if (!setIndexEntry(position, entry))
+            return false;
+    }
+    if (!_compactKeysDone)
+        return true;
+
+    if (!finishCompaction())
+        return false;
+    if (finished)
+        *finished = true;
+    return true;
+}
+
+bool DBEngine::beginCompaction(void) {
+    // Start from an empty file; a leftover of an earlier attempt is overwritten.
+    if (!_compactHandler->open(_compactFileName, "wb+")) {
+        DEBUG_PRINT("beginCompaction: Unable to create %s.\n", _compactFileName);
+        return false;
+    }
+    DBHeader logHeader;
+    logHeader.magic = DB_MAGIC_NUMBER;
+    logHeader.version = recordFileVersion();
+    size_t bytesWritten = 0;
+    bool ok = _compactHandler->write(reinterpret_cast<const uint8_t*>(&logHeader), sizeof(logHeader), bytesWritten) &&
+        bytesWritten == sizeof(logHeader);
+    _compactHandler->close();
+    if (!ok)
+        return false;
+
+    // The flag has to be on disk before any index entry can refer to the new file.
+    _compacting = true;
+    _compactNextKey = 0;
+    _compactKeysDone = false;
+    resetRecordCodecs();
+    if (!saveIndexHeader() || !syncFiles()) {
+        _compacting = false;
+        return false;
+    }
+    return true;
+}
+
+// The header read first tells how many payload bytes follow; the payload then
+// goes through _batchBuffer in pieces, so records of any size can be copied.
+// An encoded record refers to another record of the old log, so it is decoded
+// and stored in full.
+bool DBEngine::copyLogRecord(uint32_t offset, uint32_t& newOffset) {
+    if (!openLogFile("rb"))
+        return false;
+    LogEntryHeader header;
+    size_t headerBytes = logHeaderSize();
+    size_t bytesRead = 0;
+    if (!_logHandler.seek(offset) ||
+        !_logHandler.read(reinterpret_cast<uint8_t*>(&header), headerBytes, bytesRead) ||
+        bytesRead != headerBytes) {
+        closeLogFile();
+        return false;
+    }
+    if (header.internal_status & INTERNAL_STATUS_ENCODED) {
+        closeLogFile();
+        IndexEntry old;
+        old.offset = offset;
+        old.internal_status = appendGeneration() ^ INTERNAL_STATUS_LOG_GEN;
+        if (!readLogRecord(old, header, _batchBuffer, DB_CODEC_MAX_RECORD))
+            return false;
+        header.internal_status &= static_cast<uint8_t>(~INTERNAL_STATUS_ENCODED);
+        header.crc = logRecordCrc(header, _batchBuffer);
+        if (!beginLogAppend(newOffset, headerBytes + header.length))
+            return false;
+        bool ok = writeLogBytes(&header, headerBytes) && writeLogBytes(_batchBuffer, header.length);
+        endLogAppend();
+        return ok;
+    }
+    if (!beginLogAppend(newOffset, headerBytes + header.length)) {
+        closeLogFile();
+        return false;
+    }
+
+    // The compaction file has the log's format, so the crc is copied as it is.
+    bool ok = writeLogBytes(&header, headerBytes);
+    size_t remaining = header.length;
+    while (ok && remaining > 0) {
+        size_t chunk = (remaining < sizeof(_batchBuffer)) ? remaining : sizeof(_batchBuffer);
+        ok = _logHandler.read(_batchBuffer, chunk, bytesRead) && bytesRead == chunk &&
+            writeLogBytes(_batchBuffer, chunk);
+        remaining -= chunk;
+    }
+    endLogAppend();
+    closeLogFile();
+    return ok;
+}
+
+bool DBEngine::finishCompaction(void) {
+    // Every moved entry must be on disk before the old log disappears.
+    if (!syncFiles())
+        return false;
+    if (_logOpen) {
+        _logHandler.close();
+        _logOpen = false;
+    }
+    if (_compactOpen) {
+        _compactHandler->close();
+        _compactOpen = false;
+    }
+    if (!_compactHandler->rename(_compactFileName, _logFileName)) {
+        DEBUG_PRINT("finishCompaction: Unable to rename %s to %s.\n", _compactFileName, _logFileName);
+        return false;
+    }
+
+    // All entries now have the log's generation again.
+    _logGeneration ^= 1;
+    _compacting = false;
+    resetRecordCodecs();
+    // Read-ahead copies of the old log (see DBCursor) are stale.
+    _logRewrites++;
+    return saveIndexHeader() && syncFiles();
+}
+
+// The compaction file is only removed by the rename, so if it still exists the
+// log has not been replaced and the walk resumes from the first key (entries
+// already moved are skipped). Otherwise only the header update was lost.
+bool DBEngine::recoverCompaction(void) {
+    if (!_compactHandler) {
+        DEBUG_PRINT("recoverCompaction: A compaction is in progress but no compaction file is set.\n");
+        return false;
+    }
+    if (_compactHandler->open(_compactFileName, "rb")) {
+        _compactHandler->close();
+        _compactNextKey = 0;
+        _compactKeysDone = false;
+        return true;
+    }
+    _logGeneration ^= 1;
+    _compacting = false;
+    return saveIndexHeader();
+}
+
+// A compaction file without a log means the rename at the end of a compaction
+// was cut short (file systems without an atomic replace). The compaction file
+// holds every live record, so the swap is finished here; creating an empty log
+// instead would lose the database. recoverCompaction() then sees the rename done.
+bool DBEngine::finishLogSwap(void) {
+    if (!_compactHandler)
+        return true;
+    if (_logHandler.open(_logFileName, "rb")) {
+        _logHandler.close();
+        return true;
+    }
+    if (!_compactHandler->open(_compactFileName, "rb"))
+        return true;
+    _compactHandler->close();
+    DEBUG_PRINT("finishLogSwap: %s is missing, renaming %s over it.\n", _logFileName, _compactFileName);
+    return _compactHandler->rename(_compactFileName, _logFileName);
+}
+
+DB_NAMESPACE_END
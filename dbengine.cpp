@@ -1,10 +1,12 @@
 // dbengine.cpp
-#include "DBEngine.h"
+#include "dbengine.h"
 #include "IFileHandler.h"
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+DB_NAMESPACE_BEGIN
+
 // ---------------------------------------------------------------------------
 // Common Helper
 // ---------------------------------------------------------------------------
@@ -22,11 +24,166 @@ static uint32_t getMillis(void) {
 // ---------------------------------------------------------------------------
 DBEngine::DBEngine(IFileHandler& logHandler, IFileHandler& indexHandler)
     : _logHandler(logHandler), _indexHandler(indexHandler),
-    _indexCount(0), _currentPageNumber(0),
-    _pageLoaded(false), _pageDirty(false)
+    _indexCount(0), _rootPage(DB_NO_PAGE), _firstLeaf(DB_NO_PAGE),
+    _lastLeaf(DB_NO_PAGE), _pageCount(0), _freePage(DB_NO_PAGE), _treeHeight(0),
+    _maxKey(0), _maxKeyValid(false),
+    _mode(DB_MODE_SAFE), _isOpen(false),
+    _logOpen(false), _indexOpen(false), _logRewrites(0), _statusInLog(true), _newSegmentCount(0),
+    _newSegmentSize(0), _segmentCount(0), _segmentSize(0), _oldestSegment(0),
+    _newestSegment(0), _openSegment(DB_NO_SEGMENT), _compactHandler(nullptr),
+    _compactOpen(false), _compacting(false), _logGeneration(0), _compactNextKey(0),
+    _compactKeysDone(false), _logChecksums(true), _headerSequence(0),
+    _pagesAhead(false), _bulkLoading(false), _bulkStaged(0), _asyncLog(nullptr),
+    _asyncBuffer(nullptr), _asyncHalf(0), _asyncFill(0), _asyncStaged(0), _asyncWriting(0),
+    _asyncEnd(0), _asyncEndValid(false), _asyncFailed(false), _cacheTick(0),
+    _hintPage(DB_NO_PAGE), _hintFirst(0),
+    _hintValid(false), _narrowLeaves(false), _buildFirstLeaf(0), _buildNextPage(0), _buildCount(0)
 {
     _logFileName[0] = '\0';
     _indexFileName[0] = '\0';
+    _compactFileName[0] = '\0';
+    memset(_codecs, 0, sizeof(_codecs));
+    memset(&_stats, 0, sizeof(_stats));
+#if DB_AGGREGATES > 0
+    _aggregateExtractor = nullptr;
+#endif
+#if DB_RESIDENT_INDEX
+    _resident = false;
+    _newResident = false;
+    _scanThreads = 0;
+#endif
+    invalidateIndexCache();
+}
+
+DBEngine::DBEngine(IAsyncFileHandler& logHandler, IFileHandler& indexHandler,
+    uint8_t* asyncBuffer, size_t asyncBufferSize)
+    : DBEngine(static_cast<IFileHandler&>(logHandler), indexHandler)
+{
+    _asyncLog = &logHandler;
+    _asyncBuffer = asyncBuffer;
+    _asyncHalf = asyncBuffer ? asyncBufferSize / 2 : 0;
+}
+
+DBEngine::~DBEngine() {
+    closeFiles();
+}
+
+// ---------------------------------------------------------------------------
+// File Access Helpers
+// ---------------------------------------------------------------------------
+
+// In session mode the requested mode is ignored: the file is opened once for
+// reading and writing (created if it does not exist yet) and held open.
+bool DBEngine::openLogFile(const char* mode) {
+    return openLog(false, mode);
+}
+
+void DBEngine::closeLogFile(void) {
+    closeLog(false);
+}
+
+bool DBEngine::openLog(bool compactFile, const char* mode) {
+    IFileHandler& handler = logFile(compactFile);
+    const char* fileName = compactFile ? _compactFileName : _logFileName;
+    bool& held = compactFile ? _compactOpen : _logOpen;
+    // Queued records are written before anything else uses the log.
+    if (!compactFile && _asyncLog)
+        drainAsync();
+    if (_mode != DB_MODE_SESSION)
+        return handler.open(fileName, mode);
+    // The log handle may be on a segment file of a segmented log.
+    if (!compactFile && held && _openSegment != DB_NO_SEGMENT) {
+        handler.close();
+        held = false;
+    }
+    if (held)
+        return true;
+    if (!handler.open(fileName, "rb+") && !handler.open(fileName, "wb+")) {
+        DEBUG_PRINT("openLogFile: Failed to open %s for the session.\n", fileName);
+        return false;
+    }
+    held = true;
+    if (!compactFile)
+        _openSegment = DB_NO_SEGMENT;
+    return true;
+}
+
+bool DBEngine::openRecordLog(const IndexEntry& entry, const char* mode, IFileHandler*& log, uint32_t& fileOffset) {
+    fileOffset = entry.offset;
+    if (inCompactFile(entry)) {
+        log = _compactHandler;
+        return openLog(true, mode);
+    }
+    log = &_logHandler;
+    if (_segmentCount == 0)
+        return openLog(false, mode);
+    fileOffset = entry.offset % _segmentSize;
+    return openLogSegment(static_cast<uint8_t>(entry.offset / _segmentSize), mode);
+}
+
+void DBEngine::closeRecordLog(const IndexEntry& entry) {
+    closeLog(inCompactFile(entry));
+}
+
+void DBEngine::closeLog(bool compactFile) {
+    if (_mode != DB_MODE_SESSION)
+        logFile(compactFile).close();
+}
+
+// Open log file in read/write mode; if it does not exist, create it and write a DBHeader.
+// While compacting, new records go to the compaction file instead.
+bool DBEngine::beginLogAppend(uint32_t& offset, size_t bytes) {
+    if (_segmentCount > 0)
+        return beginSegmentAppend(offset, bytes);
+    IFileHandler& log = logFile(_compacting);
+    if (!openLog(_compacting, "r+b")) {
+        if (!openLog(_compacting, "wb+"))
+            return false;
+        // New file: write log header.
+        DBHeader logHeader;
+        logHeader.magic = DB_MAGIC_NUMBER;
+        logHeader.version = recordFileVersion();
+        if (!writeLogBytes(&logHeader, sizeof(logHeader))) {
+            endLogAppend();
+            return false;
+        }
+    }
+
+    // Seek to the end of the log file to obtain the record offset.
+    if (!log.seekToEnd()) {
+        endLogAppend();
+        return false;
+    }
+    offset = log.tell();
+    return true;
+}
+
+bool DBEngine::writeLogBytes(const void* data, size_t size) {
+    size_t bytesWritten = 0;
+    return logFile(_compacting).write(reinterpret_cast<const uint8_t*>(data), size, bytesWritten) &&
+        bytesWritten == size;
+}
+
+void DBEngine::endLogAppend(void) {
+    closeLog(_compacting);
+}
+
+bool DBEngine::openIndexFile(const char* mode) const {
+    if (_mode != DB_MODE_SESSION)
+        return _indexHandler.open(_indexFileName, mode);
+    if (_indexOpen)
+        return true;
+    if (!_indexHandler.open(_indexFileName, "rb+") && !_indexHandler.open(_indexFileName, "wb+")) {
+        DEBUG_PRINT("openIndexFile: Failed to open %s for the session.\n", _indexFileName);
+        return false;
+    }
+    _indexOpen = true;
+    return true;
+}
+
+void DBEngine::closeIndexFile(void) const {
+    if (_mode != DB_MODE_SESSION)
+        _indexHandler.close();
 }
 
 // ---------------------------------------------------------------------------
@@ -36,17 +193,25 @@ DBEngine::DBEngine(IFileHandler& logHandler, IFileHandler& indexHandler)
 // --- dbAppendRecord ---
 // Appends a new record to the log file and creates an index entry.
 bool DBEngine::append(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize) {
-    size_t bytesWritten = 0;
+    DB_WRITE_LOCK(_lock);
+    // A bulk load only writes the log; endBulk() builds the index.
+    if (_bulkLoading)
+        return appendBulkRecord(key, recordType, record, recordSize);
+    return appendRecord(key, recordType, record, recordSize, false);
+}
+
+bool DBEngine::appendRecord(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize, bool queued) {
     uint32_t foundIndex;
     bool reuseEntry = false;
 
-    // Check for key collision in the index.
-    if (searchIndex(key, &foundIndex)) {
-        // Retrieve the existing index entry.
-        IndexEntry existing;
-        if (!getIndexEntry(foundIndex, existing))
-            return false;
+    // Keys above the current maximum (timestamps, sequence counters) cannot
+    // collide with anything, so they skip the index search altogether.
+    uint32_t maxKey = 0;
+    bool tailAppend = (_indexCount == 0) || (currentMaxKey(maxKey) && key > maxKey);
 
+    // Check for key collision in the index.
+    IndexEntry existing;
+    if (!tailAppend && lookupKey(key, &foundIndex, &existing)) {
         // If the record is live (internal_status is not marked deleted), then abort.
         if ((existing.internal_status & INTERNAL_STATUS_DELETED) == 0) {
             DEBUG_PRINT("append: Duplicate live key detected (key=%u). Aborting append.\n", key);
@@ -57,28 +222,6 @@ bool DBEngine::append(uint32_t key, uint8_t recordType, const void* record, uint
         reuseEntry = true;
     }
 
-    // Open log file in read/write mode; if it does not exist, create it and write a DBHeader.
-    if (!_logHandler.open(_logFileName, "r+b")) {
-        if (!_logHandler.open(_logFileName, "wb+"))
-            return false;
-        // New file: write log header.
-        DBHeader logHeader;
-        logHeader.magic = DB_MAGIC_NUMBER;
-        logHeader.version = DB_VERSION;
-        if (!_logHandler.write(reinterpret_cast<const uint8_t*>(&logHeader), sizeof(logHeader), bytesWritten) ||
-            bytesWritten != sizeof(logHeader)) {
-            _logHandler.close();
-            return false;
-        }
-    }
-
-    // Seek to the end of the log file to obtain the record offset.
-    if (!_logHandler.seekToEnd()) {
-        _logHandler.close();
-        return false;
-    }
-    uint32_t offset = _logHandler.tell();
-
     // Build the log entry header with the caller-supplied key.
     LogEntryHeader header;
     header.recordType = recordType;
@@ -87,76 +230,285 @@ bool DBEngine::append(uint32_t key, uint8_t recordType, const void* record, uint
     header.status = 0;             // User-supplied status remains as provided.
     header.internal_status = 0;    // Clear internal status (i.e. record is live).
 
-    // Write the log entry header.
-    if (!_logHandler.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header), bytesWritten) ||
-        bytesWritten != sizeof(header)) {
-        _logHandler.close();
-        return false;
+    uint32_t offset = 0;
+    if (queued) {
+        // The index entry refers to the record before it is written.
+        if (!stageAsyncRecord(header, record, offset))
+            return false;
     }
+    else {
+        uint32_t rewrites = _logRewrites;
+        if (!beginLogAppend(offset, logHeaderSize() + recordSize))
+            return false;
+        // Rolling over a segmented log may have dropped the entry found above.
+        if (reuseEntry && rewrites != _logRewrites)
+            reuseEntry = lookupKey(key, &foundIndex);
 
-    // Write the record data.
-    if (!_logHandler.write(reinterpret_cast<const uint8_t*>(record), recordSize, bytesWritten) ||
-        bytesWritten != recordSize) {
-        _logHandler.close();
-        return false;
+        // Records of a type with a codec may be stored as a delta (sets the crc).
+        uint8_t encoded[DB_CODEC_MAX_RECORD];
+        const void* payload = encodeLogRecord(header, record, offset, encoded);
+
+        // Write the log entry header.
+        if (!writeLogBytes(&header, logHeaderSize())) {
+            endLogAppend();
+            return false;
+        }
+
+        // Write the record data.
+        if (!writeLogBytes(payload, header.length)) {
+            endLogAppend();
+            return false;
+        }
+        endLogAppend();
+        noteLogRecord(header, record, recordSize, offset);
     }
-    _logHandler.close();
 
     // If a duplicate (deleted) record was found, update its index entry.
     if (reuseEntry) {
         IndexEntry entry;
-        if (!getIndexEntry(foundIndex, entry))
+        if (!entryAt(foundIndex, entry))
             return false;
         // Update the index entry with the new record offset and clear the deletion flag.
         entry.offset = offset;
         // Leave the user status as is.
-        entry.internal_status = 0;  // Mark record as live.
+        entry.internal_status = header.internal_status | appendGeneration();  // Mark record as live.
         if (!setIndexEntry(foundIndex, entry))
             return false;
         DEBUG_PRINT("append: Updated index entry for key=%u at index %u.\n", key, foundIndex);
     }
+    else if (tailAppend) {
+        IndexEntry entry;
+        entry.key = header.key;
+        entry.offset = offset;
+        entry.status = header.status;
+        entry.internal_status = header.internal_status | appendGeneration();
+        if (!appendIndexEntry(entry)) {
+            DEBUG_PRINT("append: Failed to append index entry for key=%u.\n", key);
+            return false;
+        }
+    }
     else {
         // Insert a new index entry. We now pass both the user status and internal status.
-        if (!insertIndexEntry(header.key, offset, header.status, header.internal_status)) {
+        if (!insertIndexEntry(header.key, offset, header.status, header.internal_status | appendGeneration())) {
             DEBUG_PRINT("append: Failed to insert index entry (unexpected collision) for key=%u.\n", key);
             return false;
         }
     }
 
+#if DB_AGGREGATES > 0
+    if (!addRecordAggregates(key, recordType, record, recordSize))
+        return false;
+#endif
     return true;
 }
 
+// --- appendBatch ---
+// Appends a group of records: the batch is checked, all log records are written
+// from one staging buffer, and the index entries are inserted in key order
+// (mostly through the tail fast path) before the index is flushed once.
+bool DBEngine::appendBatch(const BatchItem* items, size_t n) {
+    DB_WRITE_LOCK(_lock);
+    return storeBatch(items, n, false);
+}
+
+bool DBEngine::storeBatch(const BatchItem* items, size_t n, bool replace) {
+    if (n == 0)
+        return true;
+    if (!items || n > DB_MAX_BATCH_ITEMS) {
+        DEBUG_PRINT("appendBatch: Invalid batch of %zu items (max %u).\n", n, DB_MAX_BATCH_ITEMS);
+        return false;
+    }
+    if (_bulkLoading) {
+        // Staged like single appends; the keys are not checked during a bulk load.
+        for (size_t i = 0; i < n; i++) {
+            if (!appendBulkRecord(items[i].key, items[i].recordType, items[i].record, items[i].recordSize))
+                return false;
+        }
+        return true;
+    }
+
+    // Sort the batch by key through an index permutation (insertion sort; batches are small).
+    uint16_t order[DB_MAX_BATCH_ITEMS];
+    for (size_t i = 0; i < n; i++) {
+        uint16_t item = static_cast<uint16_t>(i);
+        size_t j = i;
+        while (j > 0 && items[order[j - 1]].key > items[item].key) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = item;
+    }
+
+    // Check every key before writing anything.
+    uint32_t maxKey = 0;
+    bool haveMax = currentMaxKey(maxKey);
+    if (_indexCount > 0 && !haveMax) {
+        DEBUG_PRINT("appendBatch: Highest key not readable; the batch cannot be checked.\n");
+        return false;
+    }
+    for (size_t k = 0; k < n; k++) {
+        uint32_t key = items[order[k]].key;
+        if (k > 0 && key == items[order[k - 1]].key) {
+            DEBUG_PRINT("appendBatch: Key %u appears twice in the batch.\n", key);
+            return false;
+        }
+        // Keys above the current maximum cannot collide.
+        uint32_t foundIndex;
+        IndexEntry existing;
+        if (!replace && haveMax && key <= maxKey && lookupKey(key, &foundIndex, &existing)) {
+            if ((existing.internal_status & INTERNAL_STATUS_DELETED) == 0) {
+                DEBUG_PRINT("appendBatch: Duplicate live key detected (key=%u). Aborting batch.\n", key);
+                return false;
+            }
+        }
+    }
+
+    // Stage the log records back to back and write them in as few writes as possible.
+    uint32_t offsets[DB_MAX_BATCH_ITEMS];
+    uint32_t offset = 0;
+    size_t batchBytes = 0;
+    for (size_t i = 0; i < n; i++)
+        batchBytes += logHeaderSize() + items[i].recordSize;
+    if (!beginLogAppend(offset, batchBytes))
+        return false;
+    size_t staged = 0;
+    for (size_t i = 0; i < n; i++) {
+        LogEntryHeader header;
+        header.recordType = items[i].recordType;
+        header.length = items[i].recordSize;
+        header.key = items[i].key;
+        header.status = 0;
+        header.internal_status = 0;
+        header.crc = logRecordCrc(header, items[i].record);
+
+        size_t headerBytes = logHeaderSize();
+        size_t recordBytes = headerBytes + items[i].recordSize;
+        offsets[i] = offset;
+        offset += static_cast<uint32_t>(recordBytes);
+
+        if (staged + recordBytes > DB_BATCH_BUFFER_SIZE) {
+            if (staged > 0 && !writeLogBytes(_batchBuffer, staged)) {
+                endLogAppend();
+                return false;
+            }
+            staged = 0;
+        }
+        if (recordBytes > DB_BATCH_BUFFER_SIZE) {
+            // Too large to stage: write this record directly.
+            if (!writeLogBytes(&header, headerBytes) ||
+                !writeLogBytes(items[i].record, items[i].recordSize)) {
+                endLogAppend();
+                return false;
+            }
+            continue;
+        }
+        memcpy(&_batchBuffer[staged], &header, headerBytes);
+        memcpy(&_batchBuffer[staged + headerBytes], items[i].record, items[i].recordSize);
+        staged += recordBytes;
+    }
+    if (staged > 0 && !writeLogBytes(_batchBuffer, staged)) {
+        endLogAppend();
+        return false;
+    }
+    endLogAppend();
+
+    // Insert the index entries in key order. Once one key is above the maximum,
+    // every later key is too, so the rest of the batch takes the tail path.
+    for (size_t k = 0; k < n; k++) {
+        const BatchItem& item = items[order[k]];
+        IndexEntry entry;
+        entry.key = item.key;
+        entry.offset = offsets[order[k]];
+        entry.status = 0;
+        entry.internal_status = appendGeneration();
+
+        uint32_t foundIndex;
+        bool replaced = false;
+        if (_indexCount == 0 || (currentMaxKey(maxKey) && item.key > maxKey)) {
+            if (!appendIndexEntry(entry))
+                return false;
+        }
+        else if (lookupKey(item.key, &foundIndex)) {
+            // A deleted (or, when replacing, live) record with this key: reuse its index entry.
+            IndexEntry existing;
+            if (!entryAt(foundIndex, existing))
+                return false;
+            replaced = (existing.internal_status & INTERNAL_STATUS_DELETED) == 0;
+            // The old record is marked deleted in the log, as deleteRecord() does.
+            if (replaced && !writeLogInternalStatus(existing, (existing.internal_status | INTERNAL_STATUS_DELETED) &
+                    ~(INTERNAL_STATUS_LOG_GEN | INTERNAL_STATUS_CHANGED)))
+                return false;
+            existing.offset = entry.offset;
+            existing.internal_status = entry.internal_status;
+            if (!setIndexEntry(foundIndex, existing))
+                return false;
+        }
+        else if (!insertIndexEntry(entry.key, entry.offset, entry.status, entry.internal_status)) {
+            return false;
+        }
+#if DB_AGGREGATES > 0
+        // The replaced record's fields cannot be taken out, so its path is recomputed on demand.
+        if (replaced ? !updateAggregates(item.key, nullptr, 0) :
+            !addRecordAggregates(item.key, item.recordType, item.record, item.recordSize))
+            return false;
+#else
+        (void)replaced;
+#endif
+    }
+
+    // One index flush (pages plus a single header write) for the whole batch.
+    return flushIndexPages();
+}
+
 bool DBEngine::updateStatus(uint32_t indexId, uint8_t newStatus) {
+    DB_WRITE_LOCK(_lock);
     if (indexId >= _indexCount) {
         DEBUG_PRINT("updateStatus: Invalid indexId %u (max %u).\n", indexId, _indexCount);
         return false;
     }
 
     IndexEntry entry;
-    if (!getIndexEntry(indexId, entry))
+    if (!entryAt(indexId, entry))
         return false;
 
     uint32_t recordOffset = entry.offset;
+    if (recordOffset == DB_NO_OFFSET) {
+        DEBUG_PRINT("updateStatus: Record at index %u was reclaimed by compaction.\n", indexId);
+        return false;
+    }
 
-    if (!_logHandler.open(_logFileName, "rb+"))
+    // The next exportSince() passes the change on.
+    if (entry.status != newStatus)
+        entry.internal_status |= INTERNAL_STATUS_CHANGED;
+
+    // The index alone holds the statuses (see setStatusInLog()).
+    if (!_statusInLog) {
+        entry.status = newStatus;
+        return setIndexEntry(indexId, entry);
+    }
+
+    IFileHandler* log = nullptr;
+    if (!openRecordLog(entry, "rb+", log, recordOffset))
         return false;
 
     // Compute offset to the status field:
     // offset + sizeof(recordType) + sizeof(length) + sizeof(key)
     uint32_t statusFieldOffset = recordOffset + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t);
 
-    if (!_logHandler.seek(statusFieldOffset)) {
-        _logHandler.close();
+    if (!log->seek(statusFieldOffset)) {
+        closeRecordLog(entry);
         return false;
     }
 
+    // Read-ahead copies of this record (see DBCursor) are now stale.
+    _logRewrites++;
     size_t bytesWritten = 0;
-    if (!_logHandler.write(reinterpret_cast<const uint8_t*>(&newStatus), sizeof(newStatus), bytesWritten) ||
+    if (!log->write(reinterpret_cast<const uint8_t*>(&newStatus), sizeof(newStatus), bytesWritten) ||
         bytesWritten != sizeof(newStatus)) {
-        _logHandler.close();
+        closeRecordLog(entry);
         return false;
     }
-    _logHandler.close();
+    closeRecordLog(entry);
 
     // Update the index entry status.
     entry.status = newStatus;
@@ -166,117 +518,360 @@ bool DBEngine::updateStatus(uint32_t indexId, uint8_t newStatus) {
     return true;
 }
 
+// --- Bulk status updates ---
+// The positions are handled in ascending groups of up to DB_MAX_BATCH_ITEMS:
+// setIndexStatuses() changes each leaf once, then writeLogStatuses() sorts the
+// group's records by log offset and patches their status bytes in runs.
+bool DBEngine::updateStatusRange(uint32_t firstIndex, uint32_t count, uint8_t newStatus) {
+    DB_WRITE_LOCK(_lock);
+    if (firstIndex > _indexCount || count > _indexCount - firstIndex) {
+        DEBUG_PRINT("updateStatusRange: Invalid range of %u from %u (max %u).\n", count, firstIndex, _indexCount);
+        return false;
+    }
+    uint32_t positions[DB_MAX_BATCH_ITEMS];
+    bool reclaimed = false;
+    for (uint32_t done = 0; done < count;) {
+        size_t n = (count - done < DB_MAX_BATCH_ITEMS) ? count - done : DB_MAX_BATCH_ITEMS;
+        for (size_t i = 0; i < n; i++)
+            positions[i] = firstIndex + done + static_cast<uint32_t>(i);
+        if (!updateStatusGroup(positions, n, newStatus, reclaimed))
+            return false;
+        done += static_cast<uint32_t>(n);
+    }
+    return !reclaimed;
+}
+
+bool DBEngine::updateStatusMany(const uint32_t* indexIds, size_t n, uint8_t newStatus) {
+    DB_WRITE_LOCK(_lock);
+    for (size_t i = 0; i < n; i++) {
+        if (indexIds[i] >= _indexCount) {
+            DEBUG_PRINT("updateStatusMany: Invalid indexId %u (max %u).\n", indexIds[i], _indexCount);
+            return false;
+        }
+    }
+    uint32_t positions[DB_MAX_BATCH_ITEMS];
+    bool reclaimed = false;
+    for (size_t done = 0; done < n;) {
+        size_t group = (n - done < DB_MAX_BATCH_ITEMS) ? n - done : DB_MAX_BATCH_ITEMS;
+        // Sort the group and drop repeated positions (insertion sort; groups are small).
+        size_t count = 0;
+        for (size_t i = 0; i < group; i++) {
+            uint32_t position = indexIds[done + i];
+            size_t j = count;
+            while (j > 0 && positions[j - 1] > position)
+                j--;
+            if (j > 0 && positions[j - 1] == position)
+                continue;
+            memmove(&positions[j + 1], &positions[j], (count - j) * sizeof(positions[0]));
+            positions[j] = position;
+            count++;
+        }
+        if (!updateStatusGroup(positions, count, newStatus, reclaimed))
+            return false;
+        done += group;
+    }
+    return !reclaimed;
+}
+
+bool DBEngine::updateStatusGroup(const uint32_t* positions, size_t n, uint8_t newStatus, bool& reclaimed) {
+    // Records staged by a bulk load have to be in the log before they are patched.
+    if (_bulkLoading && !flushBulkRecords())
+        return false;
+    IndexEntry entries[DB_MAX_BATCH_ITEMS];
+    if (!setIndexStatuses(positions, n, newStatus, entries))
+        return false;
+    // Every record is written, like updateStatus() does: the index status may
+    // already match while the log does not, e.g. for a key appended again
+    // after its deletion, whose new record has status 0.
+    size_t live = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (entries[i].offset == DB_NO_OFFSET) {
+            DEBUG_PRINT("updateStatusGroup: Record at index %u was reclaimed by compaction.\n", positions[i]);
+            reclaimed = true;
+        }
+        else {
+            entries[live++] = entries[i];
+        }
+    }
+    if (!_statusInLog || live == 0)
+        return true;
+    return writeLogStatuses(entries, live, newStatus);
+}
+
+bool DBEngine::writeLogStatuses(IndexEntry* entries, size_t n, uint8_t newStatus) {
+    // Sort by file, then offset: records of the compaction file after the others.
+    for (size_t i = 1; i < n; i++) {
+        IndexEntry entry = entries[i];
+        bool compact = inCompactFile(entry);
+        size_t j = i;
+        while (j > 0 && (inCompactFile(entries[j - 1]) > compact ||
+            (inCompactFile(entries[j - 1]) == compact && entries[j - 1].offset > entry.offset))) {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = entry;
+    }
+
+    // Read-ahead copies of these records (see DBCursor) are now stale.
+    _logRewrites++;
+    const uint32_t statusField = offsetof(LogEntryHeader, status);
+    for (size_t first = 0; first < n;) {
+        IFileHandler* log = nullptr;
+        uint32_t start;
+        if (!openRecordLog(entries[first], "rb+", log, start))
+            return false;
+        start += statusField;
+        // Extend the run over the records of the same file within the buffer.
+        size_t last = first;
+        uint32_t end = start + 1;
+        while (last + 1 < n && inCompactFile(entries[last + 1]) == inCompactFile(entries[first])) {
+            const IndexEntry& next = entries[last + 1];
+            if (_segmentCount > 0 && next.offset / _segmentSize != entries[first].offset / _segmentSize)
+                break;
+            uint32_t nextEnd = start + (next.offset - entries[first].offset) + 1;
+            if (nextEnd - start > DB_BATCH_BUFFER_SIZE)
+                break;
+            end = nextEnd;
+            last++;
+        }
+
+        size_t runBytes = end - start;
+        size_t bytesDone = 0;
+        bool ok = log->seek(start);
+        if (ok && last > first) {
+            // Read the bytes in between, so that one write covers the whole run.
+            ok = log->read(_batchBuffer, runBytes, bytesDone) && bytesDone == runBytes;
+            for (size_t i = first; ok && i <= last; i++)
+                _batchBuffer[entries[i].offset - entries[first].offset] = newStatus;
+            ok = ok && log->seek(start) && log->write(_batchBuffer, runBytes, bytesDone) && bytesDone == runBytes;
+        }
+        else if (ok) {
+            ok = log->write(&newStatus, sizeof(newStatus), bytesDone) && bytesDone == sizeof(newStatus);
+        }
+        closeRecordLog(entries[first]);
+        if (!ok)
+            return false;
+        first = last + 1;
+    }
+    return true;
+}
+
+void DBEngine::setStatusInLog(bool enabled) {
+    DB_WRITE_LOCK(_lock);
+    _statusInLog = enabled;
+}
+
 
 // --- dbGetRecordByKey ---
 // Retrieves a record by searching the index for the given key.
 bool DBEngine::get(uint32_t key, void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize) {
-    uint32_t offset = 0;
-    if (!findIndexEntry(key, offset))
+    DB_READ_LOCK(_lock);
+    IndexEntry entry;
+    if (!findIndexEntry(key, entry) || entry.offset == DB_NO_OFFSET)
         return false;
 
+    LogEntryHeader localHeader;
+    if (!readLogRecord(entry, localHeader, payloadBuffer, bufferSize))
+        return false;
+
+    if (outRecordSize)
+        *outRecordSize = localHeader.length;
+    return true;
+}
+
+bool DBEngine::readLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize) {
+    if (!readRawLogRecord(entry, header, payloadBuffer, bufferSize))
+        return false;
+    if (header.internal_status & INTERNAL_STATUS_ENCODED)
+        return decodeLogRecord(entry, header, payloadBuffer, bufferSize);
+    return true;
+}
+
+bool DBEngine::readRawLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize) {
+    size_t headerBytes = logHeaderSize();
     size_t bytesRead = 0;
-    if (!_logHandler.open(_logFileName, "rb"))
+#if DB_THREAD_SAFE
+    std::unique_lock<std::mutex> logLock(_logLock);
+    // A single log file held open for the session can be read by several
+    // readers at once if the handler has positional reads.
+    if (_mode == DB_MODE_SESSION && _segmentCount == 0 && !inCompactFile(entry) && _logOpen &&
+        _asyncStaged + _asyncWriting == 0) {
+        logLock.unlock();
+        if (_logHandler.readAt(entry.offset, reinterpret_cast<uint8_t*>(&header), headerBytes, bytesRead)) {
+            if (bytesRead != headerBytes || header.length > bufferSize ||
+                !_logHandler.readAt(entry.offset + static_cast<uint32_t>(headerBytes),
+                    reinterpret_cast<uint8_t*>(payloadBuffer), header.length, bytesRead) ||
+                bytesRead != header.length)
+                return false;
+            return logRecordValid(header, payloadBuffer);
+        }
+        logLock.lock();
+    }
+#endif
+    IFileHandler* log = nullptr;
+    uint32_t offset = 0;
+    if (!openRecordLog(entry, "rb", log, offset))
         return false;
-    if (!_logHandler.seek(offset)) {
-        _logHandler.close();
+    if (!log->seek(offset)) {
+        closeRecordLog(entry);
         return false;
     }
-
-    LogEntryHeader localHeader;
-    if (!_logHandler.read(reinterpret_cast<uint8_t*>(&localHeader), sizeof(localHeader), bytesRead) ||
-        bytesRead != sizeof(localHeader)) {
-        _logHandler.close();
+    if (!log->read(reinterpret_cast<uint8_t*>(&header), headerBytes, bytesRead) ||
+        bytesRead != headerBytes) {
+        closeRecordLog(entry);
         return false;
     }
-    if (localHeader.length > bufferSize) {
-        _logHandler.close();
+    if (header.length > bufferSize) {
+        closeRecordLog(entry);
         return false;
     }
-    if (!_logHandler.read(reinterpret_cast<uint8_t*>(payloadBuffer), localHeader.length, bytesRead) ||
-        bytesRead != localHeader.length) {
-        _logHandler.close();
+    if (!log->read(reinterpret_cast<uint8_t*>(payloadBuffer), header.length, bytesRead) ||
+        bytesRead != header.length) {
+        closeRecordLog(entry);
         return false;
     }
-    _logHandler.close();
+    closeRecordLog(entry);
+#if DB_THREAD_SAFE
+    logLock.unlock();
+#endif
+    return logRecordValid(header, payloadBuffer);
+}
 
-    if (outRecordSize)
-        *outRecordSize = localHeader.length;
+// Maps the record in place. The header is mapped first to learn the payload
+// length, then the whole record, since a second map() may move the mapping.
+bool DBEngine::getView(uint32_t key, const LogEntryHeader*& header, const uint8_t*& payload) {
+    // map() may replace the mapping, so views are taken one at a time.
+    DB_WRITE_LOCK(_lock);
+    header = nullptr;
+    payload = nullptr;
+    // Safe mode closes the log after each call, which would drop the mapping.
+    if (_mode != DB_MODE_SESSION)
+        return false;
+    IndexEntry entry;
+    if (!findIndexEntry(key, entry) || entry.offset == DB_NO_OFFSET)
+        return false;
+    if (entry.internal_status & INTERNAL_STATUS_ENCODED) {
+        DEBUG_PRINT("getView: The record of key %u is encoded; use get().\n", key);
+        return false;
+    }
+    IFileHandler* log = nullptr;
+    uint32_t offset = 0;
+    if (!openRecordLog(entry, "rb", log, offset))
+        return false;
+
+    const uint8_t* mapped = log->map(offset, logHeaderSize());
+    if (!mapped)
+        return false;
+    uint16_t length = reinterpret_cast<const LogEntryHeader*>(mapped)->length;
+    mapped = log->map(offset, logHeaderSize() + length);
+    if (!mapped || !logRecordValid(*reinterpret_cast<const LogEntryHeader*>(mapped), mapped + logHeaderSize()))
+        return false;
+
+    header = reinterpret_cast<const LogEntryHeader*>(mapped);
+    payload = mapped + logHeaderSize();
     return true;
 }
 
 bool DBEngine::deleteRecord(uint32_t key) {
+    DB_WRITE_LOCK(_lock);
     uint32_t index;
     // Find the record by key.
-    if (!searchIndex(key, &index)) {
+    IndexEntry entry;
+    if (!lookupKey(key, &index, &entry)) {
         DEBUG_PRINT("deleteRecord: Key %u not found in index.\n", key);
         return false;
     }
 
-    IndexEntry entry;
-    if (!getIndexEntry(index, entry))
-        return false;
-
     // If already deleted, nothing to do.
     if (entry.internal_status & INTERNAL_STATUS_DELETED) {
         DEBUG_PRINT("deleteRecord: Key %u already marked as deleted.\n", key);
         return true;
     }
 
-    // Set the deletion flag in the internal status.
-    uint8_t newInternalStatus = entry.internal_status | INTERNAL_STATUS_DELETED;
+    // Set the deletion flag in the internal status, and mark it for exportSince().
+    uint8_t newInternalStatus = entry.internal_status | INTERNAL_STATUS_DELETED | INTERNAL_STATUS_CHANGED;
+    // The generation bit and the change mark only exist in the index.
+    uint8_t logInternalStatus = newInternalStatus & ~(INTERNAL_STATUS_LOG_GEN | INTERNAL_STATUS_CHANGED);
 
     // Update the log file.
-    // Compute offset to the internal_status field:
-    // Offset is: record offset + sizeof(recordType) + sizeof(length) + sizeof(key) + sizeof(user status)
-    uint32_t recordOffset = entry.offset;
-    uint32_t internalStatusFieldOffset = recordOffset +
-        sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
-
-    if (!_logHandler.open(_logFileName, "rb+"))
-        return false;
-    if (!_logHandler.seek(internalStatusFieldOffset)) {
-        _logHandler.close();
+    if (!writeLogInternalStatus(entry, logInternalStatus))
         return false;
-    }
-    size_t bytesWritten = 0;
-    if (!_logHandler.write(reinterpret_cast<const uint8_t*>(&newInternalStatus), sizeof(newInternalStatus), bytesWritten) ||
-        bytesWritten != sizeof(newInternalStatus)) {
-        _logHandler.close();
-        return false;
-    }
-    _logHandler.close();
 
     // Update the index entry's internal_status.
     entry.internal_status = newInternalStatus;
     if (!setIndexEntry(index, entry))
         return false;
+#if DB_AGGREGATES > 0
+    // The record's fields cannot be taken out again, so its path is recomputed on demand.
+    if (!updateAggregates(key, nullptr, 0))
+        return false;
+#endif
 
     DEBUG_PRINT("deleteRecord: Key %u marked as deleted (internal_status updated).\n", key);
     return true;
 }
 
+bool DBEngine::writeLogInternalStatus(const IndexEntry& entry, uint8_t internalStatus) {
+    IFileHandler* log = nullptr;
+    uint32_t recordOffset = 0;
+    if (!openRecordLog(entry, "rb+", log, recordOffset))
+        return false;
+    // Compute offset to the internal_status field:
+    // Offset is: record offset + sizeof(recordType) + sizeof(length) + sizeof(key) + sizeof(user status)
+    uint32_t internalStatusFieldOffset = recordOffset +
+        sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    if (!log->seek(internalStatusFieldOffset)) {
+        closeRecordLog(entry);
+        return false;
+    }
+    // Read-ahead copies of this record (see DBCursor) are now stale.
+    _logRewrites++;
+    size_t bytesWritten = 0;
+    bool ok = log->write(&internalStatus, sizeof(internalStatus), bytesWritten) &&
+        bytesWritten == sizeof(internalStatus);
+    closeRecordLog(entry);
+    return ok;
+}
+
 bool DBEngine::saveDBHeader(void) {
     DBHeader header;
     header.magic = DB_MAGIC_NUMBER;   // "LOGS"
-    header.version = DB_VERSION;       // Use the DB_VERSION constant (0x0001)
+    header.version = recordFileVersion();
+    // A segmented log keeps only the header and the segment table in this file.
+    DBSegmentTable table;
+    if (_segmentCount > 0) {
+        header.version = _logChecksums ? DB_VERSION_SEGMENTED : DB_VERSION_SEGMENTED_PLAIN;
+        table.segmentSize = _segmentSize;
+        table.segmentCount = _segmentCount;
+        table.oldest = _oldestSegment;
+        table.newest = _newestSegment;
+        table.reserved = 0;
+    }
 
     // Open the log file in a mode that allows writing at the beginning.
-    if (!_logHandler.open(_logFileName, "rb+")) {
+    if (!openLogFile("rb+")) {
         // Try creating a new file if it doesn't exist.
-        if (!_logHandler.open(_logFileName, "wb+"))
+        if (!openLogFile("wb+"))
             return false;
     }
     if (!_logHandler.seek(0)) {
-        _logHandler.close();
+        closeLogFile();
         return false;
     }
     size_t bytesWritten = 0;
     if (!_logHandler.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header), bytesWritten) ||
         bytesWritten != sizeof(header)) {
-        _logHandler.close();
+        closeLogFile();
+        return false;
+    }
+    if (_segmentCount > 0 &&
+        (!_logHandler.write(reinterpret_cast<const uint8_t*>(&table), sizeof(table), bytesWritten) ||
+         bytesWritten != sizeof(table))) {
+        closeLogFile();
         return false;
     }
-    _logHandler.close();
+    closeLogFile();
+    _stats.logHeaderWrites++;
     return true;
 }
 
@@ -284,27 +879,50 @@ bool DBEngine::saveDBHeader(void) {
 bool DBEngine::loadDBHeader(void) {
     DBHeader header;
     size_t bytesRead = 0;
-    if (!_logHandler.open(_logFileName, "rb")) {
+    if (!openLogFile("rb")) {
         DEBUG_PRINT("loadDBHeader: Could not open log file %s.\n", _logFileName);
         return false;
     }
+    if (!_logHandler.seek(0)) {
+        closeLogFile();
+        return false;
+    }
     if (!_logHandler.read(reinterpret_cast<uint8_t*>(&header), sizeof(header), bytesRead) ||
         bytesRead != sizeof(header)) {
         DEBUG_PRINT("loadDBHeader: Failed to read header from log file.\n");
-        _logHandler.close();
+        closeLogFile();
         return false;
     }
-    _logHandler.close();
+    DBSegmentTable table;
+    bool segmented = (header.version == DB_VERSION_SEGMENTED || header.version == DB_VERSION_SEGMENTED_PLAIN);
+    bool haveTable = segmented &&
+        _logHandler.read(reinterpret_cast<uint8_t*>(&table), sizeof(table), bytesRead) &&
+        bytesRead == sizeof(table);
+    closeLogFile();
 
     // Validate the header.
     if (header.magic != DB_MAGIC_NUMBER) {
         DEBUG_PRINT("loadDBHeader: Invalid magic number in log file.\n");
         return false;
     }
-    if (header.version != DB_VERSION) {
+    if (header.version != DB_VERSION && header.version != DB_VERSION_PLAIN && !haveTable) {
         DEBUG_PRINT("loadDBHeader: Unsupported version %u in log file.\n", header.version);
         return false;
     }
+    // Logs created before record checksums keep their format.
+    _logChecksums = (header.version == DB_VERSION || header.version == DB_VERSION_SEGMENTED);
+    if (haveTable) {
+        if (table.segmentCount == 0 || table.oldest >= table.segmentCount ||
+            table.newest >= table.segmentCount ||
+            static_cast<uint64_t>(table.segmentCount) * table.segmentSize > 0xFFFFFFFFu) {
+            DEBUG_PRINT("loadDBHeader: Invalid segment table.\n");
+            return false;
+        }
+        _segmentCount = table.segmentCount;
+        _segmentSize = table.segmentSize;
+        _oldestSegment = table.oldest;
+        _newestSegment = table.newest;
+    }
 
     // Save the header internally.
     _dbHeader = header;
@@ -312,8 +930,12 @@ bool DBEngine::loadDBHeader(void) {
 }
 
 bool DBEngine::open(const char logFileName[MAX_FILENAME_LENGTH],
-    const char indexFileName[MAX_FILENAME_LENGTH])
+    const char indexFileName[MAX_FILENAME_LENGTH], uint8_t mode)
 {
+    DB_WRITE_LOCK(_lock);
+    // Release anything held by a previous open().
+    closeFiles();
+
     // Copy file names as before.
     strncpy(_logFileName, logFileName, MAX_FILENAME_LENGTH - 1);
     _logFileName[MAX_FILENAME_LENGTH - 1] = '\0';
@@ -321,16 +943,38 @@ bool DBEngine::open(const char logFileName[MAX_FILENAME_LENGTH],
     _indexFileName[MAX_FILENAME_LENGTH - 1] = '\0';
 
     // Reset internal variables.
+    _mode = mode;
+    _logOpen = false;
+    _indexOpen = false;
+    _compactOpen = false;
+    _openSegment = DB_NO_SEGMENT;
+    _segmentCount = 0;
+    _asyncEndValid = false;
+    _asyncFailed = false;
+    resetRecordCodecs();
     _indexCount = 0;
-    _pageLoaded = false;
-    _pageDirty = false;
-    _currentPageNumber = 0;
+    invalidateIndexCache();
+#if DB_RESIDENT_INDEX
+    _resident = _newResident;
+#endif
+    memset(&_stats, 0, sizeof(_stats));
+
+    if (!finishLogSwap()) {
+        DEBUG_PRINT("dbOpenAndLoad: Failed to finish an interrupted compaction.\n");
+        return false;
+    }
 
     // Attempt to load and validate the DB header.
     if (!loadDBHeader()) {
         DEBUG_PRINT("dbOpenAndLoad: No valid header found. Creating new database file.\n");
+        // A new database gets the segment layout requested with setLogSegments().
+        _logChecksums = true;
+        _segmentCount = _newSegmentCount;
+        _segmentSize = _newSegmentSize;
+        _oldestSegment = 0;
+        _newestSegment = 0;
         // Create a new file by saving the header.
-        if (!saveDBHeader()) {
+        if (!saveDBHeader() || (_segmentCount > 0 && !startLogSegment(0))) {
             DEBUG_PRINT("dbOpenAndLoad: Failed to create a new DB header.\n");
             return false;
         }
@@ -341,59 +985,96 @@ bool DBEngine::open(const char logFileName[MAX_FILENAME_LENGTH],
         DEBUG_PRINT("open: Failed to load in-memory index.\n");
         return false;
     }
+    if (_compacting && !recoverCompaction()) {
+        DEBUG_PRINT("open: Unable to recover the interrupted compaction.\n");
+        return false;
+    }
+#if DB_RESIDENT_INDEX
+    if (_resident && !loadResidentIndex()) {
+        DEBUG_PRINT("open: Unable to read the index into RAM.\n");
+        return false;
+    }
+#endif
 
     // Optionally, you might also load the first index page or perform other initialization.
+    _isOpen = true;
     return true;
 }
 
-// Prints database statistics: number of records, pages, records per page, and unique keys.
-void DBEngine::printStats(void) const {
-    // _indexCount should have been set when loading the index header from disk.
-    uint32_t totalRecords = _indexCount;
-    // Each in-memory index page holds MAX_INDEX_ENTRIES entries.
-    uint32_t totalPages = (totalRecords + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES;
+bool DBEngine::sync(void) {
+    DB_WRITE_LOCK(_lock);
+    return syncFiles();
+}
 
-    printf("Database Statistics:\n");
-    printf("  Total records: %u\n", totalRecords);
-    printf("  Total pages: %u\n", totalPages);
-
-    // Print the number of entries on each page.
-    for (uint32_t page = 0; page < totalPages; page++) {
-        uint32_t start = page * MAX_INDEX_ENTRIES;
-        uint32_t end = start + MAX_INDEX_ENTRIES;
-        if (end > totalRecords)
-            end = totalRecords;
-        uint32_t countOnPage = end - start;
-        //printf("    Page %u: %u entries\n", page, countOnPage);
-    }
-
-    // Count unique keys by scanning all pages.
-    // Since this function is const but we need to load pages,
-    // we use const_cast to temporarily call non-const loadIndexPage().
-    DBEngine* self = const_cast<DBEngine*>(this);
-    uint32_t uniqueCount = 0;
-    uint32_t lastKey = 0;
-    bool first = true;
-
-    for (uint32_t page = 0; page < totalPages; page++) {
-        //printf("printStats: Loading page %u for unique key count...\n", page);
-        if (!self->loadIndexPage(page)) {
-           // printf("printStats: Error loading page %u\n", page);
-            continue;
-        }
-        // Determine number of entries on this page.
-        uint32_t start = page * MAX_INDEX_ENTRIES;
-        uint32_t countInPage = (page == totalPages - 1) ? (totalRecords - start) : MAX_INDEX_ENTRIES;
-        for (uint32_t i = 0; i < countInPage; i++) {
-            uint32_t key = self->_indexPage[i].key;
-            if (first || key != lastKey) {
-                uniqueCount++;
-                lastKey = key;
-                first = false;
-            }
-        }
+bool DBEngine::syncFiles(void) {
+    // Queued records go to the log before the index that refers to them.
+    bool asyncOk = true;
+    if (_asyncLog) {
+        drainAsync();
+        asyncOk = !_asyncFailed;
+        _asyncFailed = false;
     }
-    printf("  Unique keys: %u\n", uniqueCount);
+    if (_bulkLoading && !flushBulkRecords())
+        return false;
+    // Writes the dirty pages (if any) together with the index header.
+    if (!flushIndexPages())
+        return false;
+    // In safe mode every operation already closed (and so flushed) its file.
+    if (_logOpen && !_logHandler.flush())
+        return false;
+    if (_indexOpen && !_indexHandler.flush())
+        return false;
+    if (_compactOpen && !_compactHandler->flush())
+        return false;
+    if (!asyncOk) {
+        DEBUG_PRINT("sync: A queued log write failed; its records cannot be read.\n");
+        return false;
+    }
+    return true;
+}
+
+void DBEngine::close(void) {
+    DB_WRITE_LOCK(_lock);
+    closeFiles();
+}
+
+void DBEngine::closeFiles(void) {
+    if (_isOpen && _bulkLoading && !finishBulk()) {
+        DEBUG_PRINT("close: Bulk load not finished; the index is rebuilt by the next open().\n");
+    }
+    if (_isOpen && !syncFiles()) {
+        DEBUG_PRINT("close: Sync failed; pending index changes may be lost.\n");
+    }
+    if (_logOpen) {
+        _logHandler.close();
+        _logOpen = false;
+    }
+    if (_indexOpen) {
+        _indexHandler.close();
+        _indexOpen = false;
+    }
+    if (_compactOpen) {
+        _compactHandler->close();
+        _compactOpen = false;
+    }
+    _isOpen = false;
+    invalidateIndexCache();
 }
 
+// Prints database statistics: number of records, the tree shape and the
+// getStats() counters. Nothing is read from the files.
+void DBEngine::printStats(void) const {
+    DBStats stats;
+    getStats(stats);
+    DB_READ_LOCK(_lock);
+    printf("Database Statistics:\n");
+    printf("  Total records: %u\n", _indexCount);
+    printf("  Total pages: %u\n", _pageCount);
+    printf("  Tree height: %u\n", _treeHeight);
+    printf("  Page loads: %u, flushes: %u\n", stats.pageLoads, stats.pageFlushes);
+    printf("  Cache hits: %u, misses: %u\n", stats.cacheHits, stats.cacheMisses);
+    printf("  Splits: %u leaf, %u interior\n", stats.leafSplits, stats.interiorSplits);
+    printf("  Header writes: %u index, %u log\n", stats.indexHeaderWrites, stats.logHeaderWrites);
+}
 
+DB_NAMESPACE_END
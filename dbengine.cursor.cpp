@@ -0,0 +1,155 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// DBCursor: ordered walks over the index with read-ahead of the log
+// ---------------------------------------------------------------------------
+
+DBCursor::DBCursor(DBEngine& db)
+    : _db(db), _position(0), _valid(false), _lastOffset(0), _haveLastOffset(false),
+    _bufferStart(0), _bufferUsed(0), _bufferRewrites(0), _bufferLog(nullptr) {
+    memset(&_entry, 0, sizeof(_entry));
+}
+
+bool DBCursor::moveTo(uint32_t position) {
+    SCOPE_TIMER("DBCursor::moveTo");
+    _valid = false;
+    if (position >= _db.indexCount())
+        return false;
+    // Neighbouring positions are resolved through the leaf links.
+    if (!_db.getIndexEntry(position, _entry))
+        return false;
+    _position = position;
+    _valid = true;
+    return true;
+}
+
+bool DBCursor::seek(uint32_t key) {
+    SCOPE_TIMER("DBCursor::seek");
+    uint32_t position;
+    bool found;
+    {
+        DB_READ_LOCK(_db._lock);
+        found = _db.lowerBound(key, &position);
+    }
+    if (!found) {
+        _valid = false;
+        return false;
+    }
+    return moveTo(position);
+}
+
+bool DBCursor::first(void) {
+    return moveTo(0);
+}
+
+bool DBCursor::last(void) {
+    if (_db.indexCount() == 0) {
+        _valid = false;
+        return false;
+    }
+    return moveTo(static_cast<uint32_t>(_db.indexCount() - 1));
+}
+
+bool DBCursor::next(void) {
+    if (!_valid)
+        return false;
+    return moveTo(_position + 1);
+}
+
+bool DBCursor::prev(void) {
+    if (!_valid || _position == 0) {
+        _valid = false;
+        return false;
+    }
+    return moveTo(_position - 1);
+}
+
+bool DBCursor::readLog(IFileHandler& log, uint32_t fileBase, uint32_t offset, void* data, size_t size,
+    bool sequential) {
+    // An in-place update of the log (status change, deletion, compaction) drops
+    // the copy, and so does reading from the other file during a compaction.
+    if (_bufferUsed > 0 && (_bufferRewrites != _db._logRewrites || _bufferLog != &log))
+        _bufferUsed = 0;
+
+    if (_bufferUsed > 0 && offset >= _bufferStart &&
+        offset - _bufferStart + size <= _bufferUsed) {
+        memcpy(data, &_buffer[offset - _bufferStart], size);
+        return true;
+    }
+
+    size_t bytesRead = 0;
+    if (!sequential || size > sizeof(_buffer)) {
+        // Random access (or a record larger than the buffer): read just this.
+        return log.seek(offset - fileBase) &&
+            log.read(reinterpret_cast<uint8_t*>(data), size, bytesRead) &&
+            bytesRead == size;
+    }
+
+    // Refill from this offset. Near the end of the log the read comes up short,
+    // which is fine as long as the requested bytes arrived.
+    _bufferUsed = 0;
+    if (!log.seek(offset - fileBase))
+        return false;
+    log.read(_buffer, sizeof(_buffer), bytesRead);
+    _bufferStart = offset;
+    _bufferUsed = bytesRead;
+    _bufferRewrites = _db._logRewrites;
+    _bufferLog = &log;
+    if (bytesRead < size) {
+        DEBUG_PRINT("DBCursor::readLog: Short read at offset %u (%zu of %zu bytes).\n", offset, bytesRead, size);
+        return false;
+    }
+    memcpy(data, _buffer, size);
+    return true;
+}
+
+bool DBCursor::readPayload(void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize,
+    LogEntryHeader* outHeader) {
+    SCOPE_TIMER("DBCursor::readPayload");
+    if (!_valid || _entry.offset == DB_NO_OFFSET)
+        return false;
+    DB_READ_LOCK(_db._lock);
+
+    // Read ahead unless the walk has turned back in the log.
+    uint32_t offset = _entry.offset;
+    bool sequential = !_haveLastOffset || offset > _lastOffset;
+    _lastOffset = offset;
+    _haveLastOffset = true;
+
+    LogEntryHeader header;
+    {
+        DB_LOG_LOCK(_db._logLock);
+        IFileHandler* log = nullptr;
+        uint32_t fileOffset = 0;
+        if (!_db.openRecordLog(_entry, "rb", log, fileOffset))
+            return false;
+        uint32_t fileBase = offset - fileOffset;
+        size_t headerBytes = _db.logHeaderSize();
+        bool ok = readLog(*log, fileBase, offset, &header, headerBytes, sequential);
+        if (ok && header.length > bufferSize) {
+            DEBUG_PRINT("DBCursor::readPayload: Record of %u bytes does not fit the %u-byte buffer.\n",
+                header.length, bufferSize);
+            ok = false;
+        }
+        if (ok)
+            ok = readLog(*log, fileBase, offset + static_cast<uint32_t>(headerBytes), payloadBuffer, header.length, sequential);
+        _db.closeRecordLog(_entry);
+        if (!ok || !_db.logRecordValid(header, payloadBuffer))
+            return false;
+    }
+    // The reference of an encoded record is read outside the log lock, which
+    // the engine takes itself.
+    if ((header.internal_status & INTERNAL_STATUS_ENCODED) &&
+        !_db.decodeLogRecord(_entry, header, payloadBuffer, bufferSize))
+        return false;
+
+    if (outRecordSize)
+        *outRecordSize = header.length;
+    if (outHeader)
+        *outHeader = header;
+    return true;
+}
+
+DB_NAMESPACE_END
@@ -1,7 +1,13 @@
 #ifndef DBENGINE_H
 #define DBENGINE_H
 
+// Settings of this build of the engine (see "Engine Configurations" below).
+#ifdef DB_CONFIG_HEADER
+#include DB_CONFIG_HEADER
+#endif
+
 #include "IFileHandler.h"  // The abstract file I/O interface
+#include "IAsyncFileHandler.h"
 
 // Use the C standard headers for maximum portability on embedded devices.
 #include <stdint.h>
@@ -11,35 +17,255 @@
 // -----------------------------------------------------------------------------
 // Constants & Macros
 // -----------------------------------------------------------------------------
+// Entries of an index leaf; a page costs about MAX_INDEX_ENTRIES * 10 bytes of
+// RAM and of the index file. Index files only open with the value they were
+// written with.
+#ifndef MAX_INDEX_ENTRIES
 #define MAX_INDEX_ENTRIES 256
+#endif
+#ifndef MAX_FILENAME_LENGTH
 #define MAX_FILENAME_LENGTH 13  // For 8.3 filenames
+#endif
+
+// Number of index pages held in RAM at once. Each slot costs about
+// MAX_INDEX_ENTRIES * sizeof(IndexEntry) bytes. A page split needs the old and
+// the new page resident together, so at least 2 slots are required; 4-8 keep
+// the interior levels of the tree resident next to the working leaves.
+#ifndef INDEX_CACHE_PAGES
+#define INDEX_CACHE_PAGES 4
+#endif
+#if INDEX_CACHE_PAGES < 2
+#error "INDEX_CACHE_PAGES must be at least 2"
+#endif
+
+// Upper limit on the number of records passed to one appendBatch() call.
+#ifndef DB_MAX_BATCH_ITEMS
+#define DB_MAX_BATCH_ITEMS 64
+#endif
+
+// Staging buffer used by appendBatch() to write many log records with one
+// write. Batches that do not fit are written in buffer-sized pieces.
+#ifndef DB_BATCH_BUFFER_SIZE
+#define DB_BATCH_BUFFER_SIZE 2048
+#endif
+
+// Read-ahead buffer of each DBCursor. Payloads of records that lie one after
+// another in the log are served from one read of this size.
+#ifndef DB_CURSOR_BUFFER_SIZE
+#define DB_CURSOR_BUFFER_SIZE 1024
+#endif
+
+// Sorted runs merged at once while rebuildIndex() sorts the entries read from
+// the log. The merge reads each run through DB_BATCH_BUFFER_SIZE / fan-in
+// bytes; a larger fan-in means fewer passes over the index file.
+#ifndef DB_RECOVERY_FANIN
+#define DB_RECOVERY_FANIN 8
+#endif
+
+// Record codec (see setRecordCodec()): how many record types can be encoded at
+// once, and the largest record that is. Each type keeps a copy of its current
+// reference record, so the codec costs about DB_CODEC_TYPES * DB_CODEC_MAX_RECORD
+// bytes of RAM; 0 types leaves it out.
+#ifndef DB_CODEC_TYPES
+#define DB_CODEC_TYPES 2
+#endif
+#ifndef DB_CODEC_MAX_RECORD
+#define DB_CODEC_MAX_RECORD 128
+#endif
+#if DB_CODEC_MAX_RECORD > DB_BATCH_BUFFER_SIZE
+#error "DB_CODEC_MAX_RECORD must not exceed DB_BATCH_BUFFER_SIZE"
+#endif
+
+// Range aggregates (see aggregateRange()): how many numeric fields of a record
+// an extractor can report. Each child reference of an interior page then keeps
+// a 20-byte DBAggregate per field for its subtree, which lowers the fanout of
+// the interior pages (the build fails if too few references fit, see
+// INDEX_FANOUT); 0 leaves the feature out. Fields of records longer than
+// DB_AGGREGATE_MAX_RECORD are not aggregated. Index files only open with the
+// DB_AGGREGATES they were written with.
+#ifndef DB_AGGREGATES
+#define DB_AGGREGATES 0
+#endif
+#if DB_AGGREGATES > 15
+#error "DB_AGGREGATES must not exceed 15"
+#endif
+#ifndef DB_AGGREGATE_MAX_RECORD
+#define DB_AGGREGATE_MAX_RECORD DB_CODEC_MAX_RECORD
+#endif
+#if DB_AGGREGATE_MAX_RECORD < DB_CODEC_MAX_RECORD
+#error "DB_AGGREGATE_MAX_RECORD must not be below DB_CODEC_MAX_RECORD"
+#endif
+
+// Encoded records are deltas against the last record of their type stored in
+// full. A record is stored in full again after this many encoded ones, so the
+// deltas stay small while the values drift.
+#ifndef DB_CODEC_KEYFRAME_INTERVAL
+#define DB_CODEC_KEYFRAME_INTERVAL 32
+#endif
+
+// Define DB_CRC32_EXTERNAL to supply dbCrc32() from the platform port (e.g. the
+// SAMD21 DSU CRC32 unit) instead of the table-driven version in dbengine.crc.cpp.
+
+// Set DB_THREAD_SAFE to 1 on hosts where several threads share one DBEngine,
+// e.g. an ingest thread and query threads on a Linux gateway. Calls that change
+// the database then take an exclusive lock and lookups a shared one (see
+// "Concurrency" in the DBEngine class). Embedded builds leave it at 0 and carry
+// no locking code at all.
+#ifndef DB_THREAD_SAFE
+#define DB_THREAD_SAFE 0
+#endif
+
+// Set DB_RESIDENT_INDEX to 1 on hosts with memory to spare, e.g. a gateway
+// keeping multi-million-record archives. setResidentIndex() can then hold the
+// whole index in RAM instead of in the INDEX_CACHE_PAGES page cache, and split
+// status scans between threads. Embedded builds leave it at 0.
+#ifndef DB_RESIDENT_INDEX
+#define DB_RESIDENT_INDEX 0
+#endif
+
+// Fewest index entries a resident scan gives one thread; smaller indexes are
+// scanned on the calling thread alone.
+#ifndef DB_SCAN_CHUNK_ENTRIES
+#define DB_SCAN_CHUNK_ENTRIES 16384
+#endif
+
+// Deepest index tree supported (levels including the leaf level). With the
+// default page size three levels already address more than 11 million keys.
+#ifndef DB_MAX_TREE_HEIGHT
+#define DB_MAX_TREE_HEIGHT 8
+#endif
 
 #define DB_MAGIC_NUMBER     0x53474F4C  // "LOGS" in little-endian hex
-#define DB_VERSION          0x0001
-#define DB_IDX_VERSION      0x0001
+#define DB_VERSION          0x0003
+#define DB_VERSION_SEGMENTED 0x0004     // Log file holding the DBSegmentTable of a segmented log
+#define DB_VERSION_PLAIN    0x0001      // Records without LogEntryHeader::crc (still supported)
+#define DB_VERSION_SEGMENTED_PLAIN 0x0002 // Segmented log of records without a crc (still supported)
+#define DB_IDX_VERSION      0x0005
+#define DB_IDX_VERSION_WIDE 0x0004      // Every leaf holds IndexEntry records (still supported)
+#define DB_IDX_VERSION_SUMMARY 0x0003   // Single header, pages without a crc (rebuilt on open)
+#define DB_IDX_VERSION_TREE 0x0002      // Tree without subtree summaries (rebuilt on open)
+#define DB_IDX_VERSION_FLAT 0x0001      // Flat sorted array (upgraded on open)
+
+/// Index page types (IndexPageHeader::type).
+#define INDEX_PAGE_FREE     0x00
+#define INDEX_PAGE_LEAF     0x01
+#define INDEX_PAGE_INTERIOR 0x02
+
+/// IndexPageHeader::format bit of a narrow leaf (see setNarrowLeaves()). Bits
+/// 0-1 hold the width of a stored key minus one, bits 2-3 that of an offset.
+#define INDEX_LEAF_NARROW   0x10
+
+/// Page number used for "no page" in page links and the index header.
+#define DB_NO_PAGE          0xFFFFFFFFu
+
+/// Segment number used for "the log file itself" (see setLogSegments()).
+#define DB_NO_SEGMENT       0xFFFFu
+
+/// Log offset of a deleted record whose bytes were reclaimed by compact().
+#define DB_NO_OFFSET        0xFFFFFFFFu
 
 /// Deletion flag for internal_status.
 #define INTERNAL_STATUS_DELETED 0x01
+/// Index-only flag for internal_status: generation of the log file that holds
+/// the record. Only differs from the log's generation while compact() runs.
+#define INTERNAL_STATUS_LOG_GEN 0x02
+/// The payload is stored in the delta encoding of setRecordCodec(); kept in the
+/// log header and the index entry.
+#define INTERNAL_STATUS_ENCODED 0x04
+/// Index-only flag for internal_status: the user status or the deletion flag
+/// changed since the record was last passed to exportSince().
+#define INTERNAL_STATUS_CHANGED 0x08
+/// internal_status flag of an exportSince() delta frame (see DBExportSink).
+#define INTERNAL_STATUS_DELTA   0x80
+
+/// DBIndexHeader::flags bits.
+#define DB_IDX_FLAG_LOG_GEN     0x01  ///< Generation of the records in the log file.
+#define DB_IDX_FLAG_COMPACTING  0x02  ///< A compaction is in progress.
+#define DB_IDX_FLAG_BULK        0x04  ///< A bulk load is in progress; the index is incomplete.
+#define DB_IDX_FLAG_AHEAD       0x08  ///< Pages may have been written after this header.
+#define DB_IDX_AGGREGATES_SHIFT 4     ///< Bits 4-7 hold the DB_AGGREGATES of the index.
+
+/// DBAggregate::count of an aggregate that has to be recomputed from the records.
+#define DB_AGGREGATE_STALE  0xFFFFFFFFu
+
+/// Bit of IndexChildRef::statusMask that stands for a user status value.
+/// Statuses 0-31 have a bit of their own; larger values share them modulo 32.
+#define DB_STATUS_BIT(status) (1u << ((status) & 31))
+
+/// File handling modes for DBEngine::open().
+#define DB_MODE_SAFE        0x00  ///< Open and close the files around every operation.
+#define DB_MODE_SESSION     0x01  ///< Keep both files open until close() is called.
 
 
 // -----------------------------------------------------------------------------
 // Instrumentation Macros
 // -----------------------------------------------------------------------------
-// Only include instrumentation support on Windows. On embedded devices such as the SAMD21,
-// the instrumentation code is excluded completely.
-#ifndef _WIN32
+// SCOPE_TIMER times the enclosing function in a static slot of
+// Instrumentation.h (a few nanoseconds per call) when DB_PROFILE is set, e.g.
+// in host builds. By default, and on embedded devices such as the SAMD21, it
+// is compiled out completely.
+#ifndef DB_PROFILE
+#define DB_PROFILE 0
+#endif
+#if DB_PROFILE
     #include "Instrumentation.h"
-    //#define SCOPE_TIMER(name) ScopedTimer timer(name)
+    #define SCOPE_TIMER(name) DB_SCOPE_TIMER(name)
+#else
     #define SCOPE_TIMER(name)
+#endif
+
+// Debug output, compiled out unless the printf version is uncommented.
+//#define DEBUG_PRINT(...) printf(__VA_ARGS__)
+#define DEBUG_PRINT(...)
 
-    //#define DEBUG_PRINT(...) printf(__VA_ARGS__)
-    #define DEBUG_PRINT(...)
+
+// -----------------------------------------------------------------------------
+// Concurrency Macros
+// -----------------------------------------------------------------------------
+// Scoped locks for DB_THREAD_SAFE builds; like SCOPE_TIMER they expand to
+// nothing otherwise.
+#if DB_THREAD_SAFE
+    #include <mutex>
+    #include <shared_mutex>
+    #define DB_WRITE_LOCK(lock) std::unique_lock<std::shared_mutex> dbWriteLock(lock)
+    #define DB_READ_LOCK(lock) std::shared_lock<std::shared_mutex> dbReadLock(lock)
+    #define DB_CACHE_LOCK(lock) std::lock_guard<std::mutex> dbCacheLock(lock)
+    #define DB_LOG_LOCK(lock) std::lock_guard<std::mutex> dbLogLock(lock)
 #else
-  // Provide no-op definitions for non-Windows builds.
-    #define SCOPE_TIMER(name)
-    #define DEBUG_PRINT(...)
+    #define DB_WRITE_LOCK(lock)
+    #define DB_READ_LOCK(lock)
+    #define DB_CACHE_LOCK(lock)
+    #define DB_LOG_LOCK(lock)
+#endif
+#if DB_RESIDENT_INDEX
+    #include <memory>
+    #include <thread>
+    #include <vector>
+#endif
+
+
+// -----------------------------------------------------------------------------
+// Engine Configurations
+// -----------------------------------------------------------------------------
+// The settings above are fixed for one build of the engine sources. A program
+// that needs several, e.g. a small-page store next to a large-page mirror,
+// builds the sources once per configuration (add_dbengine_library() in
+// CMakeLists.txt). A configuration is a header, passed as DB_CONFIG_HEADER to
+// the engine sources and to the code using that engine, which defines the
+// settings that differ and DB_NAMESPACE: the engine of the configuration is
+// then DB_NAMESPACE::DBEngine. Without DB_NAMESPACE everything is declared in
+// the global namespace. The file handlers and Instrumentation.h are shared by
+// all configurations; where they depend on DB_THREAD_SAFE (CountingFileHandler,
+// DB_PROFILE) the configurations must agree on it.
+#ifdef DB_NAMESPACE
+    #define DB_NAMESPACE_BEGIN namespace DB_NAMESPACE {
+    #define DB_NAMESPACE_END }
+#else
+    #define DB_NAMESPACE_BEGIN
+    #define DB_NAMESPACE_END
 #endif
 
+DB_NAMESPACE_BEGIN
 
 // -----------------------------------------------------------------------------
 // Data Structures
@@ -56,15 +282,52 @@ struct DBHeader {
 };
 #pragma pack(pop)
 
+//
+// --- DB Segment Table ---
+// Follows the DBHeader of a segmented log (version DB_VERSION_SEGMENTED). The
+// records are stored in segmentCount files named after the log file with the
+// extension replaced by the segment number (LOGFILE.000, LOGFILE.001, ...),
+// each starting with its own DBHeader. An index entry's offset addresses
+// segment (offset / segmentSize) at (offset % segmentSize).
+//
+#pragma pack(push, 1)
+struct DBSegmentTable {
+    uint32_t segmentSize;  ///< Maximum size of one segment file in bytes
+    uint8_t  segmentCount; ///< Segment files in the ring
+    uint8_t  oldest;       ///< Oldest segment still holding records
+    uint8_t  newest;       ///< Segment currently written to
+    uint8_t  reserved;     ///< Always 0
+};
+#pragma pack(pop)
+
 //
 // --- DB Index Header ---
-// This header holds metadata for the index file, including the index count.
+// This header holds metadata for the index file, including the index count and
+// the shape of the page tree. The first three fields are shared with the flat
+// version 1 format so that either can be recognised.
+//
+// The file starts with two header slots. Each write goes to the slot the
+// previous one did not use, so a torn header write leaves the other slot
+// intact; open() takes the valid slot with the higher sequence number. Before
+// the first page of a commit is overwritten, a header with DB_IDX_FLAG_AHEAD is
+// written, so an open() that finds the flag knows the pages may not match the
+// header and rebuilds the index from the log.
 //
 #pragma pack(push, 1)
 struct DBIndexHeader {
-    uint32_t magic;      ///< Magic number ("LOGS")
-    uint16_t version;    ///< Index file format version
-    uint32_t indexCount; ///< Number of index entries stored in the file
+    uint32_t magic;       ///< Magic number ("LOGS")
+    uint16_t version;     ///< Index file format version
+    uint32_t indexCount;  ///< Number of index entries stored in the file
+    uint16_t pageEntries; ///< MAX_INDEX_ENTRIES the file was written with
+    uint8_t  treeHeight;  ///< Tree levels including the leaves (0 = empty index)
+    uint8_t  flags;       ///< DB_IDX_FLAG_* bits
+    uint32_t rootPage;    ///< Root page, or DB_NO_PAGE
+    uint32_t firstLeaf;   ///< Leaf holding the smallest keys, or DB_NO_PAGE
+    uint32_t lastLeaf;    ///< Leaf holding the largest keys, or DB_NO_PAGE
+    uint32_t pageCount;   ///< Pages allocated in the file (including free pages)
+    uint32_t freePage;    ///< Head of the free page list, or DB_NO_PAGE
+    uint32_t sequence;    ///< Incremented by every header write
+    uint32_t crc;         ///< dbCrc32() of the fields above
 };
 #pragma pack(pop)
 
@@ -74,6 +337,10 @@ struct DBIndexHeader {
 // field "status" is preserved, and we add an additional "internal_status" field 
 // for internal bookkeeping (e.g., deletion flag).
 //
+// The crc covers recordType, length, key and the payload, but not the two status
+// bytes, which are updated in place. Logs of version DB_VERSION_PLAIN (and
+// DB_VERSION_SEGMENTED_PLAIN) store the header without the crc field.
+//
 #pragma pack(push, 1)
 struct LogEntryHeader {
     uint8_t  recordType;      ///< Identifier for the record type
@@ -81,6 +348,7 @@ struct LogEntryHeader {
     uint32_t key;             ///< Key value supplied by the caller
     uint8_t  status;          ///< User-supplied status (untouched internally)
     uint8_t  internal_status; ///< Internal status (e.g., deletion flag)
+    uint32_t crc;             ///< dbCrc32() of the record (see above)
 };
 #pragma pack(pop)
 
@@ -98,6 +366,150 @@ struct IndexEntry {
 };
 #pragma pack(pop)
 
+//
+// --- Index Page ---
+// The index file is a B+-tree of fixed-size pages stored after the DBIndexHeader.
+// Leaf pages hold IndexEntry records in key order and are chained through
+// prev/next. Interior pages hold one IndexChildRef per child: the smallest key
+// of the child's subtree, its page and the number of entries below it, so a
+// global index position can be resolved with one page per level. Each reference
+// also summarises the statuses below it, which lets status scans skip subtrees
+// without loading them, and with DB_AGGREGATES > 0 the count, minimum, maximum
+// and sum of each aggregated field (a DBAggregate). Every page carries a
+// dbCrc32() of its header and of the entries or references in use, checked
+// whenever the whole page is read.
+//
+// A narrow leaf (format INDEX_LEAF_NARROW) stores each entry as the difference
+// of its key to the page's base key and of its offset to the base offset, each
+// in 1-4 bytes as the page's spread needs, followed by the two status bytes.
+// The entries are packed from the start of the page; the base key and base
+// offset take its last 8 bytes. An offset of all ones stands for DB_NO_OFFSET.
+//
+#pragma pack(push, 1)
+struct IndexPageHeader {
+    uint8_t  type;     ///< INDEX_PAGE_LEAF, INDEX_PAGE_INTERIOR or INDEX_PAGE_FREE
+    uint8_t  format;   ///< Leaf: 0 for IndexEntry records, else INDEX_LEAF_NARROW and widths; otherwise 0
+    uint16_t count;    ///< Entries (leaf) or child references (interior) in use
+    uint32_t prev;     ///< Leaf: previous leaf page, or DB_NO_PAGE
+    uint32_t next;     ///< Leaf: next leaf page; free page: next free page
+    uint32_t crc;      ///< dbCrc32() of the fields above and the entries in use
+};
+
+struct DBAggregate {
+    uint32_t count;  ///< Records with the field, or DB_AGGREGATE_STALE
+    float    min;    ///< Smallest value (if count > 0)
+    float    max;    ///< Largest value (if count > 0)
+    double   sum;    ///< Sum of the values
+};
+
+struct IndexChildRef {
+    uint32_t key;   ///< Smallest key stored in the child's subtree
+    uint32_t page;  ///< Child page number
+    uint32_t count;      ///< Number of index entries in the child's subtree
+    uint32_t deleted;    ///< Entries in the subtree with INTERNAL_STATUS_DELETED set
+    uint32_t statusMask; ///< DB_STATUS_BIT() of every user status in the subtree
+#if DB_AGGREGATES > 0
+    DBAggregate aggregates[DB_AGGREGATES]; ///< Fields of the subtree's live records
+#endif
+};
+#pragma pack(pop)
+
+//
+// --- Batch Item ---
+// One record of an appendBatch() call. The payload is only read during the call.
+//
+struct BatchItem {
+    uint32_t key;          ///< Key value supplied by the caller
+    uint8_t  recordType;   ///< Identifier for the record type
+    const void* record;    ///< Record payload
+    uint16_t recordSize;   ///< Payload length in bytes
+};
+
+//
+// --- Aggregate Extractor ---
+// Reports the aggregated fields of a record (see setAggregateExtractor()): it
+// stores field i in values[i] and returns a mask with bit i set for each of
+// the DB_AGGREGATES fields the record has.
+//
+typedef uint32_t (*DBAggregateExtractor)(uint8_t recordType, const void* record, uint16_t recordSize,
+    float values[]);
+
+//
+// --- Export Sink ---
+// Receives the change stream of exportSince() piece by piece; the pieces form
+// a sequence of frames. Each frame is a LogEntryHeader (with crc, whatever the
+// log's format) followed by header.length payload bytes. A record frame holds
+// a record as get() returns it, with the status and INTERNAL_STATUS_DELETED
+// of its log header. A delta frame has INTERNAL_STATUS_DELTA set and no
+// payload; it carries the current status and deletion flag of a record
+// exported before or in the same stream. Returns false to stop the export.
+//
+typedef bool (*DBExportSink)(void* context, const void* data, size_t size);
+
+//
+// --- Engine Statistics ---
+// Counters returned by DBEngine::getStats(), accumulated since open() or the
+// last resetStats(); they wrap around at 2^32. Media I/O (opens, seeks, reads,
+// writes and bytes) is counted by a CountingFileHandler around the handlers.
+//
+struct DBStats {
+    uint32_t pageLoads;          ///< Index pages read from the index file.
+    uint32_t pageFlushes;        ///< Index pages written to the index file.
+    uint32_t cacheHits;          ///< Page requests served from the page cache.
+    uint32_t cacheMisses;        ///< Page requests that had to load the page.
+    uint32_t leafSplits;         ///< Leaves split by an insert.
+    uint32_t interiorSplits;     ///< Interior pages split, including the root.
+    uint32_t indexHeaderWrites;  ///< Index header (commit) writes.
+    uint32_t logHeaderWrites;    ///< Log header rewrites.
+};
+
+/// Bytes of a page after its header.
+#define INDEX_PAGE_BODY (MAX_INDEX_ENTRIES * sizeof(IndexEntry))
+
+/// Child references per interior page (same byte budget as a leaf).
+#define INDEX_FANOUT (INDEX_PAGE_BODY / sizeof(IndexChildRef))
+
+/// Entries a tree of 'levels' full levels addresses, counted up to 2^32.
+constexpr uint64_t dbTreeReach(uint64_t entries, uint64_t fanout, unsigned levels) {
+    return (levels <= 1 || entries >= (1ULL << 32)) ? entries : dbTreeReach(entries * fanout, fanout, levels - 1);
+}
+
+// Every DB_AGGREGATES field makes IndexChildRef larger, so a small page may
+// not hold enough references for the splits to work, or for the tree to
+// address every key before it reaches DB_MAX_TREE_HEIGHT.
+static_assert(INDEX_FANOUT >= 3,
+    "An interior page must hold at least 3 child references: raise MAX_INDEX_ENTRIES or lower DB_AGGREGATES");
+static_assert(dbTreeReach(MAX_INDEX_ENTRIES, INDEX_FANOUT, DB_MAX_TREE_HEIGHT) >= (1ULL << 32),
+    "DB_MAX_TREE_HEIGHT levels must address 2^32 entries: raise MAX_INDEX_ENTRIES or DB_MAX_TREE_HEIGHT, or lower DB_AGGREGATES");
+
+/// Most entries a narrow leaf holds. Either half of a split leaf then fits
+/// MAX_INDEX_ENTRIES IndexEntry records, whatever widths its entries need.
+#define INDEX_LEAF_CAPACITY (2 * MAX_INDEX_ENTRIES - 1)
+
+#pragma pack(push, 1)
+struct IndexPage {
+    IndexPageHeader header;
+    union {
+        IndexEntry    entries[MAX_INDEX_ENTRIES]; ///< Leaf contents
+        IndexChildRef children[INDEX_FANOUT];     ///< Interior contents
+        uint8_t       bytes[INDEX_PAGE_BODY];     ///< Narrow leaf contents
+    };
+};
+#pragma pack(pop)
+
+
+// -----------------------------------------------------------------------------
+// Checksums
+// -----------------------------------------------------------------------------
+
+/**
+ * @brief Continues a CRC-32 (IEEE 802.3, as in zlib) over 'length' more bytes.
+ *
+ * Start with crc = 0; the result of one call can be passed to the next to
+ * checksum data that is not contiguous.
+ */
+uint32_t dbCrc32(uint32_t crc, const void* data, size_t length);
+
 
 // -----------------------------------------------------------------------------
 // DBEngine Class Declaration
@@ -107,12 +519,21 @@ struct IndexEntry {
  * @brief Implements a key-value database with an indexed, log-based storage system.
  *
  * The DBEngine supports appending new records, updating and retrieving records,
- * as well as index management. The index is maintained in a paged format.
+ * as well as index management. The index is maintained as a paged B+-tree, so
+ * an insert touches one page per tree level and a lookup reads one leaf.
  *
  * The implementation is split between general DB engine functions (e.g., file I/O)
  * and index-specific operations (e.g., paging, searching, deletion marking).
+ *
+ * Built with DB_THREAD_SAFE, one DBEngine can be shared between threads. Calls
+ * that change the database run one at a time; get(), the search, filtering and
+ * counting functions, DBCursor reads and the statistics run side by side, and
+ * only wait for each other while a page or record is read from a file. A single
+ * DBCursor still belongs to one thread.
  */
 class DBEngine {
+    friend class DBCursor;
+
 public:
     // -------------------------------------------------------------------------
     // General Database Operations
@@ -126,18 +547,62 @@ public:
      */
     DBEngine(IFileHandler& logHandler, IFileHandler& indexHandler);
 
+    /**
+     * @brief Constructs a DBEngine whose log can also be written asynchronously.
+     *
+     * appendAsync() stages records in 'asyncBuffer' and writes each half of it
+     * with one request to 'logHandler' while the other half fills, so a record
+     * may not be larger than asyncBufferSize / 2. The buffer must outlive the
+     * engine.
+     *
+     * @param logHandler Asynchronous file handler for log file operations.
+     * @param indexHandler Reference to a file handler for index file operations.
+     * @param asyncBuffer RAM for records waiting to be written.
+     * @param asyncBufferSize Size of asyncBuffer in bytes.
+     */
+    DBEngine(IAsyncFileHandler& logHandler, IFileHandler& indexHandler,
+        uint8_t* asyncBuffer, size_t asyncBufferSize);
+
+    /**
+     * @brief Closes the database (see close()).
+     */
+    ~DBEngine();
+
     /**
      * @brief Opens the database files (log and index) for future operations.
      *
      * This function opens and validates (or creates if necessary) the specified
      * log and index files.
      *
+     * In DB_MODE_SAFE every operation opens and closes the files it touches, so no
+     * file handle is held between calls. In DB_MODE_SESSION both files are opened
+     * once and kept open until close(); each operation then costs only a seek plus
+     * a read or write. Call sync() to commit outstanding writes in session mode.
+     *
      * @param logFileName Name of the log file.
      * @param indexFileName Name of the index file.
+     * @param mode DB_MODE_SAFE (default) or DB_MODE_SESSION.
      * @return True if the files were successfully opened and validated, false otherwise.
      */
     bool open(const char logFileName[MAX_FILENAME_LENGTH],
-        const char indexFileName[MAX_FILENAME_LENGTH]);
+        const char indexFileName[MAX_FILENAME_LENGTH],
+        uint8_t mode = DB_MODE_SAFE);
+
+    /**
+     * @brief Writes any dirty index page and the index header to disk and flushes
+     *        both file handlers.
+     *
+     * @return True if all pending data was committed, false otherwise.
+     */
+    bool sync(void);
+
+    /**
+     * @brief Syncs the database and releases both file handles.
+     *
+     * The engine must be re-opened with open() before further use. Calling close()
+     * on a database that is not open has no effect.
+     */
+    void close(void);
 
     /**
      * @brief Appends a new record to the log file and creates an index entry.
@@ -153,6 +618,22 @@ public:
      */
     bool append(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize);
 
+    /**
+     * @brief Appends several records with one log write and one index flush.
+     *
+     * All log records are staged in one contiguous buffer and written together,
+     * then the index entries are inserted in key order and the dirty index pages
+     * and header are written once. The batch is checked before anything is
+     * written: it is rejected if two items share a key or if an item's key is
+     * already held by a live record (keys of deleted records are reused, as in
+     * append()).
+     *
+     * @param items The records to append, in any key order.
+     * @param n Number of items (at most DB_MAX_BATCH_ITEMS).
+     * @return True if every record was appended, false otherwise.
+     */
+    bool appendBatch(const BatchItem* items, size_t n);
+
     /**
      * @brief Updates the status of a record given its index position.
      *
@@ -162,6 +643,52 @@ public:
      */
     bool updateStatus(uint32_t indexId, uint8_t newStatus);
 
+    /**
+     * @brief Sets the status of 'count' records from a global index position on.
+     *
+     * Works like updateStatus() on each record, with far fewer I/Os: the entries
+     * are changed leaf by leaf, with one summary refresh per leaf, and the
+     * status bytes in the log are written in runs. Records whose status bytes
+     * lie within DB_BATCH_BUFFER_SIZE bytes of each other in one log file are
+     * read, patched and written back together. Records that already have the
+     * status are left alone.
+     *
+     * @param firstIndex The global index position of the first record.
+     * @param count Number of records (firstIndex + count must not exceed the index count).
+     * @param newStatus The new status value.
+     * @return True if every status was set. False on an I/O error, or if a record
+     *         was reclaimed by compaction (the others are still updated).
+     */
+    bool updateStatusRange(uint32_t firstIndex, uint32_t count, uint8_t newStatus);
+
+    /**
+     * @brief Sets the status of the records at the given global index positions.
+     *
+     * As updateStatusRange(), for positions in any order. They are handled in
+     * groups of DB_MAX_BATCH_ITEMS, each sorted first, so ascending positions
+     * (e.g. from findByStatus()) give the fewest page and log accesses.
+     *
+     * @param indexIds The global index positions (each below the index count).
+     * @param n Number of positions.
+     * @param newStatus The new status value.
+     * @return True if every status was set, false otherwise (see updateStatusRange()).
+     */
+    bool updateStatusMany(const uint32_t* indexIds, size_t n, uint8_t newStatus);
+
+    /**
+     * @brief Chooses whether status updates also write the status byte of the
+     *        record in the log (the default).
+     *
+     * With false, updateStatus(), updateStatusRange() and updateStatusMany()
+     * only change the index, which then holds the only current copy of the
+     * statuses: they cost no log I/O, but rebuildIndex() (also when open()
+     * rebuilds a damaged index) restores the statuses last written to the log.
+     * The setting is not saved with the database.
+     *
+     * @param enabled True to keep the log's status bytes up to date.
+     */
+    void setStatusInLog(bool enabled);
+
     /**
      * @brief Retrieves a record from the log file given its key.
      *
@@ -173,11 +700,27 @@ public:
      */
     bool get(uint32_t key, void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize = nullptr);
 
+    /**
+     * @brief Returns pointers to a record inside the log file mapping, without copying.
+     *
+     * Needs session mode and a log handler whose map() is supported; otherwise it
+     * returns false and get() has to be used. The pointers stay valid until the next
+     * write to the log (append, updateStatus, deleteRecord, ...), the next getView(),
+     * or close(); with DB_THREAD_SAFE, that includes calls made by other threads.
+     *
+     * @param key The key of the record to look up.
+     * @param header Receives a pointer to the record's log entry header.
+     * @param payload Receives a pointer to the header->length payload bytes.
+     * @return True if the record was found and mapped, false otherwise.
+     */
+    bool getView(uint32_t key, const LogEntryHeader*& header, const uint8_t*& payload);
+
     /**
      * @brief Finds records with a specific user-supplied status.
      *
      * Searches the index for records with the specified status and returns the
      * matching global index positions in the provided array.
+     * Subtrees whose status summary shows no such status are skipped unread.
      *
      * @param status The status value to search for.
      * @param results Array to store the matching index positions.
@@ -213,6 +756,217 @@ public:
      */
     bool deleteRecord(uint32_t key);
 
+    /**
+     * @brief Stores the log as a ring of fixed-size segment files.
+     *
+     * Call before open(). Only takes effect when open() creates the database; an
+     * existing database keeps the layout it was created with. When the newest
+     * segment cannot take the next record, appends move on to the next segment
+     * file. Once all segments are in use, the oldest one is dropped: its index
+     * entries are removed in one pass over the index and its file is reused,
+     * so storage stays bounded at segmentCount * segmentSize bytes.
+     *
+     * Records (and appendBatch() batches) must fit into one segment. compact()
+     * is not available for segmented logs.
+     *
+     * @param segmentCount Number of segment files (1-255).
+     * @param segmentSize Maximum size of each segment file in bytes.
+     *        segmentCount * segmentSize must stay below 4 GiB.
+     * @return True if the layout is valid, false otherwise.
+     */
+    bool setLogSegments(uint8_t segmentCount, uint32_t segmentSize);
+
+    /**
+     * @brief Sets the file that compact() writes the new log to.
+     *
+     * Call before open(). The handler must be a different object from the log
+     * handler and support remove() and rename(). A database whose compaction was
+     * interrupted can only be opened again with the compaction file set.
+     *
+     * @param handler File handler for the compaction file.
+     * @param fileName Name of the compaction file (e.g., "LOGFILE.TMP").
+     */
+    void setCompactionFile(IFileHandler& handler, const char fileName[MAX_FILENAME_LENGTH]);
+
+    /**
+     * @brief Runs one bounded step of log compaction.
+     *
+     * The first call starts a compaction: the live records are copied in key order
+     * to the compaction file, which then replaces the log, so the space of deleted
+     * records is reclaimed. Each call visits at most 'budget' index entries, so the
+     * work can be spread over idle time; records can be appended, read, updated and
+     * deleted between steps. The step that finishes renames the compaction file over
+     * the log. The state is kept in the index header, so an interrupted compaction
+     * resumes after the next open().
+     *
+     * Deleted entries stay in the index with offset DB_NO_OFFSET; get() no longer
+     * finds them, and append() can reuse their keys as before.
+     *
+     * @param budget Maximum number of index entries to visit in this step.
+     * @param finished Optional; set to true once the compacted log has replaced the old one.
+     * @return True if the step succeeded, false on an I/O error or if no
+     *         compaction file was set.
+     */
+    bool compact(uint32_t budget, bool* finished = nullptr);
+
+    /**
+     * @brief Returns true while a compaction started by compact() is unfinished.
+     */
+    bool isCompacting(void) const;
+
+    /**
+     * @brief Rebuilds the index file from the log.
+     *
+     * open() calls this when the index header cannot be read, the index fails
+     * validation, or the index is empty while the log holds records (e.g. after
+     * power was lost before the index was written). It can also be called on an
+     * open database, for instance when the index is known to be stale.
+     *
+     * The log (every segment of a segmented log, and the compaction file of an
+     * interrupted compaction) is read once from front to back. Its entries are
+     * sorted externally in the index file and the new tree is written in one
+     * sequential pass. A file ends at its first record that is cut short or
+     * fails its checksum; the rest of it is truncated away, which needs an
+     * IFileHandler with truncate(). For keys that occur more than once, the
+     * record written last wins.
+     *
+     * @return True if the index was rebuilt, false on an I/O error.
+     */
+    bool rebuildIndex(void);
+
+    /**
+     * @brief Starts a bulk load for importing many records at once.
+     *
+     * Until endBulk(), append() and appendBatch() only stage the records and
+     * write them to the log sequentially; they are not checked against the index
+     * and do not appear in it. If a key is appended more than once, or is already
+     * in the database, the record appended last wins. Lookups and status updates
+     * keep working on the records indexed before beginBulk(). compact() is
+     * refused while a bulk load runs.
+     *
+     * If power is lost before endBulk(), the next open() rebuilds the index from
+     * the log, which then holds every record written so far.
+     *
+     * @return True if the bulk load was started, false otherwise.
+     */
+    bool beginBulk(void);
+
+    /**
+     * @brief Finishes a bulk load and builds the index with rebuildIndex().
+     *
+     * The index is built bottom up from the whole log in fully packed pages, with
+     * the header written once at the end. close() finishes a running bulk load.
+     *
+     * @return True if the index was built, false on an I/O error or if no bulk
+     *         load was running.
+     */
+    bool endBulk(void);
+
+    /**
+     * @brief Returns true between beginBulk() and endBulk().
+     */
+    bool isBulkLoading(void) const;
+
+    /**
+     * @brief Appends a record like append(), without waiting for the log write.
+     *
+     * The key is checked and the index entry created at once; the record is
+     * copied into the asynchronous staging buffer and written by the log
+     * handler in the background, together with the records queued after it.
+     * Call pollAsync() regularly to let the writes complete. Any other call
+     * that reads or writes the log (get(), append(), sync(), ...) first waits
+     * until every queued record is written. Needs the asynchronous constructor,
+     * DB_MODE_SESSION and a single log file; not available during a bulk load
+     * or a compaction. Like other session mode writes, queued records are lost
+     * on power failure until sync().
+     *
+     * @return True if the record was queued; false if the key is taken, the
+     *         record is too large, or both halves of the buffer are in use (call
+     *         pollAsync() and retry).
+     */
+    bool appendAsync(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize);
+
+    /**
+     * @brief Lets queued log writes complete and starts the next one.
+     *
+     * Call this from the application's main loop while records are queued. A
+     * failed write is reported by the next sync().
+     *
+     * @return True while records are still waiting to be written.
+     */
+    bool pollAsync(void);
+
+    /**
+     * @brief Returns the number of queued record bytes not yet written.
+     */
+    size_t pendingAsyncBytes(void) const;
+
+    /**
+     * @brief Streams the changes since a log offset as frames (see DBExportSink),
+     *        e.g. to replicate a device's database on a gateway.
+     *
+     * The log is read once from logOffset to its end, DB_BATCH_BUFFER_SIZE bytes
+     * at a time, and every record there becomes a record frame (encoded
+     * records are decoded). Records whose status or deletion flag changed
+     * since they were last exported (INTERNAL_STATUS_CHANGED) follow as delta
+     * frames, also those after logOffset, whose log status may be out of date
+     * with setStatusInLog(false); finding them reads each index leaf once. A
+     * change is unmarked once the sink has accepted the export. Store
+     * *nextOffset as the mark for the next export. compact() moves the records
+     * to new offsets, so after a compaction export from 0 again; a mark past
+     * the end of the log is refused. Rebuilding the index marks every record
+     * with a status or a deletion flag as changed. Not available for segmented
+     * logs or while compacting.
+     *
+     * @param logOffset The mark of the previous export, or 0 for everything.
+     * @param sink Receives the frames.
+     * @param context Passed to the sink.
+     * @param nextOffset Optional; receives the mark for the next export.
+     * @return True if every frame was passed on, false on an I/O error or if
+     *         the sink stopped the export.
+     */
+    bool exportSince(uint32_t logOffset, DBExportSink sink, void* context, uint32_t* nextOffset = nullptr);
+
+    /**
+     * @brief Applies frames of an exportSince() stream to this database.
+     *
+     * Consecutive record frames are stored in batches like appendBatch(); a
+     * record frame replaces a live record of the same key, which stays live if
+     * its batch cannot be stored. A deleted record frame or a
+     * delta frame deletes the key or sets its status with deleteRecord() and
+     * updateStatus(); frames for keys that are not stored are skipped. Each
+     * change takes the lock on its own. Not available during a bulk load.
+     *
+     * @param data Frames in stream order. A frame cut short at the end is left
+     *        for the next call.
+     * @param size Size of data in bytes.
+     * @param consumed Optional; receives the bytes of the frames applied.
+     * @return True if every whole frame was applied, false if a frame fails its
+     *         crc or a change could not be stored.
+     */
+    bool importStream(const void* data, size_t size, size_t* consumed = nullptr);
+
+    /**
+     * @brief Stores the records of one type delta encoded from now on.
+     *
+     * append() and appendAsync() then store a record of this type as the
+     * difference to the last record of the type stored in full: the payload is
+     * taken as 32-bit words, a bitmap marks the words that changed, and each
+     * changed word is stored as its zigzag varint difference. Slowly changing
+     * floats and counters shrink to a byte or three each, and unchanged
+     * fields to one bit. Every DB_CODEC_KEYFRAME_INTERVAL records, on a change
+     * of size, and whenever the delta would not be smaller, the record is stored
+     * in full and becomes the new reference. get() and DBCursor decode
+     * transparently, whether or not the codec is enabled; getView() refuses
+     * encoded records. Records longer than DB_CODEC_MAX_RECORD, appendBatch()
+     * and bulk loads store records in full.
+     *
+     * @param recordType The record type.
+     * @param enabled True to encode the type, false to store it in full again.
+     * @return False if DB_CODEC_TYPES types are already encoded.
+     */
+    bool setRecordCodec(uint8_t recordType, bool enabled);
+
     /**
      * @brief Returns the database file format version.
      *
@@ -221,16 +975,81 @@ public:
     uint16_t dbVersion(void) const;
 
     /**
-     * @brief Prints database engine statistics.
+     * @brief Prints the record count, the tree shape and the getStats() counters.
      */
     void printStats(void) const;
 
+    /**
+     * @brief Returns the engine counters accumulated since open() or the last
+     *        resetStats(). Keeping them costs one increment per counted event;
+     *        they are always on, also where SCOPE_TIMER is compiled out.
+     *
+     * @param stats Receives the counters.
+     */
+    void getStats(DBStats& stats) const;
+
+    /**
+     * @brief Sets all getStats() counters to zero.
+     */
+    void resetStats(void);
+
+    /**
+     * @brief Returns the index page cache counters accumulated since open() or
+     *        the last resetCacheStats().
+     *
+     * @param hits Receives the number of page requests served from RAM.
+     * @param misses Receives the number of page requests that loaded from disk.
+     */
+    void getCacheStats(uint32_t& hits, uint32_t& misses) const;
+
+    /**
+     * @brief Resets the index page cache hit/miss counters.
+     */
+    void resetCacheStats(void);
+
+    /**
+     * @brief Lets leaves be stored in the narrow format from now on.
+     *
+     * A narrow leaf keeps each key and log offset as the difference to a base
+     * value of its page, in as few bytes as the page needs, so that with keys
+     * and offsets close together (records appended in key order) a leaf holds
+     * up to INDEX_LEAF_CAPACITY entries instead of MAX_INDEX_ENTRIES: a lookup
+     * or scan loads fewer leaves, and the same number of entries per leaf
+     * needs a smaller MAX_INDEX_ENTRIES and so less RAM. A leaf becomes narrow
+     * when it is created or split, when it fills up and when the index is
+     * built in one pass (rebuildIndex(), endBulk()). Each page records its own format, so
+     * narrow leaves stay readable with the setting off; they are only changed
+     * back when an entry no longer fits. Index files with narrow leaves are
+     * not readable by engines older than index version 5.
+     *
+     * @param enabled True to store new leaves narrow where possible.
+     */
+    void setNarrowLeaves(bool enabled);
+
+#if DB_RESIDENT_INDEX
+    /**
+     * @brief Holds the whole index in RAM from the next open() on.
+     *
+     * open() then reads every index page in one pass over the index file, and
+     * pages are never evicted: lookups and index changes work on the pages in
+     * RAM, and changed pages are written back in page order by sync() and
+     * close() rather than whenever a cache slot is needed. findByStatus() and
+     * recordCount() split the entries between up to 'scanThreads' threads,
+     * each taking at least DB_SCAN_CHUNK_ENTRIES. The files do not change, so
+     * an index written in either mode opens in the other one.
+     *
+     * @param enabled True to hold the index resident, false for the page cache.
+     * @param scanThreads Threads per scan; 0 for one per hardware thread.
+     */
+    void setResidentIndex(bool enabled, unsigned scanThreads = 0);
+#endif
+
     // -------------------------------------------------------------------------
     // B-Tree / Index Search Methods
     // -------------------------------------------------------------------------
 
     /**
-     * @brief Searches for an exact key using a binary search on the index.
+     * @brief Searches for an exact key by descending the index tree.
      *
      * If the key is found, its global index is returned via the foundIndex pointer.
      *
@@ -341,6 +1160,8 @@ public:
      *   (entry.internal_status & mustBeSet) == mustBeSet AND
      *   (entry.internal_status & mustBeClear) == 0
      * are counted.
+     * Criteria that involve only INTERNAL_STATUS_DELETED are answered from the
+     * root page's summaries without reading any leaf.
      *
      * @param mustBeSet Bit mask of flags that must be set.
      * @param mustBeClear Bit mask of flags that must be clear.
@@ -348,12 +1169,56 @@ public:
      */
     size_t recordCount(uint8_t mustBeSet, uint8_t mustBeClear) const;
 
-    // -------------------------------------------------------------------------
-    // End of Public Interface
-    // -------------------------------------------------------------------------
-
-private:
-    // -------------------------------------------------------------------------
+#if DB_AGGREGATES > 0
+    /**
+     * @brief Sets the function that reports the aggregated fields of a record.
+     *
+     * It is called for every record of up to DB_AGGREGATE_MAX_RECORD bytes that
+     * append(), appendAsync() or appendBatch() stores, and for the records that
+     * aggregateRange() and refreshAggregates() read back, so it must give the
+     * same fields for the same record. Set it before the first append; after
+     * changing it, call refreshAggregates(true). The setting is not saved with
+     * the database.
+     *
+     * @param extractor The extractor, or nullptr to aggregate no fields.
+     */
+    void setAggregateExtractor(DBAggregateExtractor extractor);
+
+    /**
+     * @brief Computes the count, minimum, maximum and sum of each aggregated
+     *        field over the live records with keys from firstKey to lastKey.
+     *
+     * Subtrees that lie inside the range are taken from the summaries of the
+     * pages above them, so only the leaves at the two ends of the range are
+     * read record by record, and any subtree whose summary is stale: after a
+     * delete, a split in the middle of a leaf, a bulk load or a rebuild, until
+     * refreshAggregates() is called.
+     *
+     * @param firstKey Smallest key of the range.
+     * @param lastKey Largest key of the range (inclusive).
+     * @param results Receives one DBAggregate per field; count 0 if no record has it.
+     * @return True on success, false on an I/O error.
+     */
+    bool aggregateRange(uint32_t firstKey, uint32_t lastKey, DBAggregate results[DB_AGGREGATES]);
+
+    /**
+     * @brief Recomputes the stale summaries of aggregateRange() from the records.
+     *
+     * Each leaf with a stale summary is read once; the summaries above it are
+     * merged again from their children.
+     *
+     * @param all True to recompute every summary, e.g. after the extractor changed.
+     * @return True on success, false on an I/O error.
+     */
+    bool refreshAggregates(bool all = false);
+#endif
+
+    // -------------------------------------------------------------------------
+    // End of Public Interface
+    // -------------------------------------------------------------------------
+
+private:
+    // -------------------------------------------------------------------------
     // File and Index Metadata
     // -------------------------------------------------------------------------
     char _logFileName[MAX_FILENAME_LENGTH];   ///< Log file name.
@@ -361,46 +1226,944 @@ private:
 
     uint32_t _indexCount;  ///< Total number of index entries.
 
+    uint32_t _rootPage;    ///< Root page of the index tree, or DB_NO_PAGE.
+    uint32_t _firstLeaf;   ///< Leftmost leaf page, or DB_NO_PAGE.
+    uint32_t _lastLeaf;    ///< Rightmost leaf page, or DB_NO_PAGE.
+    uint32_t _pageCount;   ///< Pages allocated in the index file.
+    uint32_t _freePage;    ///< Head of the free page list, or DB_NO_PAGE.
+    uint8_t _treeHeight;   ///< Tree levels including the leaves (0 = empty).
+    uint32_t _maxKey;      ///< Largest key in the index (valid if _maxKeyValid).
+    bool _maxKeyValid;     ///< False until the last leaf has been read after open.
+
+    uint8_t _mode;         ///< DB_MODE_SAFE or DB_MODE_SESSION.
+    bool _isOpen;          ///< True between a successful open() and close().
+    bool _logOpen;         ///< Session mode: the log handle is currently held open.
+    mutable bool _indexOpen; ///< Session mode: the index handle is currently held open.
+    uint32_t _logRewrites; ///< Bumped whenever bytes already in the log are overwritten.
+    bool _statusInLog;     ///< Status updates also write the log (see setStatusInLog()).
+#if DB_AGGREGATES > 0
+    DBAggregateExtractor _aggregateExtractor; ///< See setAggregateExtractor(), or nullptr.
+#endif
+
+    // Segmented log state (see setLogSegments()).
+    uint8_t _newSegmentCount;      ///< Layout requested for a new database.
+    uint32_t _newSegmentSize;
+    uint8_t _segmentCount;         ///< Segments of the open database (0 = single log file).
+    uint32_t _segmentSize;         ///< Bytes per segment.
+    uint8_t _oldestSegment;        ///< Oldest segment holding records.
+    uint8_t _newestSegment;        ///< Segment being appended to.
+    uint16_t _openSegment;         ///< Session mode: segment held by the log handle, or DB_NO_SEGMENT.
+
+    // Compaction state (see compact()).
+    char _compactFileName[MAX_FILENAME_LENGTH]; ///< Compaction file name.
+    IFileHandler* _compactHandler; ///< Handler for the compaction file, or nullptr.
+    bool _compactOpen;             ///< Session mode: the compaction handle is held open.
+    bool _compacting;              ///< A compaction is in progress (persisted).
+    uint8_t _logGeneration;        ///< Generation (0/1) of the records in the log file (persisted).
+    uint32_t _compactNextKey;      ///< Smallest key the compaction has not visited yet.
+    bool _compactKeysDone;         ///< Every key has been visited; only the file swap is left.
+
+    // Checksum state.
+    bool _logChecksums;            ///< Records carry LogEntryHeader::crc (log version DB_VERSION).
+    uint32_t _headerSequence;      ///< Sequence number of the last index header written.
+    bool _pagesAhead;              ///< Pages were written after the last committed header.
+
+    // Bulk load state (see beginBulk()).
+    bool _bulkLoading;             ///< A bulk load is in progress (persisted).
+    uint16_t _bulkStaged;          ///< Record bytes staged in _batchBuffer, not yet in the log.
+
+    // Asynchronous append state (see appendAsync()). Records are staged in one
+    // half of _asyncBuffer while the other half is being written.
+    IAsyncFileHandler* _asyncLog;  ///< The log handler, if constructed for asynchronous writes.
+    uint8_t* _asyncBuffer;         ///< Caller's staging buffer.
+    size_t _asyncHalf;             ///< Size of each half of _asyncBuffer.
+    uint8_t _asyncFill;            ///< Half currently being filled (0 or 1).
+    size_t _asyncStaged;           ///< Bytes staged in that half.
+    size_t _asyncWriting;          ///< Bytes of the half being written; 0 when idle.
+    uint32_t _asyncEnd;            ///< Log offset after the last staged byte.
+    bool _asyncEndValid;           ///< False until _asyncEnd has been read from the log.
+    bool _asyncFailed;             ///< A queued write failed since the last sync().
+
+    // Record codec state (see setRecordCodec()).
+    struct CodecSlot {
+        bool used;                         ///< The slot belongs to recordType.
+        uint8_t recordType;                ///< Type encoded through this slot.
+        bool haveRef;                      ///< ref holds the type's current reference record.
+        uint16_t refLength;                ///< Payload length of the reference record.
+        uint16_t sinceRef;                 ///< Encoded records written since the reference.
+        uint32_t refOffset;                ///< Log offset of the reference record.
+        uint8_t ref[DB_CODEC_MAX_RECORD];  ///< Payload of the reference record.
+    };
+    CodecSlot _codecs[DB_CODEC_TYPES > 0 ? DB_CODEC_TYPES : 1];
+
+    // -------------------------------------------------------------------------
+    // Concurrency (DB_THREAD_SAFE)
+    // Public calls that change the database hold _lock exclusively; lookups hold
+    // it shared. Among readers, the page cache, the lookup hint and the index
+    // handle are guarded by _cacheLock, and the log handle by _logLock. Readers
+    // copy pages out of the cache (viewIndexPage()) instead of keeping a slot,
+    // write back a dirty page they evict under _cacheLock, and in session mode
+    // read through IFileHandler::readAt() without either lock. A resident index
+    // (see setResidentIndex()) never reuses a slot, so there readers use the
+    // cached page without copying it. Public calls never call each other while
+    // holding _lock; internal callers use the unlocked versions (syncFiles(),
+    // entryAt(), ...).
+    // -------------------------------------------------------------------------
+#if DB_THREAD_SAFE
+    mutable std::shared_mutex _lock;   ///< Exclusive for changes, shared for lookups.
+    mutable std::mutex _cacheLock;     ///< Page cache, lookup hint and index handle.
+    mutable std::mutex _logLock;       ///< Log handle, when used by readers.
+#endif
+
     // -------------------------------------------------------------------------
     // Index Paging Data
     // -------------------------------------------------------------------------
-    IndexEntry _indexPage[MAX_INDEX_ENTRIES]; ///< Current index page in memory.
-    uint32_t _currentPageNumber;              ///< Currently loaded page number.
-    bool _pageLoaded;                         ///< Indicates if an index page is loaded.
-    bool _pageDirty;                          ///< Indicates if the current page has been modified.
 
-    // -------------------------------------------------------------------------
-    // File Handlers
-    // -------------------------------------------------------------------------
-    IFileHandler& _logHandler;   ///< File handler for log operations.
-    IFileHandler& _indexHandler; ///< File handler for index operations.
+    /// One slot of the index page cache.
+    struct IndexPageSlot {
+        IndexPage page;                        ///< Page contents (on-disk image).
+        uint32_t pageNumber;                   ///< Page held by this slot.
+        uint32_t lastUsed;                     ///< Cache tick of the last access (LRU order).
+        bool loaded;                           ///< Slot holds a valid page.
+        bool dirty;                            ///< Page has been modified since it was loaded.
+    };
+
+    // The cache and the lookup hint are mutable: const lookups load pages too.
+    mutable IndexPageSlot _pageCache[INDEX_CACHE_PAGES]; ///< Index pages held in RAM.
+    mutable uint32_t _cacheTick;                 ///< Monotonic access counter for LRU eviction.
+    mutable DBStats _stats;                      ///< Counters of getStats(); pages also load in const lookups.
+
+    mutable uint32_t _hintPage;                  ///< Leaf of the last positional lookup.
+    mutable uint32_t _hintFirst;                 ///< Global position of that leaf's first entry.
+    mutable bool _hintValid;                     ///< False after any change to the tree shape.
+    bool _narrowLeaves;                          ///< Leaves may take the narrow format (see setNarrowLeaves()).
+
+#if DB_RESIDENT_INDEX
+    // Resident index (see setResidentIndex()): entry n holds the slot of page n.
+    // Each slot is allocated on its own, so a slot stays where it is while the
+    // vector grows, and only invalidateIndexCache() frees it.
+    mutable std::vector<std::unique_ptr<IndexPageSlot>> _residentPages;
+    mutable bool _residentComplete;              ///< Every page was read since the index was last replaced.
+    bool _resident;                              ///< The open index is held resident.
+    bool _newResident;                           ///< setResidentIndex() setting for the next open().
+    unsigned _scanThreads;                       ///< Threads per resident scan (0 = hardware threads).
+
+    /// Part of a resident scan handed to one thread (see scanIndexChunk()).
+    struct IndexScanChunk {
+        uint32_t first;                  ///< First global position of the chunk.
+        uint32_t end;                    ///< Position after the chunk.
+        bool collect;                    ///< Keep the matching positions, not just their count.
+        size_t limit;                    ///< Stop after this many matches.
+        size_t count;                    ///< Matches found.
+        std::vector<uint32_t> positions; ///< Matching positions, if collected.
+        bool ok;                         ///< False if a page was not resident.
+    };
+#endif
+
+    /// Entry predicate for findMatchingEntry(). An entry matches if its user
+    /// status equals 'status' (when byStatus is set) and its internal_status has
+    /// every bit of mustBeSet and none of mustBeClear.
+    struct IndexFilter {
+        bool byStatus;       ///< Compare the user status.
+        uint8_t status;      ///< User status to look for.
+        uint8_t mustBeSet;   ///< internal_status bits that must be set.
+        uint8_t mustBeClear; ///< internal_status bits that must be clear.
+
+        bool matches(const IndexEntry& entry) const {
+            return (!byStatus || entry.status == status) &&
+                (entry.internal_status & mustBeSet) == mustBeSet &&
+                (entry.internal_status & mustBeClear) == 0;
+        }
+
+        // False only if the summary proves that no entry below ref matches.
+        // The deletion flag is the only internal flag that is summarised.
+        bool mayMatch(const IndexChildRef& ref) const {
+            if (ref.count == 0)
+                return false;
+            if (byStatus && !(ref.statusMask & DB_STATUS_BIT(status)))
+                return false;
+            if ((mustBeSet & INTERNAL_STATUS_DELETED) && ref.deleted == 0)
+                return false;
+            if ((mustBeClear & INTERNAL_STATUS_DELETED) && ref.deleted == ref.count)
+                return false;
+            return true;
+        }
+    };
+
+    /// Root-to-leaf route taken by a key descent.
+    struct IndexPath {
+        uint32_t page[DB_MAX_TREE_HEIGHT];  ///< Page visited at each level (0 = root).
+        uint16_t child[DB_MAX_TREE_HEIGHT]; ///< Interior levels: child slot followed.
+        uint8_t depth;                      ///< Number of levels visited.
+    };
+
+    // Bottom-up index builder state (see beginIndexBuild()).
+    uint32_t _buildFirstLeaf;                    ///< First page written by the builder.
+    uint32_t _buildNextPage;                     ///< Next page the builder will write.
+    uint32_t _buildCount;                        ///< Entries added so far.
+
+    // -------------------------------------------------------------------------
+    // Batch Staging
+    // -------------------------------------------------------------------------
+    uint8_t _batchBuffer[DB_BATCH_BUFFER_SIZE];  ///< Staging area for appendBatch() and bulk load log writes.
+
+    // -------------------------------------------------------------------------
+    // File Handlers
+    // -------------------------------------------------------------------------
+    IFileHandler& _logHandler;   ///< File handler for log operations.
+    IFileHandler& _indexHandler; ///< File handler for index operations.
+
+    // -------------------------------------------------------------------------
+    // Unlocked Operations
+    // The bodies of public calls that other engine code also needs. Callers
+    // hold _lock (see "Concurrency" above).
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief sync() without the lock.
+     */
+    bool syncFiles(void);
+
+    /**
+     * @brief close() without the lock.
+     */
+    void closeFiles(void);
+
+    /**
+     * @brief rebuildIndex() without the lock.
+     */
+    bool rebuildIndexFromLog(void);
+
+    /**
+     * @brief endBulk() without the lock.
+     */
+    bool finishBulk(void);
+
+    // -------------------------------------------------------------------------
+    // File Access Helpers
+    // All engine code goes through these so that the open/close policy of the
+    // current mode is applied in one place.
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Makes the log file available for an operation.
+     *
+     * In safe mode the file is opened with the requested mode. In session mode the
+     * file is opened read/write (created if missing) on first use and then reused.
+     *
+     * @param mode The fopen-style mode to use in safe mode.
+     * @return True if the log file is open, false otherwise.
+     */
+    bool openLogFile(const char* mode);
+
+    /**
+     * @brief Ends an operation on the log file. Closes the file in safe mode only.
+     */
+    void closeLogFile(void);
+
+    /**
+     * @brief Bytes of a LogEntryHeader as stored in this log's format.
+     */
+    size_t logHeaderSize(void) const {
+        return _logChecksums ? sizeof(LogEntryHeader) : offsetof(LogEntryHeader, crc);
+    }
+
+    /**
+     * @brief DBHeader::version of the files holding this log's records.
+     */
+    uint16_t recordFileVersion(void) const { return _logChecksums ? DB_VERSION : DB_VERSION_PLAIN; }
+
+    /**
+     * @brief Returns the checksum stored in a LogEntryHeader for this record.
+     */
+    static uint32_t logRecordCrc(const LogEntryHeader& header, const void* payload);
+
+    /**
+     * @brief Checks a record read back from the log against its checksum.
+     *
+     * @return True if the record is intact or the log has no checksums.
+     */
+    bool logRecordValid(const LogEntryHeader& header, const void* payload) const;
+
+    /**
+     * @brief Returns the handler of the log file or of the compaction file.
+     */
+    IFileHandler& logFile(bool compactFile) { return compactFile ? *_compactHandler : _logHandler; }
+
+    /**
+     * @brief openLogFile() for either the log file or the compaction file.
+     */
+    bool openLog(bool compactFile, const char* mode);
+
+    /**
+     * @brief closeLogFile() for either the log file or the compaction file.
+     */
+    void closeLog(bool compactFile);
+
+    /**
+     * @brief Opens the file that holds an entry's record (log file, segment or
+     *        compaction file) as openLogFile() does.
+     *
+     * @param entry The index entry.
+     * @param mode The fopen-style mode to use in safe mode.
+     * @param log Receives the handler of the file.
+     * @param fileOffset Receives the record's offset within that file.
+     * @return True if the file is open, false otherwise.
+     */
+    bool openRecordLog(const IndexEntry& entry, const char* mode, IFileHandler*& log, uint32_t& fileOffset);
+
+    /**
+     * @brief Ends an operation started with openRecordLog().
+     */
+    void closeRecordLog(const IndexEntry& entry);
+
+    /**
+     * @brief Reads, checks and decodes the log record of an index entry (the I/O
+     *        of get()).
+     *
+     * Safe to call under the shared lock: in session mode the record is read with
+     * IFileHandler::readAt() if the handler supports it, otherwise with _logLock
+     * held.
+     *
+     * @param entry The record's index entry.
+     * @param header Receives the record's log entry header.
+     * @param payloadBuffer Receives the payload.
+     * @param bufferSize Size of payloadBuffer in bytes.
+     * @return True if the record fits the buffer and passes its checksum.
+     */
+    bool readLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize);
+
+    /**
+     * @brief readLogRecord() without decoding an encoded payload.
+     */
+    bool readRawLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize);
+
+    /**
+     * @brief Returns true if the entry's record is in the compaction file.
+     */
+    bool inCompactFile(const IndexEntry& entry) const {
+        return _compacting && ((entry.internal_status & INTERNAL_STATUS_LOG_GEN) != 0) != (_logGeneration != 0);
+    }
+
+    /**
+     * @brief Returns the internal_status generation bit for newly written records:
+     *        that of the compaction file while compacting, of the log otherwise.
+     */
+    uint8_t appendGeneration(void) const {
+        return ((_logGeneration != 0) != _compacting) ? INTERNAL_STATUS_LOG_GEN : 0;
+    }
+
+    /**
+     * @brief Opens the file that new records are written to (the compaction file
+     *        while compacting, the newest segment of a segmented log, the log
+     *        otherwise), creating it with a DBHeader if it does not exist, and
+     *        positions it at the end.
+     *
+     * On failure the file has already been closed again.
+     *
+     * @param offset Receives the offset at which the next record will start.
+     * @param bytes Number of bytes about to be written (used to roll segments).
+     * @return True if the log is ready for writing, false otherwise.
+     */
+    bool beginLogAppend(uint32_t& offset, size_t bytes);
+
+    /**
+     * @brief Writes raw bytes at the current position of the file opened by
+     *        beginLogAppend().
+     *
+     * @param data The bytes to write.
+     * @param size Number of bytes to write.
+     * @return True if every byte was written, false otherwise.
+     */
+    bool writeLogBytes(const void* data, size_t size);
+
+    /**
+     * @brief Ends an append started with beginLogAppend().
+     */
+    void endLogAppend(void);
+
+    // -------------------------------------------------------------------------
+    // Segmented Log Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Builds the file name of a segment from the log file name.
+     */
+    void segmentFileName(uint8_t segment, char fileName[MAX_FILENAME_LENGTH]) const;
+
+    /**
+     * @brief openLogFile() for one segment file of a segmented log. In session
+     *        mode the log handle is switched to the segment if needed.
+     */
+    bool openLogSegment(uint8_t segment, const char* mode);
+
+    /**
+     * @brief beginLogAppend() for a segmented log: positions the newest segment
+     *        at its end, rolling over to the next segment if 'bytes' do not fit.
+     */
+    bool beginSegmentAppend(uint32_t& offset, size_t bytes);
+
+    /**
+     * @brief Creates (or truncates) a segment file and writes its DBHeader.
+     */
+    bool startLogSegment(uint8_t segment);
+
+    /**
+     * @brief Moves appends to the next segment. If the ring is full, the oldest
+     *        segment's index entries are removed first and its file is reused.
+     *
+     * @return True on success, false otherwise.
+     */
+    bool rollLogSegment(void);
+
+    // -------------------------------------------------------------------------
+    // Compaction Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Creates an empty compaction file and records in the index header that
+     *        a compaction is in progress.
+     *
+     * @return True on success, false otherwise.
+     */
+    bool beginCompaction(void);
+
+    /**
+     * @brief Copies one record from the log file to the end of the compaction file.
+     *
+     * @param offset The record's offset in the log file.
+     * @param newOffset Receives its offset in the compaction file.
+     * @return True on success, false on a read or write error.
+     */
+    bool copyLogRecord(uint32_t offset, uint32_t& newOffset);
+
+    /**
+     * @brief Commits the index, renames the compaction file over the log file and
+     *        switches to the new log generation.
+     *
+     * @return True on success, false otherwise (the swap is retried by the next step).
+     */
+    bool finishCompaction(void);
+
+    /**
+     * @brief Completes or resumes a compaction recorded in the index header (open() helper).
+     *
+     * @return True if the database can be used, false otherwise.
+     */
+    bool recoverCompaction(void);
+
+    /**
+     * @brief Renames a left-over compaction file over a missing log file (open() helper).
+     *
+     * @return False if the compaction file exists but could not be renamed.
+     */
+    bool finishLogSwap(void);
+
+    // -------------------------------------------------------------------------
+    // Bulk Load Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Stages one record of a bulk load, writing the staged records to
+     *        the log first if it does not fit.
+     *
+     * @return True on success, false on a write error.
+     */
+    bool appendBulkRecord(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize);
+
+    /**
+     * @brief Writes the records staged by appendBulkRecord() to the log.
+     *
+     * @return True on success, false on a write error.
+     */
+    bool flushBulkRecords(void);
+
+    // -------------------------------------------------------------------------
+    // Asynchronous Append Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief The body of append() and appendAsync().
+     *
+     * @param queued Stage the log record for an asynchronous write instead of
+     *        writing it.
+     * @return True if the record was appended or queued, false otherwise.
+     */
+    bool appendRecord(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize, bool queued);
+
+    /**
+     * @brief The body of appendBatch() and importBatch(), without the lock.
+     *
+     * @param replace Accept live keys: their records are marked deleted only
+     *        after the new records are in the log, and their entries are reused.
+     * @return True on success, false otherwise.
+     */
+    bool storeBatch(const BatchItem* items, size_t n, bool replace);
+
+    /**
+     * @brief Copies a log record into the staging buffer and starts its write
+     *        if the log handler is idle.
+     *
+     * The record is encoded on the way (see encodeLogRecord()), which also fills
+     * in the header's crc.
+     *
+     * @param offset Receives the log offset the record will be written at.
+     * @return True if the record was staged.
+     */
+    bool stageAsyncRecord(LogEntryHeader& header, const void* record, uint32_t& offset);
+
+    /**
+     * @brief Submits the staged half of the buffer and switches to the other.
+     *
+     * A request the handler refuses is written with the blocking calls instead.
+     */
+    void submitAsync(void);
+
+    /**
+     * @brief Waits until every staged record is written (openLog() helper).
+     */
+    void drainAsync(void);
+
+    /**
+     * @brief Completion of an asynchronous log write.
+     */
+    static void asyncWriteDone(void* context, bool ok);
+
+    // -------------------------------------------------------------------------
+    // Change Stream Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Makes the log bytes [at, at + bytes) available in _batchBuffer,
+     *        reading DB_BATCH_BUFFER_SIZE bytes from 'at' (or up to 'size', the
+     *        end of the log file) unless they are already there. The log must
+     *        be open.
+     *
+     * @param bufferStart Log offset of _batchBuffer[0] (updated).
+     * @param bufferUsed Valid bytes in _batchBuffer (updated).
+     * @return True on success, false on a read error.
+     */
+    bool readLogAhead(uint32_t at, uint32_t bytes, uint32_t size, uint32_t& bufferStart, uint32_t& bufferUsed);
+
+    /**
+     * @brief Passes the records from log offset 'start' on to the sink as
+     *        record frames (exportSince() helper). The log must be open.
+     *
+     * @param end Receives the offset after the last record passed on.
+     * @return True on success, false on an I/O error or if the sink stopped.
+     */
+    bool exportLogRecords(uint32_t start, DBExportSink sink, void* context, uint32_t& end);
+
+    /**
+     * @brief Passes one record read from the log on as a record frame.
+     *
+     * @param header The record's header as stored.
+     * @param offset The record's log offset.
+     * @param payload The record's payload as stored.
+     * @return True on success, false if it cannot be decoded or the sink stopped.
+     */
+    bool exportRecord(const LogEntryHeader& header, uint32_t offset, const void* payload,
+        DBExportSink sink, void* context);
+
+    /**
+     * @brief Passes a delta frame on for every changed entry and unmarks it.
+     *
+     * @return True on success, false on an I/O error or if the sink stopped.
+     */
+    bool exportChanges(DBExportSink sink, void* context);
+
+    /**
+     * @brief Stores record frames collected by importStream() in one batch that
+     *        replaces live records of their keys, and sets their statuses.
+     *
+     * @return True on success, false otherwise.
+     */
+    bool importBatch(const BatchItem* items, const uint8_t* statuses, size_t n);
+
+    /**
+     * @brief Applies a deleted record frame or a delta frame (importStream() helper).
+     *
+     * @return True on success or if the key is not stored, false otherwise.
+     */
+    bool importChange(const LogEntryHeader& frame);
+
+    // -------------------------------------------------------------------------
+    // Record Codec Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Returns the codec slot of a record type, or nullptr if the type is
+     *        not encoded.
+     */
+    CodecSlot* codecSlot(uint8_t recordType) const;
+
+    /**
+     * @brief Encodes a record about to be written at 'offset' if its type has a
+     *        codec and the delta pays off, and fills in header.crc.
+     *
+     * On encoding header.length and INTERNAL_STATUS_ENCODED are updated.
+     *
+     * @param encoded Buffer of DB_CODEC_MAX_RECORD bytes for the encoding.
+     * @return The payload to write: 'record' or 'encoded'.
+     */
+    const void* encodeLogRecord(LogEntryHeader& header, const void* record, uint32_t offset, uint8_t* encoded);
+
+    /**
+     * @brief Updates the codec state once a record has been written.
+     *
+     * A record of an encoded type stored in full becomes the new reference.
+     */
+    void noteLogRecord(const LogEntryHeader& header, const void* record, uint16_t recordSize, uint32_t offset);
+
+    /**
+     * @brief Forgets every reference record, so the next record of each type is
+     *        stored in full (after the log was replaced, truncated or reopened).
+     */
+    void resetRecordCodecs(void);
+
+    /**
+     * @brief Decodes an encoded record read by readRawLogRecord().
+     *
+     * @param entry The record's index entry.
+     * @param header The record's header; length becomes the decoded length.
+     * @param payloadBuffer Holds the encoding, receives the decoded payload.
+     * @param bufferSize Size of payloadBuffer in bytes.
+     * @return True if the reference record was found and the payload fits.
+     */
+    bool decodeLogRecord(const IndexEntry& entry, LogEntryHeader& header, void* payloadBuffer, uint16_t bufferSize);
+
+    // -------------------------------------------------------------------------
+    // Recovery Helpers
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Adds an index entry for every record of one log file to the sorted
+     *        runs of rebuildIndex(), truncating a torn or damaged tail.
+     *
+     * @param log The file, opened for reading and writing.
+     * @param base Index offset of the file's first byte.
+     * @param generation INTERNAL_STATUS_LOG_GEN bit for the file's entries.
+     * @param total Entries collected so far (updated).
+     * @return True on success, false on an I/O error.
+     */
+    bool scanLogForRecovery(IFileHandler& log, uint32_t base, uint8_t generation, uint32_t& total);
+
+    /**
+     * @brief Sorts the entries collected for the current run and writes them to
+     *        the index file as the run's page.
+     *
+     * @param count Entries in the run (at most MAX_INDEX_ENTRIES).
+     * @param page Page to write.
+     * @return True on success, false on a write error.
+     */
+    bool writeRecoveryRun(uint16_t count, uint32_t page);
+
+    /**
+     * @brief Merges runs of 'runLength' entries, DB_RECOVERY_FANIN at a time.
+     *
+     * The 'total' entries are stored back to back on the pages from 'fromPage'.
+     * The merged runs are written the same way from 'toPage'; with toPage set to
+     * DB_NO_PAGE the single merged run goes to the index builder instead, keeping
+     * only the last entry of each key.
+     *
+     * @return True on success, false on an I/O error.
+     */
+    bool mergeRecoveryRuns(uint32_t fromPage, uint32_t toPage, uint32_t total, uint32_t runLength);
+
+    /**
+     * @brief Returns true if the log holds at least one record.
+     */
+    bool logHasRecords(void);
+
+    /**
+     * @brief Makes the index file available for an operation (see openLogFile()).
+     *
+     * @param mode The fopen-style mode to use in safe mode.
+     * @return True if the index file is open, false otherwise.
+     */
+    bool openIndexFile(const char* mode) const;
+
+    /**
+     * @brief Ends an operation on the index file. Closes the file in safe mode only.
+     */
+    void closeIndexFile(void) const;
+
+    // -------------------------------------------------------------------------
+    // Internal / Index Helper Functions
+    // These functions are used internally for managing the index file and its pages.
+    // -------------------------------------------------------------------------
+
+    /**
+     * @brief Returns the cache slot holding the given page, loading it if needed.
+     *
+     * On a miss a slot is freed with evictIndexPage() and the page is read into it.
+     * The returned pointer is only valid until the next call that may load a page,
+     * except that the next such call never evicts it.
+     *
+     * @param pageNumber The page number (0-based) to access.
+     * @return The slot holding the page, or nullptr if the page could not be loaded.
+     */
+    IndexPageSlot* getIndexPage(uint32_t pageNumber);
+
+    /**
+     * @brief Read-only access to a page for lookups.
+     *
+     * Behaves like getIndexPage(), but with DB_THREAD_SAFE the page is copied
+     * into 'scratch', since another reader may reuse the slot as soon as
+     * _cacheLock is released. The pointer is valid under the same rules as
+     * getIndexPage()'s, and while 'scratch' is not reused.
+     *
+     * @param pageNumber The page number (0-based) to read.
+     * @param scratch Caller's page buffer.
+     * @return The page, or nullptr if it could not be read.
+     */
+    const IndexPage* viewIndexPage(uint32_t pageNumber, IndexPage& scratch) const;
+
+    /**
+     * @brief Returns the cache slot holding the given page without loading it.
+     *
+     * @param pageNumber The page number to look for.
+     * @return The slot holding the page, or nullptr if it is not cached.
+     */
+    IndexPageSlot* findCachedPage(uint32_t pageNumber) const;
 
-    // -------------------------------------------------------------------------
-    // Internal / Index Helper Functions
-    // These functions are used internally for managing the index file and its pages.
-    // -------------------------------------------------------------------------
+    /**
+     * @brief Writes a cached page to disk if it is dirty.
+     *
+     * @param slot The cache slot to write.
+     * @param updateHeader True to also rewrite the index header afterwards.
+     * @return True if the write was successful or not needed, false otherwise.
+     */
+    bool flushIndexPage(IndexPageSlot& slot, bool updateHeader = true);
 
     /**
-     * @brief Flushes the current in-memory index page to disk if it is dirty.
+     * @brief Writes every dirty cached page to disk, followed by a single
+     *        index header update.
      *
      * @return True if the flush was successful or not needed, false otherwise.
      */
-    bool flushIndexPage(void);
+    bool flushIndexPages(void);
 
     /**
-     * @brief Loads the specified index page (0-based) into memory.
-     *
-     * If the requested page is not fully populated, the remainder is zero-filled.
+     * @brief Loads the specified index page (0-based) into a cache slot.
      *
      * @param pageNumber The page number to load.
+     * @param slot The cache slot to load the page into.
      * @return True if the page was successfully loaded, false otherwise.
      */
-    bool loadIndexPage(uint32_t pageNumber);
+    bool loadIndexPage(uint32_t pageNumber, IndexPageSlot& slot) const;
+
+    /**
+     * @brief Reads a page image from the index file.
+     *
+     * Bytes beyond the end of the file (a page that was never written) read as zero.
+     * A whole page that fails its crc is not returned.
+     *
+     * @param pageNumber The page number to read.
+     * @param page Receives the page contents.
+     * @param bytes Number of bytes to read from the start of the page.
+     * @return True if the read was successful, false otherwise.
+     */
+    bool readIndexPage(uint32_t pageNumber, IndexPage& page, size_t bytes = sizeof(IndexPage)) const;
+
+    /**
+     * @brief Reads 'count' entries of a leaf-format page starting at slot 'first'.
+     *
+     * @return True if every entry was read, false otherwise.
+     */
+    bool readIndexEntries(uint32_t pageNumber, uint16_t first, IndexEntry* entries, uint16_t count);
+
+    /**
+     * @brief Writes a page image to its place in the index file.
+     *
+     * The page's crc is set first. Partial writes may only cover what the crc
+     * covers, i.e. the header of a free page. The first page written after a
+     * committed header is preceded by a header with DB_IDX_FLAG_AHEAD.
+     *
+     * @param pageNumber The page number to write.
+     * @param page The page contents (its crc is updated).
+     * @param bytes Number of bytes to write from the start of the page.
+     * @return True if the write was successful, false otherwise.
+     */
+    bool writeIndexPage(uint32_t pageNumber, IndexPage& page, size_t bytes = sizeof(IndexPage));
+
+    /**
+     * @brief Drops every cached page without writing it.
+     */
+    void invalidateIndexCache(void);
+
+    /**
+     * @brief Frees a cache slot for another page, writing it first if it is dirty.
+     *
+     * Leaf pages are evicted before interior pages so that the upper levels of
+     * the tree stay resident. A resident index (see setResidentIndex()) evicts
+     * nothing and hands out the slot of 'pageNumber' instead.
+     *
+     * @param pageNumber The page the slot is wanted for.
+     * @return The freed slot, or nullptr if the dirty page could not be written.
+     */
+    IndexPageSlot* evictIndexPage(uint32_t pageNumber);
+
+    /**
+     * @brief Returns a cache slot for a page that is being (re)initialised.
+     *
+     * The page is not read from disk; it is cleared, given the requested type and
+     * marked dirty.
+     *
+     * @param pageNumber The page being initialised.
+     * @param type INDEX_PAGE_LEAF or INDEX_PAGE_INTERIOR.
+     * @return The slot, or nullptr if no slot could be freed.
+     */
+    IndexPageSlot* newIndexPage(uint32_t pageNumber, uint8_t type);
+
+#if DB_RESIDENT_INDEX
+    /**
+     * @brief Returns the resident slot of a page, allocating it if needed.
+     *
+     * The slot is not loaded; findCachedPage() only returns loaded slots.
+     */
+    IndexPageSlot* residentSlot(uint32_t pageNumber) const;
+
+    /**
+     * @brief Reads every page that is not resident yet, front to back in one pass.
+     *
+     * Pages are copied out of IFileHandler::map() if the handler maps the whole
+     * index. A page that fails its crc is left out, so the next access reports it.
+     *
+     * @return True unless the index file could not be read.
+     */
+    bool loadResidentIndex(void) const;
+
+    /**
+     * @brief Writes the dirty resident pages in page order.
+     *
+     * @param anyFlushed Set to true if a page was written.
+     * @return True if every dirty page was written, false otherwise.
+     */
+    bool flushResidentPages(bool& anyFlushed);
+
+    /**
+     * @brief Counts or collects the entries matching 'filter' on several threads.
+     *
+     * Each thread runs scanIndexChunk() over its share of the positions; the
+     * calling thread takes the first share. Applies only to a resident index
+     * with at least two shares of DB_SCAN_CHUNK_ENTRIES.
+     *
+     * @param filter Entries to look for.
+     * @param results Receives the matching positions in order, or nullptr to count them.
+     * @param maxResults Capacity of 'results'.
+     * @param found Number of matches (stored, if 'results' is given).
+     * @return False if the scan does not apply; the caller scans on its own then.
+     */
+    bool parallelScan(const IndexFilter& filter, uint32_t results[], size_t maxResults, size_t& found) const;
+
+    /**
+     * @brief Scans the positions of one chunk on resident pages, skipping the
+     *        subtrees whose summary rules out a match like findMatchingEntry().
+     *
+     * Runs without locks: pages are only read, and all of them are resident.
+     */
+    void scanIndexChunk(const IndexFilter* filter, IndexScanChunk* chunk) const;
+#endif
+
+    /**
+     * @brief Takes a page from the free list or, if it is empty, extends the file.
+     *
+     * @param pageNumber Receives the allocated page number.
+     * @return True on success, false if the free list could not be read.
+     */
+    bool allocateIndexPage(uint32_t& pageNumber);
+
+    /**
+     * @brief Descends from the root to the leaf that holds (or would hold) a key.
+     *
+     * @param key The key to look for.
+     * @param path Receives the pages and child slots visited.
+     * @param firstPosition Receives the global position of the leaf's first entry.
+     * @return True on success, false if the index is empty or a page could not be loaded.
+     */
+    bool descendToKey(uint32_t key, IndexPath& path, uint32_t& firstPosition);
+
+    /**
+     * @brief Finds the leaf holding a global index position.
+     *
+     * Sequential positions are resolved from the previous lookup by following the
+     * leaf links; other positions descend the tree using the subtree counts.
+     *
+     * @param globalIndex The global index position (must be < indexCount()).
+     * @param slotIndex Receives the entry's slot within the leaf.
+     * @return The cache slot holding the leaf, or nullptr on failure.
+     */
+    IndexPageSlot* findPosition(uint32_t globalIndex, uint16_t& slotIndex);
+
+    /**
+     * @brief Reads the entry at a global index position (getIndexEntry() without
+     *        the lock). Uses the same lookup hint as findPosition().
+     *
+     * @param globalIndex The global index position.
+     * @param entry Receives the entry.
+     * @return True if the entry was read, false otherwise.
+     */
+    bool entryAt(uint32_t globalIndex, IndexEntry& entry) const;
+
+    /**
+     * @brief searchIndex() without the lock.
+     *
+     * @param foundEntry If given, receives the entry found.
+     */
+    bool lookupKey(uint32_t key, uint32_t* foundIndex, IndexEntry* foundEntry = nullptr) const;
+
+    /**
+     * @brief Walks from the root to the leaf holding a global position, using the
+     *        subtree counts, and records the route.
+     *
+     * @param globalIndex The position to find (must be below indexCount()).
+     * @param path Receives the route; path.page[path.depth - 1] is the leaf.
+     * @param offsetInLeaf Receives the slot of the position within the leaf.
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool descendToPosition(uint32_t globalIndex, IndexPath& path, uint32_t& offsetInLeaf);
+
+    /**
+     * @brief Finds the first entry at or after a global position that passes a filter.
+     *
+     * Subtrees whose summary rules out a match are skipped without being loaded.
+     *
+     * @param start The first global position to consider.
+     * @param filter The predicate to apply.
+     * @param entry Receives the matching entry.
+     * @param position Receives its global position.
+     * @return True if a match was found, false otherwise.
+     */
+    bool findMatchingEntry(uint32_t start, const IndexFilter& filter, IndexEntry& entry, uint32_t& position) const;
+
+    /**
+     * @brief Recomputes the subtree summaries above a global position after the
+     *        status or deletion flag of its entry changed.
+     *
+     * @param globalIndex The position whose entry changed.
+     * @param allLevels True to refresh every level, not only up to the first
+     *        unchanged reference (needed after a leaf split).
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool refreshSummaries(uint32_t globalIndex, bool allLevels = false);
+
+    /**
+     * @brief Finds the first global position whose key is not less than the given key.
+     *
+     * @param key The key to look for.
+     * @param position Receives the position (equal to indexCount() if every key is smaller).
+     * @param entry If given, receives the entry at the position unless it is indexCount().
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool lowerBound(uint32_t key, uint32_t* position, IndexEntry* entry = nullptr) const;
 
     /**
      * @brief Updates an index entry at the given global index in memory.
      *
-     * Marks the page as dirty so that it will be flushed later.
+     * Marks the page as dirty so that it will be flushed later, and refreshes
+     * the parents' summaries if the status or deletion flag changed. The entry's
+     * key must not change, since that could break the key order.
      *
      * @param globalIndex The global index position to update.
      * @param entry The new index entry to write.
@@ -408,13 +2171,100 @@ private:
      */
     bool setIndexEntry(uint32_t globalIndex, const IndexEntry& entry);
 
+    /**
+     * @brief Sets the user status of the entries at ascending global positions.
+     *
+     * Each leaf is changed in place and the summaries above it are refreshed
+     * once. Entries of records reclaimed by compaction are not changed.
+     *
+     * @param positions Distinct global positions in ascending order.
+     * @param n Number of positions.
+     * @param newStatus The new status value.
+     * @param entries Receives the entry at each position, as it was before.
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool setIndexStatuses(const uint32_t* positions, size_t n, uint8_t newStatus, IndexEntry* entries);
+
+#if DB_AGGREGATES > 0
+    /**
+     * @brief Returns the aggregated fields of a record (see setAggregateExtractor()).
+     *
+     * @param values Receives the fields.
+     * @return Mask of the fields set in values.
+     */
+    uint32_t extractAggregates(uint8_t recordType, const void* record, uint16_t recordSize,
+        float values[DB_AGGREGATES]) const;
+
+    /**
+     * @brief Adds the fields of a record just appended to the summaries on the path to its key.
+     *
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool addRecordAggregates(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize);
+
+    /**
+     * @brief Changes the aggregates of every child reference on the path to a key.
+     *
+     * @param key The key whose path is changed.
+     * @param values The fields to add, or nullptr to mark the references stale.
+     * @param mask Fields of values to add.
+     * @return True on success, false if a page could not be loaded.
+     */
+    bool updateAggregates(uint32_t key, const float* values, uint32_t mask);
+
+    /**
+     * @brief Adds the fields of the live records at leaf slots [first, end) to results.
+     *
+     * @return True on success, false if a record could not be read.
+     */
+    bool scanAggregates(const IndexPage& leaf, uint16_t first, uint16_t end, DBAggregate results[DB_AGGREGATES]);
+#endif
+
+    /**
+     * @brief Writes a status byte into the log records of the given entries,
+     *        in runs of nearby records (see updateStatusRange()).
+     *
+     * @param entries The entries of the records; sorted by file and offset here.
+     * @param n Number of entries.
+     * @param newStatus The status byte to write.
+     * @return True on success, false on an I/O error.
+     */
+    bool writeLogStatuses(IndexEntry* entries, size_t n, uint8_t newStatus);
+
+    /**
+     * @brief Writes the internal status byte of an entry's log record.
+     *
+     * @return True on success, false on an I/O error.
+     */
+    bool writeLogInternalStatus(const IndexEntry& entry, uint8_t internalStatus);
+
+    /**
+     * @brief updateStatusRange() for at most DB_MAX_BATCH_ITEMS distinct
+     *        positions in ascending order, without the lock.
+     *
+     * @param reclaimed Set if one of the records was reclaimed by compaction.
+     * @return True on success, false on an I/O error.
+     */
+    bool updateStatusGroup(const uint32_t* positions, size_t n, uint8_t newStatus, bool& reclaimed);
+
     /**
      * @brief Writes the index header (including the index count) to disk.
      *
+     * The header commits the pages written before it: DB_IDX_FLAG_AHEAD is
+     * cleared unless dirty pages are still waiting in the cache.
+     *
      * @return True if the header was successfully written, false otherwise.
      */
     bool saveIndexHeader(void);
 
+    /**
+     * @brief Writes the header to the next of the two header slots through the
+     *        open index file.
+     *
+     * @return True if the header was written, false otherwise.
+     */
+    bool writeIndexHeader(void);
+
     /**
      * @brief Reads the index header from disk and initializes the in-memory index state.
      *
@@ -431,10 +2281,21 @@ private:
      */
     bool findIndexEntry(uint32_t key, uint32_t& offset) const;
 
+    /**
+     * @brief Finds an index entry by key and returns the whole entry.
+     *
+     * @param key The key to search for.
+     * @param entry Reference to store the index entry.
+     * @return True if the key is found, false otherwise.
+     */
+    bool findIndexEntry(uint32_t key, IndexEntry& entry) const;
+
     /**
      * @brief Inserts a new index entry in sorted order.
      *
-     * If the target index page is full, the page is split.
+     * The entry goes into the leaf found by descendToKey() and the subtree counts
+     * along the path are updated. If the leaf is full it is split, which may in
+     * turn split its ancestors.
      *
      * @param key The key to insert.
      * @param offset The file offset of the new record.
@@ -445,26 +2306,127 @@ private:
     bool insertIndexEntry(uint32_t key, uint32_t offset, uint8_t status, uint8_t internal_status);
 
     /**
-     * @brief Splits a full index page and inserts a new index entry.
+     * @brief Returns the largest key in the index, reading the last leaf once
+     *        after open if necessary.
      *
-     * The current page is split at the midpoint, and the new entry is inserted
-     * into the appropriate page. Both pages are then flushed.
+     * @param maxKey Receives the largest key.
+     * @return True if the index is not empty and the key is known, false otherwise.
+     */
+    bool currentMaxKey(uint32_t& maxKey);
+
+    /**
+     * @brief Appends an entry whose key is larger than every key in the index.
      *
-     * @param targetPage The page number to split.
-     * @param offsetInPage The offset within the page where the new entry should be inserted.
-     * @param key The key to insert.
-     * @param recordOffset The file offset of the new record.
-     * @param status User-supplied status.
-     * @param internal_status Internal status flags.
+     * Follows the rightmost path without any key comparisons and adds the entry
+     * to the end of the last leaf. When that leaf is full a new last leaf is
+     * started and the full one is written out right away.
+     *
+     * @param entry The entry to append.
+     * @return True if the entry was appended, false otherwise.
+     */
+    bool appendIndexEntry(const IndexEntry& entry);
+
+    /**
+     * @brief Splits a leaf that cannot take a new index entry and inserts it.
+     *
+     * The leaf is split at the midpoint, except when the entry is appended to the
+     * rightmost leaf: then the new leaf starts with just that entry, so ascending
+     * keys leave full leaves behind. Each half gets the narrowest format its
+     * entries allow. The new leaf is linked into the leaf chain and registered
+     * with the parent.
+     *
+     * @param path The path returned by descendToKey() for the entry's key.
+     * @param offsetInPage The slot within the leaf where the entry belongs.
+     * @param entry The entry to insert.
      * @return True if the split and insertion were successful, false otherwise.
      */
-    bool splitPageAndInsert(uint32_t targetPage, uint32_t offsetInPage,
-        uint32_t key, uint32_t recordOffset, uint8_t status, uint8_t internal_status);
+    bool splitPageAndInsert(IndexPath& path, uint16_t offsetInPage, const IndexEntry& entry);
+
+    /**
+     * @brief Adds a child reference to an interior page right after the child
+     *        followed by the path, splitting the page (and growing a new root)
+     *        when it is full.
+     *
+     * The followed child's reference takes the count and summary from 'left',
+     * which describes what remained in the split page.
+     *
+     * @param path The path that led to the split child.
+     * @param level The interior level receiving the reference (0 = root).
+     * @param left The summary of the split page after the split.
+     * @param ref The reference to the new child.
+     * @return True on success, false otherwise.
+     */
+    bool insertChildRef(IndexPath& path, uint8_t level, const IndexChildRef& left, const IndexChildRef& ref);
+
+    /**
+     * @brief Starts writing a new tree from entries supplied in ascending key order.
+     *
+     * Leaves are filled completely and written to consecutive pages starting at
+     * firstPage; finishIndexBuild() then adds the interior levels. The page cache
+     * is used as the work buffer and is invalidated first.
+     *
+     * @param firstPage The first page to write.
+     * @return True if the build could be started, false otherwise.
+     */
+    bool beginIndexBuild(uint32_t firstPage);
+
+    /**
+     * @brief Adds the next entry to the tree being built.
+     *
+     * @param entry The entry; its key must be greater than the previous one.
+     * @return True on success, false on an ordering or write error.
+     */
+    bool addIndexBuildEntry(const IndexEntry& entry);
+
+    /**
+     * @brief Writes the last leaf and the interior levels, then installs the new
+     *        tree as the current index and saves the header.
+     *
+     * @return True on success, false on a read or write error.
+     */
+    bool finishIndexBuild(void);
+
+    /**
+     * @brief Writes parent levels above a level of consecutive pages until a
+     *        single root remains (builder helper).
+     *
+     * @param levelStart First page of the level; receives the root page.
+     * @param levelPages Pages in the level; receives 1 (or 0 for an empty tree).
+     * @param height Height of the given level; receives the tree height.
+     * @return True on success, false on a read or write error.
+     */
+    bool buildInteriorLevels(uint32_t& levelStart, uint32_t& levelPages, uint8_t& height);
+
+    /**
+     * @brief Converts a version 1 (flat array) index file to the tree format.
+     *
+     * The tree is written after the old entries, which are streamed into the
+     * builder; the pages they occupied are then put on the free list.
+     *
+     * @param entryCount Number of entries recorded in the version 1 header.
+     * @return True if the index was converted, false otherwise.
+     */
+    bool upgradeIndexV1(uint32_t entryCount);
+
+    /**
+     * @brief Removes the entries whose log offset lies in [dropFrom, dropTo) and
+     *        rebuilds the interior levels above the remaining leaves.
+     *
+     * Every leaf is read once and only the ones that change are written. Leaves
+     * left empty and the old interior pages are put on the free list. With an
+     * empty range this just re-summarises the tree.
+     *
+     * @param dropFrom First log offset to remove.
+     * @param dropTo End of the range (exclusive).
+     * @return True on success, false on a read or write error.
+     */
+    bool rebuildIndexLevels(uint32_t dropFrom, uint32_t dropTo);
 
     /**
      * @brief Validates the index file for corruption.
      *
-     * Checks the order of keys in the first page and other integrity constraints.
+     * Checks the tree shape recorded in the header against the root page, and the
+     * order of keys in the root and the first leaf.
      *
      * @return True if the index is valid, false otherwise.
      */
@@ -501,4 +2463,126 @@ private:
     DBHeader _dbHeader;  ///< In-memory copy of the database header.
 };
 
+
+// -----------------------------------------------------------------------------
+// DBCursor Class Declaration
+// -----------------------------------------------------------------------------
+
+/**
+ * @brief Walks the index in key order and reads record payloads by offset.
+ *
+ * A cursor sits on one index entry at a time. Moving it follows the index leaf
+ * links, and readPayload() reads the record at the entry's log offset without
+ * searching for the key again. While the entries visited have increasing log
+ * offsets, the log is read ahead in DB_CURSOR_BUFFER_SIZE chunks, so exporting
+ * a key range turns into a few large sequential reads.
+ *
+ * Inserting keys moves the positions of the entries after them; call seek()
+ * again after appending while a cursor is in use.
+ */
+class DBCursor {
+public:
+    /**
+     * @brief Creates a cursor over an open database. It is not on an entry yet.
+     *
+     * @param db The database to walk.
+     */
+    explicit DBCursor(DBEngine& db);
+
+    /**
+     * @brief Moves to the first entry whose key is not less than the given key.
+     *
+     * @param key The key to start at (e.g., the start of a time window).
+     * @return True if there is such an entry, false otherwise.
+     */
+    bool seek(uint32_t key);
+
+    /**
+     * @brief Moves to the entry with the smallest key.
+     *
+     * @return True if the index is not empty, false otherwise.
+     */
+    bool first(void);
+
+    /**
+     * @brief Moves to the entry with the largest key.
+     *
+     * @return True if the index is not empty, false otherwise.
+     */
+    bool last(void);
+
+    /**
+     * @brief Moves to the next entry in key order.
+     *
+     * @return True if the cursor is on a valid entry afterwards, false at the end.
+     */
+    bool next(void);
+
+    /**
+     * @brief Moves to the previous entry in key order.
+     *
+     * @return True if the cursor is on a valid entry afterwards, false at the start.
+     */
+    bool prev(void);
+
+    /**
+     * @brief Returns true if the cursor is on an entry.
+     */
+    bool valid(void) const { return _valid; }
+
+    /**
+     * @brief Returns the current index entry (key, log offset and status flags).
+     */
+    const IndexEntry& entry(void) const { return _entry; }
+
+    /**
+     * @brief Returns the global index position of the current entry.
+     */
+    uint32_t position(void) const { return _position; }
+
+    /**
+     * @brief Reads the payload of the record under the cursor.
+     *
+     * @param payloadBuffer Buffer to store the record payload.
+     * @param bufferSize Size of the payloadBuffer in bytes.
+     * @param outRecordSize Optional pointer to receive the actual record size.
+     * @param outHeader Optional pointer to receive the record's log entry header.
+     * @return True if the record was read, false if the cursor is not on an entry,
+     *         the buffer is too small, or the log could not be read.
+     */
+    bool readPayload(void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize = nullptr,
+        LogEntryHeader* outHeader = nullptr);
+
+private:
+    /**
+     * @brief Moves to a global index position and loads its entry.
+     */
+    bool moveTo(uint32_t position);
+
+    /**
+     * @brief Copies 'size' bytes at 'offset' of the given log file into 'data',
+     *        from the read-ahead buffer when possible. Sequential reads refill the
+     *        buffer; others read only what was asked for. The file must be open.
+     *        Offsets are index offsets; 'fileBase' is the index offset of the
+     *        file's first byte (non-zero for the segments of a segmented log).
+     */
+    bool readLog(IFileHandler& log, uint32_t fileBase, uint32_t offset, void* data, size_t size,
+        bool sequential);
+
+    DBEngine& _db;
+    IndexEntry _entry;         ///< Entry under the cursor (valid if _valid).
+    uint32_t _position;        ///< Global index position of _entry.
+    bool _valid;               ///< False until a move succeeds, and after moving off either end.
+
+    uint32_t _lastOffset;      ///< Log offset of the previous readPayload() record.
+    bool _haveLastOffset;      ///< _lastOffset is set.
+    uint8_t _buffer[DB_CURSOR_BUFFER_SIZE]; ///< Read-ahead copy of the log.
+    uint32_t _bufferStart;     ///< Index offset of _buffer[0].
+    size_t _bufferUsed;        ///< Valid bytes in _buffer (0 = empty).
+    uint32_t _bufferRewrites;  ///< _db._logRewrites when the buffer was filled.
+    IFileHandler* _bufferLog;  ///< File the buffer was filled from.
+};
+
+DB_NAMESPACE_END
+
 #endif // DBENGINE_H
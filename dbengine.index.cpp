@@ -1,32 +1,491 @@
-#include "DBEngine.h"
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
 
 // Define our own MIN macro since STL is not permitted.
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+// ---------------------------------------------------------------------------
+// Page Layout Helpers
+// ---------------------------------------------------------------------------
+
+// File offset of an index page. Pages follow the two header slots back to back.
+static uint32_t indexPageOffset(uint32_t pageNumber) {
+    return static_cast<uint32_t>(2 * sizeof(DBIndexHeader) + pageNumber * sizeof(IndexPage));
+}
+
+// ---------------------------------------------------------------------------
+// Leaf Formats
+//   A wide leaf (format 0) is an IndexEntry array. A narrow one packs each
+//   entry into keyBytes + offsetBytes + 2 bytes (see IndexPage). Both are read
+//   through a LeafCodec set up once per page: a field is one unaligned 4-byte
+//   load and a mask, so decoding an entry takes no branch on the format. The
+//   wide format is the narrow one with 4-byte fields and zero bases.
+// ---------------------------------------------------------------------------
+
+struct LeafCodec {
+    uint8_t keyBytes;     // Bytes of a stored key.
+    uint8_t offsetBytes;  // Bytes of a stored offset.
+    uint8_t stride;       // Bytes of an entry.
+    uint32_t keyMask;
+    uint32_t offsetMask;  // Also the stored value of DB_NO_OFFSET.
+    uint32_t baseKey;
+    uint32_t baseOffset;
+};
+
+// Key and offset range of a set of entries, for choosing their format.
+struct LeafRange {
+    uint32_t minKey, maxKey;
+    uint32_t minOffset, maxOffset;  // minOffset > maxOffset: every offset is DB_NO_OFFSET.
+};
+
+static uint32_t widthMask(uint8_t bytes) {
+    return (bytes >= 4) ? 0xFFFFFFFFu : (1u << (8 * bytes)) - 1;
+}
+
+static uint8_t widthFor(uint32_t value) {
+    return (value <= 0xFF) ? 1 : (value <= 0xFFFF) ? 2 : (value <= 0xFFFFFF) ? 3 : 4;
+}
+
+// Reads 4 bytes; the caller masks off what belongs to the next field. The file
+// format is little-endian throughout.
+static inline uint32_t loadLeafWord(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static void formatCodec(uint8_t format, uint32_t baseKey, uint32_t baseOffset, LeafCodec& codec) {
+    if (format & INDEX_LEAF_NARROW) {
+        codec.keyBytes = static_cast<uint8_t>((format & 0x03) + 1);
+        codec.offsetBytes = static_cast<uint8_t>(((format >> 2) & 0x03) + 1);
+        codec.baseKey = baseKey;
+        codec.baseOffset = baseOffset;
+    }
+    else {
+        codec.keyBytes = 4;
+        codec.offsetBytes = 4;
+        codec.baseKey = 0;
+        codec.baseOffset = 0;
+    }
+    codec.stride = static_cast<uint8_t>(codec.keyBytes + codec.offsetBytes + 2);
+    codec.keyMask = widthMask(codec.keyBytes);
+    codec.offsetMask = widthMask(codec.offsetBytes);
+}
+
+static void leafCodec(const IndexPage& page, LeafCodec& codec) {
+    uint32_t baseKey = 0, baseOffset = 0;
+    if (page.header.format & INDEX_LEAF_NARROW) {
+        memcpy(&baseKey, &page.bytes[INDEX_PAGE_BODY - 8], sizeof(baseKey));
+        memcpy(&baseOffset, &page.bytes[INDEX_PAGE_BODY - 4], sizeof(baseOffset));
+    }
+    formatCodec(page.header.format, baseKey, baseOffset, codec);
+}
+
+static uint16_t leafCapacity(uint8_t format) {
+    if (!(format & INDEX_LEAF_NARROW))
+        return MAX_INDEX_ENTRIES;
+    LeafCodec codec;
+    formatCodec(format, 0, 0, codec);
+    return static_cast<uint16_t>(MIN((INDEX_PAGE_BODY - 8) / codec.stride, INDEX_LEAF_CAPACITY));
+}
+
+static bool leafFormatValid(uint8_t format) {
+    return format == 0 || (format & ~0x0F) == INDEX_LEAF_NARROW;
+}
+
+static inline uint32_t leafKey(const IndexPage& page, const LeafCodec& codec, uint16_t i) {
+    return codec.baseKey + (loadLeafWord(&page.bytes[i * codec.stride]) & codec.keyMask);
+}
+
+static inline void leafEntry(const IndexPage& page, const LeafCodec& codec, uint16_t i, IndexEntry& entry) {
+    const uint8_t* p = &page.bytes[i * codec.stride];
+    uint32_t offset = loadLeafWord(p + codec.keyBytes) & codec.offsetMask;
+    entry.key = codec.baseKey + (loadLeafWord(p) & codec.keyMask);
+    entry.offset = (offset == codec.offsetMask) ? DB_NO_OFFSET : codec.baseOffset + offset;
+    entry.status = p[codec.keyBytes + codec.offsetBytes];
+    entry.internal_status = p[codec.keyBytes + codec.offsetBytes + 1];
+}
+
+static void storeLeafEntry(IndexPage& page, const LeafCodec& codec, uint16_t i, const IndexEntry& entry) {
+    uint8_t* p = &page.bytes[i * codec.stride];
+    uint32_t key = entry.key - codec.baseKey;
+    uint32_t offset = (entry.offset == DB_NO_OFFSET) ? codec.offsetMask : entry.offset - codec.baseOffset;
+    memcpy(p, &key, codec.keyBytes);
+    memcpy(p + codec.keyBytes, &offset, codec.offsetBytes);
+    p[codec.keyBytes + codec.offsetBytes] = entry.status;
+    p[codec.keyBytes + codec.offsetBytes + 1] = entry.internal_status;
+}
+
+static bool leafCanHold(const LeafCodec& codec, const IndexEntry& entry) {
+    return entry.key >= codec.baseKey && entry.key - codec.baseKey <= codec.keyMask &&
+        (entry.offset == DB_NO_OFFSET ||
+        (entry.offset >= codec.baseOffset && entry.offset - codec.baseOffset < codec.offsetMask));
+}
+
+static void addToRange(LeafRange& range, const IndexEntry& entry) {
+    if (entry.key < range.minKey)
+        range.minKey = entry.key;
+    if (entry.key > range.maxKey)
+        range.maxKey = entry.key;
+    if (entry.offset != DB_NO_OFFSET) {
+        if (entry.offset < range.minOffset)
+            range.minOffset = entry.offset;
+        if (range.minOffset > range.maxOffset || entry.offset > range.maxOffset)
+            range.maxOffset = entry.offset;
+    }
+}
+
+// Range of 'count' entries from slot 'first', and of 'extra' if given.
+static void leafRange(const IndexPage& page, const LeafCodec& codec, uint16_t first, uint16_t count,
+    const IndexEntry* extra, LeafRange& range) {
+    range.minKey = 0xFFFFFFFFu;
+    range.maxKey = 0;
+    range.minOffset = 0xFFFFFFFFu;
+    range.maxOffset = 0;
+    IndexEntry entry;
+    for (uint16_t i = first; i < first + count; i++) {
+        leafEntry(page, codec, i, entry);
+        addToRange(range, entry);
+    }
+    if (extra)
+        addToRange(range, *extra);
+}
+
+// The narrowest format that holds 'count' entries of the range, if narrow
+// leaves are enabled, else the wide one. Returns false if neither holds them.
+static bool chooseLeafFormat(const LeafRange& range, uint32_t count, bool narrow,
+    uint8_t& format, uint32_t& baseKey, uint32_t& baseOffset) {
+    if (narrow) {
+        bool offsets = range.minOffset <= range.maxOffset;
+        uint8_t keyBytes = widthFor(range.maxKey - range.minKey);
+        // All ones is reserved for DB_NO_OFFSET.
+        uint8_t offsetBytes = offsets ? widthFor(range.maxOffset - range.minOffset + 1) : 1;
+        uint8_t candidate = static_cast<uint8_t>(INDEX_LEAF_NARROW | (keyBytes - 1) | ((offsetBytes - 1) << 2));
+        if (!(offsets && range.maxOffset - range.minOffset + 1 == 0) &&
+            static_cast<size_t>(keyBytes + offsetBytes + 2) < sizeof(IndexEntry) && count <= leafCapacity(candidate)) {
+            format = candidate;
+            baseKey = range.minKey;
+            baseOffset = offsets ? range.minOffset : 0;
+            return true;
+        }
+    }
+    format = 0;
+    baseKey = 0;
+    baseOffset = 0;
+    return count <= MAX_INDEX_ENTRIES;
+}
+
+// Rewrites a leaf's entries in another format, in place: front to back when
+// the entries shrink, back to front when they grow, so no entry is overwritten
+// before it is read. The bases of a narrow leaf go last, as the entries of a
+// wide one may cover them.
+static void recodeLeaf(IndexPage& page, uint8_t format, uint32_t baseKey, uint32_t baseOffset) {
+    LeafCodec from, to;
+    leafCodec(page, from);
+    formatCodec(format, baseKey, baseOffset, to);
+    uint16_t count = page.header.count;
+    IndexEntry entry;
+    if (to.stride <= from.stride) {
+        for (uint16_t i = 0; i < count; i++) {
+            leafEntry(page, from, i, entry);
+            storeLeafEntry(page, to, i, entry);
+        }
+    }
+    else {
+        for (uint16_t i = count; i-- > 0;) {
+            leafEntry(page, from, i, entry);
+            storeLeafEntry(page, to, i, entry);
+        }
+    }
+    page.header.format = format;
+    if (format & INDEX_LEAF_NARROW) {
+        memcpy(&page.bytes[INDEX_PAGE_BODY - 8], &baseKey, sizeof(baseKey));
+        memcpy(&page.bytes[INDEX_PAGE_BODY - 4], &baseOffset, sizeof(baseOffset));
+    }
+}
+
+// Gives a leaf the format for its entries plus 'extra' (if given), keeping the
+// current one while it still has room. Returns false if no format holds them.
+static bool fitLeaf(IndexPage& page, const IndexEntry* extra, bool narrow) {
+    LeafCodec codec;
+    leafCodec(page, codec);
+    uint32_t count = page.header.count + (extra ? 1 : 0);
+    if (page.header.count > 0 && (!extra || leafCanHold(codec, *extra)) && count <= leafCapacity(page.header.format))
+        return true;
+    LeafRange range;
+    leafRange(page, codec, 0, page.header.count, extra, range);
+    uint8_t format;
+    uint32_t baseKey, baseOffset;
+    if (!chooseLeafFormat(range, count, narrow, format, baseKey, baseOffset))
+        return false;
+    recodeLeaf(page, format, baseKey, baseOffset);
+    return true;
+}
+
+// Inserts an entry at slot 'at', changing the leaf's format if it needs wider
+// fields or more room. Returns false if the leaf cannot take the entry.
+static bool insertLeafEntry(IndexPage& page, uint16_t at, const IndexEntry& entry, bool narrow) {
+    if (!fitLeaf(page, &entry, narrow))
+        return false;
+    LeafCodec codec;
+    leafCodec(page, codec);
+    memmove(&page.bytes[(at + 1) * codec.stride], &page.bytes[at * codec.stride],
+        (page.header.count - at) * codec.stride);
+    storeLeafEntry(page, codec, at, entry);
+    page.header.count++;
+    return true;
+}
+
+// Replaces the entry in slot 'at' (same key). Returns false if the leaf would
+// need a format it has no room for.
+static bool setLeafEntry(IndexPage& page, uint16_t at, const IndexEntry& entry, bool narrow) {
+    LeafCodec codec;
+    leafCodec(page, codec);
+    if (!leafCanHold(codec, entry)) {
+        // The range still includes the old entry, so every entry stays representable.
+        LeafRange range;
+        leafRange(page, codec, 0, page.header.count, &entry, range);
+        uint8_t format;
+        uint32_t baseKey, baseOffset;
+        if (!chooseLeafFormat(range, page.header.count, narrow, format, baseKey, baseOffset))
+            return false;
+        recodeLeaf(page, format, baseKey, baseOffset);
+        leafCodec(page, codec);
+    }
+    storeLeafEntry(page, codec, at, entry);
+    return true;
+}
+
+static void removeLeafEntry(IndexPage& page, uint16_t at) {
+    LeafCodec codec;
+    leafCodec(page, codec);
+    memmove(&page.bytes[at * codec.stride], &page.bytes[(at + 1) * codec.stride],
+        (page.header.count - at - 1) * codec.stride);
+    page.header.count--;
+}
+
+// Checksum of a page: its header up to the crc, then the entries (leaf) or
+// child references (interior) in use. Free pages only have their header.
+static uint32_t indexPageCrc(const IndexPage& page) {
+    uint32_t crc = dbCrc32(0, &page.header, offsetof(IndexPageHeader, crc));
+    if (page.header.type == INDEX_PAGE_LEAF) {
+        LeafCodec codec;
+        formatCodec(page.header.format, 0, 0, codec);
+        uint16_t count = MIN(page.header.count, leafCapacity(page.header.format));
+        crc = dbCrc32(crc, page.bytes, count * codec.stride);
+        if (page.header.format & INDEX_LEAF_NARROW)
+            crc = dbCrc32(crc, &page.bytes[INDEX_PAGE_BODY - 8], 8);
+    }
+    else if (page.header.type == INDEX_PAGE_INTERIOR)
+        crc = dbCrc32(crc, page.children, MIN(page.header.count, INDEX_FANOUT) * sizeof(IndexChildRef));
+    return crc;
+}
+
+// Completes a page read that returned 'bytesRead' of 'bytes' bytes: the rest
+// reads as zeros, and a whole page must match its crc.
+static bool checkIndexPage(IndexPage& page, size_t bytes, size_t bytesRead) {
+    if (bytesRead < bytes)
+        memset(reinterpret_cast<uint8_t*>(&page) + bytesRead, 0, bytes - bytesRead);
+    // Only a whole page can be checked; one past the end of the file is all zeros.
+    if (bytes == sizeof(IndexPage) && bytesRead > 0 && page.header.crc != indexPageCrc(page)) {
+        DEBUG_PRINT("readIndexPage: Checksum mismatch.\n");
+        return false;
+    }
+    return true;
+}
+
+// Both searches below halve the range with a conditional move instead of a
+// branch, so the loop runs log2(count) times whatever the key and the CPU
+// never mispredicts the comparison. Narrow keys are compared as stored, after
+// moving key into the page's range once.
+
+// First slot of a leaf whose key is >= key (count if every key is smaller).
+static uint16_t leafLowerBound(const IndexPage& page, uint32_t key) {
+    LeafCodec codec;
+    leafCodec(page, codec);
+    uint16_t count = page.header.count;
+    if (count == 0 || key <= codec.baseKey)
+        return 0;
+    key -= codec.baseKey;
+    if (key > codec.keyMask)
+        return count;
+    const uint8_t* keys = page.bytes;
+    uint32_t first = 0, length = count;
+    while (length > 1) {
+        uint32_t half = length / 2;
+        uint32_t probe = loadLeafWord(&keys[(first + half) * codec.stride]) & codec.keyMask;
+        first = (probe < key) ? first + half : first;
+        length -= half;
+    }
+    uint32_t last = loadLeafWord(&keys[first * codec.stride]) & codec.keyMask;
+    return static_cast<uint16_t>(first + (last < key));
+}
+
+// Child of an interior page to follow for key: the last child whose smallest
+// key is <= key, or the first child if key is below all of them.
+static uint16_t childForKey(const IndexPage& page, uint32_t key) {
+    uint32_t first = 0, length = page.header.count;
+    while (length > 1) {
+        uint32_t half = length / 2;
+        first = (page.children[first + half].key <= key) ? first + half : first;
+        length -= half;
+    }
+    return static_cast<uint16_t>(first);
+}
+
+#if DB_AGGREGATES > 0
+// Sets an aggregate to no values, or with count DB_AGGREGATE_STALE to unknown ones.
+static void resetAggregate(DBAggregate& aggregate, uint32_t count) {
+    aggregate.count = count;
+    aggregate.min = 0;
+    aggregate.max = 0;
+    aggregate.sum = 0;
+}
+
+// Adds the values of 'from' to 'into'; either one stale makes the result stale.
+static void mergeAggregate(DBAggregate& into, const DBAggregate& from) {
+    if (into.count == DB_AGGREGATE_STALE || from.count == 0)
+        return;
+    if (into.count == 0 || from.count == DB_AGGREGATE_STALE) {
+        into = from;
+        return;
+    }
+    into.count += from.count;
+    if (from.min < into.min)
+        into.min = from.min;
+    if (from.max > into.max)
+        into.max = from.max;
+    into.sum += from.sum;
+}
+
+static void addAggregateValue(DBAggregate& into, float value) {
+    DBAggregate single;
+    single.count = 1;
+    single.min = value;
+    single.max = value;
+    single.sum = value;
+    mergeAggregate(into, single);
+}
+
+static bool aggregatesStale(const IndexChildRef& ref) {
+    for (uint32_t f = 0; f < DB_AGGREGATES; f++) {
+        if (ref.aggregates[f].count == DB_AGGREGATE_STALE)
+            return true;
+    }
+    return false;
+}
+#endif
+
+// Fills in the key, entry count and status summary a parent needs for this
+// page. The caller sets ref.page. A leaf's aggregates come out stale, since
+// only the reference to it knows them (see "Range aggregates").
+static void summarizeIndexPage(const IndexPage& page, IndexChildRef& ref) {
+    ref.key = 0;
+    ref.count = 0;
+    ref.deleted = 0;
+    ref.statusMask = 0;
+#if DB_AGGREGATES > 0
+    bool staleLeaf = page.header.type == INDEX_PAGE_LEAF && page.header.count > 0;
+    for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+        resetAggregate(ref.aggregates[f], staleLeaf ? DB_AGGREGATE_STALE : 0);
+#endif
+    if (page.header.count == 0)
+        return;
+    if (page.header.type == INDEX_PAGE_LEAF) {
+        LeafCodec codec;
+        leafCodec(page, codec);
+        ref.key = leafKey(page, codec, 0);
+        ref.count = page.header.count;
+        IndexEntry entry;
+        for (uint16_t i = 0; i < page.header.count; i++) {
+            leafEntry(page, codec, i, entry);
+            if (entry.internal_status & INTERNAL_STATUS_DELETED)
+                ref.deleted++;
+            ref.statusMask |= DB_STATUS_BIT(entry.status);
+        }
+        return;
+    }
+    ref.key = page.children[0].key;
+    for (uint16_t i = 0; i < page.header.count; i++) {
+        ref.count += page.children[i].count;
+        ref.deleted += page.children[i].deleted;
+        ref.statusMask |= page.children[i].statusMask;
+#if DB_AGGREGATES > 0
+        for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+            mergeAggregate(ref.aggregates[f], page.children[i].aggregates[f]);
+#endif
+    }
+}
+
 //
 // validateIndex()
 //   A simple function to check for index corruption.
-//   In this example, we load the first page and verify that the keys are in sorted order.
-//   (More extensive checkssuch as verifying a magic number or checksumcould be added.)
+//   The header must describe a plausible tree, the root must account for every
+//   entry, and the keys of the first leaf must be in sorted order.
+//   Torn writes are caught by the page and header checksums instead.
 //
 bool DBEngine::validateIndex(void) {
-    // If the index is empty, there's nothing to validate.
-    if (_indexCount == 0)
-        return true;
+    // An empty index has no pages to check.
+    if (_treeHeight == 0)
+        return (_indexCount == 0 && _rootPage == DB_NO_PAGE);
+
+    if (_treeHeight > DB_MAX_TREE_HEIGHT || _rootPage >= _pageCount ||
+        _firstLeaf >= _pageCount || _lastLeaf >= _pageCount) {
+        DEBUG_PRINT("validateIndex: Header describes an impossible tree (height %u, root %u, %u pages).\n",
+            _treeHeight, _rootPage, _pageCount);
+        return false;
+    }
+
+    // The root must match the tree height and hold every entry below it.
+    IndexPageSlot* root = getIndexPage(_rootPage);
+    if (!root) {
+        DEBUG_PRINT("validateIndex: Failed to load root page %u.\n", _rootPage);
+        return false;
+    }
+    uint8_t expectedType = (_treeHeight == 1) ? INDEX_PAGE_LEAF : INDEX_PAGE_INTERIOR;
+    uint16_t limit = (_treeHeight == 1) ? leafCapacity(root->page.header.format) : INDEX_FANOUT;
+    if (root->page.header.type != expectedType || root->page.header.count == 0 ||
+        root->page.header.count > limit || (expectedType == INDEX_PAGE_LEAF && !leafFormatValid(root->page.header.format))) {
+        DEBUG_PRINT("validateIndex: Root page %u has type %u and %u entries.\n",
+            _rootPage, root->page.header.type, root->page.header.count);
+        return false;
+    }
+    if (expectedType == INDEX_PAGE_INTERIOR) {
+        for (uint16_t i = 0; i + 1 < root->page.header.count; i++) {
+            if (root->page.children[i].key >= root->page.children[i + 1].key) {
+                DEBUG_PRINT("validateIndex: Root children out of order at slot %u.\n", i);
+                return false;
+            }
+        }
+    }
+    IndexChildRef summary;
+    summarizeIndexPage(root->page, summary);
+    if (summary.count != _indexCount) {
+        DEBUG_PRINT("validateIndex: Root holds %u entries, header says %u.\n", summary.count, _indexCount);
+        return false;
+    }
 
-    // Load the first page.
-    if (!loadIndexPage(0)) {
-        DEBUG_PRINT("validateIndex: Failed to load page 0.\n");
+    // Check the order of keys in the first leaf.
+    IndexPageSlot* page = getIndexPage(_firstLeaf);
+    if (!page) {
+        DEBUG_PRINT("validateIndex: Failed to load leaf %u.\n", _firstLeaf);
+        return false;
+    }
+    if (page->page.header.type != INDEX_PAGE_LEAF || page->page.header.prev != DB_NO_PAGE ||
+        !leafFormatValid(page->page.header.format) ||
+        page->page.header.count > leafCapacity(page->page.header.format)) {
+        DEBUG_PRINT("validateIndex: Page %u is not the first leaf.\n", _firstLeaf);
         return false;
     }
-    // Determine how many entries are in the first page.
-    uint32_t entries = MIN(MAX_INDEX_ENTRIES, _indexCount);
-    for (uint32_t i = 0; i < entries - 1; i++) {
-        if (_indexPage[i].key > _indexPage[i + 1].key) {
-            DEBUG_PRINT("validateIndex: Corruption detected in page 0 at entry %u (key %u > %u).\n",
-                i, _indexPage[i].key, _indexPage[i + 1].key);
+    LeafCodec codec;
+    leafCodec(page->page, codec);
+    for (uint16_t i = 0; i + 1 < page->page.header.count; i++) {
+        if (leafKey(page->page, codec, i) > leafKey(page->page, codec, i + 1)) {
+            DEBUG_PRINT("validateIndex: Corruption detected in leaf %u at entry %u (key %u > %u).\n",
+                _firstLeaf, i, leafKey(page->page, codec, i), leafKey(page->page, codec, i + 1));
             return false;
         }
     }
@@ -35,189 +494,765 @@ bool DBEngine::validateIndex(void) {
 
 //
 // saveIndexHeader()
-//   Writes the header (the total _indexCount) at the start of the index file.
+//   Writes the header (the total _indexCount and the tree shape) at the start of the index file.
+//   It commits the pages written so far, unless dirty pages are still cached.
 //
 bool DBEngine::saveIndexHeader(void) {
     SCOPE_TIMER("DBEngine::saveIndexHeader");
+    bool pending = false;
+    for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++)
+        pending = pending || (_pageCache[i].loaded && _pageCache[i].dirty);
+#if DB_RESIDENT_INDEX
+    for (size_t i = 0; i < _residentPages.size() && !pending; i++)
+        pending = _residentPages[i] && _residentPages[i]->loaded && _residentPages[i]->dirty;
+#endif
+    _pagesAhead = pending;
+
+    DEBUG_PRINT("saveIndexHeader: Opening file %s for update...\n", _indexFileName);
+    if (!openIndexFile("rb+")) {
+        DEBUG_PRINT("saveIndexHeader: File not openable in rb+ mode, trying wb+ mode.\n");
+        if (!openIndexFile("wb+"))
+            return false;
+    }
+    bool ok = writeIndexHeader();
+    closeIndexFile();
+    DEBUG_PRINT("saveIndexHeader: Done. _indexCount = %u\n", _indexCount);
+    return ok;
+}
+
+
+//
+// writeIndexHeader()
+//   Header with sequence number n goes to slot n % 2, so the slot holding the
+//   previous header is never the one being overwritten.
+//
+bool DBEngine::writeIndexHeader(void) {
     DBIndexHeader header;
     header.magic = DB_MAGIC_NUMBER;     // Example magic number.
     header.version = DB_IDX_VERSION;                 // Current version.
     header.indexCount = _indexCount;    // Include the current index count.
+    header.pageEntries = MAX_INDEX_ENTRIES;
+    header.treeHeight = _treeHeight;
+    header.flags = (_logGeneration ? DB_IDX_FLAG_LOG_GEN : 0) | (_compacting ? DB_IDX_FLAG_COMPACTING : 0) |
+        (_bulkLoading ? DB_IDX_FLAG_BULK : 0) | (_pagesAhead ? DB_IDX_FLAG_AHEAD : 0) |
+        (DB_AGGREGATES << DB_IDX_AGGREGATES_SHIFT);
+    header.rootPage = _rootPage;
+    header.firstLeaf = _firstLeaf;
+    header.lastLeaf = _lastLeaf;
+    header.pageCount = _pageCount;
+    header.freePage = _freePage;
+    header.sequence = ++_headerSequence;
+    header.crc = dbCrc32(0, &header, offsetof(DBIndexHeader, crc));
 
     size_t bytesWritten = 0;
-    DEBUG_PRINT("saveIndexHeader: Opening file %s for update...\n", _indexFileName);
-    if (!_indexHandler.open(_indexFileName, "rb+")) {
-        DEBUG_PRINT("saveIndexHeader: File not openable in rb+ mode, trying wb+ mode.\n");
-        if (!_indexHandler.open(_indexFileName, "wb+"))
-            return false;
-    }
-    if (!_indexHandler.seek(0)) {
-        DEBUG_PRINT("saveIndexHeader: Seek to 0 failed.\n");
-        _indexHandler.close();
+    if (!_indexHandler.seek((header.sequence & 1) * sizeof(header))) {
+        DEBUG_PRINT("writeIndexHeader: Seek to header slot failed.\n");
         return false;
     }
-    DEBUG_PRINT("saveIndexHeader: Writing DBIndexHeader (size = %zu bytes)...\n", sizeof(header));
+    DEBUG_PRINT("writeIndexHeader: Writing DBIndexHeader %u (size = %zu bytes)...\n", header.sequence, sizeof(header));
     if (!_indexHandler.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header), bytesWritten) ||
         bytesWritten != sizeof(header)) {
-        DEBUG_PRINT("saveIndexHeader: Write failed (wrote %zu bytes, expected %zu).\n", bytesWritten, sizeof(header));
-        _indexHandler.close();
+        DEBUG_PRINT("writeIndexHeader: Write failed (wrote %zu bytes, expected %zu).\n", bytesWritten, sizeof(header));
         return false;
     }
-    _indexHandler.close();
-    DEBUG_PRINT("saveIndexHeader: Done. _indexCount = %u\n", _indexCount);
+    _stats.indexHeaderWrites++;
     return true;
 }
 
 
 //
 // loadIndexHeader()
-//   Reads the header from the index file and initializes _indexCount.
-//   (If the file does not exist, _indexCount is set to 0.)
+//   Reads the header from the index file and initializes _indexCount and the tree shape.
+//   (If the file does not exist, the index starts out empty.)
+//   Version 1 (flat) indexes are converted on the spot; for versions 2 and 3
+//   it fails, so that loadIndex() rebuilds the index from the log.
 //
 bool DBEngine::loadIndexHeader(void) {
     SCOPE_TIMER("DBEngine::loadIndexHeader");
+
+    // Start from an empty tree; a header on disk replaces it below.
+    _indexCount = 0;
+    _rootPage = DB_NO_PAGE;
+    _firstLeaf = DB_NO_PAGE;
+    _lastLeaf = DB_NO_PAGE;
+    _freePage = DB_NO_PAGE;
+    _pageCount = 0;
+    _treeHeight = 0;
+    _maxKeyValid = false;
+    _logGeneration = 0;
+    _compacting = false;
+    _bulkLoading = false;
+    _bulkStaged = 0;
+
+    _pagesAhead = false;
+    _headerSequence = 0;
+
     size_t bytesRead = 0;
     DEBUG_PRINT("loadIndexHeader: Opening file %s in rb mode...\n", _indexFileName);
-    if (!_indexHandler.open(_indexFileName, "rb")) {
+    if (!openIndexFile("rb")) {
         DEBUG_PRINT("loadIndexHeader: File not found. Setting _indexCount = 0.\n");
-        _indexCount = 0;
         return true;
     }
-    DBIndexHeader header;
-    if (!_indexHandler.read(reinterpret_cast<uint8_t*>(&header), sizeof(header), bytesRead) ||
-        bytesRead != sizeof(header)) {
-        DEBUG_PRINT("loadIndexHeader: Read failed (read %zu bytes, expected %zu).\n", bytesRead, sizeof(header));
-        _indexHandler.close();
+    if (!_indexHandler.seek(0)) {
+        closeIndexFile();
         return false;
     }
-    _indexHandler.close();
+    // A short read is expected for small version 1 files, so only the byte count matters.
+    DBIndexHeader slots[2];
+    memset(slots, 0, sizeof(slots));
+    _indexHandler.read(reinterpret_cast<uint8_t*>(slots), sizeof(slots), bytesRead);
+    closeIndexFile();
+
+    // An empty file (e.g. just created by a session-mode open) is a new index.
+    if (bytesRead == 0) {
+        DEBUG_PRINT("loadIndexHeader: File is empty. Setting _indexCount = 0.\n");
+        return true;
+    }
 
-    // Validate the header.
-    if (header.magic != DB_MAGIC_NUMBER) {
-        DEBUG_PRINT("loadIndexHeader: Invalid magic number.\n");
+    // Of the two slots, the intact one written last describes the index.
+    const DBIndexHeader* current = nullptr;
+    for (uint32_t i = 0; i < 2; i++) {
+        const DBIndexHeader& slot = slots[i];
+        if (bytesRead < (i + 1) * sizeof(slot) || slot.magic != DB_MAGIC_NUMBER ||
+            (slot.version != DB_IDX_VERSION && slot.version != DB_IDX_VERSION_WIDE) || slot.crc != dbCrc32(0, &slot, offsetof(DBIndexHeader, crc)))
+            continue;
+        if (!current || static_cast<int32_t>(slot.sequence - current->sequence) > 0)
+            current = &slot;
+    }
+    if (!current) {
+        // Older formats have one header at the start of the file.
+        const DBIndexHeader& header = slots[0];
+        if (bytesRead < offsetof(DBIndexHeader, pageEntries) || header.magic != DB_MAGIC_NUMBER) {
+            DEBUG_PRINT("loadIndexHeader: No intact header (read %zu bytes).\n", bytesRead);
+            return false;
+        }
+        if (header.version == DB_IDX_VERSION_FLAT) {
+            DEBUG_PRINT("loadIndexHeader: Upgrading flat index with %u entries.\n", header.indexCount);
+            return upgradeIndexV1(header.indexCount);
+        }
+        // Version 2 and 3 pages have no crc; the log has everything to build a new tree.
+        DEBUG_PRINT("loadIndexHeader: Version %u index is rebuilt from the log.\n", header.version);
+        return false;
+    }
+    const DBIndexHeader& header = *current;
+    if (header.pageEntries != MAX_INDEX_ENTRIES) {
+        DEBUG_PRINT("loadIndexHeader: Index written with %u entries per page, built for %u.\n",
+            header.pageEntries, MAX_INDEX_ENTRIES);
         return false;
     }
-    if (header.version != 1) {
-        DEBUG_PRINT("loadIndexHeader: Unsupported version %u.\n", header.version);
+    if ((header.flags >> DB_IDX_AGGREGATES_SHIFT) != DB_AGGREGATES) {
+        DEBUG_PRINT("loadIndexHeader: Index written with %u aggregates, built for %u.\n",
+            static_cast<unsigned>(header.flags >> DB_IDX_AGGREGATES_SHIFT), static_cast<unsigned>(DB_AGGREGATES));
         return false;
     }
     _indexCount = header.indexCount;
+    _treeHeight = header.treeHeight;
+    _rootPage = header.rootPage;
+    _firstLeaf = header.firstLeaf;
+    _lastLeaf = header.lastLeaf;
+    _pageCount = header.pageCount;
+    _freePage = header.freePage;
+    _logGeneration = (header.flags & DB_IDX_FLAG_LOG_GEN) ? 1 : 0;
+    _compacting = (header.flags & DB_IDX_FLAG_COMPACTING) != 0;
+    _bulkLoading = (header.flags & DB_IDX_FLAG_BULK) != 0;
+    _pagesAhead = (header.flags & DB_IDX_FLAG_AHEAD) != 0;
+    _headerSequence = header.sequence;
     DEBUG_PRINT("loadIndexHeader: _indexCount = %u\n", _indexCount);
     return true;
 }
 
 
 //
-// flushIndexPage()
-//   Writes the current in-memory page (_indexPage) to disk if its dirty.
-//   (Only flush when the page is full or when required by a page switch.)
+// writeIndexPage()
+//   Writes the first 'bytes' bytes of a page image at the page's file offset.
+//   The first page written after a commit is announced in the header first,
+//   and that header is flushed before the page can overwrite anything.
 //
-bool DBEngine::flushIndexPage(void) {
-    SCOPE_TIMER("DBEngine::flushIndexPage");
-
-    if (!_pageDirty) {
-        DEBUG_PRINT("flushIndexPage: No flush needed; _pageDirty is false.\n");
-        return true;
+bool DBEngine::writeIndexPage(uint32_t pageNumber, IndexPage& page, size_t bytes) {
+    if (!openIndexFile("rb+")) {
+        DEBUG_PRINT("writeIndexPage: Failed to open file %s in rb+ mode.\n", _indexFileName);
+        return false;
     }
-
-    DEBUG_PRINT("flushIndexPage: Flushing page %u. _indexCount = %u\n", _currentPageNumber, _indexCount);
-    if (!_indexHandler.open(_indexFileName, "rb+")) {
-        DEBUG_PRINT("flushIndexPage: Failed to open file %s in rb+ mode.\n", _indexFileName);
+    if (!_pagesAhead) {
+        _pagesAhead = true;
+        if (!writeIndexHeader() || !_indexHandler.flush()) {
+            closeIndexFile();
+            return false;
+        }
+    }
+    page.header.crc = indexPageCrc(page);
+    uint32_t pageOffset = indexPageOffset(pageNumber);
+    DEBUG_PRINT("writeIndexPage: Writing page %u at offset %u\n", pageNumber, pageOffset);
+    if (!_indexHandler.seek(pageOffset)) {
+        DEBUG_PRINT("writeIndexPage: Seek failed.\n");
+        closeIndexFile();
         return false;
     }
+    size_t bytesWritten = 0;
+    if (!_indexHandler.write(reinterpret_cast<const uint8_t*>(&page), bytes, bytesWritten) ||
+        bytesWritten != bytes) {
+        DEBUG_PRINT("writeIndexPage: Write failed (wrote %zu bytes, expected %zu).\n", bytesWritten, bytes);
+        closeIndexFile();
+        return false;
+    }
+    closeIndexFile();
+    _stats.pageFlushes++;
+    return true;
+}
+
 
-    size_t pageOffset = sizeof(DBIndexHeader) + _currentPageNumber * sizeof(IndexEntry) * MAX_INDEX_ENTRIES;
-    DEBUG_PRINT("flushIndexPage: Seeking to offset %zu\n", pageOffset);
-    if (!_indexHandler.seek(static_cast<uint32_t>(pageOffset))) {
-        DEBUG_PRINT("flushIndexPage: Seek failed.\n");
-        _indexHandler.close();
+//
+// readIndexPage()
+//   Reads the first 'bytes' bytes of a page. Anything beyond the end of the
+//   file (a page that was allocated but never written) reads as zeros.
+//
+bool DBEngine::readIndexPage(uint32_t pageNumber, IndexPage& page, size_t bytes) const {
+    if (!openIndexFile("rb")) {
+        DEBUG_PRINT("readIndexPage: Failed to open file %s in rb mode.\n", _indexFileName);
+        return false;
+    }
+    uint32_t pageOffset = indexPageOffset(pageNumber);
+    if (!_indexHandler.seek(pageOffset)) {
+        DEBUG_PRINT("readIndexPage: Seek failed.\n");
+        closeIndexFile();
         return false;
     }
+    size_t bytesRead = 0;
+    if (!_indexHandler.read(reinterpret_cast<uint8_t*>(&page), bytes, bytesRead)) {
+        DEBUG_PRINT("readIndexPage: Partial read of page %u (%zu of %zu bytes); zero-filling.\n",
+            pageNumber, bytesRead, bytes);
+    }
+    closeIndexFile();
+    _stats.pageLoads++;
+    return checkIndexPage(page, bytes, bytesRead);
+}
 
-    // Determine how many entries are in this page.
-    uint32_t pageFirstIndex = _currentPageNumber * MAX_INDEX_ENTRIES;
-    uint32_t entriesInPage = 0;
-    if (_indexCount > pageFirstIndex)
-        entriesInPage = MIN(MAX_INDEX_ENTRIES, _indexCount - pageFirstIndex);
-    size_t bytesToWrite = entriesInPage * sizeof(IndexEntry);
 
-    DEBUG_PRINT("flushIndexPage: Writing %zu bytes (entriesInPage = %u)...\n", bytesToWrite, entriesInPage);
-    size_t bytesWritten = 0;
-    if (!_indexHandler.write(reinterpret_cast<const uint8_t*>(_indexPage), bytesToWrite, bytesWritten) ||
-        bytesWritten != bytesToWrite) {
-        DEBUG_PRINT("flushIndexPage: Write failed (wrote %zu bytes, expected %zu).\n", bytesWritten, bytesToWrite);
-        _indexHandler.close();
+//
+// readIndexEntries()
+//   Reads a slice of a leaf-format page without loading the whole page.
+//
+bool DBEngine::readIndexEntries(uint32_t pageNumber, uint16_t first, IndexEntry* entries, uint16_t count) {
+    if (!openIndexFile("rb"))
         return false;
+    uint32_t offset = indexPageOffset(pageNumber) +
+        static_cast<uint32_t>(sizeof(IndexPageHeader) + first * sizeof(IndexEntry));
+    size_t bytes = count * sizeof(IndexEntry);
+    size_t bytesRead = 0;
+    bool ok = _indexHandler.seek(offset) &&
+        _indexHandler.read(reinterpret_cast<uint8_t*>(entries), bytes, bytesRead) && bytesRead == bytes;
+    closeIndexFile();
+    if (!ok) {
+        DEBUG_PRINT("readIndexEntries: Failed to read %u entries of page %u.\n", count, pageNumber);
+    }
+    return ok;
+}
+
+
+//
+// flushIndexPage()
+//   Writes one cached page to disk if it's dirty.
+//   (Pages are flushed when their slot is evicted, or on sync.)
+//
+bool DBEngine::flushIndexPage(IndexPageSlot& slot, bool updateHeader) {
+    SCOPE_TIMER("DBEngine::flushIndexPage");
+
+    if (!slot.loaded || !slot.dirty) {
+        DEBUG_PRINT("flushIndexPage: No flush needed; page is clean.\n");
+        return true;
     }
-    _indexHandler.close();
+
+    DEBUG_PRINT("flushIndexPage: Flushing page %u. _indexCount = %u\n", slot.pageNumber, _indexCount);
+    if (!writeIndexPage(slot.pageNumber, slot.page))
+        return false;
+    slot.dirty = false;
 
     // Update the header with the new _indexCount.
-    if (!saveIndexHeader()) {
+    if (updateHeader && !saveIndexHeader()) {
         DEBUG_PRINT("flushIndexPage: Failed to update the index header.\n");
         return false;
     }
 
-    _pageDirty = false;
     DEBUG_PRINT("flushIndexPage: Flush successful.\n");
     return true;
 }
 
 
+//
+// flushIndexPages()
+//   Writes all dirty cached pages, then the header once.
+//
+bool DBEngine::flushIndexPages(void) {
+    SCOPE_TIMER("DBEngine::flushIndexPages");
+    bool anyFlushed = false;
+    for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++) {
+        if (_pageCache[i].loaded && _pageCache[i].dirty) {
+            if (!flushIndexPage(_pageCache[i], false))
+                return false;
+            anyFlushed = true;
+        }
+    }
+#if DB_RESIDENT_INDEX
+    if (!flushResidentPages(anyFlushed))
+        return false;
+#endif
+    // Pages written on eviction are only committed by the next header.
+    if ((anyFlushed || _pagesAhead) && !saveIndexHeader()) {
+        DEBUG_PRINT("flushIndexPages: Failed to update the index header.\n");
+        return false;
+    }
+    return true;
+}
+
+
 //
 // loadIndexPage()
-//   Loads the specified page (0-based) into the in-memory page buffer (_indexPage).
-//   If the file does not contain enough data for a full page, the remainder is zero-filled.
+//   Loads the specified page into the given cache slot.
+//   The caller is responsible for flushing the slot's previous contents.
 //
-bool DBEngine::loadIndexPage(uint32_t pageNumber) {
+bool DBEngine::loadIndexPage(uint32_t pageNumber, IndexPageSlot& slot) const {
     SCOPE_TIMER("DBEngine::loadIndexPage");
     DEBUG_PRINT("loadIndexPage: Requesting page %u. Current _indexCount = %u\n", pageNumber, _indexCount);
 
-    if (!flushIndexPage()) {
-        DEBUG_PRINT("loadIndexPage: Flush failed.\n");
+    // The slot is invalid until the read below succeeds.
+    slot.loaded = false;
+    slot.dirty = false;
+
+    if (!readIndexPage(pageNumber, slot.page))
         return false;
+
+    slot.pageNumber = pageNumber;
+    slot.loaded = true;
+    DEBUG_PRINT("loadIndexPage: Page %u loaded successfully.\n", pageNumber);
+    return true;
+}
+
+
+//
+// findCachedPage()
+//   Looks up a page in the cache without touching the disk or the LRU order.
+//
+DBEngine::IndexPageSlot* DBEngine::findCachedPage(uint32_t pageNumber) const {
+#if DB_RESIDENT_INDEX
+    if (_resident) {
+        IndexPageSlot* slot = (pageNumber < _residentPages.size()) ? _residentPages[pageNumber].get() : nullptr;
+        return (slot && slot->loaded) ? slot : nullptr;
+    }
+#endif
+    for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++) {
+        if (_pageCache[i].loaded && _pageCache[i].pageNumber == pageNumber)
+            return &_pageCache[i];
+    }
+    return nullptr;
+}
+
+
+//
+// evictIndexPage()
+//   Picks a slot for a new page: an empty slot if there is one, otherwise the
+//   least recently used leaf, otherwise the least recently used interior page.
+//   The slot handed out last is never chosen, so a caller may work on two pages
+//   at once as long as it claims them back to back. A resident index has a
+//   slot for every page, so nothing is evicted.
+//
+DBEngine::IndexPageSlot* DBEngine::evictIndexPage(uint32_t pageNumber) {
+#if DB_RESIDENT_INDEX
+    if (_resident)
+        return residentSlot(pageNumber);
+#else
+    (void)pageNumber;
+#endif
+    IndexPageSlot* victim = nullptr;
+    for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++) {
+        if (!_pageCache[i].loaded)
+            return &_pageCache[i];
+    }
+    for (int pass = 0; pass < 2 && !victim; pass++) {
+        for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++) {
+            IndexPageSlot* slot = &_pageCache[i];
+            if (slot->lastUsed == _cacheTick)
+                continue;
+            // The first pass only considers leaves; interior pages are shared by every lookup.
+            if (pass == 0 && slot->page.header.type == INDEX_PAGE_INTERIOR)
+                continue;
+            if (!victim || slot->lastUsed < victim->lastUsed)
+                victim = slot;
+        }
     }
+    if (!victim)
+        return nullptr;
+
+    if (victim->dirty) {
+        DEBUG_PRINT("evictIndexPage: Evicting dirty page %u.\n", victim->pageNumber);
+        if (!flushIndexPage(*victim)) {
+            DEBUG_PRINT("evictIndexPage: Flush failed.\n");
+            return nullptr;
+        }
+    }
+    victim->loaded = false;
+    return victim;
+}
 
-    if (!_indexHandler.open(_indexFileName, "rb")) {
-        DEBUG_PRINT("loadIndexPage: Failed to open file %s in rb mode.\n", _indexFileName);
-        return false;
+
+//
+// getIndexPage()
+//   Returns the cache slot for a page, loading it into an evicted slot on a miss.
+//
+DBEngine::IndexPageSlot* DBEngine::getIndexPage(uint32_t pageNumber) {
+    IndexPageSlot* slot = findCachedPage(pageNumber);
+    if (slot) {
+        _stats.cacheHits++;
+        slot->lastUsed = ++_cacheTick;
+        return slot;
     }
+    _stats.cacheMisses++;
+
+    IndexPageSlot* victim = evictIndexPage(pageNumber);
+    if (!victim)
+        return nullptr;
+    if (!loadIndexPage(pageNumber, *victim))
+        return nullptr;
+    victim->lastUsed = ++_cacheTick;
+    return victim;
+}
+
 
-    size_t pageOffset = sizeof(DBIndexHeader) + pageNumber * sizeof(IndexEntry) * MAX_INDEX_ENTRIES;
-    DEBUG_PRINT("loadIndexPage: Seeking to offset %zu\n", pageOffset);
-    if (!_indexHandler.seek(static_cast<uint32_t>(pageOffset))) {
-        DEBUG_PRINT("loadIndexPage: Seek failed.\n");
-        _indexHandler.close();
+//
+// viewIndexPage()
+//   The read-only counterpart of getIndexPage() used by lookups. Readers of a
+//   DB_THREAD_SAFE build share the cache, so they work on copies.
+//
+const IndexPage* DBEngine::viewIndexPage(uint32_t pageNumber, IndexPage& scratch) const {
+    // Evicting may write back a dirty page, which leaves the database as it is.
+    DBEngine* self = const_cast<DBEngine*>(this);
+#if DB_THREAD_SAFE
+    std::unique_lock<std::mutex> cacheLock(_cacheLock);
+    IndexPageSlot* slot = findCachedPage(pageNumber);
+    if (slot) {
+        _stats.cacheHits++;
+        slot->lastUsed = ++_cacheTick;
+#if DB_RESIDENT_INDEX
+        // A resident slot keeps its page until the next change, which waits for _lock.
+        if (_resident)
+            return &slot->page;
+#endif
+        scratch = slot->page;
+        return &scratch;
+    }
+    _stats.cacheMisses++;
+    // A positional read needs neither the handle's file position nor the lock.
+    // Only cached pages can be dirty, so the file holds this one as it is.
+    bool loaded = false;
+    if (_mode == DB_MODE_SESSION && _indexOpen) {
+        cacheLock.unlock();
+        size_t bytesRead = 0;
+        loaded = _indexHandler.readAt(indexPageOffset(pageNumber), reinterpret_cast<uint8_t*>(&scratch),
+            sizeof(scratch), bytesRead);
+        if (loaded && !checkIndexPage(scratch, sizeof(scratch), bytesRead))
+            return nullptr;
+        cacheLock.lock();
+        if (loaded)
+            _stats.pageLoads++;
+    }
+    if (!loaded && !readIndexPage(pageNumber, scratch))
+        return nullptr;
+    // Keep a copy for the next reader, unless one was added meanwhile.
+    slot = findCachedPage(pageNumber) ? nullptr : self->evictIndexPage(pageNumber);
+    if (slot) {
+        slot->page = scratch;
+        slot->pageNumber = pageNumber;
+        slot->loaded = true;
+        slot->dirty = false;
+        slot->lastUsed = ++_cacheTick;
+    }
+    return &scratch;
+#else
+    (void)scratch;
+    IndexPageSlot* slot = self->getIndexPage(pageNumber);
+    return slot ? &slot->page : nullptr;
+#endif
+}
+
+
+//
+// newIndexPage()
+//   Claims a slot for a page whose old contents do not matter (a freshly
+//   allocated page, or a new root), so nothing is read from disk.
+//
+DBEngine::IndexPageSlot* DBEngine::newIndexPage(uint32_t pageNumber, uint8_t type) {
+    IndexPageSlot* slot = findCachedPage(pageNumber);
+    if (!slot) {
+        slot = evictIndexPage(pageNumber);
+        if (!slot)
+            return nullptr;
+    }
+    memset(&slot->page, 0, sizeof(slot->page));
+    slot->page.header.type = type;
+    slot->page.header.prev = DB_NO_PAGE;
+    slot->page.header.next = DB_NO_PAGE;
+    slot->pageNumber = pageNumber;
+    slot->loaded = true;
+    slot->dirty = true;
+    slot->lastUsed = ++_cacheTick;
+    return slot;
+}
+
+
+//
+// invalidateIndexCache()
+//   Forgets all cached pages (used when the index is (re)opened or closed).
+//
+void DBEngine::invalidateIndexCache(void) {
+    for (uint32_t i = 0; i < INDEX_CACHE_PAGES; i++) {
+        _pageCache[i].loaded = false;
+        _pageCache[i].dirty = false;
+        _pageCache[i].lastUsed = 0;
+    }
+#if DB_RESIDENT_INDEX
+    _residentPages.clear();
+    _residentComplete = false;
+#endif
+    _cacheTick = 0;
+    _hintValid = false;
+}
+
+
+void DBEngine::setNarrowLeaves(bool enabled) {
+    DB_WRITE_LOCK(_lock);
+    _narrowLeaves = enabled;
+}
+
+
+void DBEngine::getCacheStats(uint32_t& hits, uint32_t& misses) const {
+    DB_CACHE_LOCK(_cacheLock);
+    hits = _stats.cacheHits;
+    misses = _stats.cacheMisses;
+}
+
+
+void DBEngine::resetCacheStats(void) {
+    DB_CACHE_LOCK(_cacheLock);
+    _stats.cacheHits = 0;
+    _stats.cacheMisses = 0;
+}
+
+
+// Readers count under _cacheLock and writers hold the lock exclusively, so
+// both locks together give a consistent snapshot.
+void DBEngine::getStats(DBStats& stats) const {
+    DB_READ_LOCK(_lock);
+    DB_CACHE_LOCK(_cacheLock);
+    stats = _stats;
+}
+
+
+void DBEngine::resetStats(void) {
+    DB_READ_LOCK(_lock);
+    DB_CACHE_LOCK(_cacheLock);
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+
+//
+// allocateIndexPage()
+//   Reuses the head of the free list if there is one; otherwise the file grows by a page.
+//
+bool DBEngine::allocateIndexPage(uint32_t& pageNumber) {
+    if (_freePage != DB_NO_PAGE) {
+        IndexPageSlot* slot = getIndexPage(_freePage);
+        if (!slot)
+            return false;
+        pageNumber = _freePage;
+        _freePage = slot->page.header.next;
+        DEBUG_PRINT("allocateIndexPage: Reusing free page %u.\n", pageNumber);
+        return true;
+    }
+    pageNumber = _pageCount++;
+    DEBUG_PRINT("allocateIndexPage: Appending page %u.\n", pageNumber);
+    return true;
+}
+
+
+//
+// descendToKey()
+//   Walks from the root to the leaf responsible for key, recording the route so
+//   that inserts can update the ancestors afterwards.
+//
+bool DBEngine::descendToKey(uint32_t key, IndexPath& path, uint32_t& firstPosition) {
+    SCOPE_TIMER("DBEngine::descendToKey");
+    if (_treeHeight == 0)
         return false;
+
+    path.depth = 0;
+    firstPosition = 0;
+    uint32_t page = _rootPage;
+    for (uint8_t level = 0; level < _treeHeight; level++) {
+        IndexPageSlot* slot = getIndexPage(page);
+        if (!slot)
+            return false;
+        path.page[level] = page;
+        path.depth = level + 1;
+
+        uint8_t expectedType = (level + 1 == _treeHeight) ? INDEX_PAGE_LEAF : INDEX_PAGE_INTERIOR;
+        if (slot->page.header.type != expectedType) {
+            DEBUG_PRINT("descendToKey: Page %u at level %u has type %u.\n", page, level, slot->page.header.type);
+            return false;
+        }
+        if (expectedType == INDEX_PAGE_LEAF)
+            break;
+
+        uint16_t child = childForKey(slot->page, key);
+        for (uint16_t i = 0; i < child; i++)
+            firstPosition += slot->page.children[i].count;
+        path.child[level] = child;
+        page = slot->page.children[child].page;
     }
+    return true;
+}
 
-    uint32_t expectedEntries = 0;
-    if (_indexCount > pageNumber * MAX_INDEX_ENTRIES)
-        expectedEntries = MIN(MAX_INDEX_ENTRIES, _indexCount - pageNumber * MAX_INDEX_ENTRIES);
-    size_t bytesExpected = expectedEntries * sizeof(IndexEntry);
-    DEBUG_PRINT("loadIndexPage: Expected entries: %u, bytesExpected: %zu\n", expectedEntries, bytesExpected);
 
-    size_t bytesRead = 0;
-    bool readSuccess = _indexHandler.read(reinterpret_cast<uint8_t*>(_indexPage), bytesExpected, bytesRead);
-    _indexHandler.close();
+//
+// descendToPosition()
+//   Walks down by subtree counts to the leaf that holds a global position.
+//
+bool DBEngine::descendToPosition(uint32_t globalIndex, IndexPath& path, uint32_t& offsetInLeaf) {
+    uint32_t page = _rootPage;
+    uint32_t remaining = globalIndex;
+    path.depth = 0;
+    for (uint8_t level = 0; level + 1 < _treeHeight; level++) {
+        IndexPageSlot* slot = getIndexPage(page);
+        if (!slot)
+            return false;
+        const IndexPage& node = slot->page;
+        uint16_t child = 0;
+        while (child + 1 < node.header.count && remaining >= node.children[child].count) {
+            remaining -= node.children[child].count;
+            child++;
+        }
+        path.page[level] = page;
+        path.child[level] = child;
+        path.depth = level + 1;
+        page = node.children[child].page;
+    }
+    path.page[path.depth++] = page;
+    offsetInLeaf = remaining;
+    return true;
+}
 
-    if (!readSuccess && bytesRead > 0) {
-        DEBUG_PRINT("loadIndexPage: Partial read (read returned false) with %zu bytes read (expected %zu).\n", bytesRead, bytesExpected);
+
+//
+// findPosition()
+//   Resolves a global index position to a leaf slot. The leaf of the previous
+//   lookup is remembered, so walking positions in order only follows leaf links.
+//
+DBEngine::IndexPageSlot* DBEngine::findPosition(uint32_t globalIndex, uint16_t& slotIndex) {
+    if (globalIndex >= _indexCount)
+        return nullptr;
+
+    IndexPageSlot* hint = _hintValid ? findCachedPage(_hintPage) : nullptr;
+    if (hint) {
+        uint32_t count = hint->page.header.count;
+        uint32_t next = hint->page.header.next;
+        uint32_t prev = hint->page.header.prev;
+        if (globalIndex >= _hintFirst && globalIndex < _hintFirst + count) {
+            slotIndex = static_cast<uint16_t>(globalIndex - _hintFirst);
+            return getIndexPage(_hintPage);
+        }
+        // Step into the neighbouring leaf.
+        _hintValid = false;
+        if (globalIndex == _hintFirst + count && next != DB_NO_PAGE) {
+            IndexPageSlot* slot = getIndexPage(next);
+            if (!slot || slot->page.header.count == 0)
+                return nullptr;
+            _hintPage = next;
+            _hintFirst += count;
+            _hintValid = true;
+            slotIndex = 0;
+            return slot;
+        }
+        if (globalIndex + 1 == _hintFirst && prev != DB_NO_PAGE) {
+            IndexPageSlot* slot = getIndexPage(prev);
+            if (!slot || slot->page.header.count == 0)
+                return nullptr;
+            _hintPage = prev;
+            _hintFirst -= slot->page.header.count;
+            _hintValid = true;
+            slotIndex = slot->page.header.count - 1;
+            return slot;
+        }
     }
-    else if (!readSuccess && bytesRead == 0) {
-        DEBUG_PRINT("loadIndexPage: Read returned false with 0 bytes read; assuming no data on disk yet.\n");
-        bytesRead = 0;
+
+    IndexPath path;
+    uint32_t remaining;
+    if (!descendToPosition(globalIndex, path, remaining))
+        return nullptr;
+    uint32_t page = path.page[path.depth - 1];
+    IndexPageSlot* leaf = getIndexPage(page);
+    if (!leaf || remaining >= leaf->page.header.count) {
+        DEBUG_PRINT("findPosition: Position %u not found in leaf %u.\n", globalIndex, page);
+        return nullptr;
     }
+    _hintPage = page;
+    _hintFirst = globalIndex - remaining;
+    _hintValid = true;
+    slotIndex = static_cast<uint16_t>(remaining);
+    return leaf;
+}
+
 
-    DEBUG_PRINT("loadIndexPage: Read %zu bytes (expected %zu).\n", bytesRead, bytesExpected);
-    if (bytesRead < bytesExpected) {
-        DEBUG_PRINT("loadIndexPage: Partial read; zero-filling remaining %zu bytes.\n", bytesExpected - bytesRead);
-        memset(reinterpret_cast<uint8_t*>(_indexPage) + bytesRead, 0, bytesExpected - bytesRead);
+//
+// lowerBound()
+//   Returns the first global position whose key is >= key. One page per tree
+//   level is visited; the upper levels normally stay in the cache. With
+//   'entry', the entry at that position is decoded from the leaf just
+//   searched, so a lookup does not need entryAt() to find it again.
+//
+bool DBEngine::lowerBound(uint32_t key, uint32_t* position, IndexEntry* entry) const {
+    SCOPE_TIMER("DBEngine::lowerBound");
+    if (_treeHeight == 0) {
+        *position = 0;
+        return true;
+    }
+    IndexPage scratch;
+    uint32_t page = _rootPage;
+    uint32_t firstPosition = 0;
+    bool inLeaf = false;
+    for (uint8_t level = 0; level < _treeHeight; level++) {
+        const IndexPage* node = viewIndexPage(page, scratch);
+        if (!node)
+            return false;
+        uint8_t expectedType = (level + 1 == _treeHeight) ? INDEX_PAGE_LEAF : INDEX_PAGE_INTERIOR;
+        if (node->header.type != expectedType) {
+            DEBUG_PRINT("lowerBound: Page %u at level %u has type %u.\n", page, level, node->header.type);
+            return false;
+        }
+        if (expectedType == INDEX_PAGE_LEAF) {
+            uint16_t slot = leafLowerBound(*node, key);
+            *position = firstPosition + slot;
+            if (entry && slot < node->header.count) {
+                LeafCodec codec;
+                leafCodec(*node, codec);
+                leafEntry(*node, codec, slot, *entry);
+                inLeaf = true;
+            }
+            break;
+        }
+        uint16_t child = childForKey(*node, key);
+        for (uint16_t i = 0; i < child; i++)
+            firstPosition += node->children[i].count;
+        page = node->children[child].page;
     }
 
-    _currentPageNumber = pageNumber;
-    _pageLoaded = true;
-    _pageDirty = false;
-    DEBUG_PRINT("loadIndexPage: Page %u loaded successfully.\n", pageNumber);
+    // The caller usually reads the entry next; let entryAt() start here.
+    {
+        DB_CACHE_LOCK(_cacheLock);
+        _hintPage = page;
+        _hintFirst = firstPosition;
+        _hintValid = true;
+    }
+    // Every key of the leaf is smaller: the entry starts the next leaf.
+    if (entry && !inLeaf && *position < _indexCount)
+        return entryAt(*position, *entry);
     return true;
 }
 
@@ -228,28 +1263,93 @@ bool DBEngine::loadIndexPage(uint32_t pageNumber) {
 //   Loads the appropriate page if necessary.
 //
 bool DBEngine::getIndexEntry(uint32_t globalIndex, IndexEntry& entry) {
+    DB_READ_LOCK(_lock);
+    return entryAt(globalIndex, entry);
+}
+
+//
+// entryAt()
+//   findPosition() for readers: the leaf of the previous lookup is used when it
+//   is still cached and holds the position or borders on it; otherwise the tree
+//   is descended by subtree counts.
+//
+bool DBEngine::entryAt(uint32_t globalIndex, IndexEntry& entry) const {
     SCOPE_TIMER("DBEngine::getIndexEntry");
-    uint32_t page = globalIndex / MAX_INDEX_ENTRIES;
-    uint32_t offset = globalIndex % MAX_INDEX_ENTRIES;
-    DEBUG_PRINT("getIndexEntry: globalIndex = %u, page = %u, offset = %u\n", globalIndex, page, offset);
+    if (globalIndex >= _indexCount)
+        return false;
 
-    // Check if the desired page is already loaded.
-    if (!_pageLoaded || _currentPageNumber != page) {
-        // If a page is loaded but it is dirty, flush it first.
-        if (_pageLoaded && _pageDirty) {
-            DEBUG_PRINT("getIndexEntry: Current page %u is dirty; flushing page...\n", _currentPageNumber);
-            if (!flushIndexPage()) {
-                DEBUG_PRINT("getIndexEntry: Flush failed.\n");
+    bool hintValid = false;
+    uint32_t page = 0, first = 0, count = 0, next = DB_NO_PAGE, prev = DB_NO_PAGE;
+    {
+        DB_CACHE_LOCK(_cacheLock);
+        const IndexPageSlot* hint = _hintValid ? findCachedPage(_hintPage) : nullptr;
+        if (hint) {
+            hintValid = true;
+            page = _hintPage;
+            first = _hintFirst;
+            count = hint->page.header.count;
+            next = hint->page.header.next;
+            prev = hint->page.header.prev;
+        }
+    }
+    IndexPage scratch;
+    const IndexPage* leaf = nullptr;
+    if (hintValid) {
+        if (globalIndex >= first && globalIndex < first + count) {
+            leaf = viewIndexPage(page, scratch);
+            if (!leaf)
                 return false;
+        }
+        else if (globalIndex == first + count && next != DB_NO_PAGE) {
+            // Step into the neighbouring leaf.
+            page = next;
+            first += count;
+            leaf = viewIndexPage(page, scratch);
+            if (!leaf)
+                return false;
+        }
+        else if (globalIndex + 1 == first && prev != DB_NO_PAGE) {
+            page = prev;
+            leaf = viewIndexPage(page, scratch);
+            if (!leaf)
+                return false;
+            first -= leaf->header.count;
+        }
+    }
+    if (!leaf) {
+        uint32_t remaining = globalIndex;
+        page = _rootPage;
+        for (uint8_t level = 0; level + 1 < _treeHeight; level++) {
+            const IndexPage* node = viewIndexPage(page, scratch);
+            if (!node)
+                return false;
+            uint16_t child = 0;
+            while (child + 1 < node->header.count && remaining >= node->children[child].count) {
+                remaining -= node->children[child].count;
+                child++;
             }
+            page = node->children[child].page;
         }
-        DEBUG_PRINT("getIndexEntry: Loading page %u...\n", page);
-        if (!loadIndexPage(page))
+        leaf = viewIndexPage(page, scratch);
+        first = globalIndex - remaining;
+        if (!leaf)
             return false;
     }
-
-    entry = _indexPage[offset];
+    uint32_t offset = globalIndex - first;
+    if (offset >= leaf->header.count) {
+        DEBUG_PRINT("getIndexEntry: Position %u not found in leaf %u.\n", globalIndex, page);
+        return false;
+    }
+    LeafCodec codec;
+    leafCodec(*leaf, codec);
+    leafEntry(*leaf, codec, static_cast<uint16_t>(offset), entry);
+    DEBUG_PRINT("getIndexEntry: globalIndex = %u, page = %u, offset = %u\n", globalIndex, page, offset);
     DEBUG_PRINT("getIndexEntry: Retrieved entry: key=%u, offset=%u, status=%u\n", entry.key, entry.offset, entry.status);
+
+    DB_CACHE_LOCK(_cacheLock);
+    _hintPage = page;
+    _hintFirst = first;
+    _hintValid = true;
     return true;
 }
 
@@ -258,223 +1358,875 @@ bool DBEngine::getIndexEntry(uint32_t globalIndex, IndexEntry& entry) {
 // setIndexEntry()
 //   Updates the index entry at the given global index in the in-memory page,
 //   marks the page as dirty so it will be flushed later.
+//   (The key must not change, or the entry would be out of order.) A narrow
+//   leaf that cannot hold the new offset and has no room to widen is split.
 //
 bool DBEngine::setIndexEntry(uint32_t globalIndex, const IndexEntry& entry) {
     SCOPE_TIMER("DBEngine::setIndexEntry");
-    uint32_t page = globalIndex / MAX_INDEX_ENTRIES;
-    uint32_t offset = globalIndex % MAX_INDEX_ENTRIES;
-    DEBUG_PRINT("setIndexEntry: globalIndex = %u, page = %u, offset = %u, new key=%u\n", globalIndex, page, offset, entry.key);
-    if (!_pageLoaded || _currentPageNumber != page) {
-        DEBUG_PRINT("setIndexEntry: Loading page %u...\n", page);
-        if (!loadIndexPage(page))
+    uint16_t offset = 0;
+    IndexPageSlot* slot = findPosition(globalIndex, offset);
+    if (!slot)
+        return false;
+    DEBUG_PRINT("setIndexEntry: globalIndex = %u, page = %u, offset = %u, new key=%u\n",
+        globalIndex, slot->pageNumber, offset, entry.key);
+    LeafCodec codec;
+    leafCodec(slot->page, codec);
+    IndexEntry old;
+    leafEntry(slot->page, codec, offset, old);
+    if (!setLeafEntry(slot->page, offset, entry, _narrowLeaves)) {
+        // Take the entry out and insert it again, which splits the leaf.
+        IndexPath path;
+        uint32_t offsetInLeaf;
+        if (!descendToPosition(globalIndex, path, offsetInLeaf))
+            return false;
+        slot = getIndexPage(path.page[path.depth - 1]);
+        if (!slot)
+            return false;
+#if DB_AGGREGATES > 0
+        // The split takes the entry for a new one; both halves are stale either way.
+        if (!updateAggregates(entry.key, nullptr, 0))
+            return false;
+        slot = getIndexPage(path.page[path.depth - 1]);
+        if (!slot)
             return false;
+#endif
+        removeLeafEntry(slot->page, static_cast<uint16_t>(offsetInLeaf));
+        slot->dirty = true;
+        if (!splitPageAndInsert(path, static_cast<uint16_t>(offsetInLeaf), entry))
+            return false;
+#if DB_AGGREGATES > 0
+        if (!updateAggregates(entry.key, nullptr, 0))
+            return false;
+#endif
+        _hintValid = false;
+        // The split set the counts of the new halves; the levels above them
+        // still summarise the old entry.
+        return refreshSummaries(globalIndex, true);
     }
-    _indexPage[offset] = entry;
-    _pageDirty = true;
+    slot->dirty = true;
     DEBUG_PRINT("setIndexEntry: Entry set; marking page dirty.\n");
+
+    // Keep the parents' summaries exact so that scans can rely on them.
+    if (_treeHeight > 1 && (old.status != entry.status ||
+        ((old.internal_status ^ entry.internal_status) & INTERNAL_STATUS_DELETED)))
+        return refreshSummaries(globalIndex);
+    return true;
+}
+
+//
+// setIndexStatuses()
+//   The status byte sits at the same place in both leaf formats, so it is
+//   changed in place; an entry never needs a wider format for it. The change
+//   mark for exportSince() goes into the internal_status byte after it.
+//
+bool DBEngine::setIndexStatuses(const uint32_t* positions, size_t n, uint8_t newStatus, IndexEntry* entries) {
+    SCOPE_TIMER("DBEngine::setIndexStatuses");
+    size_t i = 0;
+    while (i < n) {
+        uint16_t offset = 0;
+        IndexPageSlot* slot = findPosition(positions[i], offset);
+        if (!slot)
+            return false;
+        uint32_t leafFirst = positions[i] - offset;
+        uint32_t leafEnd = leafFirst + slot->page.header.count;
+        LeafCodec codec;
+        leafCodec(slot->page, codec);
+        bool changed = false;
+        for (; i < n && positions[i] < leafEnd; i++) {
+            uint16_t at = static_cast<uint16_t>(positions[i] - leafFirst);
+            leafEntry(slot->page, codec, at, entries[i]);
+            if (entries[i].offset == DB_NO_OFFSET || entries[i].status == newStatus)
+                continue;
+            slot->page.bytes[at * codec.stride + codec.keyBytes + codec.offsetBytes] = newStatus;
+            slot->page.bytes[at * codec.stride + codec.keyBytes + codec.offsetBytes + 1] |= INTERNAL_STATUS_CHANGED;
+            changed = true;
+        }
+        if (!changed)
+            continue;
+        slot->dirty = true;
+        if (_treeHeight > 1 && !refreshSummaries(positions[i - 1]))
+            return false;
+    }
+    return true;
+}
+
+//
+// refreshSummaries()
+//   Re-summarises each level on the path to a changed entry from the page
+//   below it. The walk stops at the first parent whose reference is unchanged,
+//   unless allLevels is set.
+//
+bool DBEngine::refreshSummaries(uint32_t globalIndex, bool allLevels) {
+    SCOPE_TIMER("DBEngine::refreshSummaries");
+    IndexPath path;
+    uint32_t offsetInLeaf;
+    if (!descendToPosition(globalIndex, path, offsetInLeaf))
+        return false;
+    IndexPageSlot* slot = getIndexPage(path.page[path.depth - 1]);
+    if (!slot)
+        return false;
+    IndexChildRef summary;
+    summarizeIndexPage(slot->page, summary);
+    for (uint8_t level = path.depth - 1; level-- > 0;) {
+        IndexPageSlot* node = getIndexPage(path.page[level]);
+        if (!node)
+            return false;
+        IndexChildRef& ref = node->page.children[path.child[level]];
+        if (!allLevels && ref.deleted == summary.deleted && ref.statusMask == summary.statusMask)
+            break;
+        ref.deleted = summary.deleted;
+        ref.statusMask = summary.statusMask;
+        node->dirty = true;
+        summarizeIndexPage(node->page, summary);
+    }
     return true;
 }
 
 //
 // splitPageAndInsert()
-//   Handles the case where the target page is full by splitting the page
-//   into two. The current page is split at a fixed split point (half full).
-//   Then, depending on the insertion offset, the new entry is inserted
-//   into either the first half (current page) or the new page. Both pages
-//   are then flushed and the global index count is updated.
-//
-bool DBEngine::splitPageAndInsert(uint32_t targetPage, uint32_t offsetInPage,
-    uint32_t key, uint32_t recordOffset, uint8_t status, uint8_t internal_status) {
+//   Handles the case where the target leaf cannot take the entry by moving
+//   part of it to a newly allocated leaf. Normally the leaf is split in half;
+//   when the entry is appended past the end of the rightmost leaf, the new leaf
+//   starts with just that entry so that ascending keys keep the leaves full.
+//   Each half holds at most MAX_INDEX_ENTRIES entries, so it fits a wide leaf
+//   whatever its keys and offsets; the new half gets the narrowest format that
+//   holds them. The new leaf is linked in after the old one and registered with
+//   the parent.
+//
+bool DBEngine::splitPageAndInsert(IndexPath& path, uint16_t offsetInPage, const IndexEntry& entry) {
     SCOPE_TIMER("DBEngine::splitPageAndInsert");
-    DEBUG_PRINT("splitPageAndInsert: Splitting page %u at offset %u for new key=%u\n", targetPage, offsetInPage, key);
+    uint8_t leafLevel = path.depth - 1;
+    uint32_t leafPage = path.page[leafLevel];
+    DEBUG_PRINT("splitPageAndInsert: Splitting leaf %u at offset %u for new key=%u\n", leafPage, offsetInPage, entry.key);
+
+    // Allocate first: taking a page from the free list may load it.
+    uint32_t newPageNumber;
+    if (!allocateIndexPage(newPageNumber))
+        return false;
+
+    IndexPageSlot* slot = getIndexPage(leafPage);
+    if (!slot)
+        return false;
+    IndexPageSlot* newSlot = newIndexPage(newPageNumber, INDEX_PAGE_LEAF);
+    if (!newSlot)
+        return false;
+    IndexPage& page = slot->page;
+    IndexPage& newPage = newSlot->page;
+
+    uint16_t count = page.header.count;
+    uint16_t splitIndex = count / 2;
+    bool toLeft = offsetInPage < splitIndex;
+    if (!toLeft && count - splitIndex >= MAX_INDEX_ENTRIES) {
+        // An odd narrow leaf at capacity: the entry or one more old entry
+        // goes to the left half.
+        if (offsetInPage == splitIndex)
+            toLeft = true;
+        else
+            splitIndex++;
+    }
+    bool tailSplit = page.header.next == DB_NO_PAGE && offsetInPage == count;
+    if (tailSplit) {
+        splitIndex = count;
+        toLeft = false;
+    }
+
+    uint16_t moved = count - splitIndex;
+    LeafCodec codec, newCodec;
+    leafCodec(page, codec);
+    LeafRange range;
+    leafRange(page, codec, splitIndex, moved, toLeft ? nullptr : &entry, range);
+    uint8_t format;
+    uint32_t baseKey, baseOffset;
+    chooseLeafFormat(range, moved + (toLeft ? 0 : 1), _narrowLeaves, format, baseKey, baseOffset);
+    recodeLeaf(newPage, format, baseKey, baseOffset);
+    leafCodec(newPage, newCodec);
+    IndexEntry movedEntry;
+    for (uint16_t i = 0; i < moved; i++) {
+        leafEntry(page, codec, splitIndex + i, movedEntry);
+        storeLeafEntry(newPage, newCodec, i, movedEntry);
+    }
+    page.header.count = splitIndex;
+    newPage.header.count = moved;
+
+    // Insert the new entry into the appropriate half; both have room for it.
+    if (toLeft)
+        insertLeafEntry(page, offsetInPage, entry, _narrowLeaves);
+    else
+        insertLeafEntry(newPage, offsetInPage - splitIndex, entry, _narrowLeaves);
+
+    // Link the new leaf in after the old one.
+    uint32_t nextPage = page.header.next;
+    newPage.header.prev = leafPage;
+    newPage.header.next = nextPage;
+    page.header.next = newPageNumber;
+    slot->dirty = true;
+
+    IndexChildRef left, ref;
+    summarizeIndexPage(page, left);
+    left.page = leafPage;
+    summarizeIndexPage(newPage, ref);
+    ref.page = newPageNumber;
+
+    if (nextPage == DB_NO_PAGE) {
+        _lastLeaf = newPageNumber;
+    }
+    else {
+        IndexPageSlot* nextSlot = getIndexPage(nextPage);
+        if (!nextSlot)
+            return false;
+        nextSlot->page.header.prev = newPageNumber;
+        nextSlot->dirty = true;
+    }
+
+#if DB_AGGREGATES > 0
+    // Past the end of the last leaf, the old leaf keeps its records and thus
+    // its aggregates, and the new one starts without values. A root leaf has
+    // no reference that knew its aggregates.
+    if (tailSplit) {
+        for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+            resetAggregate(ref.aggregates[f], 0);
+        if (leafLevel > 0) {
+            IndexPageSlot* parent = getIndexPage(path.page[leafLevel - 1]);
+            if (!parent)
+                return false;
+            memcpy(left.aggregates, parent->page.children[path.child[leafLevel - 1]].aggregates, sizeof(left.aggregates));
+        }
+    }
+#endif
+
+    _stats.leafSplits++;
+    DEBUG_PRINT("splitPageAndInsert: Leaf %u split; %u entries moved to leaf %u\n", leafPage, ref.count, newPageNumber);
+    return insertChildRef(path, leafLevel, left, ref);
+}
+
+
+//
+// insertChildRef()
+//   Registers a new right sibling of the page at path level 'level' with its
+//   parent. A full parent is split in half in turn; a split root grows the tree
+//   by one level.
+//
+bool DBEngine::insertChildRef(IndexPath& path, uint8_t level, const IndexChildRef& left, const IndexChildRef& ref) {
+    SCOPE_TIMER("DBEngine::insertChildRef");
+
+    if (level == 0) {
+        // The root itself was split: a new root adopts both halves.
+        if (_treeHeight >= DB_MAX_TREE_HEIGHT) {
+            DEBUG_PRINT("insertChildRef: Tree height limit %u reached.\n", DB_MAX_TREE_HEIGHT);
+            return false;
+        }
+        uint32_t rootPage;
+        if (!allocateIndexPage(rootPage))
+            return false;
+        IndexPageSlot* root = newIndexPage(rootPage, INDEX_PAGE_INTERIOR);
+        if (!root)
+            return false;
+        root->page.children[0] = left;
+        root->page.children[1] = ref;
+        root->page.header.count = 2;
+        _rootPage = rootPage;
+        _treeHeight++;
+        DEBUG_PRINT("insertChildRef: New root %u, tree height %u\n", rootPage, _treeHeight);
+        return true;
+    }
+
+    uint8_t parentLevel = level - 1;
+    uint32_t parentPage = path.page[parentLevel];
+    uint16_t child = path.child[parentLevel];
+    uint16_t at = child + 1;
+
+    IndexPageSlot* parent = getIndexPage(parentPage);
+    if (!parent)
+        return false;
+    // The split child keeps everything except what moved to its new sibling.
+    IndexChildRef& split = parent->page.children[child];
+    split.count = left.count;
+    split.deleted = left.deleted;
+    split.statusMask = left.statusMask;
+#if DB_AGGREGATES > 0
+    memcpy(split.aggregates, left.aggregates, sizeof(split.aggregates));
+#endif
+    parent->dirty = true;
+
+    if (parent->page.header.count < INDEX_FANOUT) {
+        size_t numToShift = parent->page.header.count - at;
+        if (numToShift > 0) {
+            memmove(&parent->page.children[at + 1], &parent->page.children[at], numToShift * sizeof(IndexChildRef));
+        }
+        parent->page.children[at] = ref;
+        parent->page.header.count++;
+        return true;
+    }
 
-    uint32_t splitIndex = MAX_INDEX_ENTRIES / 2;
+    // The parent is full as well: split it in half.
+    uint32_t siblingPage;
+    if (!allocateIndexPage(siblingPage))
+        return false;
+    parent = getIndexPage(parentPage);
+    if (!parent)
+        return false;
+    IndexPageSlot* sibling = newIndexPage(siblingPage, INDEX_PAGE_INTERIOR);
+    if (!sibling)
+        return false;
+    IndexPage& node = parent->page;
+    IndexPage& newNode = sibling->page;
 
-    // Prepare a temporary buffer for the new page.
-    IndexEntry newPageBuffer[MAX_INDEX_ENTRIES];
-    memcpy(newPageBuffer, &_indexPage[splitIndex], (MAX_INDEX_ENTRIES - splitIndex) * sizeof(IndexEntry));
+    uint16_t splitIndex = INDEX_FANOUT / 2;
+    uint16_t moved = INDEX_FANOUT - splitIndex;
+    memcpy(newNode.children, &node.children[splitIndex], moved * sizeof(IndexChildRef));
+    node.header.count = splitIndex;
+    newNode.header.count = moved;
 
-    // Insert the new entry into the appropriate half.
-    if (offsetInPage < splitIndex) {
-        size_t numToShift = splitIndex - offsetInPage;
+    if (at <= splitIndex) {
+        size_t numToShift = splitIndex - at;
         if (numToShift > 0) {
-            memmove(&_indexPage[offsetInPage + 1], &_indexPage[offsetInPage], numToShift * sizeof(IndexEntry));
+            memmove(&node.children[at + 1], &node.children[at], numToShift * sizeof(IndexChildRef));
         }
-        _indexPage[offsetInPage].key = key;
-        _indexPage[offsetInPage].offset = recordOffset;
-        _indexPage[offsetInPage].status = status;
-        _indexPage[offsetInPage].internal_status = internal_status;
+        node.children[at] = ref;
+        node.header.count++;
     }
     else {
-        uint32_t newOffset = offsetInPage - splitIndex;
-        size_t numToShift = (MAX_INDEX_ENTRIES - splitIndex) - newOffset;
+        uint16_t newAt = at - splitIndex;
+        size_t numToShift = moved - newAt;
         if (numToShift > 0) {
-            memmove(&newPageBuffer[newOffset + 1], &newPageBuffer[newOffset], numToShift * sizeof(IndexEntry));
+            memmove(&newNode.children[newAt + 1], &newNode.children[newAt], numToShift * sizeof(IndexChildRef));
         }
-        newPageBuffer[newOffset].key = key;
-        newPageBuffer[newOffset].offset = recordOffset;
-        newPageBuffer[newOffset].status = status;
-        newPageBuffer[newOffset].internal_status = internal_status;
+        newNode.children[newAt] = ref;
+        newNode.header.count++;
+    }
+
+    IndexChildRef nodeRef, siblingRef;
+    summarizeIndexPage(node, nodeRef);
+    nodeRef.page = parentPage;
+    summarizeIndexPage(newNode, siblingRef);
+    siblingRef.page = siblingPage;
+    _stats.interiorSplits++;
+    DEBUG_PRINT("insertChildRef: Interior page %u split; new sibling %u\n", parentPage, siblingPage);
+    return insertChildRef(path, parentLevel, nodeRef, siblingRef);
+}
+
+
+
+bool DBEngine::insertIndexEntry(uint32_t key, uint32_t offset, uint8_t status, uint8_t internal_status) {
+    SCOPE_TIMER("DBEngine::insertIndexEntry");
+    DEBUG_PRINT("insertIndexEntry: Inserting new entry with key=%u, offset=%u, status=%u, internal_status=%u\n",
+        key, offset, status, internal_status);
+
+    IndexEntry newEntry;
+    newEntry.key = key;
+    newEntry.offset = offset;
+    newEntry.status = status;
+    newEntry.internal_status = internal_status;
+
+    // The first entry creates the root leaf.
+    if (_treeHeight == 0) {
+        uint32_t page;
+        if (!allocateIndexPage(page))
+            return false;
+        IndexPageSlot* slot = newIndexPage(page, INDEX_PAGE_LEAF);
+        if (!slot)
+            return false;
+        insertLeafEntry(slot->page, 0, newEntry, _narrowLeaves);
+        _rootPage = page;
+        _firstLeaf = page;
+        _lastLeaf = page;
+        _treeHeight = 1;
+        _indexCount = 1;
+        _maxKey = key;
+        _maxKeyValid = true;
+        _hintValid = false;
+        return true;
+    }
+
+    IndexPath path;
+    uint32_t firstPosition;
+    if (!descendToKey(key, path, firstPosition))
+        return false;
+    uint32_t leafPage = path.page[path.depth - 1];
+    IndexPageSlot* slot = getIndexPage(leafPage);
+    if (!slot)
+        return false;
+    uint16_t offsetInPage = leafLowerBound(slot->page, key);
+    DEBUG_PRINT("insertIndexEntry: Global insertion position = %u\n", firstPosition + offsetInPage);
+
+    // *** Uniqueness check ***
+    // Keys before the slot are smaller and the next leaf starts above key,
+    // so only the slot itself can collide.
+    LeafCodec codec;
+    leafCodec(slot->page, codec);
+    if (offsetInPage < slot->page.header.count && leafKey(slot->page, codec, offsetInPage) == key) {
+        DEBUG_PRINT("insertIndexEntry: Duplicate key detected (key=%u at index %u).\n", key, firstPosition + offsetInPage);
+        return false;
+    }
+    // *** End Uniqueness Check ***
+
+    // Every ancestor on the path gains one entry; only the leftmost path can
+    // receive a new smallest key.
+    for (uint8_t level = path.depth - 1; level-- > 0;) {
+        IndexPageSlot* node = getIndexPage(path.page[level]);
+        if (!node)
+            return false;
+        IndexChildRef& ref = node->page.children[path.child[level]];
+        ref.count++;
+        if (internal_status & INTERNAL_STATUS_DELETED)
+            ref.deleted++;
+        ref.statusMask |= DB_STATUS_BIT(status);
+        if (key < ref.key)
+            ref.key = key;
+        node->dirty = true;
+    }
+
+    slot = getIndexPage(leafPage);
+    if (!slot)
+        return false;
+    if (insertLeafEntry(slot->page, offsetInPage, newEntry, _narrowLeaves)) {
+        // There was room in the leaf.
+        slot->dirty = true;
+    }
+    else {
+        // The leaf is full: split it and insert the new entry.
+        if (!splitPageAndInsert(path, offsetInPage, newEntry))
+            return false;
+    }
+    _indexCount++;
+    _hintValid = false;
+    if (_maxKeyValid && key > _maxKey)
+        _maxKey = key;
+
+    DEBUG_PRINT("insertIndexEntry: New entry inserted at global position %u\n", firstPosition + offsetInPage);
+    return true;
+}
+
+
+//
+// currentMaxKey()
+//   The largest key is the last entry of the last leaf. It is read once after
+//   open and then kept up to date by the insert paths.
+//
+bool DBEngine::currentMaxKey(uint32_t& maxKey) {
+    if (_indexCount == 0)
+        return false;
+    if (!_maxKeyValid) {
+        IndexPageSlot* slot = getIndexPage(_lastLeaf);
+        if (!slot || slot->page.header.count == 0)
+            return false;
+        LeafCodec codec;
+        leafCodec(slot->page, codec);
+        _maxKey = leafKey(slot->page, codec, slot->page.header.count - 1);
+        _maxKeyValid = true;
+    }
+    maxKey = _maxKey;
+    return true;
+}
+
+
+//
+// appendIndexEntry()
+//   Fast path for keys above the current maximum: the entry belongs at the end
+//   of the last leaf, so the descent simply takes the last child at every level
+//   and no uniqueness check is needed. Existing positions do not move, so the
+//   position hint stays valid.
+//
+bool DBEngine::appendIndexEntry(const IndexEntry& entry) {
+    SCOPE_TIMER("DBEngine::appendIndexEntry");
+    if (_treeHeight == 0)
+        return insertIndexEntry(entry.key, entry.offset, entry.status, entry.internal_status);
+
+    // Walk the rightmost path, counting the new entry in every ancestor.
+    IndexPath path;
+    uint32_t page = _rootPage;
+    for (uint8_t level = 0; level + 1 < _treeHeight; level++) {
+        IndexPageSlot* node = getIndexPage(page);
+        if (!node || node->page.header.type != INDEX_PAGE_INTERIOR || node->page.header.count == 0)
+            return false;
+        uint16_t child = node->page.header.count - 1;
+        IndexChildRef& ref = node->page.children[child];
+        ref.count++;
+        if (entry.internal_status & INTERNAL_STATUS_DELETED)
+            ref.deleted++;
+        ref.statusMask |= DB_STATUS_BIT(entry.status);
+        node->dirty = true;
+        path.page[level] = page;
+        path.child[level] = child;
+        page = ref.page;
+    }
+    path.page[_treeHeight - 1] = page;
+    path.depth = _treeHeight;
+
+    IndexPageSlot* slot = getIndexPage(page);
+    if (!slot || slot->page.header.type != INDEX_PAGE_LEAF)
+        return false;
+    uint16_t entriesInPage = slot->page.header.count;
+    if (insertLeafEntry(slot->page, entriesInPage, entry, _narrowLeaves)) {
+        slot->dirty = true;
+    }
+    else {
+        // Start a new last leaf. The old one is complete and will not change
+        // again on an ascending workload, so write it out now.
+        if (!splitPageAndInsert(path, entriesInPage, entry))
+            return false;
+        IndexPageSlot* full = findCachedPage(page);
+        if (full && !flushIndexPage(*full, false))
+            return false;
     }
+    _indexCount++;
+    _maxKey = entry.key;
+    _maxKeyValid = true;
+
+    DEBUG_PRINT("appendIndexEntry: Appended key=%u at global position %u\n", entry.key, _indexCount - 1);
+    return true;
+}
 
-    // Update the global index count.
-    _indexCount++;  // one new entry inserted.
 
-    // Flush the current (split) page.
-    _pageDirty = true;
-    if (!flushIndexPage()) {
-        DEBUG_PRINT("splitPageAndInsert: Failed to flush current page after split.\n");
+// ---------------------------------------------------------------------------
+// Bottom-Up Index Builder
+//   Writes a complete tree from entries that arrive in ascending key order:
+//   full leaves on consecutive pages, then one interior level at a time until
+//   a single root remains. Only two page buffers are used, borrowed from the
+//   page cache: slot 0 holds the leaf being filled (later the page being
+//   summarised) and slot 1 holds the interior page being filled.
+// ---------------------------------------------------------------------------
+
+bool DBEngine::beginIndexBuild(uint32_t firstPage) {
+    SCOPE_TIMER("DBEngine::beginIndexBuild");
+    if (!flushIndexPages())
+        return false;
+    invalidateIndexCache();
+
+    _buildFirstLeaf = firstPage;
+    _buildNextPage = firstPage;
+    _buildCount = 0;
+
+    IndexPage& leaf = _pageCache[0].page;
+    memset(&leaf, 0, sizeof(leaf));
+    leaf.header.type = INDEX_PAGE_LEAF;
+    leaf.header.prev = DB_NO_PAGE;
+    leaf.header.next = DB_NO_PAGE;
+    return true;
+}
+
+bool DBEngine::addIndexBuildEntry(const IndexEntry& entry) {
+    IndexPage& leaf = _pageCache[0].page;
+    LeafCodec codec;
+    leafCodec(leaf, codec);
+    if (leaf.header.count > 0 && entry.key <= leafKey(leaf, codec, leaf.header.count - 1)) {
+        DEBUG_PRINT("addIndexBuildEntry: Key %u is not above the previous key.\n", entry.key);
         return false;
     }
+    if (!insertLeafEntry(leaf, leaf.header.count, entry, _narrowLeaves)) {
+        // More entries follow, so the full leaf links to the next page.
+        leaf.header.next = _buildNextPage + 1;
+        if (!writeIndexPage(_buildNextPage, leaf))
+            return false;
+        leaf.header.prev = _buildNextPage++;
+        leaf.header.next = DB_NO_PAGE;
+        leaf.header.count = 0;
+        insertLeafEntry(leaf, 0, entry, _narrowLeaves);
+    }
+    _buildCount++;
+    return true;
+}
 
-    // Write out the new page.
-    uint32_t newPageNumber = targetPage + 1;
-    if (!_indexHandler.open(_indexFileName, "rb+")) {
-        if (!_indexHandler.open(_indexFileName, "wb+"))
+bool DBEngine::finishIndexBuild(void) {
+    SCOPE_TIMER("DBEngine::finishIndexBuild");
+    IndexPage& scratch = _pageCache[0].page;
+
+    uint8_t height = 0;
+    _lastLeaf = DB_NO_PAGE;
+    if (_buildCount > 0) {
+        if (!writeIndexPage(_buildNextPage, scratch))
             return false;
+        _lastLeaf = _buildNextPage++;
+        height = 1;
     }
-    size_t newPageOffset = sizeof(DBIndexHeader) + newPageNumber * sizeof(IndexEntry) * MAX_INDEX_ENTRIES;
-    if (!_indexHandler.seek(static_cast<uint32_t>(newPageOffset))) {
-        DEBUG_PRINT("splitPageAndInsert: Seek failed for new page offset.\n");
-        _indexHandler.close();
-        return false;
-    }
-    size_t bytesToWrite = (MAX_INDEX_ENTRIES - splitIndex) * sizeof(IndexEntry);
-    size_t bytesWritten = 0;
-    if (!_indexHandler.write(reinterpret_cast<const uint8_t*>(newPageBuffer), bytesToWrite, bytesWritten) ||
-        bytesWritten != bytesToWrite) {
-        DEBUG_PRINT("splitPageAndInsert: Write failed for new page (wrote %zu bytes, expected %zu).\n", bytesWritten, bytesToWrite);
-        _indexHandler.close();
-        return false;
-    }
-    _indexHandler.close();
 
-    // Update the header with the new _indexCount.
-    if (!saveIndexHeader())
+    uint32_t levelStart = _buildFirstLeaf;
+    uint32_t levelPages = _buildNextPage - _buildFirstLeaf;
+    if (!buildInteriorLevels(levelStart, levelPages, height))
         return false;
 
-    _pageDirty = false;
-    DEBUG_PRINT("splitPageAndInsert: Split and insertion successful. New _indexCount = %u\n", _indexCount);
-    return true;
+    _indexCount = _buildCount;
+    _treeHeight = height;
+    _rootPage = (height > 0) ? levelStart : DB_NO_PAGE;
+    _firstLeaf = (height > 0) ? _buildFirstLeaf : DB_NO_PAGE;
+    _pageCount = _buildNextPage;
+    _maxKeyValid = false;
+    invalidateIndexCache();
+    DEBUG_PRINT("finishIndexBuild: %u entries, height %u, root %u\n", _indexCount, _treeHeight, _rootPage);
+    return saveIndexHeader();
 }
 
+bool DBEngine::buildInteriorLevels(uint32_t& levelStart, uint32_t& levelPages, uint8_t& height) {
+    IndexPage& scratch = _pageCache[0].page;
+    IndexPage& node = _pageCache[1].page;
 
-
-bool DBEngine::insertIndexEntry(uint32_t key, uint32_t offset, uint8_t status, uint8_t internal_status) {
-    SCOPE_TIMER("DBEngine::insertIndexEntry");
-    DEBUG_PRINT("insertIndexEntry: Inserting new entry with key=%u, offset=%u, status=%u, internal_status=%u\n",
-        key, offset, status, internal_status);
-
-    // Use binary search to find the global insertion position.
-    uint32_t low = 0, high = _indexCount;
-    while (low < high) {
-        uint32_t mid = (low + high) / 2;
-        IndexEntry entry;
-        if (!getIndexEntry(mid, entry))
+    while (levelPages > 1) {
+        if (height >= DB_MAX_TREE_HEIGHT) {
+            DEBUG_PRINT("buildInteriorLevels: Tree height limit %u reached.\n", DB_MAX_TREE_HEIGHT);
             return false;
-        if (entry.key < key)
-            low = mid + 1;
-        else
-            high = mid;
+        }
+        uint32_t parentStart = _buildNextPage;
+        memset(&node, 0, sizeof(node));
+        node.header.type = INDEX_PAGE_INTERIOR;
+        node.header.prev = DB_NO_PAGE;
+        node.header.next = DB_NO_PAGE;
+        for (uint32_t page = levelStart; page < levelStart + levelPages; page++) {
+            if (!readIndexPage(page, scratch))
+                return false;
+            if (node.header.count == INDEX_FANOUT) {
+                if (!writeIndexPage(_buildNextPage++, node))
+                    return false;
+                node.header.count = 0;
+            }
+            IndexChildRef& ref = node.children[node.header.count++];
+            summarizeIndexPage(scratch, ref);
+            ref.page = page;
+        }
+        if (!writeIndexPage(_buildNextPage++, node))
+            return false;
+        levelStart = parentStart;
+        levelPages = _buildNextPage - parentStart;
+        height++;
     }
-    uint32_t pos = low;
-    DEBUG_PRINT("insertIndexEntry: Global insertion position = %u\n", pos);
+    return true;
+}
 
-    // *** Uniqueness check ***
-    // If pos is within bounds, check if the key already exists.
-    if (pos < _indexCount) {
-        IndexEntry entry;
-        if (!getIndexEntry(pos, entry))
+
+//
+// upgradeIndexV1()
+//   A version 1 index is one sorted array of IndexEntry records right after a
+//   10-byte header. The tree is built on the first pages that lie wholly past
+//   that array, reading the old entries a page at a time (into cache slot 1)
+//   as they are consumed. With every entry copied, the header is rewritten and
+//   the pages that overlapped the array go on the free list for later splits.
+//   The header slots overlap the array too, so no header is written before.
+//
+bool DBEngine::upgradeIndexV1(uint32_t entryCount) {
+    SCOPE_TIMER("DBEngine::upgradeIndexV1");
+    const uint32_t flatStart = offsetof(DBIndexHeader, pageEntries);
+    uint32_t flatEnd = flatStart + entryCount * sizeof(IndexEntry);
+    uint32_t firstPage = 0;
+    if (flatEnd > indexPageOffset(0))
+        firstPage = (flatEnd - indexPageOffset(0) + sizeof(IndexPage) - 1) / sizeof(IndexPage);
+
+    // Until finishIndexBuild() commits, the version 1 header stays in charge.
+    _pagesAhead = true;
+    if (!beginIndexBuild(firstPage))
+        return false;
+    IndexEntry* chunk = _pageCache[1].page.entries;
+    for (uint32_t done = 0; done < entryCount;) {
+        uint32_t count = MIN(MAX_INDEX_ENTRIES, entryCount - done);
+        size_t bytes = count * sizeof(IndexEntry);
+        size_t bytesRead = 0;
+        if (!openIndexFile("rb"))
             return false;
-        if (entry.key == key) {
-            DEBUG_PRINT("insertIndexEntry: Duplicate key detected (key=%u at index %u).\n", key, pos);
+        if (!_indexHandler.seek(static_cast<uint32_t>(flatStart + done * sizeof(IndexEntry))) ||
+            !_indexHandler.read(reinterpret_cast<uint8_t*>(chunk), bytes, bytesRead) ||
+            bytesRead != bytes) {
+            DEBUG_PRINT("upgradeIndexV1: Failed to read entries %u-%u.\n", done, done + count - 1);
+            closeIndexFile();
             return false;
         }
+        closeIndexFile();
+        for (uint32_t i = 0; i < count; i++) {
+            if (!addIndexBuildEntry(chunk[i]))
+                return false;
+        }
+        done += count;
     }
-    if (pos > 0) {
-        IndexEntry prevEntry;
-        if (!getIndexEntry(pos - 1, prevEntry))
+    if (!finishIndexBuild())
+        return false;
+
+    // Put the pages below the new tree on the free list, lowest page first.
+    IndexPage& freePage = _pageCache[0].page;
+    memset(&freePage.header, 0, sizeof(freePage.header));
+    freePage.header.type = INDEX_PAGE_FREE;
+    freePage.header.prev = DB_NO_PAGE;
+    for (uint32_t page = firstPage; page-- > 0;) {
+        freePage.header.next = _freePage;
+        if (!writeIndexPage(page, freePage, sizeof(freePage.header)))
             return false;
-        if (prevEntry.key == key) {
-            DEBUG_PRINT("insertIndexEntry: Duplicate key detected (key=%u at index %u).\n", key, pos - 1);
+        _freePage = page;
+    }
+    DEBUG_PRINT("upgradeIndexV1: Converted %u entries; %u pages free.\n", entryCount, firstPage);
+    return saveIndexHeader();
+}
+
+
+//
+// rebuildIndexLevels()
+//   One pass over the leaf chain: entries whose log offset lies in
+//   [dropFrom, dropTo) are removed from their leaf, leaves left empty are
+//   unlinked and freed, and the first interior level for the remaining leaves
+//   is written on pages after the existing ones. The upper levels follow as in
+//   the builder, and once the new header is saved the old interior pages go on
+//   the free list. Leaves that lose no entries are only read.
+//
+bool DBEngine::rebuildIndexLevels(uint32_t dropFrom, uint32_t dropTo) {
+    SCOPE_TIMER("DBEngine::rebuildIndexLevels");
+    if (!flushIndexPages())
+        return false;
+    invalidateIndexCache();
+    IndexPage& scratch = _pageCache[0].page;
+    IndexPage& node = _pageCache[1].page;
+
+    uint32_t oldPageCount = _pageCount;
+    _buildNextPage = oldPageCount;
+    memset(&node, 0, sizeof(node));
+    node.header.type = INDEX_PAGE_INTERIOR;
+    node.header.prev = DB_NO_PAGE;
+    node.header.next = DB_NO_PAGE;
+
+    uint32_t leaves = 0, kept = 0, entries = 0, dropped = 0;
+    uint32_t firstKept = DB_NO_PAGE, lastKept = DB_NO_PAGE;
+    IndexPageHeader lastHeader;  // Header of lastKept as it is on disk.
+    memset(&lastHeader, 0, sizeof(lastHeader));
+    for (uint32_t page = _firstLeaf, next; page != DB_NO_PAGE; page = next) {
+        if (page >= oldPageCount || ++leaves > oldPageCount || !readIndexPage(page, scratch) ||
+            scratch.header.type != INDEX_PAGE_LEAF) {
+            DEBUG_PRINT("rebuildIndexLevels: Broken leaf chain at page %u.\n", page);
             return false;
         }
-    }
-    // *** End Uniqueness Check ***
+        next = scratch.header.next;
 
-    // Determine target page and offset within that page.
-    uint32_t targetPage = pos / MAX_INDEX_ENTRIES;
-    uint32_t offsetInPage = pos % MAX_INDEX_ENTRIES;
+        // Kept entries stay in the leaf's format; a smaller range still fits it.
+        LeafCodec codec;
+        leafCodec(scratch, codec);
+        uint16_t count = 0;
+        IndexEntry entry;
+        for (uint16_t i = 0; i < scratch.header.count; i++) {
+            leafEntry(scratch, codec, i, entry);
+            if (entry.offset >= dropFrom && entry.offset < dropTo)
+                continue;
+            storeLeafEntry(scratch, codec, count++, entry);
+        }
+        entries += scratch.header.count;
+        dropped += scratch.header.count - count;
+        bool changed = (count != scratch.header.count);
+        scratch.header.count = count;
+
+        if (count == 0) {
+            memset(&scratch.header, 0, sizeof(scratch.header));
+            scratch.header.type = INDEX_PAGE_FREE;
+            scratch.header.prev = DB_NO_PAGE;
+            scratch.header.next = _freePage;
+            if (!writeIndexPage(page, scratch, sizeof(scratch.header)))
+                return false;
+            _freePage = page;
+            continue;
+        }
 
-    // Load the target page if not already loaded.
-    if (!_pageLoaded || _currentPageNumber != targetPage) {
-        if (!loadIndexPage(targetPage))
+        // Close the gap left by unlinked leaves.
+        if (scratch.header.prev != lastKept) {
+            scratch.header.prev = lastKept;
+            changed = true;
+        }
+        if (changed && !writeIndexPage(page, scratch))
             return false;
-    }
-    // Determine how many entries are currently in the target page.
-    uint32_t pageFirstIndex = targetPage * MAX_INDEX_ENTRIES;
-    uint32_t entriesInPage = MIN(MAX_INDEX_ENTRIES, _indexCount - pageFirstIndex);
 
-    if (entriesInPage < MAX_INDEX_ENTRIES) {
-        // There is room in the current page.
-        size_t numToShift = entriesInPage - offsetInPage;
-        if (numToShift > 0) {
-            memmove(&_indexPage[offsetInPage + 1],
-                &_indexPage[offsetInPage],
-                numToShift * sizeof(IndexEntry));
-        }
-        // Insert the new entry.
-        _indexPage[offsetInPage].key = key;
-        _indexPage[offsetInPage].offset = offset;
-        _indexPage[offsetInPage].status = status;
-        _indexPage[offsetInPage].internal_status = internal_status;
-        _indexCount++;
-        _pageDirty = true;
-        // If after insertion the page becomes full, flush it.
-        if (entriesInPage + 1 == MAX_INDEX_ENTRIES) {
-            if (!flushIndexPage())
+        if (node.header.count == INDEX_FANOUT) {
+            if (!writeIndexPage(_buildNextPage++, node))
+                return false;
+            node.header.count = 0;
+        }
+        IndexChildRef& ref = node.children[node.header.count++];
+        summarizeIndexPage(scratch, ref);
+        ref.page = page;
+
+        // The previous leaf kept still links to a page that was freed. Its crc
+        // covers the link, so the whole page is read back and rewritten.
+        IndexPageHeader header = scratch.header;
+        if (lastKept != DB_NO_PAGE && lastHeader.next != page) {
+            if (!readIndexPage(lastKept, scratch))
+                return false;
+            scratch.header.next = page;
+            if (!writeIndexPage(lastKept, scratch))
                 return false;
         }
+        if (firstKept == DB_NO_PAGE)
+            firstKept = page;
+        lastKept = page;
+        lastHeader = header;
+        kept++;
     }
-    else {
-        // The target page is full: perform a page split and insert the new entry.
-        if (!splitPageAndInsert(targetPage, offsetInPage, key, offset, status, internal_status))
+    if (entries != _indexCount) {
+        DEBUG_PRINT("rebuildIndexLevels: Leaves hold %u entries, header says %u.\n", entries, _indexCount);
+        return false;
+    }
+    if (lastKept != DB_NO_PAGE && lastHeader.next != DB_NO_PAGE) {
+        if (!readIndexPage(lastKept, scratch))
+            return false;
+        scratch.header.next = DB_NO_PAGE;
+        if (!writeIndexPage(lastKept, scratch))
             return false;
     }
 
-    DEBUG_PRINT("insertIndexEntry: New entry inserted at global position %u\n", pos);
-    return true;
-}
+    uint8_t height = (kept > 0) ? 1 : 0;
+    uint32_t levelStart = firstKept;
+    if (kept > 1) {
+        if (!writeIndexPage(_buildNextPage++, node))
+            return false;
+        levelStart = oldPageCount;
+        uint32_t levelPages = _buildNextPage - oldPageCount;
+        height = 2;
+        if (!buildInteriorLevels(levelStart, levelPages, height))
+            return false;
+    }
+    _indexCount = entries - dropped;
+    _treeHeight = height;
+    _rootPage = (height > 0) ? levelStart : DB_NO_PAGE;
+    _firstLeaf = firstKept;
+    _lastLeaf = lastKept;
+    _pageCount = _buildNextPage;
+    _maxKeyValid = false;
+    invalidateIndexCache();
+    if (!saveIndexHeader())
+        return false;
 
+    // The old interior pages are no longer referenced.
+    for (uint32_t page = oldPageCount; page-- > 0;) {
+        if (!readIndexPage(page, scratch, sizeof(scratch.header)))
+            return false;
+        if (scratch.header.type != INDEX_PAGE_INTERIOR)
+            continue;
+        memset(&scratch.header, 0, sizeof(scratch.header));
+        scratch.header.type = INDEX_PAGE_FREE;
+        scratch.header.prev = DB_NO_PAGE;
+        scratch.header.next = _freePage;
+        if (!writeIndexPage(page, scratch, sizeof(scratch.header)))
+            return false;
+        _freePage = page;
+    }
+    DEBUG_PRINT("rebuildIndexLevels: %u leaves kept, %u entries dropped; tree height %u.\n",
+        kept, dropped, _treeHeight);
+    return saveIndexHeader();
+}
 
 
 //
 // searchIndex()
-//   Performs a binary search (using paging) for an exact key.
+//   Looks up an exact key by descending the tree (one leaf load at most once
+//   the interior pages are cached).
 //   If found, sets *foundIndex to the matching global index.
 //
 bool DBEngine::searchIndex(uint32_t key, uint32_t* foundIndex) const {
+    DB_READ_LOCK(_lock);
+    return lookupKey(key, foundIndex);
+}
+
+bool DBEngine::lookupKey(uint32_t key, uint32_t* foundIndex, IndexEntry* foundEntry) const {
     SCOPE_TIMER("DBEngine::searchIndex");
-    uint32_t low = 0;
-    uint32_t high = _indexCount;
     DEBUG_PRINT("searchIndex: Searching for key=%u in range [0, %u)\n", key, _indexCount);
-    while (low < high) {
-        uint32_t mid = (low + high) / 2;
-        IndexEntry entry;
-        if (!const_cast<DBEngine*>(this)->getIndexEntry(mid, entry))
-            return false;
-        DEBUG_PRINT("searchIndex: mid=%u, entry.key=%u\n", mid, entry.key);
-        if (entry.key == key) {
-            *foundIndex = mid;
-            DEBUG_PRINT("searchIndex: Found key at index %u\n", mid);
-            return true;
-        }
-        else if (entry.key < key) {
-            low = mid + 1;
-        }
-        else {
-            high = mid;
-        }
+    uint32_t pos;
+    IndexEntry entry;
+    if (!lowerBound(key, &pos, &entry) || pos >= _indexCount)
+        return false;
+    if (entry.key == key) {
+        *foundIndex = pos;
+        if (foundEntry)
+            *foundEntry = entry;
+        DEBUG_PRINT("searchIndex: Found key at index %u\n", pos);
+        return true;
     }
     DEBUG_PRINT("searchIndex: Key not found.\n");
     return false;
@@ -482,17 +2234,22 @@ bool DBEngine::searchIndex(uint32_t key, uint32_t* foundIndex) const {
 
 //
 // findIndexEntry()
-//   Searches for an index entry by key and, if found, returns its file offset.
+//   Searches for an index entry by key and, if found, returns its file offset
+//   (or the whole entry).
 //
 bool DBEngine::findIndexEntry(uint32_t key, uint32_t& offset) const {
+    IndexEntry entry;
+    if (!findIndexEntry(key, entry))
+        return false;
+    offset = entry.offset;
+    return true;
+}
+
+bool DBEngine::findIndexEntry(uint32_t key, IndexEntry& entry) const {
     SCOPE_TIMER("DBEngine::findIndexEntry");
     uint32_t idx;
-    if (searchIndex(key, &idx)) {
-        IndexEntry entry;
-        if (!const_cast<DBEngine*>(this)->getIndexEntry(idx, entry))
-            return false;
-        offset = entry.offset;
-        DEBUG_PRINT("findIndexEntry: Found key=%u at index %u with offset=%u\n", key, idx, offset);
+    if (lookupKey(key, &idx, &entry)) {
+        DEBUG_PRINT("findIndexEntry: Found key=%u at index %u with offset=%u\n", key, idx, entry.offset);
         return true;
     }
     DEBUG_PRINT("findIndexEntry: Key=%u not found.\n", key);
@@ -503,48 +2260,29 @@ bool DBEngine::findIndexEntry(uint32_t key, uint32_t& offset) const {
 // B-TreeStyle Search Methods
 //
 bool DBEngine::findKey(uint32_t key, uint32_t* index) {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::btreeFindKey");
-    uint32_t low = 0, high = _indexCount;
     DEBUG_PRINT("btreeFindKey: Searching for key=%u\n", key);
-    while (low < high) {
-        uint32_t mid = (low + high) / 2;
-        IndexEntry entry;
-        if (!getIndexEntry(mid, entry))
-            return false;
-        if (entry.key == key) {
-            *index = mid;
-            DEBUG_PRINT("btreeFindKey: Found key at index %u\n", mid);
-            return true;
-        }
-        else if (entry.key < key) {
-            low = mid + 1;
-        }
-        else {
-            high = mid;
-        }
+    uint32_t pos;
+    IndexEntry entry;
+    if (!lowerBound(key, &pos, &entry) || pos >= _indexCount)
+        return false;
+    if (entry.key == key) {
+        *index = pos;
+        DEBUG_PRINT("btreeFindKey: Found key at index %u\n", pos);
+        return true;
     }
     DEBUG_PRINT("btreeFindKey: Key not found.\n");
     return false;
 }
 
 bool DBEngine::locateKey(uint32_t key, uint32_t* index) {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::btreeLocateKey");
-    uint32_t low = 0, high = _indexCount;
-    uint32_t result = _indexCount;
+    uint32_t result;
     DEBUG_PRINT("btreeLocateKey: Locating key=%u\n", key);
-    while (low < high) {
-        uint32_t mid = (low + high) / 2;
-        IndexEntry entry;
-        if (!getIndexEntry(mid, entry))
-            return false;
-        if (entry.key >= key) {
-            result = mid;
-            high = mid;
-        }
-        else {
-            low = mid + 1;
-        }
-    }
+    if (!lowerBound(key, &result))
+        return false;
     if (result < _indexCount) {
         *index = result;
         DEBUG_PRINT("btreeLocateKey: Located key at index %u\n", result);
@@ -554,7 +2292,10 @@ bool DBEngine::locateKey(uint32_t key, uint32_t* index) {
     return false;
 }
 
+// Positions are global, so the neighbours are simply +/-1; reading them with
+// getIndexEntry() then follows the leaf links instead of descending the tree.
 bool DBEngine::nextKey(uint32_t currentIndex, uint32_t* nextIndex) {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::btreeNextKey");
     if (currentIndex + 1 < _indexCount) {
         *nextIndex = currentIndex + 1;
@@ -566,6 +2307,7 @@ bool DBEngine::nextKey(uint32_t currentIndex, uint32_t* nextIndex) {
 }
 
 bool DBEngine::prevKey(uint32_t currentIndex, uint32_t* prevIndex) {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::btreePrevKey");
     if (currentIndex > 0) {
         *prevIndex = currentIndex - 1;
@@ -580,25 +2322,31 @@ bool DBEngine::prevKey(uint32_t currentIndex, uint32_t* prevIndex) {
 // dbFindRecordsByStatus()
 //   Searches the index for records with the specified status.
 //   Fills the provided results array with the global index positions.
+//   Subtrees whose status summary lacks the status are not loaded.
 //
 size_t DBEngine::findByStatus(uint8_t status, uint32_t results[], size_t maxResults) const {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::dbFindRecordsByStatus");
     size_t count = 0;
     DEBUG_PRINT("dbFindRecordsByStatus: Searching for status=%u\n", status);
-    for (uint32_t i = 0; i < _indexCount && count < maxResults; i++) {
-        IndexEntry entry;
-        if (!const_cast<DBEngine*>(this)->getIndexEntry(i, entry))
-            break;
-        if (entry.status == status) {
-            results[count++] = i;
-            DEBUG_PRINT("dbFindRecordsByStatus: Found status at index %u\n", i);
-        }
+    IndexFilter filter = { true, status, 0, 0 };
+#if DB_RESIDENT_INDEX
+    if (parallelScan(filter, results, maxResults, count))
+        return count;
+#endif
+    IndexEntry entry;
+    uint32_t position = 0;
+    while (count < maxResults && findMatchingEntry(position, filter, entry, position)) {
+        results[count++] = position;
+        DEBUG_PRINT("dbFindRecordsByStatus: Found status at index %u\n", position);
+        position++;
     }
     DEBUG_PRINT("dbFindRecordsByStatus: Found %zu matching records.\n", count);
     return count;
 }
 
 size_t DBEngine::indexCount(void) const {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::dbGetIndexCount");
     DEBUG_PRINT("dbGetIndexCount: _indexCount = %u\n", _indexCount);
     return _indexCount;
@@ -613,6 +2361,25 @@ bool DBEngine::loadIndex(void) {
     SCOPE_TIMER("DBEngine::dbBuildIndex");
     DEBUG_PRINT("dbBuildIndex: Building index...\n");
     bool result = loadIndexHeader();
+    // A header that cannot be read (or upgraded) is replaced by one rebuilt
+    // from the log, and so is a missing index when the log is not empty.
+    if (!result) {
+        DEBUG_PRINT("dbBuildIndex: Unreadable index header; rebuilding from the log.\n");
+        return rebuildIndexFromLog();
+    }
+    if (_bulkLoading) {
+        DEBUG_PRINT("dbBuildIndex: Bulk load was not finished; rebuilding.\n");
+        return rebuildIndexFromLog();
+    }
+    // Power was lost between the first page write of a commit and its header.
+    if (_pagesAhead) {
+        DEBUG_PRINT("dbBuildIndex: Pages written after the last committed header; rebuilding.\n");
+        return rebuildIndexFromLog();
+    }
+    if (_indexCount == 0 && logHasRecords()) {
+        DEBUG_PRINT("dbBuildIndex: Empty index for a non-empty log; rebuilding.\n");
+        return rebuildIndexFromLog();
+    }
     // If the file did not exist, _indexCount was set to 0.
     // Create an empty index file by saving the header.
     if (_indexCount == 0) {
@@ -621,16 +2388,72 @@ bool DBEngine::loadIndex(void) {
             return false;
         }
     }
-    // Validate the index to detect corruption.
+    // Validate the index to detect corruption. This also leaves the root
+    // resident, so the first lookup only has to load its leaf.
     if (!validateIndex()) {
-        DEBUG_PRINT("dbBuildIndex: Index corruption detected.\n");
-        // Here you might trigger a rebuild from the log file.
-        return false;
+        DEBUG_PRINT("dbBuildIndex: Index corruption detected; rebuilding from the log.\n");
+        return rebuildIndexFromLog();
     }
     DEBUG_PRINT("dbBuildIndex: _indexCount = %u\n", _indexCount);
     return result;
 }
 
+//
+// findMatchingEntry()
+//   Depth-first walk from the root, starting at global position 'start'. At
+//   each interior page the children that end before 'start' or whose summary
+//   rules out a match are skipped; only leaves that may hold a match are read.
+//
+bool DBEngine::findMatchingEntry(uint32_t start, const IndexFilter& filter, IndexEntry& entry, uint32_t& position) const {
+    SCOPE_TIMER("DBEngine::findMatchingEntry");
+    if (start >= _indexCount)
+        return false;
+
+    IndexPath path;
+    IndexPage scratch;
+    uint32_t base = 0;  // Global position of the first entry below path.page[level].
+    uint8_t level = 0;
+    path.page[0] = _rootPage;
+    path.child[0] = 0;
+    for (;;) {
+        const IndexPage* page = viewIndexPage(path.page[level], scratch);
+        if (!page)
+            return false;
+        const IndexPage& node = *page;
+        if (level + 1 == _treeHeight) {
+            LeafCodec codec;
+            leafCodec(node, codec);
+            for (uint32_t i = (start > base) ? start - base : 0; i < node.header.count; i++) {
+                leafEntry(node, codec, static_cast<uint16_t>(i), entry);
+                if (filter.matches(entry)) {
+                    position = base + i;
+                    return true;
+                }
+            }
+            base += node.header.count;
+        }
+        else {
+            uint16_t child = path.child[level];
+            while (child < node.header.count &&
+                (base + node.children[child].count <= start || !filter.mayMatch(node.children[child]))) {
+                base += node.children[child].count;
+                child++;
+            }
+            if (child < node.header.count) {
+                path.child[level] = child + 1;
+                path.page[level + 1] = node.children[child].page;
+                path.child[level + 1] = 0;
+                level++;
+                continue;
+            }
+        }
+        // This subtree is exhausted; carry on in its parent.
+        if (level == 0)
+            return false;
+        level--;
+    }
+}
+
 // Generic function: returns the first index entry for which:
 //    (entry.internal_status & mustBeSet) == mustBeSet   AND
 //    (entry.internal_status & mustBeClear) == 0
@@ -638,35 +2461,16 @@ bool DBEngine::loadIndex(void) {
 // If found, 'entry' is set to that entry and 'indexPosition' to its global index.
 bool DBEngine::getFirstMatchingIndexEntry(uint8_t mustBeSet, uint8_t mustBeClear,
     IndexEntry& entry, uint32_t& indexPosition) const {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::getFirstMatchingIndexEntry");
     DEBUG_PRINT("getFirstMatchingIndexEntry: Looking for first index entry matching (set: 0x%02X, clear: 0x%02X).\n",
         mustBeSet, mustBeClear);
 
-    if (_indexCount == 0)
-        return false;
-
-    uint32_t totalPages = (_indexCount + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES;
-    // Use const_cast to allow page loading (or mark caching members as mutable).
-    DBEngine* engine = const_cast<DBEngine*>(this);
-
-    // Instead of maintaining a separate counter, compute the page offset once.
-    for (uint32_t page = 0; page < totalPages; ++page) {
-        if (!engine->loadIndexPage(page)) {
-            DEBUG_PRINT("getFirstMatchingIndexEntry: Failed to load page %u.\n", page);
-            return false;
-        }
-        uint32_t pageOffset = page * MAX_INDEX_ENTRIES;
-        uint32_t entriesInPage = MIN(MAX_INDEX_ENTRIES, _indexCount - pageOffset);
-        for (uint32_t i = 0; i < entriesInPage; ++i) {
-            uint8_t status = engine->_indexPage[i].internal_status;
-            if (((status & mustBeSet) == mustBeSet) && ((status & mustBeClear) == 0)) {
-                entry = engine->_indexPage[i];
-                indexPosition = pageOffset + i;
-                DEBUG_PRINT("getFirstMatchingIndexEntry: Found matching entry at global index %u (key=%u).\n",
-                    indexPosition, entry.key);
-                return true;
-            }
-        }
+    IndexFilter filter = { false, 0, mustBeSet, mustBeClear };
+    if (findMatchingEntry(0, filter, entry, indexPosition)) {
+        DEBUG_PRINT("getFirstMatchingIndexEntry: Found matching entry at global index %u (key=%u).\n",
+            indexPosition, entry.key);
+        return true;
     }
 
     DEBUG_PRINT("getFirstMatchingIndexEntry: No matching index entry found.\n");
@@ -702,36 +2506,481 @@ size_t DBEngine::recordCount(uint8_t internalStatus) const {
 // This lets the caller count records that, for example, have the
 // deletion flag set, or records that do not have the deletion flag.
 size_t DBEngine::recordCount(uint8_t mustBeSet, uint8_t mustBeClear) const {
+    DB_READ_LOCK(_lock);
     SCOPE_TIMER("DBEngine::recordCount");
     size_t count = 0;
-
-    // We need to load pages even in a const method.
-    // Either mark members used for caching as 'mutable'
-    // or use const_cast.
-    DBEngine* engine = const_cast<DBEngine*>(this);
+    IndexPage scratch;
+
+    // Criteria on the deletion flag alone are answered from the root's summaries.
+    if (_treeHeight > 1 && ((mustBeSet | mustBeClear) & ~INTERNAL_STATUS_DELETED) == 0) {
+        const IndexPage* root = viewIndexPage(_rootPage, scratch);
+        if (root) {
+            IndexChildRef summary;
+            summarizeIndexPage(*root, summary);
+            if (mustBeSet & mustBeClear)
+                count = 0;
+            else if (mustBeSet)
+                count = summary.deleted;
+            else if (mustBeClear)
+                count = summary.count - summary.deleted;
+            else
+                count = summary.count;
+            DEBUG_PRINT("recordCount: %zu matching records from the root summary.\n", count);
+            return count;
+        }
+    }
 
     DEBUG_PRINT("recordCount: Scanning %u index entries for (set: 0x%02X, clear: 0x%02X).\n",
         _indexCount, mustBeSet, mustBeClear);
+#if DB_RESIDENT_INDEX
+    IndexFilter filter = { false, 0, mustBeSet, mustBeClear };
+    if (parallelScan(filter, nullptr, 0, count))
+        return count;
+#endif
 
-    // Compute the total number of pages that hold the index entries.
-    uint32_t totalPages = (_indexCount + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES;
-    for (uint32_t page = 0; page < totalPages; ++page) {
-        if (!engine->loadIndexPage(page)) {
-            DEBUG_PRINT("recordCount: Failed to load page %u. Skipping...\n", page);
-            continue;
+    // Walk the leaf chain from the first leaf.
+    uint32_t seen = 0;
+    for (uint32_t page = _firstLeaf; page != DB_NO_PAGE && seen < _indexCount;) {
+        const IndexPage* leaf = viewIndexPage(page, scratch);
+        if (!leaf) {
+            DEBUG_PRINT("recordCount: Failed to load page %u. Stopping...\n", page);
+            break;
         }
-        // Determine how many entries are in the current page.
-        uint32_t pageFirstIndex = page * MAX_INDEX_ENTRIES;
-        uint32_t entriesInPage = MIN(MAX_INDEX_ENTRIES, _indexCount - pageFirstIndex);
+        uint32_t entriesInPage = leaf->header.count;
+        LeafCodec codec;
+        leafCodec(*leaf, codec);
+        IndexEntry entry;
         for (uint32_t i = 0; i < entriesInPage; ++i) {
-            uint8_t status = engine->_indexPage[i].internal_status;
+            leafEntry(*leaf, codec, static_cast<uint16_t>(i), entry);
+            uint8_t status = entry.internal_status;
             // Check that all bits in 'mustBeSet' are set and none of the bits in 'mustBeClear' are set.
             if (((status & mustBeSet) == mustBeSet) && ((status & mustBeClear) == 0))
                 ++count;
         }
+        seen += entriesInPage;
+        page = leaf->header.next;
     }
     DEBUG_PRINT("recordCount: Found %zu matching records (set: 0x%02X, clear: 0x%02X).\n",
         count, mustBeSet, mustBeClear);
     return count;
 }
 
+#if DB_RESIDENT_INDEX
+// ---------------------------------------------------------------------------
+// Resident index
+//
+// With setResidentIndex(true), open() reads the whole index into one slot per
+// page and the page cache is not used: findCachedPage() indexes the slot of the
+// page, evictIndexPage() hands it out, and nothing is written before sync() or
+// close(), which write the dirty slots in page order. The bottom-up builder
+// still borrows _pageCache[0] and [1] as work buffers; once it replaces the
+// index, invalidateIndexCache() drops the slots and pages come back as they are
+// used, or all at once with the next parallel scan.
+//
+// The pages are copied into the slots even where IFileHandler::map() could
+// expose the file in place. Pages change in place and are written back one
+// by one, and a mapping is read-only and only valid until the next write. A
+// handler that maps the file still saves the reads of the initial load.
+// ---------------------------------------------------------------------------
+
+void DBEngine::setResidentIndex(bool enabled, unsigned scanThreads) {
+    DB_WRITE_LOCK(_lock);
+    _newResident = enabled;
+    _scanThreads = scanThreads;
+}
+
+DBEngine::IndexPageSlot* DBEngine::residentSlot(uint32_t pageNumber) const {
+    if (pageNumber >= _residentPages.size())
+        _residentPages.resize(pageNumber + 1);
+    if (!_residentPages[pageNumber]) {
+        _residentPages[pageNumber].reset(new IndexPageSlot);
+        _residentPages[pageNumber]->loaded = false;
+        _residentPages[pageNumber]->dirty = false;
+    }
+    return _residentPages[pageNumber].get();
+}
+
+// Pages follow each other in the file, so only resident pages need a seek.
+// Without a mapping of the whole index, the pages are read one by one.
+bool DBEngine::loadResidentIndex(void) const {
+    SCOPE_TIMER("DBEngine::loadResidentIndex");
+    if (_pageCount > 0)
+        residentSlot(_pageCount - 1);
+    if (!openIndexFile("rb"))
+        return false;
+    const uint8_t* mapped = (_pageCount > 0) ?
+        _indexHandler.map(indexPageOffset(0), _pageCount * sizeof(IndexPage)) : nullptr;
+    bool ok = true;
+    bool seek = true;
+    uint32_t loaded = 0;
+    for (uint32_t page = 0; ok && page < _pageCount; page++) {
+        IndexPageSlot* slot = residentSlot(page);
+        if (slot->loaded) {
+            seek = true;
+            continue;
+        }
+        size_t bytesRead = 0;
+        if (mapped) {
+            memcpy(&slot->page, mapped + static_cast<size_t>(page) * sizeof(IndexPage), sizeof(slot->page));
+            bytesRead = sizeof(slot->page);
+        }
+        else {
+            ok = !seek || _indexHandler.seek(indexPageOffset(page));
+            seek = false;
+            // A short read past the end of the file leaves a page of zeros.
+            if (ok && !_indexHandler.read(reinterpret_cast<uint8_t*>(&slot->page), sizeof(slot->page), bytesRead))
+                seek = true;
+        }
+        _stats.pageLoads++;
+        if (ok && checkIndexPage(slot->page, sizeof(slot->page), bytesRead)) {
+            slot->pageNumber = page;
+            slot->loaded = true;
+            slot->dirty = false;
+            slot->lastUsed = _cacheTick;
+            loaded++;
+        }
+    }
+    closeIndexFile();
+    _residentComplete = ok;
+    DEBUG_PRINT("loadResidentIndex: Read %u of %u pages.\n", loaded, _pageCount);
+    return ok;
+}
+
+bool DBEngine::flushResidentPages(bool& anyFlushed) {
+    for (size_t i = 0; i < _residentPages.size(); i++) {
+        IndexPageSlot* slot = _residentPages[i].get();
+        if (slot && slot->loaded && slot->dirty) {
+            if (!flushIndexPage(*slot, false))
+                return false;
+            anyFlushed = true;
+        }
+    }
+    return true;
+}
+
+bool DBEngine::parallelScan(const IndexFilter& filter, uint32_t results[], size_t maxResults, size_t& found) const {
+    SCOPE_TIMER("DBEngine::parallelScan");
+    unsigned threads = _scanThreads ? _scanThreads : std::thread::hardware_concurrency();
+    if (threads > _indexCount / DB_SCAN_CHUNK_ENTRIES)
+        threads = _indexCount / DB_SCAN_CHUNK_ENTRIES;
+    if (!_resident || _treeHeight == 0 || threads < 2)
+        return false;
+    {
+        // The chunks read the slots without locking, so all must be loaded first.
+        DB_CACHE_LOCK(_cacheLock);
+        if (!_residentComplete && !loadResidentIndex())
+            return false;
+    }
+    std::vector<IndexScanChunk> chunks(threads);
+    for (unsigned i = 0; i < threads; i++) {
+        chunks[i].first = static_cast<uint32_t>(static_cast<uint64_t>(_indexCount) * i / threads);
+        chunks[i].end = static_cast<uint32_t>(static_cast<uint64_t>(_indexCount) * (i + 1) / threads);
+        chunks[i].collect = (results != nullptr);
+        chunks[i].limit = results ? maxResults : static_cast<size_t>(-1);
+        chunks[i].count = 0;
+        chunks[i].ok = true;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+        workers.push_back(std::thread(&DBEngine::scanIndexChunk, this, &filter, &chunks[i]));
+    scanIndexChunk(&filter, &chunks[0]);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    found = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        if (!chunks[i].ok)
+            return false;
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        if (!results) {
+            found += chunks[i].count;
+            continue;
+        }
+        for (size_t n = 0; n < chunks[i].positions.size() && found < maxResults; n++)
+            results[found++] = chunks[i].positions[n];
+    }
+    DEBUG_PRINT("parallelScan: %zu matches in %u chunks.\n", found, threads);
+    return true;
+}
+
+void DBEngine::scanIndexChunk(const IndexFilter* filter, IndexScanChunk* chunk) const {
+    IndexPath path;
+    uint32_t base = 0;  // Global position of the first entry below path.page[level].
+    uint8_t level = 0;
+    path.page[0] = _rootPage;
+    path.child[0] = 0;
+    for (;;) {
+        uint32_t pageNumber = path.page[level];
+        const IndexPageSlot* slot = (pageNumber < _residentPages.size()) ? _residentPages[pageNumber].get() : nullptr;
+        if (!slot || !slot->loaded) {
+            chunk->ok = false;
+            return;
+        }
+        const IndexPage& node = slot->page;
+        if (level + 1 == _treeHeight) {
+            LeafCodec codec;
+            leafCodec(node, codec);
+            IndexEntry entry;
+            uint32_t end = MIN(static_cast<uint32_t>(node.header.count), chunk->end - base);
+            for (uint32_t i = (chunk->first > base) ? chunk->first - base : 0; i < end; i++) {
+                leafEntry(node, codec, static_cast<uint16_t>(i), entry);
+                if (!filter->matches(entry))
+                    continue;
+                if (chunk->collect)
+                    chunk->positions.push_back(base + i);
+                if (++chunk->count >= chunk->limit)
+                    return;
+            }
+            base += node.header.count;
+        }
+        else {
+            uint16_t child = path.child[level];
+            while (child < node.header.count && base < chunk->end &&
+                (base + node.children[child].count <= chunk->first || !filter->mayMatch(node.children[child]))) {
+                base += node.children[child].count;
+                child++;
+            }
+            if (child < node.header.count && base < chunk->end) {
+                path.child[level] = child + 1;
+                path.page[level + 1] = node.children[child].page;
+                path.child[level + 1] = 0;
+                level++;
+                continue;
+            }
+        }
+        if (level == 0)
+            return;
+        level--;
+    }
+}
+#endif
+
+#if DB_AGGREGATES > 0
+// ---------------------------------------------------------------------------
+// Range aggregates
+//
+// Every child reference of an interior page carries a DBAggregate per field
+// for its subtree. A leaf has no room for its own, so its aggregates live in
+// the reference to it, and a single-leaf tree has none. append() adds the
+// fields of a new record to each reference on its path. What cannot be kept
+// up to date that way marks references stale instead: a delete marks its
+// path, a split in the middle of a leaf both halves, and bulk loads and
+// rebuilds write stale leaf references. A split past the end of the last
+// leaf, the normal case for ascending keys, keeps the old leaf's aggregates.
+// aggregateRange() merges the fresh subtrees inside the range and reads the
+// records of the rest; refreshAggregates() makes the references fresh again.
+// ---------------------------------------------------------------------------
+
+void DBEngine::setAggregateExtractor(DBAggregateExtractor extractor) {
+    DB_WRITE_LOCK(_lock);
+    _aggregateExtractor = extractor;
+}
+
+uint32_t DBEngine::extractAggregates(uint8_t recordType, const void* record, uint16_t recordSize,
+    float values[DB_AGGREGATES]) const {
+    if (!_aggregateExtractor || recordSize > DB_AGGREGATE_MAX_RECORD)
+        return 0;
+    return _aggregateExtractor(recordType, record, recordSize, values) & ((1u << DB_AGGREGATES) - 1);
+}
+
+bool DBEngine::addRecordAggregates(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize) {
+    float values[DB_AGGREGATES];
+    uint32_t mask = extractAggregates(recordType, record, recordSize, values);
+    if (mask == 0)
+        return true;
+    return updateAggregates(key, values, mask);
+}
+
+bool DBEngine::updateAggregates(uint32_t key, const float* values, uint32_t mask) {
+    if (_treeHeight < 2)
+        return true;
+    IndexPath path;
+    uint32_t firstPosition;
+    if (!descendToKey(key, path, firstPosition))
+        return false;
+    for (uint8_t level = 0; level + 1 < path.depth; level++) {
+        IndexPageSlot* node = getIndexPage(path.page[level]);
+        if (!node)
+            return false;
+        DBAggregate* aggregates = node->page.children[path.child[level]].aggregates;
+        for (uint32_t f = 0; f < DB_AGGREGATES; f++) {
+            if (!values)
+                aggregates[f].count = DB_AGGREGATE_STALE;
+            else if (mask & (1u << f))
+                addAggregateValue(aggregates[f], values[f]);
+        }
+        node->dirty = true;
+    }
+    return true;
+}
+
+//
+// scanAggregates()
+//   Reads the records one by one. readLogRecord() has read the header when it
+//   refuses a record for its length, which skips records too long to aggregate.
+//
+bool DBEngine::scanAggregates(const IndexPage& leaf, uint16_t first, uint16_t end, DBAggregate results[DB_AGGREGATES]) {
+    LeafCodec codec;
+    leafCodec(leaf, codec);
+    uint8_t record[DB_AGGREGATE_MAX_RECORD];
+    for (uint16_t i = first; i < end; i++) {
+        IndexEntry entry;
+        leafEntry(leaf, codec, i, entry);
+        if ((entry.internal_status & INTERNAL_STATUS_DELETED) || entry.offset == DB_NO_OFFSET)
+            continue;
+        LogEntryHeader header;
+        header.length = 0;
+        header.internal_status = 0;
+        if (!readLogRecord(entry, header, record, sizeof(record))) {
+            if (header.length > sizeof(record) && (header.internal_status & INTERNAL_STATUS_ENCODED) == 0)
+                continue;
+            DEBUG_PRINT("scanAggregates: Failed to read the record of key=%u.\n", entry.key);
+            return false;
+        }
+        float values[DB_AGGREGATES];
+        uint32_t mask = extractAggregates(header.recordType, record, header.length, values);
+        for (uint32_t f = 0; f < DB_AGGREGATES; f++) {
+            if (mask & (1u << f))
+                addAggregateValue(results[f], values[f]);
+        }
+    }
+    return true;
+}
+
+//
+// aggregateRange()
+//   Works from position to position: each step descends to the highest fresh
+//   subtree that starts at the position and ends inside the range, or else to
+//   the leaf holding the position, whose part in the range is read.
+//
+bool DBEngine::aggregateRange(uint32_t firstKey, uint32_t lastKey, DBAggregate results[DB_AGGREGATES]) {
+    DB_READ_LOCK(_lock);
+    SCOPE_TIMER("DBEngine::aggregateRange");
+    for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+        resetAggregate(results[f], 0);
+    if (firstKey > lastKey || _indexCount == 0)
+        return true;
+    uint32_t position, end;
+    if (!lowerBound(firstKey, &position))
+        return false;
+    if (lastKey == 0xFFFFFFFFu)
+        end = _indexCount;
+    else if (!lowerBound(lastKey + 1, &end))
+        return false;
+
+    IndexPage scratch;
+    while (position < end) {
+        uint32_t page = _rootPage;
+        uint32_t first = 0;
+        bool merged = false;
+        for (uint8_t level = 0; level + 1 < _treeHeight && !merged; level++) {
+            const IndexPage* node = viewIndexPage(page, scratch);
+            if (!node || node->header.type != INDEX_PAGE_INTERIOR || node->header.count == 0)
+                return false;
+            uint16_t child = 0;
+            while (child + 1 < node->header.count && position >= first + node->children[child].count) {
+                first += node->children[child].count;
+                child++;
+            }
+            const IndexChildRef& ref = node->children[child];
+            if (first == position && position + ref.count <= end && !aggregatesStale(ref)) {
+                for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+                    mergeAggregate(results[f], ref.aggregates[f]);
+                position += ref.count;
+                merged = true;
+            }
+            page = ref.page;
+        }
+        if (merged)
+            continue;
+
+        const IndexPage* leaf = viewIndexPage(page, scratch);
+        if (!leaf || leaf->header.type != INDEX_PAGE_LEAF || position - first >= leaf->header.count) {
+            DEBUG_PRINT("aggregateRange: Position %u not found in leaf %u.\n", position, page);
+            return false;
+        }
+        uint32_t stop = first + leaf->header.count;
+        if (stop > end)
+            stop = end;
+        if (!scanAggregates(*leaf, static_cast<uint16_t>(position - first), static_cast<uint16_t>(stop - first), results))
+            return false;
+        position = stop;
+    }
+    return true;
+}
+
+//
+// refreshAggregates()
+//   Visits the leaves in order. A stale leaf reference is recomputed from the
+//   records; the levels above are merged again whenever one of them is
+//   stale, so each is complete once its last leaf has been visited.
+//
+bool DBEngine::refreshAggregates(bool all) {
+    DB_WRITE_LOCK(_lock);
+    SCOPE_TIMER("DBEngine::refreshAggregates");
+    if (_treeHeight < 2)
+        return true;
+    uint32_t position = 0;
+    while (position < _indexCount) {
+        IndexPath path;
+        uint32_t offsetInLeaf;
+        if (!descendToPosition(position, path, offsetInLeaf))
+            return false;
+        uint8_t parentLevel = path.depth - 2;
+        uint32_t leafCount = 0;
+        bool leafStale = false;
+        bool pathStale = false;
+        for (uint8_t level = 0; level <= parentLevel; level++) {
+            IndexPageSlot* node = getIndexPage(path.page[level]);
+            if (!node)
+                return false;
+            const IndexChildRef& ref = node->page.children[path.child[level]];
+            bool stale = all || aggregatesStale(ref);
+            if (level == parentLevel) {
+                leafStale = stale;
+                leafCount = ref.count;
+            }
+            else {
+                pathStale = pathStale || stale;
+            }
+        }
+        if (leafCount == 0)
+            return false;
+
+        if (leafStale) {
+            IndexPageSlot* leaf = getIndexPage(path.page[path.depth - 1]);
+            if (!leaf)
+                return false;
+            DBAggregate aggregates[DB_AGGREGATES];
+            for (uint32_t f = 0; f < DB_AGGREGATES; f++)
+                resetAggregate(aggregates[f], 0);
+            if (!scanAggregates(leaf->page, 0, leaf->page.header.count, aggregates))
+                return false;
+            IndexPageSlot* parent = getIndexPage(path.page[parentLevel]);
+            if (!parent)
+                return false;
+            memcpy(parent->page.children[path.child[parentLevel]].aggregates, aggregates, sizeof(aggregates));
+            parent->dirty = true;
+        }
+        if (leafStale || pathStale) {
+            for (uint8_t level = parentLevel; level-- > 0;) {
+                IndexPageSlot* node = getIndexPage(path.page[level + 1]);
+                if (!node)
+                    return false;
+                IndexChildRef summary;
+                summarizeIndexPage(node->page, summary);
+                IndexPageSlot* upper = getIndexPage(path.page[level]);
+                if (!upper)
+                    return false;
+                memcpy(upper->page.children[path.child[level]].aggregates, summary.aggregates, sizeof(summary.aggregates));
+                upper->dirty = true;
+            }
+        }
+        position += leafCount - offsetInLeaf;
+    }
+    return flushIndexPages();
+}
+#endif
+
+DB_NAMESPACE_END
@@ -0,0 +1,357 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// Define our own MIN macro since STL is not permitted.
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// ---------------------------------------------------------------------------
+// Index recovery
+//
+// rebuildIndex() recreates the index from the log alone. Each log file is read
+// once, front to back, in DB_BATCH_BUFFER_SIZE pieces, and every record header
+// becomes an index entry. The entries are sorted externally: each page worth
+// of them is sorted in RAM and written to the index file as a run, runs are
+// merged DB_RECOVERY_FANIN at a time until one merge can take all of them, and
+// that last merge feeds the bottom-up builder, which writes the new tree in a
+// single sequential pass. Only the page cache and _batchBuffer are used.
+//
+// Runs are stored back to back from page 0, with MAX_INDEX_ENTRIES entries on
+// every page but the last, so run r of length L simply starts at entry r * L.
+// Merge passes alternate between pages [0, R) and [R, 2R) for R run pages, and
+// the tree is built on whichever of the two the last merge does not read.
+// ---------------------------------------------------------------------------
+
+static_assert(DB_BATCH_BUFFER_SIZE / sizeof(IndexEntry) >= DB_RECOVERY_FANIN,
+    "DB_BATCH_BUFFER_SIZE must hold at least one IndexEntry per merged run");
+
+// Stable bottom-up merge sort by key; 'scratch' must hold 'count' entries.
+static void sortEntriesByKey(IndexEntry* entries, IndexEntry* scratch, uint32_t count) {
+    IndexEntry* from = entries;
+    IndexEntry* to = scratch;
+    for (uint32_t width = 1; width < count; width *= 2) {
+        for (uint32_t left = 0; left < count; left += 2 * width) {
+            uint32_t mid = MIN(left + width, count);
+            uint32_t right = MIN(left + 2 * width, count);
+            uint32_t i = left, j = mid, k = left;
+            while (i < mid && j < right)
+                to[k++] = (from[j].key < from[i].key) ? from[j++] : from[i++];
+            while (i < mid)
+                to[k++] = from[i++];
+            while (j < right)
+                to[k++] = from[j++];
+        }
+        IndexEntry* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != entries)
+        memcpy(entries, from, count * sizeof(IndexEntry));
+}
+
+bool DBEngine::rebuildIndex(void) {
+    DB_WRITE_LOCK(_lock);
+    return rebuildIndexFromLog();
+}
+
+bool DBEngine::rebuildIndexFromLog(void) {
+    SCOPE_TIMER("DBEngine::rebuildIndex");
+    // Records staged by a bulk load have to be in the log before it is scanned;
+    // the rebuilt index then covers them, which ends the bulk load.
+    if (_bulkLoading && !flushBulkRecords())
+        return false;
+    _bulkLoading = false;
+    resetRecordCodecs();
+    // Whatever is cached belongs to the index being replaced. Saving an empty
+    // index first means an interrupted rebuild is simply started again by the
+    // next open(), which finds an empty index next to a non-empty log.
+    invalidateIndexCache();
+    _indexCount = 0;
+    _rootPage = DB_NO_PAGE;
+    _firstLeaf = DB_NO_PAGE;
+    _lastLeaf = DB_NO_PAGE;
+    _freePage = DB_NO_PAGE;
+    _pageCount = 0;
+    _treeHeight = 0;
+    _maxKeyValid = false;
+    _logGeneration = 0;
+    _compacting = false;
+    if (!saveIndexHeader())
+        return false;
+
+    uint32_t total = 0;
+    bool ok = true;
+    if (_segmentCount > 0) {
+        // Oldest segment first, so that later records of a key come later.
+        for (uint8_t segment = _oldestSegment; ok; segment = static_cast<uint8_t>((segment + 1) % _segmentCount)) {
+            if (openLogSegment(segment, "rb+")) {
+                ok = scanLogForRecovery(_logHandler, static_cast<uint32_t>(segment) * _segmentSize, 0, total);
+                closeLogFile();
+            }
+            if (segment == _newestSegment)
+                break;
+        }
+    }
+    else {
+        ok = openLogFile("rb+") && scanLogForRecovery(_logHandler, 0, 0, total);
+        closeLogFile();
+    }
+
+    // A compaction file only exists while a compaction is unfinished. It holds
+    // the newer copies, so it is read after the log, and the compaction
+    // resumes from the first key. The file is not left open here: open() checks
+    // for it again in recoverCompaction().
+    if (ok && _compactHandler && _segmentCount == 0) {
+        bool held = _compactOpen;
+        if (held || _compactHandler->open(_compactFileName, "rb+")) {
+            ok = scanLogForRecovery(*_compactHandler, 0, INTERNAL_STATUS_LOG_GEN, total);
+            if (!held)
+                _compactHandler->close();
+            _compacting = true;
+            _compactNextKey = 0;
+            _compactKeysDone = false;
+        }
+    }
+    if (ok && total % MAX_INDEX_ENTRIES != 0)
+        ok = writeRecoveryRun(static_cast<uint16_t>(total % MAX_INDEX_ENTRIES), total / MAX_INDEX_ENTRIES);
+    if (!ok) {
+        DEBUG_PRINT("rebuildIndex: Failed to read the log.\n");
+        return false;
+    }
+
+    uint32_t runPages = (total + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES;
+    uint32_t source = 0;
+    uint32_t runLength = MAX_INDEX_ENTRIES;
+    while (total > static_cast<uint64_t>(runLength) * DB_RECOVERY_FANIN) {
+        uint32_t target = (source == 0) ? runPages : 0;
+        if (!mergeRecoveryRuns(source, target, total, runLength))
+            return false;
+        source = target;
+        runLength *= DB_RECOVERY_FANIN;
+    }
+    // The leaves never need more pages than the runs they are merged from.
+    uint32_t firstPage = (source == 0) ? runPages : 0;
+    if (!beginIndexBuild(firstPage) || !mergeRecoveryRuns(source, DB_NO_PAGE, total, runLength) ||
+        !finishIndexBuild())
+        return false;
+
+    // Pages below the tree go on the free list, lowest page first.
+    IndexPage& freePage = _pageCache[0].page;
+    memset(&freePage.header, 0, sizeof(freePage.header));
+    freePage.header.type = INDEX_PAGE_FREE;
+    freePage.header.prev = DB_NO_PAGE;
+    for (uint32_t page = firstPage; page-- > 0;) {
+        freePage.header.next = _freePage;
+        if (!writeIndexPage(page, freePage, sizeof(freePage.header)))
+            return false;
+        _freePage = page;
+    }
+    DEBUG_PRINT("rebuildIndex: %u log records, %u index entries, tree height %u.\n",
+        total, _indexCount, _treeHeight);
+    return saveIndexHeader();
+}
+
+// Record headers are parsed out of _batchBuffer, which is refilled from the
+// first header that does not lie wholly inside it; payloads are skipped.
+bool DBEngine::scanLogForRecovery(IFileHandler& log, uint32_t base, uint8_t generation, uint32_t& total) {
+    if (!log.seekToEnd())
+        return false;
+    uint32_t size = log.tell();
+    DBHeader fileHeader;
+    size_t bytesRead = 0;
+    if (size < sizeof(fileHeader) || !log.seek(0) ||
+        !log.read(reinterpret_cast<uint8_t*>(&fileHeader), sizeof(fileHeader), bytesRead) ||
+        fileHeader.magic != DB_MAGIC_NUMBER) {
+        // Nothing was ever appended to a file without a complete header.
+        DEBUG_PRINT("scanLogForRecovery: No log header; file skipped.\n");
+        return true;
+    }
+
+    IndexEntry* run = _pageCache[1].page.entries;
+    const uint32_t headerBytes = static_cast<uint32_t>(logHeaderSize());
+    uint32_t bufferStart = 0;
+    uint32_t bufferUsed = 0;
+    uint32_t position = sizeof(DBHeader);
+    while (position < size) {
+        LogEntryHeader header;
+        if (size - position < headerBytes)
+            break;
+        if (position < bufferStart || position + headerBytes > bufferStart + bufferUsed) {
+            uint32_t chunk = MIN(static_cast<uint32_t>(sizeof(_batchBuffer)), size - position);
+            if (!log.seek(position) || !log.read(_batchBuffer, chunk, bytesRead) || bytesRead != chunk)
+                return false;
+            bufferStart = position;
+            bufferUsed = chunk;
+        }
+        memcpy(&header, &_batchBuffer[position - bufferStart], headerBytes);
+        if (header.length > size - position - headerBytes)
+            break;
+        if (_logChecksums) {
+            // The payload may run past the buffer; the check goes through it in pieces.
+            uint32_t crc = dbCrc32(0, &header, offsetof(LogEntryHeader, status));
+            uint32_t at = position + headerBytes;
+            uint32_t end = at + header.length;
+            while (at < end) {
+                if (at >= bufferStart + bufferUsed) {
+                    uint32_t chunk = MIN(static_cast<uint32_t>(sizeof(_batchBuffer)), size - at);
+                    if (!log.seek(at) || !log.read(_batchBuffer, chunk, bytesRead) || bytesRead != chunk)
+                        return false;
+                    bufferStart = at;
+                    bufferUsed = chunk;
+                }
+                uint32_t piece = MIN(end - at, bufferStart + bufferUsed - at);
+                crc = dbCrc32(crc, &_batchBuffer[at - bufferStart], piece);
+                at += piece;
+            }
+            if (crc != header.crc) {
+                DEBUG_PRINT("scanLogForRecovery: Checksum mismatch at offset %u; the log ends there.\n", position);
+                break;
+            }
+        }
+
+        IndexEntry& entry = run[total % MAX_INDEX_ENTRIES];
+        entry.key = header.key;
+        entry.offset = base + position;
+        entry.status = header.status;
+        entry.internal_status = static_cast<uint8_t>((header.internal_status & ~INTERNAL_STATUS_LOG_GEN) | generation);
+        // Whether exportSince() passed a change on is not in the log, so every
+        // record that has one is marked.
+        if (entry.status != 0 || (entry.internal_status & INTERNAL_STATUS_DELETED))
+            entry.internal_status |= INTERNAL_STATUS_CHANGED;
+        total++;
+        if (total % MAX_INDEX_ENTRIES == 0 && !writeRecoveryRun(MAX_INDEX_ENTRIES, total / MAX_INDEX_ENTRIES - 1))
+            return false;
+        position += headerBytes + header.length;
+    }
+
+    if (position < size) {
+        // Power was lost while this record was appended (or the record was damaged).
+        DEBUG_PRINT("scanLogForRecovery: Truncating torn record at offset %u (file size %u).\n", position, size);
+        if (!log.truncate(position)) {
+            DEBUG_PRINT("scanLogForRecovery: The file handler cannot truncate.\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DBEngine::writeRecoveryRun(uint16_t count, uint32_t page) {
+    IndexPage& run = _pageCache[1].page;
+    sortEntriesByKey(run.entries, _pageCache[0].page.entries, count);
+    run.header.type = INDEX_PAGE_FREE;
+    run.header.format = 0;
+    run.header.count = count;
+    run.header.prev = DB_NO_PAGE;
+    run.header.next = DB_NO_PAGE;
+    return writeIndexPage(page, run);
+}
+
+bool DBEngine::mergeRecoveryRuns(uint32_t fromPage, uint32_t toPage, uint32_t total, uint32_t runLength) {
+    SCOPE_TIMER("DBEngine::mergeRecoveryRuns");
+    // Each input run reads through its own slice of _batchBuffer.
+    const uint16_t slice = static_cast<uint16_t>(sizeof(_batchBuffer) / sizeof(IndexEntry) / DB_RECOVERY_FANIN);
+    IndexEntry* buffers = reinterpret_cast<IndexEntry*>(_batchBuffer);
+    struct {
+        uint32_t next;   // Next entry to read from the file.
+        uint32_t end;    // End of the run.
+        uint16_t used;   // Entries of the slice consumed.
+        uint16_t count;  // Entries in the slice (0 = run exhausted).
+    } runs[DB_RECOVERY_FANIN];
+
+    // Slot 0 collects the output pages; in the last merge it is the builder's leaf.
+    IndexPage& out = _pageCache[0].page;
+    if (toPage != DB_NO_PAGE) {
+        memset(&out.header, 0, sizeof(out.header));
+        out.header.type = INDEX_PAGE_FREE;
+        out.header.prev = DB_NO_PAGE;
+        out.header.next = DB_NO_PAGE;
+    }
+    uint32_t written = 0;
+    IndexEntry pending;
+    bool havePending = false;
+
+    for (uint64_t group = 0; group < total; group += static_cast<uint64_t>(runLength) * DB_RECOVERY_FANIN) {
+        uint32_t inputs = 0;
+        for (; inputs < DB_RECOVERY_FANIN && group + static_cast<uint64_t>(inputs) * runLength < total; inputs++) {
+            runs[inputs].next = static_cast<uint32_t>(group + static_cast<uint64_t>(inputs) * runLength);
+            runs[inputs].end = static_cast<uint32_t>(MIN(static_cast<uint64_t>(runs[inputs].next) + runLength,
+                static_cast<uint64_t>(total)));
+            runs[inputs].used = 0;
+            runs[inputs].count = 0;
+        }
+        for (;;) {
+            // Ties go to the earlier run, which holds the earlier records.
+            int best = -1;
+            for (uint32_t i = 0; i < inputs; i++) {
+                if (runs[i].used == runs[i].count) {
+                    uint32_t inPage = runs[i].next % MAX_INDEX_ENTRIES;
+                    uint16_t count = static_cast<uint16_t>(MIN(MIN(static_cast<uint32_t>(slice),
+                        runs[i].end - runs[i].next), MAX_INDEX_ENTRIES - inPage));
+                    if (count > 0 && !readIndexEntries(fromPage + runs[i].next / MAX_INDEX_ENTRIES,
+                        static_cast<uint16_t>(inPage), &buffers[i * slice], count))
+                        return false;
+                    runs[i].next += count;
+                    runs[i].used = 0;
+                    runs[i].count = count;
+                    if (count == 0)
+                        continue;
+                }
+                if (best < 0 || buffers[i * slice + runs[i].used].key <
+                    buffers[best * slice + runs[best].used].key)
+                    best = static_cast<int>(i);
+            }
+            if (best < 0)
+                break;
+            const IndexEntry& entry = buffers[best * slice + runs[best].used++];
+
+            if (toPage == DB_NO_PAGE) {
+                // Equal keys arrive oldest first; the last one is kept.
+                if (havePending && pending.key != entry.key && !addIndexBuildEntry(pending))
+                    return false;
+                pending = entry;
+                havePending = true;
+                continue;
+            }
+            out.entries[written % MAX_INDEX_ENTRIES] = entry;
+            written++;
+            if (written % MAX_INDEX_ENTRIES == 0) {
+                out.header.count = MAX_INDEX_ENTRIES;
+                if (!writeIndexPage(toPage + written / MAX_INDEX_ENTRIES - 1, out))
+                    return false;
+            }
+        }
+    }
+
+    if (toPage == DB_NO_PAGE)
+        return !havePending || addIndexBuildEntry(pending);
+    if (written % MAX_INDEX_ENTRIES != 0) {
+        out.header.count = static_cast<uint16_t>(written % MAX_INDEX_ENTRIES);
+        if (!writeIndexPage(toPage + written / MAX_INDEX_ENTRIES, out))
+            return false;
+    }
+    return true;
+}
+
+bool DBEngine::logHasRecords(void) {
+    bool found = false;
+    if (_segmentCount > 0) {
+        for (uint8_t segment = _oldestSegment; !found; segment = static_cast<uint8_t>((segment + 1) % _segmentCount)) {
+            if (openLogSegment(segment, "rb")) {
+                found = _logHandler.seekToEnd() && _logHandler.tell() > sizeof(DBHeader);
+                closeLogFile();
+            }
+            if (segment == _newestSegment)
+                break;
+        }
+        return found;
+    }
+    if (!openLogFile("rb"))
+        return false;
+    found = _logHandler.seekToEnd() && _logHandler.tell() > sizeof(DBHeader);
+    closeLogFile();
+    return found;
+}
+
+DB_NAMESPACE_END
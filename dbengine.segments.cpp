@@ -0,0 +1,144 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// Segmented log
+//
+// With setLogSegments() the records go to a fixed ring of segment files rather
+// than to the log file, which then only holds the DBHeader and the
+// DBSegmentTable. Index offsets address the ring as one range: segment s covers
+// [s * segmentSize, (s + 1) * segmentSize), so the index format is the same as
+// for a single log file. Appends fill the newest segment; a record that does
+// not fit starts the next one. When the ring is full, the oldest segment's
+// entries are removed from the index in a single pass over the leaves
+// (rebuildIndexLevels()) and the segment file is started again from empty.
+// ---------------------------------------------------------------------------
+
+bool DBEngine::setLogSegments(uint8_t segmentCount, uint32_t segmentSize) {
+    DB_WRITE_LOCK(_lock);
+    if (segmentCount == 0) {
+        // Back to a single log file.
+        _newSegmentCount = 0;
+        _newSegmentSize = 0;
+        return true;
+    }
+    if (segmentSize <= sizeof(DBHeader) + sizeof(LogEntryHeader) ||
+        static_cast<uint64_t>(segmentCount) * segmentSize > 0xFFFFFFFFu) {
+        DEBUG_PRINT("setLogSegments: Invalid layout of %u segments of %u bytes.\n",
+            static_cast<unsigned>(segmentCount), static_cast<unsigned>(segmentSize));
+        return false;
+    }
+    _newSegmentCount = segmentCount;
+    _newSegmentSize = segmentSize;
+    return true;
+}
+
+// LOGFILE.BIN -> LOGFILE.000; at most 8 characters of the base name are kept
+// so the names also fit 8.3 file systems.
+void DBEngine::segmentFileName(uint8_t segment, char fileName[MAX_FILENAME_LENGTH]) const {
+    size_t length = 0;
+    while (length < 8 && length + 5 < MAX_FILENAME_LENGTH &&
+        _logFileName[length] != '\0' && _logFileName[length] != '.') {
+        fileName[length] = _logFileName[length];
+        length++;
+    }
+    fileName[length++] = '.';
+    fileName[length++] = static_cast<char>('0' + segment / 100);
+    fileName[length++] = static_cast<char>('0' + (segment / 10) % 10);
+    fileName[length++] = static_cast<char>('0' + segment % 10);
+    fileName[length] = '\0';
+}
+
+bool DBEngine::openLogSegment(uint8_t segment, const char* mode) {
+    char fileName[MAX_FILENAME_LENGTH];
+    segmentFileName(segment, fileName);
+    if (_mode != DB_MODE_SESSION)
+        return _logHandler.open(fileName, mode);
+    if (_logOpen && _openSegment == segment)
+        return true;
+    if (_logOpen) {
+        _logHandler.close();
+        _logOpen = false;
+    }
+    if (!_logHandler.open(fileName, "rb+") && !_logHandler.open(fileName, "wb+")) {
+        DEBUG_PRINT("openLogSegment: Failed to open %s for the session.\n", fileName);
+        return false;
+    }
+    _logOpen = true;
+    _openSegment = segment;
+    return true;
+}
+
+bool DBEngine::beginSegmentAppend(uint32_t& offset, size_t bytes) {
+    if (bytes > _segmentSize - sizeof(DBHeader)) {
+        DEBUG_PRINT("beginSegmentAppend: %u bytes do not fit into a segment.\n", static_cast<unsigned>(bytes));
+        return false;
+    }
+    if (!openLogSegment(_newestSegment, "r+b")) {
+        if (!startLogSegment(_newestSegment) || !openLogSegment(_newestSegment, "r+b"))
+            return false;
+    }
+    if (!_logHandler.seekToEnd()) {
+        endLogAppend();
+        return false;
+    }
+    uint32_t end = _logHandler.tell();
+    if (end < sizeof(DBHeader) || end + bytes > _segmentSize) {
+        endLogAppend();
+        // A segment without a complete header is started again; a full one rolls.
+        bool ok = (end < sizeof(DBHeader)) ? startLogSegment(_newestSegment) : rollLogSegment();
+        if (!ok || !openLogSegment(_newestSegment, "r+b"))
+            return false;
+        if (!_logHandler.seekToEnd()) {
+            endLogAppend();
+            return false;
+        }
+        end = _logHandler.tell();
+    }
+    offset = static_cast<uint32_t>(_newestSegment) * _segmentSize + end;
+    return true;
+}
+
+bool DBEngine::startLogSegment(uint8_t segment) {
+    // The session handle may hold this or another segment; it is reopened on demand.
+    if (_logOpen) {
+        _logHandler.close();
+        _logOpen = false;
+    }
+    char fileName[MAX_FILENAME_LENGTH];
+    segmentFileName(segment, fileName);
+    if (!_logHandler.open(fileName, "wb+")) {
+        DEBUG_PRINT("startLogSegment: Unable to create %s.\n", fileName);
+        return false;
+    }
+    DBHeader logHeader;
+    logHeader.magic = DB_MAGIC_NUMBER;
+    logHeader.version = recordFileVersion();
+    size_t bytesWritten = 0;
+    bool ok = _logHandler.write(reinterpret_cast<const uint8_t*>(&logHeader), sizeof(logHeader), bytesWritten) &&
+        bytesWritten == sizeof(logHeader);
+    _logHandler.close();
+    return ok;
+}
+
+bool DBEngine::rollLogSegment(void) {
+    uint8_t next = static_cast<uint8_t>((_newestSegment + 1) % _segmentCount);
+    if (next == _oldestSegment) {
+        // The index must no longer refer to the segment before its file is reused.
+        uint32_t first = static_cast<uint32_t>(next) * _segmentSize;
+        if (!rebuildIndexLevels(first, first + _segmentSize) || !syncFiles())
+            return false;
+        _oldestSegment = static_cast<uint8_t>((_oldestSegment + 1) % _segmentCount);
+    }
+    if (!startLogSegment(next))
+        return false;
+    _newestSegment = next;
+    // A reference record must lie in the segment of the records that use it.
+    resetRecordCodecs();
+    // Read-ahead copies of the reused segment (see DBCursor) are stale.
+    _logRewrites++;
+    return saveDBHeader();
+}
+
+DB_NAMESPACE_END
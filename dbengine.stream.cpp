@@ -0,0 +1,266 @@
+#include "dbengine.h"
+
+DB_NAMESPACE_BEGIN
+
+// Define our own MIN macro since STL is not permitted.
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// ---------------------------------------------------------------------------
+// Change stream
+//
+// The log only grows, so everything appended since an export lies behind the
+// log offset the export ended at. exportSince() reads that part of the log
+// front to back, like rebuildIndex() does, and passes each record on as a
+// frame. Statuses and deletion flags are changed in place, though, also in
+// records before the mark, and with setStatusInLog(false) only in the index;
+// such changes set INTERNAL_STATUS_CHANGED in the index entry, and the export
+// adds a small delta frame for each of them.
+// importStream() applies the frames on the receiving side.
+// ---------------------------------------------------------------------------
+
+bool DBEngine::exportSince(uint32_t logOffset, DBExportSink sink, void* context, uint32_t* nextOffset) {
+    DB_WRITE_LOCK(_lock);
+    SCOPE_TIMER("DBEngine::exportSince");
+    if (!_isOpen || !sink || _segmentCount > 0 || _compacting) {
+        DEBUG_PRINT("exportSince: Database not open, no sink, segmented log, or compaction running.\n");
+        return false;
+    }
+    // Staged records have to be in the log before it is read.
+    if (_bulkLoading && !flushBulkRecords())
+        return false;
+    uint32_t start = (logOffset < sizeof(DBHeader)) ? static_cast<uint32_t>(sizeof(DBHeader)) : logOffset;
+    uint32_t end = start;
+    if (!openLogFile("rb"))
+        return false;
+    bool ok = exportLogRecords(start, sink, context, end);
+    closeLogFile();
+    if (!ok || !exportChanges(sink, context))
+        return false;
+    if (nextOffset)
+        *nextOffset = end;
+    return true;
+}
+
+bool DBEngine::readLogAhead(uint32_t at, uint32_t bytes, uint32_t size, uint32_t& bufferStart, uint32_t& bufferUsed) {
+    if (at >= bufferStart && at + bytes <= bufferStart + bufferUsed)
+        return true;
+    uint32_t chunk = MIN(static_cast<uint32_t>(sizeof(_batchBuffer)), size - at);
+    size_t bytesRead = 0;
+    if (!_logHandler.seek(at) || !_logHandler.read(_batchBuffer, chunk, bytesRead) || bytesRead != chunk)
+        return false;
+    bufferStart = at;
+    bufferUsed = chunk;
+    return true;
+}
+
+// A record that fits _batchBuffer is checked and passed on from there. A larger
+// one is read twice in buffer-sized pieces: once for its checksum, once for the
+// sink. Like rebuildIndex(), the export ends at a torn or damaged record.
+bool DBEngine::exportLogRecords(uint32_t start, DBExportSink sink, void* context, uint32_t& end) {
+    if (!_logHandler.seekToEnd())
+        return false;
+    uint32_t size = _logHandler.tell();
+    if (start > size) {
+        DEBUG_PRINT("exportLogRecords: Offset %u lies past the end of the log (%u).\n", start, size);
+        return false;
+    }
+    const uint32_t headerBytes = static_cast<uint32_t>(logHeaderSize());
+    uint32_t bufferStart = 0;
+    uint32_t bufferUsed = 0;
+    end = start;
+    while (size - end >= headerBytes) {
+        if (!readLogAhead(end, headerBytes, size, bufferStart, bufferUsed))
+            return false;
+        LogEntryHeader header;
+        memcpy(&header, &_batchBuffer[end - bufferStart], headerBytes);
+        if (header.length > size - end - headerBytes)
+            break;
+        uint32_t recordBytes = headerBytes + header.length;
+        if (recordBytes <= sizeof(_batchBuffer)) {
+            if (!readLogAhead(end, recordBytes, size, bufferStart, bufferUsed))
+                return false;
+            const uint8_t* payload = &_batchBuffer[end + headerBytes - bufferStart];
+            if (!logRecordValid(header, payload))
+                break;
+            if (!exportRecord(header, end, payload, sink, context))
+                return false;
+        }
+        else {
+            // Too large to be encoded (see DB_CODEC_MAX_RECORD), so sent as stored.
+            LogEntryHeader frame = header;
+            frame.internal_status &= INTERNAL_STATUS_DELETED;
+            frame.crc = dbCrc32(0, &header, offsetof(LogEntryHeader, status));
+            for (int pass = 0; pass < 2; pass++) {
+                if (pass == 1 && !sink(context, &frame, sizeof(frame)))
+                    return false;
+                for (uint32_t at = end + headerBytes; at < end + recordBytes; at += bufferUsed) {
+                    bufferUsed = 0;
+                    if (!readLogAhead(at, 1, MIN(size, end + recordBytes), bufferStart, bufferUsed))
+                        return false;
+                    if (pass == 0)
+                        frame.crc = dbCrc32(frame.crc, _batchBuffer, bufferUsed);
+                    else if (!sink(context, _batchBuffer, bufferUsed))
+                        return false;
+                }
+                if (pass == 0 && _logChecksums && frame.crc != header.crc) {
+                    DEBUG_PRINT("exportLogRecords: Checksum mismatch at offset %u; the export ends there.\n", end);
+                    return true;
+                }
+            }
+            bufferUsed = 0;
+        }
+        end += recordBytes;
+    }
+    return true;
+}
+
+bool DBEngine::exportRecord(const LogEntryHeader& header, uint32_t offset, const void* payload,
+    DBExportSink sink, void* context)
+{
+    LogEntryHeader frame = header;
+    uint8_t decoded[DB_CODEC_MAX_RECORD];
+    if (header.internal_status & INTERNAL_STATUS_ENCODED) {
+        IndexEntry entry;
+        entry.key = header.key;
+        entry.offset = offset;
+        entry.status = header.status;
+        entry.internal_status = appendGeneration();
+        memcpy(decoded, payload, header.length);
+        // The reference may have to be read, which opens the log on its own in
+        // safe mode; the read-ahead in _batchBuffer stays valid.
+        closeLogFile();
+        bool ok = decodeLogRecord(entry, frame, decoded, sizeof(decoded));
+        if (!openLogFile("rb") || !ok)
+            return false;
+        payload = decoded;
+    }
+    frame.internal_status &= INTERNAL_STATUS_DELETED;
+    frame.crc = logRecordCrc(frame, payload);
+    return sink(context, &frame, sizeof(frame)) && (frame.length == 0 || sink(context, payload, frame.length));
+}
+
+// Record frames carry the status of the log, which setStatusInLog(false)
+// leaves behind, so every changed entry gets a delta frame, also one whose
+// record was just exported. Records reclaimed by compaction (DB_NO_OFFSET)
+// were deleted before the mark.
+bool DBEngine::exportChanges(DBExportSink sink, void* context) {
+    IndexFilter filter;
+    filter.byStatus = false;
+    filter.status = 0;
+    filter.mustBeSet = INTERNAL_STATUS_CHANGED;
+    filter.mustBeClear = 0;
+    IndexEntry entry;
+    uint32_t position = 0;
+    for (uint32_t next = 0; findMatchingEntry(next, filter, entry, position); next = position + 1) {
+        LogEntryHeader frame;
+        frame.recordType = 0;
+        frame.length = 0;
+        frame.key = entry.key;
+        frame.status = entry.status;
+        frame.internal_status = static_cast<uint8_t>((entry.internal_status & INTERNAL_STATUS_DELETED) |
+            INTERNAL_STATUS_DELTA);
+        frame.crc = logRecordCrc(frame, nullptr);
+        if (!sink(context, &frame, sizeof(frame)))
+            return false;
+        entry.internal_status &= static_cast<uint8_t>(~INTERNAL_STATUS_CHANGED);
+        if (!setIndexEntry(position, entry))
+            return false;
+    }
+    return true;
+}
+
+// Record frames are collected until a frame needs the batch stored first: a
+// deletion or delta, a key already in the batch, or a full batch.
+bool DBEngine::importStream(const void* data, size_t size, size_t* consumed) {
+    if (consumed)
+        *consumed = 0;
+    if (isBulkLoading()) {
+        DEBUG_PRINT("importStream: Not available during a bulk load.\n");
+        return false;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    BatchItem items[DB_MAX_BATCH_ITEMS];
+    uint8_t statuses[DB_MAX_BATCH_ITEMS];
+    size_t pending = 0;
+    size_t applied = 0;  // Bytes of the frames stored so far.
+    size_t at = 0;
+    bool ok = true;
+    while (ok && size - at >= sizeof(LogEntryHeader)) {
+        LogEntryHeader frame;
+        memcpy(&frame, &bytes[at], sizeof(frame));
+        if (frame.length > size - at - sizeof(frame))
+            break;
+        const uint8_t* payload = &bytes[at + sizeof(frame)];
+        if (logRecordCrc(frame, payload) != frame.crc) {
+            DEBUG_PRINT("importStream: Checksum mismatch in the frame of key %u.\n", frame.key);
+            ok = false;
+            break;
+        }
+        bool record = (frame.internal_status & (INTERNAL_STATUS_DELETED | INTERNAL_STATUS_DELTA)) == 0;
+        bool flush = !record || pending == DB_MAX_BATCH_ITEMS;
+        for (size_t i = 0; i < pending && !flush; i++)
+            flush = (items[i].key == frame.key);
+        if (pending > 0 && flush) {
+            ok = importBatch(items, statuses, pending);
+            if (!ok)
+                break;
+            pending = 0;
+            applied = at;
+        }
+        if (record) {
+            items[pending].key = frame.key;
+            items[pending].recordType = frame.recordType;
+            items[pending].record = payload;
+            items[pending].recordSize = frame.length;
+            statuses[pending++] = frame.status;
+        }
+        else if (!(ok = importChange(frame))) {
+            break;
+        }
+        at += sizeof(frame) + frame.length;
+        if (pending == 0)
+            applied = at;
+    }
+    if (ok && pending > 0) {
+        ok = importBatch(items, statuses, pending);
+        if (ok)
+            applied = at;
+    }
+    if (consumed)
+        *consumed = applied;
+    return ok;
+}
+
+// The old records are only marked deleted once the new ones are in the log, so
+// a batch that fails to store leaves them live and can simply be sent again.
+bool DBEngine::importBatch(const BatchItem* items, const uint8_t* statuses, size_t n) {
+    {
+        DB_WRITE_LOCK(_lock);
+        if (!storeBatch(items, n, true))
+            return false;
+    }
+    uint32_t position;
+    for (size_t i = 0; i < n; i++) {
+        if (statuses[i] != 0 && (!searchIndex(items[i].key, &position) || !updateStatus(position, statuses[i])))
+            return false;
+    }
+    return true;
+}
+
+bool DBEngine::importChange(const LogEntryHeader& frame) {
+    uint32_t position;
+    IndexEntry entry;
+    if (!searchIndex(frame.key, &position))
+        return true;
+    if (!getIndexEntry(position, entry))
+        return false;
+    if (entry.internal_status & INTERNAL_STATUS_DELETED)
+        return true;
+    if (entry.status != frame.status && !updateStatus(position, frame.status))
+        return false;
+    return (frame.internal_status & INTERNAL_STATUS_DELETED) == 0 || deleteRecord(frame.key);
+}
+
+DB_NAMESPACE_END
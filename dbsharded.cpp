@@ -0,0 +1,262 @@
+#include "dbsharded.h"
+
+DB_NAMESPACE_BEGIN
+
+// ---------------------------------------------------------------------------
+// ShardedDB
+// ---------------------------------------------------------------------------
+
+ShardedDB::ShardedDB(IFileHandler* const logHandlers[], IFileHandler* const indexHandlers[], uint8_t shardCount)
+    : _shardCount(shardCount), _byRange(false), _isOpen(false), _writers(shardCount), _busy(0), _stopping(false) {
+    for (uint8_t s = 0; s < shardCount; s++)
+        _shards.emplace_back(new DBEngine(*logHandlers[s], *indexHandlers[s]));
+    memset(_bounds, 0, sizeof(_bounds));
+}
+
+ShardedDB::~ShardedDB() {
+    close();
+}
+
+bool ShardedDB::setRangeBounds(const uint32_t* firstKeys) {
+    if (_isOpen)
+        return false;
+    for (uint8_t s = 1; s + 1 < _shardCount; s++) {
+        if (firstKeys[s] <= firstKeys[s - 1]) {
+            DEBUG_PRINT("setRangeBounds: Bound %u is not above bound %u.\n", s, s - 1);
+            return false;
+        }
+    }
+    for (uint8_t s = 0; s + 1 < _shardCount; s++)
+        _bounds[s] = firstKeys[s];
+    _byRange = true;
+    return true;
+}
+
+// LOGFILE.BIN -> LOGFIL03.BIN
+void ShardedDB::shardFileName(const char* fileName, uint8_t shard, char shardName[MAX_FILENAME_LENGTH]) {
+    size_t length = 0;
+    while (length < 6 && fileName[length] != '\0' && fileName[length] != '.') {
+        shardName[length] = fileName[length];
+        length++;
+    }
+    shardName[length++] = static_cast<char>('0' + (shard / 10) % 10);
+    shardName[length++] = static_cast<char>('0' + shard % 10);
+    const char* extension = strchr(fileName, '.');
+    if (extension) {
+        for (size_t i = 0; i < 4 && extension[i] != '\0' && length + 1 < MAX_FILENAME_LENGTH; i++)
+            shardName[length++] = extension[i];
+    }
+    shardName[length] = '\0';
+}
+
+bool ShardedDB::open(const char logFileName[MAX_FILENAME_LENGTH], const char indexFileName[MAX_FILENAME_LENGTH],
+    uint8_t mode) {
+    if (_isOpen)
+        return false;
+    if (_shardCount == 0 || _shardCount > DB_MAX_SHARDS) {
+        DEBUG_PRINT("ShardedDB::open: Invalid shard count %u.\n", _shardCount);
+        return false;
+    }
+    for (uint8_t s = 0; s < _shardCount; s++) {
+        char logName[MAX_FILENAME_LENGTH];
+        char indexName[MAX_FILENAME_LENGTH];
+        shardFileName(logFileName, s, logName);
+        shardFileName(indexFileName, s, indexName);
+        if (!_shards[s]->open(logName, indexName, mode)) {
+            DEBUG_PRINT("ShardedDB::open: Shard %u (%s, %s) did not open.\n", s, logName, indexName);
+            while (s-- > 0)
+                _shards[s]->close();
+            return false;
+        }
+    }
+    _stopping = false;
+    for (uint8_t s = 0; s < _shardCount; s++) {
+        _writers[s].pending = false;
+        _writers[s].ok = true;
+        _writers[s].thread = std::thread(&ShardedDB::runWriter, this, s);
+    }
+    _isOpen = true;
+    return true;
+}
+
+bool ShardedDB::sync(void) {
+    bool ok = true;
+    for (uint8_t s = 0; s < _shardCount; s++)
+        ok = _shards[s]->sync() && ok;
+    return ok;
+}
+
+void ShardedDB::close(void) {
+    if (!_isOpen)
+        return;
+    stopWriters();
+    for (uint8_t s = 0; s < _shardCount; s++)
+        _shards[s]->close();
+    _isOpen = false;
+}
+
+void ShardedDB::stopWriters(void) {
+    {
+        std::lock_guard<std::mutex> lock(_writerLock);
+        _stopping = true;
+    }
+    _jobReady.notify_all();
+    for (uint8_t s = 0; s < _shardCount; s++) {
+        if (_writers[s].thread.joinable())
+            _writers[s].thread.join();
+    }
+}
+
+// Fibonacci hashing: consecutive keys go to different shards.
+uint8_t ShardedDB::shardFor(uint32_t key) const {
+    if (!_byRange)
+        return static_cast<uint8_t>((static_cast<uint64_t>(key * 2654435761u) * _shardCount) >> 32);
+    uint8_t first = 0, length = _shardCount - 1;
+    while (length > 0) {
+        uint8_t half = length / 2;
+        if (_bounds[first + half] <= key) {
+            first += half + 1;
+            length -= half + 1;
+        }
+        else {
+            length = half;
+        }
+    }
+    return first;
+}
+
+bool ShardedDB::append(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize) {
+    return _isOpen && _shards[shardFor(key)]->append(key, recordType, record, recordSize);
+}
+
+bool ShardedDB::get(uint32_t key, void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize) {
+    return _isOpen && _shards[shardFor(key)]->get(key, payloadBuffer, bufferSize, outRecordSize);
+}
+
+bool ShardedDB::deleteRecord(uint32_t key) {
+    return _isOpen && _shards[shardFor(key)]->deleteRecord(key);
+}
+
+size_t ShardedDB::indexCount(void) const {
+    size_t count = 0;
+    for (uint8_t s = 0; s < _shardCount; s++)
+        count += _shards[s]->indexCount();
+    return count;
+}
+
+bool ShardedDB::appendBatch(const BatchItem* items, size_t n) {
+    if (!_isOpen)
+        return false;
+    std::lock_guard<std::mutex> batch(_batchLock);
+    std::unique_lock<std::mutex> lock(_writerLock);
+    for (uint8_t s = 0; s < _shardCount; s++)
+        _writers[s].items.clear();
+    for (size_t i = 0; i < n; i++)
+        _writers[shardFor(items[i].key)].items.push_back(items[i]);
+    for (uint8_t s = 0; s < _shardCount; s++) {
+        _writers[s].ok = true;
+        if (!_writers[s].items.empty()) {
+            _writers[s].pending = true;
+            _busy++;
+        }
+    }
+    _jobReady.notify_all();
+    _jobDone.wait(lock, [this] { return _busy == 0; });
+    bool ok = true;
+    for (uint8_t s = 0; s < _shardCount; s++)
+        ok = ok && _writers[s].ok;
+    return ok;
+}
+
+// The writer of a shard stores the part of each batch it is given.
+void ShardedDB::runWriter(uint8_t shard) {
+    Writer& writer = _writers[shard];
+    DBEngine& db = *_shards[shard];
+    std::unique_lock<std::mutex> lock(_writerLock);
+    for (;;) {
+        _jobReady.wait(lock, [this, &writer] { return writer.pending || _stopping; });
+        if (!writer.pending)
+            return;
+        lock.unlock();
+        bool ok = true;
+        for (size_t first = 0; first < writer.items.size(); first += DB_MAX_BATCH_ITEMS) {
+            size_t count = writer.items.size() - first;
+            if (count > DB_MAX_BATCH_ITEMS)
+                count = DB_MAX_BATCH_ITEMS;
+            ok = db.appendBatch(&writer.items[first], count) && ok;
+        }
+        lock.lock();
+        writer.ok = ok;
+        writer.pending = false;
+        if (--_busy == 0)
+            _jobDone.notify_all();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// ShardedCursor
+// ---------------------------------------------------------------------------
+
+ShardedCursor::ShardedCursor(ShardedDB& db) : _db(db), _heapSize(0) {
+    for (uint8_t s = 0; s < db._shardCount; s++)
+        _cursors.emplace_back(new DBCursor(*db._shards[s]));
+}
+
+bool ShardedCursor::seek(uint32_t key) {
+    for (uint8_t s = 0; s < _db._shardCount; s++)
+        _cursors[s]->seek(key);
+    return buildHeap();
+}
+
+bool ShardedCursor::first(void) {
+    for (uint8_t s = 0; s < _db._shardCount; s++)
+        _cursors[s]->first();
+    return buildHeap();
+}
+
+bool ShardedCursor::buildHeap(void) {
+    _heapSize = 0;
+    for (uint8_t s = 0; s < _db._shardCount; s++) {
+        if (_cursors[s]->valid())
+            _heap[_heapSize++] = s;
+    }
+    for (uint8_t at = _heapSize / 2; at-- > 0;)
+        siftDown(at);
+    return valid();
+}
+
+void ShardedCursor::siftDown(uint8_t at) {
+    for (;;) {
+        uint8_t smallest = at;
+        uint8_t left = static_cast<uint8_t>(2 * at + 1);
+        uint8_t right = static_cast<uint8_t>(2 * at + 2);
+        if (left < _heapSize && keyAt(left) < keyAt(smallest))
+            smallest = left;
+        if (right < _heapSize && keyAt(right) < keyAt(smallest))
+            smallest = right;
+        if (smallest == at)
+            return;
+        uint8_t shard = _heap[at];
+        _heap[at] = _heap[smallest];
+        _heap[smallest] = shard;
+        at = smallest;
+    }
+}
+
+bool ShardedCursor::next(void) {
+    if (!valid())
+        return false;
+    // A key lives in one shard only, so the next key is below another shard's head.
+    if (!_cursors[_heap[0]]->next())
+        _heap[0] = _heap[--_heapSize];
+    if (_heapSize > 0)
+        siftDown(0);
+    return valid();
+}
+
+bool ShardedCursor::readPayload(void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize,
+    LogEntryHeader* outHeader) {
+    return valid() && _cursors[_heap[0]]->readPayload(payloadBuffer, bufferSize, outRecordSize, outHeader);
+}
+
+DB_NAMESPACE_END
@@ -0,0 +1,262 @@
+#ifndef DBSHARDED_H
+#define DBSHARDED_H
+
+#include "dbengine.h"
+
+#if !DB_THREAD_SAFE
+#error "ShardedDB needs DB_THREAD_SAFE"
+#endif
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Most shards of a ShardedDB; the shard number takes two digits of the file names.
+#ifndef DB_MAX_SHARDS
+#define DB_MAX_SHARDS 100
+#endif
+#if DB_MAX_SHARDS > 100
+#error "DB_MAX_SHARDS must not exceed 100"
+#endif
+
+DB_NAMESPACE_BEGIN
+
+// -----------------------------------------------------------------------------
+// Sharded Database
+//
+// A host-side front end that spreads the keys over several DBEngine instances,
+// each with its own pair of file handlers and files, so that appends to
+// different shards do not meet at one log offset or one index page. A key
+// always lives in the same shard: hashed, which spreads ascending keys evenly,
+// or by key ranges set with setRangeBounds(). appendBatch() hands each shard
+// its part of a batch and lets one writer thread per shard store them side by
+// side. Lookups go to the key's shard on the caller's thread and, since the
+// shards are DB_THREAD_SAFE engines, run alongside the writers. A
+// ShardedCursor walks all shards in key order.
+//
+// The partitioning is not saved with the database; open it with the same shard
+// count and range bounds every time. The engine on the MCU is unchanged: each
+// shard is an ordinary database that DBEngine opens on its own.
+// -----------------------------------------------------------------------------
+class ShardedDB {
+    friend class ShardedCursor;
+
+public:
+    /**
+     * @brief Creates the shards over the given file handlers.
+     *
+     * @param logHandlers Log file handler of each shard; they must outlive the ShardedDB.
+     * @param indexHandlers Index file handler of each shard.
+     * @param shardCount Number of shards (1 to DB_MAX_SHARDS).
+     */
+    ShardedDB(IFileHandler* const logHandlers[], IFileHandler* const indexHandlers[], uint8_t shardCount);
+
+    /**
+     * @brief Closes the shards (see close()).
+     */
+    ~ShardedDB();
+
+    /**
+     * @brief Partitions the keys by range instead of by hash.
+     *
+     * Shard 0 takes the keys below firstKeys[0], shard i the keys from
+     * firstKeys[i - 1] up to firstKeys[i], and the last shard the rest. Call it
+     * before open().
+     *
+     * @param firstKeys First key of shards 1 to shardCount - 1, ascending.
+     * @return False if the keys are not strictly ascending or the database is open.
+     */
+    bool setRangeBounds(const uint32_t* firstKeys);
+
+    /**
+     * @brief Opens every shard and starts its writer thread.
+     *
+     * Shard s uses the file names of shardFileName(), e.g. LOGFIL03.BIN and
+     * INDEX03.BIN for LOGFILE.BIN and INDEX.BIN.
+     *
+     * @param logFileName Log file name the shards' names are made from.
+     * @param indexFileName Index file name the shards' names are made from.
+     * @param mode DB_MODE_SAFE or DB_MODE_SESSION (default).
+     * @return True if every shard was opened; otherwise none is left open.
+     */
+    bool open(const char logFileName[MAX_FILENAME_LENGTH], const char indexFileName[MAX_FILENAME_LENGTH],
+        uint8_t mode = DB_MODE_SESSION);
+
+    /**
+     * @brief Syncs every shard (see DBEngine::sync()).
+     *
+     * @return True if every shard committed its writes.
+     */
+    bool sync(void);
+
+    /**
+     * @brief Stops the writer threads and closes every shard.
+     */
+    void close(void);
+
+    /**
+     * @brief Appends a record to the shard of its key, on the caller's thread.
+     */
+    bool append(uint32_t key, uint8_t recordType, const void* record, uint16_t recordSize);
+
+    /**
+     * @brief Appends any number of records, each shard's part by its own writer
+     *        thread at the same time as the others.
+     *
+     * Each shard stores its part with DBEngine::appendBatch() in groups of up to
+     * DB_MAX_BATCH_ITEMS, so a group with a duplicate key is refused as a whole
+     * while the other groups and shards are stored. Calls are carried out one
+     * at a time; the payloads are only read during the call.
+     *
+     * @param items The records, in any key order.
+     * @param n Number of records.
+     * @return True if every record was stored.
+     */
+    bool appendBatch(const BatchItem* items, size_t n);
+
+    /**
+     * @brief Retrieves a record from the shard of its key (see DBEngine::get()).
+     */
+    bool get(uint32_t key, void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize = nullptr);
+
+    /**
+     * @brief Deletes a record in the shard of its key (see DBEngine::deleteRecord()).
+     */
+    bool deleteRecord(uint32_t key);
+
+    /**
+     * @brief Returns the number of index entries of all shards together.
+     */
+    size_t indexCount(void) const;
+
+    /**
+     * @brief Returns the shard that holds a key.
+     */
+    uint8_t shardFor(uint32_t key) const;
+
+    /**
+     * @brief Returns the number of shards.
+     */
+    uint8_t shardCount(void) const { return _shardCount; }
+
+    /**
+     * @brief Returns the engine of one shard, e.g. for status updates by position.
+     */
+    DBEngine& shard(uint8_t shard) { return *_shards[shard]; }
+
+    /**
+     * @brief Makes the file name of one shard from a database file name.
+     *
+     * At most 6 characters of the base name are kept and the two-digit shard
+     * number is added, so the names also fit 8.3 file systems; the extension
+     * (up to 3 characters) stays.
+     *
+     * @param fileName The database file name, e.g. LOGFILE.BIN.
+     * @param shard The shard number.
+     * @param shardName Receives the shard's file name, e.g. LOGFIL03.BIN.
+     */
+    static void shardFileName(const char* fileName, uint8_t shard, char shardName[MAX_FILENAME_LENGTH]);
+
+private:
+    ShardedDB(const ShardedDB&);
+    ShardedDB& operator=(const ShardedDB&);
+
+    // Writer thread of one shard and the part of the batch it is given.
+    struct Writer {
+        std::thread thread;
+        std::vector<BatchItem> items;
+        bool pending;   ///< items is waiting to be stored.
+        bool ok;        ///< Every item of the last batch was stored.
+    };
+
+    void runWriter(uint8_t shard);
+    void stopWriters(void);
+
+    uint8_t _shardCount;
+    std::vector<std::unique_ptr<DBEngine>> _shards;
+    bool _byRange;                        ///< Keys are partitioned by _bounds.
+    uint32_t _bounds[DB_MAX_SHARDS - 1];  ///< First key of shards 1 to _shardCount - 1.
+    bool _isOpen;
+
+    std::vector<Writer> _writers;
+    std::mutex _batchLock;                ///< Held by the appendBatch() call in progress.
+    std::mutex _writerLock;               ///< Guards the Writer jobs, _busy and _stopping.
+    std::condition_variable _jobReady;
+    std::condition_variable _jobDone;
+    uint32_t _busy;                       ///< Writers still storing their part of the batch.
+    bool _stopping;
+};
+
+// -----------------------------------------------------------------------------
+// Sharded Cursor
+//
+// Walks the entries of all shards in key order: a DBCursor per shard, merged
+// through a binary heap of the shards ordered by the key under their cursor.
+// Each step costs a DBCursor::next() and log2(shardCount) comparisons, and
+// readPayload() keeps the read-ahead of the shard's cursor. Like DBCursor it
+// belongs to one thread.
+// -----------------------------------------------------------------------------
+class ShardedCursor {
+public:
+    /**
+     * @brief Creates a cursor over an open ShardedDB. It is not on an entry yet.
+     */
+    explicit ShardedCursor(ShardedDB& db);
+
+    /**
+     * @brief Moves to the first entry of any shard whose key is not less than key.
+     *
+     * @return True if there is such an entry, false otherwise.
+     */
+    bool seek(uint32_t key);
+
+    /**
+     * @brief Moves to the entry with the smallest key of all shards.
+     */
+    bool first(void);
+
+    /**
+     * @brief Moves to the next entry in key order.
+     *
+     * @return True if the cursor is on a valid entry afterwards, false at the end.
+     */
+    bool next(void);
+
+    /**
+     * @brief Returns true if the cursor is on an entry.
+     */
+    bool valid(void) const { return _heapSize > 0; }
+
+    /**
+     * @brief Returns the current index entry.
+     */
+    const IndexEntry& entry(void) const { return _cursors[_heap[0]]->entry(); }
+
+    /**
+     * @brief Returns the shard of the current entry.
+     */
+    uint8_t shard(void) const { return _heap[0]; }
+
+    /**
+     * @brief Reads the payload of the record under the cursor (see DBCursor::readPayload()).
+     */
+    bool readPayload(void* payloadBuffer, uint16_t bufferSize, uint16_t* outRecordSize = nullptr,
+        LogEntryHeader* outHeader = nullptr);
+
+private:
+    // Builds the heap from the shards whose cursor is on an entry.
+    bool buildHeap(void);
+    void siftDown(uint8_t at);
+    uint32_t keyAt(uint8_t at) const { return _cursors[_heap[at]]->entry().key; }
+
+    ShardedDB& _db;
+    std::vector<std::unique_ptr<DBCursor>> _cursors;
+    uint8_t _heap[DB_MAX_SHARDS];  ///< Shards on an entry, smallest key first.
+    uint8_t _heapSize;
+};
+
+DB_NAMESPACE_END
+
+#endif // DBSHARDED_H
@@ -5,10 +5,23 @@
 #include <cstring>
 #include <vector>
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
-#include "DBEngine.h"
+#include <atomic>
+#include <thread>
+#include "dbengine.h"
 #include "FileHandler_Windows.h"  // Your Windows implementation of IFileHandler
+#include "FileHandler_Buffered.h"
+#include "FileHandler_Queued.h"
+#include "FileHandler_Counting.h"
+#if DB_THREAD_SAFE
+#include "dbsharded.h"
+#endif
+#ifndef _WIN32
+#include "FileHandler_Posix.h"
+#endif
 #include "Instrumentation.h"
+#include "testapp.h"
 
 // ANSI color codes for tick and cross.
 #define GREEN_TICK "\033[32m[OK]\033[0m"
@@ -267,6 +280,82 @@ void testBTreeSearch() {
 }
 
 
+// Test: Index Page Cache
+//   - Touches entries spread over up to INDEX_CACHE_PAGES - 1 leaves twice (one slot
+//     stays with the root of the index tree).
+//   - Verifies that the second round is served entirely from the page cache.
+//   - Prints summary messages (indented) with a green tick if successful, or a red cross if failed.
+void testIndexPageCache() {
+    std::cout << "Test Index Page Cache" << std::endl;
+
+    uint32_t pages = static_cast<uint32_t>((db.indexCount() + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES);
+    if (pages > INDEX_CACHE_PAGES - 1)
+        pages = INDEX_CACHE_PAGES - 1;
+    if (pages == 0) {
+        std::cerr << "    [Setup] FAIL: Index is empty. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    IndexEntry entry;
+    for (uint32_t page = 0; page < pages; page++)
+        db.getIndexEntry(page * MAX_INDEX_ENTRIES, entry);
+
+    db.resetCacheStats();
+    for (uint32_t page = 0; page < pages; page++)
+        db.getIndexEntry(page * MAX_INDEX_ENTRIES, entry);
+
+    uint32_t hits = 0, misses = 0;
+    db.getCacheStats(hits, misses);
+    if (misses == 0 && hits >= pages)
+        std::cout << "    [Cache] SUCCESS: " << pages << " resident pages re-read with "
+        << hits << " hits and no misses. " << GREEN_TICK << std::endl;
+    else
+        std::cerr << "    [Cache] FAIL: Expected at least " << pages << " hits and 0 misses, got "
+        << hits << " hits and " << misses << " misses. " << RED_CROSS << std::endl;
+}
+
+
+// Test: Tree Leaf Lookup
+//   - Picks a key stored in the third leaf of the B+-tree (or the last leaf for small indexes).
+//   - Reopens the database so that the page cache starts out cold.
+//   - Verifies that findKey descends to the key's leaf while loading at most one index page.
+void testTreeLeafLookup() {
+    std::cout << "Test Tree Leaf Lookup" << std::endl;
+
+    size_t count = db.indexCount();
+    if (count == 0) {
+        std::cerr << "    [Setup] FAIL: Index is empty. " << RED_CROSS << std::endl;
+        return;
+    }
+    uint32_t pos = static_cast<uint32_t>(2 * MAX_INDEX_ENTRIES + 5);
+    if (pos >= count)
+        pos = static_cast<uint32_t>(count - 1);
+    IndexEntry target;
+    if (!db.getIndexEntry(pos, target)) {
+        std::cerr << "    [Setup] FAIL: Unable to read index entry " << pos << ". " << RED_CROSS << std::endl;
+        return;
+    }
+
+    db.close();
+    if (!db.open("LOGFILE.BIN", "INDEX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Reopen] FAIL: Unable to reopen database. " << RED_CROSS << std::endl;
+        return;
+    }
+    db.resetCacheStats();
+
+    uint32_t foundIndex = 0;
+    bool found = db.findKey(target.key, &foundIndex);
+    uint32_t hits = 0, misses = 0;
+    db.getCacheStats(hits, misses);
+    if (found && foundIndex == pos && misses <= 1)
+        std::cout << "    [Lookup] SUCCESS: Key " << target.key << " found at index " << foundIndex
+        << " with " << misses << " page load(s). " << GREEN_TICK << std::endl;
+    else
+        std::cerr << "    [Lookup] FAIL: Key " << target.key << " (found=" << found << ", index " << foundIndex
+        << ", expected " << pos << ") needed " << misses << " page loads. " << RED_CROSS << std::endl;
+}
+
+
 // Test 5: Validate Index Offsets
 //   - Checks that the index contains at least one entry.
 //   - Iterates through all index entries to confirm that at least one offset is non‑zero.
@@ -649,6 +738,2955 @@ void testIndexFilteringAndCounting() {
 }
 
 
+// Test: Index Tree Inserts
+//   - Appends records in a scrambled key order, so that leaves split in the middle
+//     instead of only at the right edge.
+//   - Walks the whole index to confirm that the keys are still strictly ascending.
+//   - Looks up every new key and checks that the walk and the lookup agree.
+//   - Reopens the database and repeats the lookups to confirm the tree persisted.
+void testIndexTreeInserts() {
+    const uint32_t numRecords = 3000;
+    const uint32_t baseKey = 500000;
+    TemperatureRecord rec = { 18.0f, 60.0f, 0, 0, "Out of order insert" };
+
+    std::cout << "Test Index Tree Inserts" << std::endl;
+
+    size_t countBefore = db.indexCount();
+    for (uint32_t i = 0; i < numRecords; i++) {
+        // 7919 is coprime to numRecords, so every offset is used exactly once.
+        uint32_t key = baseKey + (i * 7919) % numRecords;
+        rec.height = key;
+        if (!db.append(key, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Append] FAIL: Failed appending record with key " << key << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    if (db.indexCount() != countBefore + numRecords) {
+        std::cerr << "    [Append] FAIL: Expected " << countBefore + numRecords << " entries, got "
+            << db.indexCount() << " " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Append] SUCCESS: " << numRecords << " scrambled keys inserted. " << GREEN_TICK << std::endl;
+
+    IndexEntry prev, entry;
+    if (!db.getIndexEntry(0, prev)) {
+        std::cerr << "    [Order] FAIL: Unable to read index entry 0 " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 1; i < db.indexCount(); i++) {
+        if (!db.getIndexEntry(i, entry) || entry.key <= prev.key) {
+            std::cerr << "    [Order] FAIL: Entry " << i << " (key " << entry.key
+                << ") does not follow key " << prev.key << " " << RED_CROSS << std::endl;
+            return;
+        }
+        prev = entry;
+    }
+    std::cout << "    [Order] SUCCESS: " << db.indexCount() << " keys in ascending order. " << GREEN_TICK << std::endl;
+
+    for (int round = 0; round < 2; round++) {
+        if (round == 1) {
+            db.close();
+            if (!db.open("LOGFILE.BIN", "INDEX.BIN", DB_MODE_SESSION) ||
+                db.indexCount() != countBefore + numRecords) {
+                std::cerr << "    [Reopen] FAIL: Index did not survive the reopen " << RED_CROSS << std::endl;
+                return;
+            }
+        }
+        for (uint32_t key = baseKey; key < baseKey + numRecords; key++) {
+            uint32_t index = 0;
+            TemperatureRecord out;
+            if (!db.findKey(key, &index) || !db.getIndexEntry(index, entry) || entry.key != key ||
+                !db.get(key, &out, sizeof(out)) || out.height != key) {
+                std::cerr << "    [Lookup] FAIL: Key " << key << " not found correctly (round "
+                    << round << ") " << RED_CROSS << std::endl;
+                return;
+            }
+        }
+    }
+    std::cout << "    [Lookup] SUCCESS: All keys found before and after reopening. " << GREEN_TICK << std::endl;
+}
+
+
+// Test: Index Format Upgrade
+//   - Builds a small database in separate files and rewrites its index in the
+//     flat version 1 layout (10-byte header followed by the sorted entries).
+//   - Reopens it, which converts the index, and verifies every record.
+//   - Inserts a key at the front so that a full leaf splits into a recycled page.
+void testIndexUpgradeV1() {
+    const uint32_t numRecords = 600;
+    TemperatureRecord rec = { 20.0f, 50.0f, 0, 0, "Version 1 index" };
+
+    std::cout << "Test Index Format Upgrade" << std::endl;
+
+    std::remove("OLDLOG.BIN");
+    std::remove("OLDIDX.BIN");
+    WindowsFileHandler oldLogHandler;
+    WindowsFileHandler oldIndexHandler;
+    DBEngine oldDb(oldLogHandler, oldIndexHandler);
+    if (!oldDb.open("OLDLOG.BIN", "OLDIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::vector<IndexEntry> entries(numRecords);
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!oldDb.append(i * 3 + 10, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < numRecords; i++)
+        oldDb.getIndexEntry(i, entries[i]);
+    oldDb.close();
+
+    // Rewrite the index exactly as version 1 stored it.
+    FILE* f = fopen("OLDIDX.BIN", "wb");
+    if (!f) {
+        std::cerr << "    [Setup] FAIL: Unable to rewrite OLDIDX.BIN " << RED_CROSS << std::endl;
+        return;
+    }
+    uint32_t magic = DB_MAGIC_NUMBER;
+    uint16_t version = DB_IDX_VERSION_FLAT;
+    uint32_t count = numRecords;
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&count, sizeof(count), 1, f);
+    fwrite(entries.data(), sizeof(IndexEntry), numRecords, f);
+    fclose(f);
+
+    if (!oldDb.open("OLDLOG.BIN", "OLDIDX.BIN", DB_MODE_SAFE) || oldDb.indexCount() != numRecords) {
+        std::cerr << "    [Upgrade] FAIL: Version 1 index was not converted. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!oldDb.get(i * 3 + 10, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Upgrade] FAIL: Record " << i << " lost in conversion. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    std::cout << "    [Upgrade] SUCCESS: " << numRecords << " records readable after conversion. " << GREEN_TICK << std::endl;
+
+    rec.height = 12345;
+    if (!oldDb.append(1, 1, &rec, sizeof(rec))) {
+        std::cerr << "    [Insert] FAIL: Unable to insert into the converted index. " << RED_CROSS << std::endl;
+        return;
+    }
+    oldDb.close();
+    TemperatureRecord out;
+    if (!oldDb.open("OLDLOG.BIN", "OLDIDX.BIN", DB_MODE_SESSION) || oldDb.indexCount() != numRecords + 1 ||
+        !oldDb.get(1, &out, sizeof(out)) || out.height != 12345 ||
+        !oldDb.get(numRecords * 3 + 7, &out, sizeof(out)) || out.height != numRecords - 1) {
+        std::cerr << "    [Insert] FAIL: Converted index did not accept a new key. " << RED_CROSS << std::endl;
+        return;
+    }
+    oldDb.close();
+    std::remove("OLDLOG.BIN");
+    std::remove("OLDIDX.BIN");
+    std::cout << "    [Insert] SUCCESS: New key stored alongside the converted entries. " << GREEN_TICK << std::endl;
+}
+
+
+// Test: Ascending Key Appends
+//   - Appends a run of keys above the current maximum, enough to fill several leaves.
+//   - Verifies that the run never had to load an index page from disk: the tail
+//     leaf stays in the cache and the full leaves are written, not re-read.
+//   - Checks that an out-of-order key below the maximum is still rejected as a
+//     duplicate and that every appended record can be read back.
+void testAscendingAppends() {
+    const uint32_t numRecords = 3 * MAX_INDEX_ENTRIES;
+    const uint32_t baseKey = 2000000;
+    TemperatureRecord rec = { 21.0f, 40.0f, 0, 0, "Ascending append" };
+
+    std::cout << "Test Ascending Key Appends" << std::endl;
+
+    size_t countBefore = db.indexCount();
+    // Touch the tail once so that the run starts with a warm cache.
+    rec.height = baseKey;
+    if (!db.append(baseKey, 1, &rec, sizeof(rec))) {
+        std::cerr << "    [Append] FAIL: Failed appending record with key " << baseKey << " " << RED_CROSS << std::endl;
+        return;
+    }
+    db.resetCacheStats();
+    for (uint32_t i = 1; i < numRecords; i++) {
+        rec.height = baseKey + i;
+        if (!db.append(baseKey + i, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Append] FAIL: Failed appending record with key " << baseKey + i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    uint32_t hits = 0, misses = 0;
+    db.getCacheStats(hits, misses);
+    if (db.indexCount() != countBefore + numRecords || misses != 0) {
+        std::cerr << "    [Append] FAIL: " << db.indexCount() - countBefore << " of " << numRecords
+            << " records appended with " << misses << " page loads. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Append] SUCCESS: " << numRecords << " ascending keys appended without page loads. "
+        << GREEN_TICK << std::endl;
+
+    if (db.append(baseKey + 5, 1, &rec, sizeof(rec))) {
+        std::cerr << "    [Duplicate] FAIL: Key " << baseKey + 5 << " was accepted twice. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!db.get(baseKey + i, &out, sizeof(out)) || out.height != baseKey + i) {
+            std::cerr << "    [Retrieve] FAIL: Record with key " << baseKey + i << " not found. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    std::cout << "    [Retrieve] SUCCESS: Duplicate rejected and all records read back. " << GREEN_TICK << std::endl;
+}
+
+
+// Test: Batched Appends
+//   - Appends a batch of records given in scrambled key order and reads them all back.
+//   - Verifies that a batch repeating a key, or clashing with a live record, is
+//     rejected without changing the index.
+//   - Deletes a record and verifies that a batch can reuse its key.
+void testAppendBatch() {
+    const uint32_t numRecords = 40;
+    const uint32_t baseKey = 3000000;
+    TemperatureRecord recs[numRecords];
+    BatchItem items[numRecords];
+
+    std::cout << "Test Batched Appends" << std::endl;
+
+    for (uint32_t i = 0; i < numRecords; i++) {
+        // 17 is coprime to numRecords, so every key in the range is used once.
+        uint32_t key = baseKey + (i * 17) % numRecords;
+        recs[i] = { 19.0f, 55.0f, key, i, "Batched record" };
+        items[i] = { key, 1, &recs[i], static_cast<uint16_t>(sizeof(recs[i])) };
+    }
+    size_t countBefore = db.indexCount();
+    if (!db.appendBatch(items, numRecords) || db.indexCount() != countBefore + numRecords) {
+        std::cerr << "    [Batch] FAIL: Batch of " << numRecords << " records was not appended. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t key = baseKey; key < baseKey + numRecords; key++) {
+        TemperatureRecord out;
+        if (!db.get(key, &out, sizeof(out)) || out.height != key) {
+            std::cerr << "    [Batch] FAIL: Record with key " << key << " not found. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    std::cout << "    [Batch] SUCCESS: " << numRecords << " records appended in one batch. " << GREEN_TICK << std::endl;
+
+    TemperatureRecord extra = { 0.0f, 0.0f, 7, 7, "Rejected" };
+    BatchItem repeated[2] = { { baseKey + 100, 1, &extra, sizeof(extra) }, { baseKey + 100, 1, &extra, sizeof(extra) } };
+    BatchItem clashing[2] = { { baseKey + 101, 1, &extra, sizeof(extra) }, { baseKey + 3, 1, &extra, sizeof(extra) } };
+    if (db.appendBatch(repeated, 2) || db.appendBatch(clashing, 2) ||
+        db.indexCount() != countBefore + numRecords) {
+        std::cerr << "    [Reject] FAIL: Invalid batch changed the index. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reject] SUCCESS: Batches with repeated or live keys rejected. " << GREEN_TICK << std::endl;
+
+    TemperatureRecord reused = { 0.0f, 0.0f, 4242, 0, "Reused key" };
+    BatchItem reuse[2] = { { baseKey + 200, 1, &reused, sizeof(reused) }, { baseKey + 5, 1, &reused, sizeof(reused) } };
+    TemperatureRecord out;
+    if (!db.deleteRecord(baseKey + 5) || !db.appendBatch(reuse, 2) ||
+        db.indexCount() != countBefore + numRecords + 1 ||
+        !db.get(baseKey + 5, &out, sizeof(out)) || out.height != 4242) {
+        std::cerr << "    [Reuse] FAIL: Deleted key was not reused by the batch. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reuse] SUCCESS: Deleted key reused by a batch. " << GREEN_TICK << std::endl;
+}
+
+
+// Test: Buffered File Handler
+//   - Opens a second database whose handlers are wrapped in BufferedFileHandler.
+//   - Appends records and verifies that the log writes are still held in RAM.
+//   - Verifies that get() sees the buffered records and that sync() empties the buffer.
+//   - Reopens the files with plain handlers and verifies every record.
+void testBufferedFileHandler() {
+    const uint32_t numRecords = 100;
+    const uint32_t baseKey = 4000000;
+    TemperatureRecord rec = { 21.0f, 40.0f, 0, 0, "Buffered write" };
+
+    std::cout << "Test Buffered File Handler" << std::endl;
+
+    std::remove("BUFLOG.BIN");
+    std::remove("BUFIDX.BIN");
+    static uint8_t logBuffer[4096];
+    static uint8_t indexBuffer[512];
+    WindowsFileHandler logFile;
+    WindowsFileHandler indexFile;
+    BufferedFileHandler bufferedLog(logFile, logBuffer, sizeof(logBuffer));
+    BufferedFileHandler bufferedIndex(indexFile, indexBuffer, sizeof(indexBuffer));
+    DBEngine bufDb(bufferedLog, bufferedIndex);
+    if (!bufDb.open("BUFLOG.BIN", "BUFIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create buffered database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!bufDb.append(baseKey + i, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Append] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    if (bufferedLog.pendingBytes() == 0) {
+        std::cerr << "    [Append] FAIL: Log writes were not buffered. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Append] SUCCESS: " << bufferedLog.pendingBytes() << " log bytes pending after "
+        << numRecords << " appends. " << GREEN_TICK << std::endl;
+
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!bufDb.get(baseKey + i, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Read] FAIL: Record " << i << " not readable through the buffer. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    rec.height = numRecords;
+    if (!bufDb.append(baseKey + numRecords, 1, &rec, sizeof(rec)) || !bufDb.sync() ||
+        bufferedLog.pendingBytes() != 0 || bufferedIndex.pendingBytes() != 0) {
+        std::cerr << "    [Sync] FAIL: sync() did not write the buffered data. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Sync] SUCCESS: Records readable and buffers empty after sync(). " << GREEN_TICK << std::endl;
+    bufDb.close();
+
+    WindowsFileHandler plainLog;
+    WindowsFileHandler plainIndex;
+    DBEngine plainDb(plainLog, plainIndex);
+    if (!plainDb.open("BUFLOG.BIN", "BUFIDX.BIN", DB_MODE_SESSION) || plainDb.indexCount() != numRecords + 1) {
+        std::cerr << "    [Reopen] FAIL: Buffered database did not reopen. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i <= numRecords; i++) {
+        TemperatureRecord out;
+        if (!plainDb.get(baseKey + i, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Reopen] FAIL: Record " << i << " missing after reopen. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    plainDb.close();
+    std::remove("BUFLOG.BIN");
+    std::remove("BUFIDX.BIN");
+    std::cout << "    [Reopen] SUCCESS: " << numRecords + 1 << " records intact without the buffer. " << GREEN_TICK << std::endl;
+}
+
+// Test: Zero-Copy Record Views
+//   - Verifies that getView() declines when the log handler cannot map (the shared db).
+//   - Opens a second database over a handler whose map() serves the requested range.
+//   - Verifies that getView() returns the header and payload of each record.
+//   - Verifies that a deleted record's view shows the deletion flag and that a
+//     missing key is refused.
+class MappingFileHandler : public WindowsFileHandler {
+public:
+    const uint8_t* map(uint32_t offset, size_t length) override {
+        size_t bytesRead = 0;
+        _view.resize(length);
+        if (!seek(offset) || !read(_view.data(), length, bytesRead) || bytesRead != length)
+            return nullptr;
+        return _view.data();
+    }
+private:
+    std::vector<uint8_t> _view;
+};
+
+void testGetView() {
+    const uint32_t numRecords = 50;
+    const uint32_t baseKey = 5000000;
+    TemperatureRecord rec = { 19.0f, 45.0f, 0, 0, "Mapped record" };
+
+    std::cout << "Test Zero-Copy Record Views" << std::endl;
+
+    const LogEntryHeader* header = nullptr;
+    const uint8_t* payload = nullptr;
+    IndexEntry first;
+    uint32_t firstPos = 0;
+    if (!db.getFirstActiveIndexEntry(first, firstPos) || db.getView(first.key, header, payload) || header || payload) {
+        std::cerr << "    [Unmapped] FAIL: getView() succeeded without a mapping handler. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Unmapped] SUCCESS: getView() declines on a handler without map(). " << GREEN_TICK << std::endl;
+
+    std::remove("VIEWLOG.BIN");
+    std::remove("VIEWIDX.BIN");
+    MappingFileHandler mapLog;
+    WindowsFileHandler mapIndex;
+    DBEngine viewDb(mapLog, mapIndex);
+    if (!viewDb.open("VIEWLOG.BIN", "VIEWIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!viewDb.append(baseKey + i, 3, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!viewDb.getView(baseKey + i, header, payload) || header->key != baseKey + i ||
+            header->recordType != 3 || header->length != sizeof(TemperatureRecord)) {
+            std::cerr << "    [View] FAIL: No view for key " << baseKey + i << " " << RED_CROSS << std::endl;
+            return;
+        }
+        memcpy(&out, payload, sizeof(out));
+        if (out.height != i) {
+            std::cerr << "    [View] FAIL: Payload mismatch for key " << baseKey + i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    std::cout << "    [View] SUCCESS: " << numRecords << " records viewed in place. " << GREEN_TICK << std::endl;
+
+    if (!viewDb.deleteRecord(baseKey) || !viewDb.getView(baseKey, header, payload) ||
+        !(header->internal_status & INTERNAL_STATUS_DELETED) ||
+        viewDb.getView(baseKey + numRecords, header, payload)) {
+        std::cerr << "    [Delete] FAIL: View does not reflect the deletion flag. " << RED_CROSS << std::endl;
+        return;
+    }
+    viewDb.close();
+    std::remove("VIEWLOG.BIN");
+    std::remove("VIEWIDX.BIN");
+    std::cout << "    [Delete] SUCCESS: Deleted record flagged in its view; missing key refused. " << GREEN_TICK << std::endl;
+}
+
+#ifndef _WIN32
+// Appends numRecords records starting at baseKey to a fresh database over the
+// given handlers and reads them all back by key. Returns the elapsed time.
+static bool runHandlerWorkload(IFileHandler& logFile, IFileHandler& indexFile, uint32_t baseKey,
+    uint32_t numRecords, double& seconds) {
+    TemperatureRecord rec = { 22.0f, 55.0f, 0, 0, "Handler workload" };
+    std::remove("HNDLOG.BIN");
+    std::remove("HNDIDX.BIN");
+    DBEngine handlerDb(logFile, indexFile);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    if (!handlerDb.open("HNDLOG.BIN", "HNDIDX.BIN", DB_MODE_SESSION))
+        return false;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        // Scrambled keys so that lookups are not purely sequential.
+        if (!handlerDb.append(baseKey + (i * 7919) % numRecords, 1, &rec, sizeof(rec)))
+            return false;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!handlerDb.get(baseKey + (i * 7919) % numRecords, &out, sizeof(out)) || out.height != i)
+            return false;
+    }
+    handlerDb.close();
+    std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - startTime;
+    seconds = diff.count();
+    return true;
+}
+
+// Test: POSIX File Handler
+//   - Runs the same append/lookup workload over the stdio and the POSIX handler
+//     and reports both timings.
+//   - Reopens the POSIX-written files with the stdio handler to check that the
+//     on-disk format is identical.
+//   - Verifies that getView() works through the handler's mmap-backed map().
+void testPosixFileHandler() {
+    const uint32_t numRecords = 2000;
+    const uint32_t baseKey = 6000000;
+
+    std::cout << "Test POSIX File Handler" << std::endl;
+
+    double stdioSeconds = 0, posixSeconds = 0;
+    WindowsFileHandler stdioLog;
+    WindowsFileHandler stdioIndex;
+    PosixFileHandler posixLog(PosixFileHandler::ACCESS_SEQUENTIAL);
+    PosixFileHandler posixIndex(PosixFileHandler::ACCESS_RANDOM);
+    if (!runHandlerWorkload(stdioLog, stdioIndex, baseKey, numRecords, stdioSeconds) ||
+        !runHandlerWorkload(posixLog, posixIndex, baseKey, numRecords, posixSeconds)) {
+        std::cerr << "    [Workload] FAIL: Append/lookup workload failed. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Workload] SUCCESS: " << numRecords << " appends and lookups: stdio "
+        << stdioSeconds << " s, POSIX " << posixSeconds << " s. " << GREEN_TICK << std::endl;
+
+    DBEngine checkDb(stdioLog, stdioIndex);
+    if (!checkDb.open("HNDLOG.BIN", "HNDIDX.BIN", DB_MODE_SESSION) || checkDb.indexCount() != numRecords) {
+        std::cerr << "    [Format] FAIL: POSIX-written files not readable with stdio. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        if (!checkDb.get(baseKey + (i * 7919) % numRecords, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Format] FAIL: Record " << i << " differs. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    checkDb.close();
+    std::cout << "    [Format] SUCCESS: Files interchangeable between handlers. " << GREEN_TICK << std::endl;
+
+    DBEngine viewDb(posixLog, posixIndex);
+    const LogEntryHeader* header = nullptr;
+    const uint8_t* payload = nullptr;
+    TemperatureRecord rec = { 23.0f, 60.0f, 0, 0, "Mapped after growth" };
+    rec.height = numRecords;
+    if (!viewDb.open("HNDLOG.BIN", "HNDIDX.BIN", DB_MODE_SESSION) ||
+        !viewDb.getView(baseKey, header, payload) ||
+        !viewDb.append(baseKey + numRecords, 1, &rec, sizeof(rec)) ||
+        !viewDb.getView(baseKey + numRecords, header, payload) ||
+        header->length != sizeof(TemperatureRecord) ||
+        memcmp(payload, &rec, sizeof(rec)) != 0) {
+        std::cerr << "    [Map] FAIL: getView() did not map the log. " << RED_CROSS << std::endl;
+        return;
+    }
+    viewDb.close();
+    std::remove("HNDLOG.BIN");
+    std::remove("HNDIDX.BIN");
+    std::cout << "    [Map] SUCCESS: Records viewed through mmap, including one appended after mapping. "
+        << GREEN_TICK << std::endl;
+}
+#endif
+
+// Test: Status Summaries
+//   - Builds a separate database from scrambled keys (so leaves split) and marks
+//     all but three records as uploaded.
+//   - Verifies after a reopen that findByStatus() finds exactly the three pending
+//     records while loading only the leaves that hold them.
+//   - Verifies that recordCount() on the deletion flag needs no page loads.
+//   - Rewrites the index as version 2 (no summaries), reopens it and repeats the checks.
+static bool checkStatusSummaries(DBEngine& sumDb, const uint32_t* pending, size_t numPending,
+    uint32_t numRecords, uint32_t numDeleted, const char* stage) {
+    uint32_t results[16];
+    uint32_t hits = 0, misses = 0;
+    sumDb.resetCacheStats();
+    size_t found = sumDb.findByStatus(0, results, 16);
+    sumDb.getCacheStats(hits, misses);
+    bool ok = (found == numPending);
+    for (size_t i = 0; ok && i < found; i++) {
+        IndexEntry entry;
+        ok = sumDb.getIndexEntry(results[i], entry) && entry.key == pending[i] && entry.status == 0;
+    }
+    if (!ok || misses > numPending) {
+        std::cerr << "    [" << stage << "] FAIL: findByStatus found " << found << " records with "
+            << misses << " page loads. " << RED_CROSS << std::endl;
+        return false;
+    }
+    size_t pageLoads = misses;
+    sumDb.resetCacheStats();
+    size_t deleted = sumDb.recordCount(INTERNAL_STATUS_DELETED);
+    size_t active = sumDb.recordCount(0, INTERNAL_STATUS_DELETED);
+    sumDb.getCacheStats(hits, misses);
+    if (deleted != numDeleted || active != numRecords - numDeleted || misses != 0) {
+        std::cerr << "    [" << stage << "] FAIL: recordCount returned " << deleted << " deleted, "
+            << active << " active with " << misses << " page loads. " << RED_CROSS << std::endl;
+        return false;
+    }
+    std::cout << "    [" << stage << "] SUCCESS: " << found << " pending records found with " << pageLoads
+        << " page loads; counts from the summaries. " << GREEN_TICK << std::endl;
+    return true;
+}
+
+void testStatusSummaries() {
+    const uint32_t numRecords = 3000;
+    const uint32_t baseKey = 7000000;
+    const uint32_t numDeleted = 10;
+    const uint32_t pending[] = { baseKey + 5, baseKey + 1500, baseKey + 2999 };
+    TemperatureRecord rec = { 18.0f, 35.0f, 0, 0, "Summary record" };
+
+    std::cout << "Test Status Summaries" << std::endl;
+
+    std::remove("SUMLOG.BIN");
+    std::remove("SUMIDX.BIN");
+    WindowsFileHandler sumLog;
+    WindowsFileHandler sumIndex;
+    DBEngine sumDb(sumLog, sumIndex);
+    if (!sumDb.open("SUMLOG.BIN", "SUMIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!sumDb.append(baseKey + (i * 7919) % numRecords, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    // Upload everything except the pending keys; delete a few uploaded ones.
+    for (uint32_t i = 0; i < numRecords; i++) {
+        uint32_t key = baseKey + i;
+        if (key == pending[0] || key == pending[1] || key == pending[2])
+            continue;
+        if (!sumDb.updateStatus(i, STATUS_UPLOADED) || (i % 97 == 1 && i / 97 < numDeleted && !sumDb.deleteRecord(key))) {
+            std::cerr << "    [Setup] FAIL: Unable to update record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    sumDb.close();
+    if (!sumDb.open("SUMLOG.BIN", "SUMIDX.BIN", DB_MODE_SESSION) ||
+        !checkStatusSummaries(sumDb, pending, 3, numRecords, numDeleted, "Summaries")) {
+        return;
+    }
+    sumDb.close();
+
+    // Strip the summaries: version 2 interior references are key, page and count only.
+    // The newer of the two header slots describes the tree.
+    FILE* f = fopen("SUMIDX.BIN", "rb+");
+    DBIndexHeader headers[2];
+    IndexPage root;
+    bool readHeaders = f && fread(headers, sizeof(headers), 1, f) == 1;
+    DBIndexHeader header = headers[(readHeaders && headers[1].sequence > headers[0].sequence) ? 1 : 0];
+    if (!readHeaders || header.treeHeight != 2 ||
+        fseek(f, static_cast<long>(sizeof(headers) + header.rootPage * sizeof(IndexPage)), SEEK_SET) != 0 ||
+        fread(&root, sizeof(root), 1, f) != 1 || root.header.count > INDEX_FANOUT) {
+        std::cerr << "    [Setup] FAIL: Unable to read SUMIDX.BIN " << RED_CROSS << std::endl;
+        if (f)
+            fclose(f);
+        return;
+    }
+    uint32_t oldRefs[INDEX_FANOUT * 3];
+    for (uint16_t i = 0; i < root.header.count; i++) {
+        oldRefs[i * 3] = root.children[i].key;
+        oldRefs[i * 3 + 1] = root.children[i].page;
+        oldRefs[i * 3 + 2] = root.children[i].count;
+    }
+    memset(root.children, 0, sizeof(root.children));
+    memcpy(root.children, oldRefs, root.header.count * 3 * sizeof(uint32_t));
+    header.version = DB_IDX_VERSION_TREE;
+    fseek(f, static_cast<long>(sizeof(headers) + header.rootPage * sizeof(IndexPage)), SEEK_SET);
+    fwrite(&root, sizeof(root), 1, f);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(&header, sizeof(header), 1, f);
+    fclose(f);
+
+    if (!sumDb.open("SUMLOG.BIN", "SUMIDX.BIN", DB_MODE_SESSION) || sumDb.indexCount() != numRecords) {
+        std::cerr << "    [Upgrade] FAIL: Version 2 index not converted. " << RED_CROSS << std::endl;
+        return;
+    }
+    sumDb.close();
+    if (!sumDb.open("SUMLOG.BIN", "SUMIDX.BIN", DB_MODE_SESSION) ||
+        !checkStatusSummaries(sumDb, pending, 3, numRecords, numDeleted, "Upgrade")) {
+        return;
+    }
+    sumDb.close();
+    std::remove("SUMLOG.BIN");
+    std::remove("SUMIDX.BIN");
+}
+
+// Test: Range Scan Cursor
+//   - Fills a separate database with ascending keys (timestamps 10 apart).
+//   - Exports a key window with DBCursor and verifies every payload, counting
+//     the log reads to confirm that consecutive records share read-ahead chunks.
+//   - Walks the window backwards with prev().
+//   - Verifies that a status change made after the read-ahead is visible.
+class ReadCountingFileHandler : public WindowsFileHandler {
+public:
+    bool read(uint8_t* buffer, size_t size, size_t& bytesRead) override {
+        reads++;
+        return WindowsFileHandler::read(buffer, size, bytesRead);
+    }
+    uint32_t reads = 0;
+};
+
+void testCursorScan() {
+    const uint32_t numRecords = 1000;
+    const uint32_t baseKey = 8000000;
+    const uint32_t windowStart = baseKey + 2005;   // Between two keys: starts at record 201.
+    const uint32_t windowEnd = baseKey + 4000;     // Exclusive: ends after record 399.
+    TemperatureRecord rec = { 17.0f, 30.0f, 0, 0, "Cursor record" };
+
+    std::cout << "Test Range Scan Cursor" << std::endl;
+
+    std::remove("CURLOG.BIN");
+    std::remove("CURIDX.BIN");
+    ReadCountingFileHandler curLog;
+    WindowsFileHandler curIndex;
+    DBEngine curDb(curLog, curIndex);
+    if (!curDb.open("CURLOG.BIN", "CURIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!curDb.append(baseKey + i * 10, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+
+    DBCursor cursor(curDb);
+    curLog.reads = 0;
+    uint32_t expected = 201;
+    for (bool ok = cursor.seek(windowStart); ok && cursor.entry().key < windowEnd; ok = cursor.next()) {
+        TemperatureRecord out;
+        uint16_t size = 0;
+        if (!cursor.readPayload(&out, sizeof(out), &size) || size != sizeof(out) || out.height != expected) {
+            std::cerr << "    [Forward] FAIL: Record " << expected << " not read correctly. " << RED_CROSS << std::endl;
+            return;
+        }
+        expected++;
+    }
+    uint32_t exported = expected - 201;
+    if (exported != 199 || curLog.reads > exported / 4) {
+        std::cerr << "    [Forward] FAIL: Exported " << exported << " records with " << curLog.reads
+            << " log reads. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Forward] SUCCESS: Exported " << exported << " records with " << curLog.reads
+        << " log reads. " << GREEN_TICK << std::endl;
+
+    // Walk back from the last record of the window.
+    bool ok = cursor.prev();
+    for (uint32_t i = 399; ok && i >= 201; i--) {
+        TemperatureRecord out;
+        if (cursor.entry().key != baseKey + i * 10 || !cursor.readPayload(&out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Backward] FAIL: Record " << i << " not read correctly. " << RED_CROSS << std::endl;
+            return;
+        }
+        ok = cursor.prev();
+    }
+    if (!ok || cursor.entry().key != baseKey + 2000) {
+        std::cerr << "    [Backward] FAIL: Cursor did not stop before the window. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Backward] SUCCESS: Window walked in reverse. " << GREEN_TICK << std::endl;
+
+    // Fill the read-ahead buffer, change a record inside it, and read it again.
+    TemperatureRecord out;
+    LogEntryHeader header;
+    if (!cursor.seek(windowStart) || !cursor.readPayload(&out, sizeof(out)) || !cursor.next() ||
+        !curDb.updateStatus(cursor.position(), STATUS_UPLOADED) ||
+        !cursor.readPayload(&out, sizeof(out), nullptr, &header) || header.status != STATUS_UPLOADED) {
+        std::cerr << "    [Refresh] FAIL: Stale read-ahead data returned. " << RED_CROSS << std::endl;
+        return;
+    }
+    if (cursor.seek(baseKey + numRecords * 10) || !cursor.last() || cursor.entry().key != baseKey + (numRecords - 1) * 10 ||
+        cursor.next() || cursor.valid()) {
+        std::cerr << "    [Ends] FAIL: Cursor moved past the last entry. " << RED_CROSS << std::endl;
+        return;
+    }
+    curDb.close();
+    std::remove("CURLOG.BIN");
+    std::remove("CURIDX.BIN");
+    std::cout << "    [Refresh] SUCCESS: In-place updates seen through the cursor; ends respected. " << GREEN_TICK << std::endl;
+}
+
+// Test: Log Compaction
+//   - Fills a separate database and deletes every other record.
+//   - Compacts in small steps, appending, re-using a deleted key, deleting and
+//     updating between the steps.
+//   - Verifies every record afterwards and that the log holds only live records.
+//   - Interrupts a second compaction with close(), checks that the database only
+//     reopens with the compaction file set, and finishes the compaction.
+//   - Cuts the final rename short after the old log is removed and checks that
+//     open() finishes the swap instead of starting an empty log.
+static long testFileSize(const char* fileName) {
+    FILE* f = fopen(fileName, "rb");
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static bool checkCompactedRecords(DBEngine& cmpDb, uint32_t baseKey, uint32_t numRecords, uint32_t& live) {
+    live = 0;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord out;
+        bool deleted = (i % 2 == 1 && i != 1) || i == 280;
+        bool found = cmpDb.get(baseKey + i, &out, sizeof(out));
+        if (found == deleted)
+            return false;
+        if (found && out.height != (i == 1 ? 9999 : i))
+            return false;
+        if (found)
+            live++;
+    }
+    TemperatureRecord out;
+    if (!cmpDb.get(baseKey + 1000, &out, sizeof(out)) || out.height != 1000)
+        return false;
+    live++;
+    return true;
+}
+
+// Removes the target and then fails, like a non-atomic replace interrupted by a crash.
+class CrashingRenameFileHandler : public WindowsFileHandler {
+public:
+    bool rename(const char*, const char* newName) override {
+        std::remove(newName);
+        return false;
+    }
+};
+
+void testCompaction() {
+    const uint32_t numRecords = 300;
+    const uint32_t baseKey = 9000000;
+    const long recordBytes = static_cast<long>(sizeof(LogEntryHeader) + sizeof(TemperatureRecord));
+    TemperatureRecord rec = { 5.0f, 60.0f, 0, 0, "Compaction record" };
+
+    std::cout << "Test Log Compaction" << std::endl;
+
+    std::remove("CMPLOG.BIN");
+    std::remove("CMPIDX.BIN");
+    std::remove("CMPTMP.BIN");
+    WindowsFileHandler cmpLog;
+    WindowsFileHandler cmpIndex;
+    WindowsFileHandler cmpTemp;
+    DBEngine cmpDb(cmpLog, cmpIndex);
+    cmpDb.setCompactionFile(cmpTemp, "CMPTMP.BIN");
+    if (!cmpDb.open("CMPLOG.BIN", "CMPIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!cmpDb.append(baseKey + i, 1, &rec, sizeof(rec)) ||
+            (i % 2 == 1 && !cmpDb.deleteRecord(baseKey + i))) {
+            std::cerr << "    [Setup] FAIL: Append or delete failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    cmpDb.sync();
+    long sizeBefore = testFileSize("CMPLOG.BIN");
+
+    // Small steps, with other work in between.
+    uint32_t steps = 0;
+    bool finished = false;
+    bool ok = true;
+    while (ok && !finished) {
+        ok = cmpDb.compact(32, &finished);
+        steps++;
+        if (ok && steps == 2) {
+            uint32_t position = 0;
+            rec.height = 9999;
+            ok = cmpDb.isCompacting() && cmpDb.append(baseKey + 1, 1, &rec, sizeof(rec));
+            rec.height = 1000;
+            ok = ok && cmpDb.append(baseKey + 1000, 1, &rec, sizeof(rec)) &&
+                cmpDb.deleteRecord(baseKey + 280) &&
+                cmpDb.searchIndex(baseKey + 2, &position) && cmpDb.updateStatus(position, STATUS_UPLOADED);
+        }
+    }
+    if (!ok || steps < 5 || cmpDb.isCompacting()) {
+        std::cerr << "    [Steps] FAIL: Compaction did not complete in steps (" << steps << " steps). "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Steps] SUCCESS: Compacted in " << steps << " steps with updates in between. "
+        << GREEN_TICK << std::endl;
+
+    uint32_t live = 0;
+    IndexEntry entry;
+    uint32_t position = 0;
+    if (!checkCompactedRecords(cmpDb, baseKey, numRecords, live) ||
+        !cmpDb.searchIndex(baseKey + 2, &position) || !cmpDb.getIndexEntry(position, entry) ||
+        entry.status != STATUS_UPLOADED) {
+        std::cerr << "    [Records] FAIL: Records wrong after compaction. " << RED_CROSS << std::endl;
+        return;
+    }
+    long sizeAfter = testFileSize("CMPLOG.BIN");
+    if (sizeAfter != static_cast<long>(sizeof(DBHeader)) + live * recordBytes || testFileSize("CMPTMP.BIN") != -1) {
+        std::cerr << "    [Records] FAIL: Log is " << sizeAfter << " bytes for " << live << " live records. "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Records] SUCCESS: " << live << " live records kept; log shrank from " << sizeBefore
+        << " to " << sizeAfter << " bytes. " << GREEN_TICK << std::endl;
+
+    // Interrupt a second compaction (nothing new to reclaim) and resume it after reopening.
+    if (!cmpDb.compact(40, &finished) || finished || !cmpDb.isCompacting()) {
+        std::cerr << "    [Resume] FAIL: Second compaction did not start. " << RED_CROSS << std::endl;
+        return;
+    }
+    cmpDb.close();
+    DBEngine plainDb(cmpLog, cmpIndex);
+    bool plainOpened = plainDb.open("CMPLOG.BIN", "CMPIDX.BIN", DB_MODE_SESSION);
+    plainDb.close();
+
+    DBEngine resumedDb(cmpLog, cmpIndex);
+    resumedDb.setCompactionFile(cmpTemp, "CMPTMP.BIN");
+    ok = !plainOpened && resumedDb.open("CMPLOG.BIN", "CMPIDX.BIN", DB_MODE_SESSION) && resumedDb.isCompacting();
+    finished = false;
+    while (ok && !finished)
+        ok = resumedDb.compact(100, &finished);
+    if (!ok || !checkCompactedRecords(resumedDb, baseKey, numRecords, live) ||
+        testFileSize("CMPLOG.BIN") != sizeAfter) {
+        std::cerr << "    [Resume] FAIL: Interrupted compaction not recovered. " << RED_CROSS << std::endl;
+        return;
+    }
+    resumedDb.close();
+    std::cout << "    [Resume] SUCCESS: Interrupted compaction finished after reopening. " << GREEN_TICK << std::endl;
+
+    // Lose the log halfway through the final rename and reopen.
+    CrashingRenameFileHandler crashTemp;
+    DBEngine crashDb(cmpLog, cmpIndex);
+    crashDb.setCompactionFile(crashTemp, "CMPTMP.BIN");
+    ok = crashDb.open("CMPLOG.BIN", "CMPIDX.BIN", DB_MODE_SESSION);
+    finished = false;
+    ok = ok && !crashDb.compact(1000, &finished) && !finished && testFileSize("CMPLOG.BIN") == -1;
+    crashDb.close();
+
+    DBEngine swappedDb(cmpLog, cmpIndex);
+    swappedDb.setCompactionFile(cmpTemp, "CMPTMP.BIN");
+    if (!ok || !swappedDb.open("CMPLOG.BIN", "CMPIDX.BIN", DB_MODE_SESSION) || swappedDb.isCompacting() ||
+        !checkCompactedRecords(swappedDb, baseKey, numRecords, live) ||
+        testFileSize("CMPLOG.BIN") != sizeAfter || testFileSize("CMPTMP.BIN") != -1) {
+        std::cerr << "    [Swap] FAIL: Interrupted rename not finished on open. " << RED_CROSS << std::endl;
+        return;
+    }
+    swappedDb.close();
+    std::remove("CMPLOG.BIN");
+    std::remove("CMPIDX.BIN");
+    std::cout << "    [Swap] SUCCESS: Missing log restored from the compaction file. " << GREEN_TICK << std::endl;
+}
+
+// Test: Segmented Log
+//   - Creates a database whose log is a ring of four small segment files.
+//   - Appends far more records than the ring holds, with a deletion in between.
+//   - Verifies that the oldest records were dropped from the index, that the most
+//     recent ones are intact and that no segment grew beyond its size.
+//   - Reopens in safe mode without setLogSegments(): the layout comes from the
+//     log file, and appends keep rolling over.
+//   - Checks that a record larger than a segment is refused.
+void testSegmentedLog() {
+    const uint8_t numSegments = 4;
+    const uint32_t segmentSize = 2048;
+    const uint32_t numRecords = 400;
+    const uint32_t baseKey = 10000000;
+    const uint32_t recordBytes = static_cast<uint32_t>(sizeof(LogEntryHeader) + sizeof(TemperatureRecord));
+    const uint32_t perSegment = (segmentSize - static_cast<uint32_t>(sizeof(DBHeader))) / recordBytes;
+    const char* segmentFiles[numSegments] = { "SEGLOG.000", "SEGLOG.001", "SEGLOG.002", "SEGLOG.003" };
+    TemperatureRecord rec = { 7.0f, 40.0f, 0, 0, "Segment record" };
+
+    std::cout << "Test Segmented Log" << std::endl;
+
+    std::remove("SEGLOG.BIN");
+    std::remove("SEGIDX.BIN");
+    for (uint8_t s = 0; s < numSegments; s++)
+        std::remove(segmentFiles[s]);
+    WindowsFileHandler segLog;
+    WindowsFileHandler segIndex;
+    DBEngine segDb(segLog, segIndex);
+    if (segDb.setLogSegments(0xFF, 0x01100000u) || !segDb.setLogSegments(numSegments, segmentSize) ||
+        !segDb.open("SEGLOG.BIN", "SEGIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create segmented database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!segDb.append(baseKey + i, 1, &rec, sizeof(rec)) ||
+            (i == numRecords - 5 && !segDb.deleteRecord(baseKey + i))) {
+            std::cerr << "    [Rollover] FAIL: Append or delete failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    segDb.sync();
+
+    // Every segment but the one being filled is full, so at least that many of
+    // the newest records must still be there.
+    bool ok = segDb.indexCount() <= numSegments * perSegment;
+    TemperatureRecord out;
+    ok = ok && !segDb.get(baseKey, &out, sizeof(out));
+    for (uint32_t i = numRecords - (numSegments - 1) * perSegment; ok && i < numRecords; i++)
+        ok = segDb.get(baseKey + i, &out, sizeof(out)) && out.height == i;
+    uint32_t position = 0;
+    IndexEntry entry;
+    ok = ok && segDb.searchIndex(baseKey + numRecords - 5, &position) && segDb.getIndexEntry(position, entry) &&
+        (entry.internal_status & INTERNAL_STATUS_DELETED) != 0;
+    for (uint8_t s = 0; ok && s < numSegments; s++) {
+        long size = testFileSize(segmentFiles[s]);
+        ok = size >= static_cast<long>(sizeof(DBHeader)) && size <= static_cast<long>(segmentSize);
+    }
+    if (!ok) {
+        std::cerr << "    [Rollover] FAIL: Wrong records or segment sizes after " << numRecords << " appends. "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Rollover] SUCCESS: " << segDb.indexCount() << " of " << numRecords
+        << " records kept in " << static_cast<int>(numSegments) << " segments of " << segmentSize << " bytes. "
+        << GREEN_TICK << std::endl;
+    segDb.close();
+
+    // The layout is read back from the log file.
+    DBEngine safeDb(segLog, segIndex);
+    ok = safeDb.open("SEGLOG.BIN", "SEGIDX.BIN", DB_MODE_SAFE) &&
+        safeDb.get(baseKey + numRecords - 1, &out, sizeof(out)) && out.height == numRecords - 1;
+    for (uint32_t i = numRecords; ok && i < numRecords + 2 * perSegment; i++) {
+        rec.height = i;
+        ok = safeDb.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && !safeDb.get(baseKey + numRecords - numSegments * perSegment, &out, sizeof(out)) &&
+        safeDb.get(baseKey + numRecords + 2 * perSegment - 1, &out, sizeof(out)) &&
+        out.height == numRecords + 2 * perSegment - 1 && safeDb.indexCount() <= numSegments * perSegment;
+    if (!ok) {
+        std::cerr << "    [Reopen] FAIL: Segmented database not usable after reopening. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reopen] SUCCESS: Layout restored from the log file; appends keep rolling over. "
+        << GREEN_TICK << std::endl;
+
+    static uint8_t oversized[segmentSize];
+    memset(oversized, 0x5A, sizeof(oversized));
+    ok = !safeDb.append(baseKey + 5000, 1, oversized, sizeof(oversized)) &&
+        !safeDb.get(baseKey + 5000, &out, sizeof(out));
+    safeDb.close();
+    std::remove("SEGLOG.BIN");
+    std::remove("SEGIDX.BIN");
+    for (uint8_t s = 0; s < numSegments; s++)
+        std::remove(segmentFiles[s]);
+    if (!ok) {
+        std::cerr << "    [Oversize] FAIL: Record larger than a segment was accepted. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Oversize] SUCCESS: Record larger than a segment refused. " << GREEN_TICK << std::endl;
+}
+
+// Test: Index Recovery
+//   - Fills a separate database in scrambled key order, with deletions, a reused
+//     key and a status update, then closes it.
+//   - Overwrites both index header slots and appends half a record header to
+//     the log, as a power loss in the middle of an append would leave it.
+//   - Reopens: the index must be rebuilt from the log and the torn record cut off.
+//   - Deletes the index file and reopens again to rebuild it from scratch.
+static bool checkRecoveredRecords(DBEngine& rcvDb, uint32_t baseKey, uint32_t numRecords) {
+    if (rcvDb.indexCount() != numRecords)
+        return false;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        uint32_t position = 0;
+        IndexEntry entry;
+        TemperatureRecord out;
+        if (!rcvDb.searchIndex(baseKey + i, &position) || !rcvDb.getIndexEntry(position, entry) ||
+            !rcvDb.get(baseKey + i, &out, sizeof(out)))
+            return false;
+        bool deleted = (i % 10 == 3);
+        if (((entry.internal_status & INTERNAL_STATUS_DELETED) != 0) != deleted ||
+            out.height != (i == 13 ? 99999 : i) || entry.status != (i == 20 ? STATUS_UPLOADED : 0))
+            return false;
+    }
+    return true;
+}
+
+void testIndexRecovery() {
+    const uint32_t numRecords = 3000;
+    const uint32_t baseKey = 11000000;
+    TemperatureRecord rec = { 3.0f, 80.0f, 0, 0, "Recovery record" };
+
+    std::cout << "Test Index Recovery" << std::endl;
+
+    std::remove("RCVLOG.BIN");
+    std::remove("RCVIDX.BIN");
+    WindowsFileHandler rcvLog;
+    WindowsFileHandler rcvIndex;
+    DBEngine rcvDb(rcvLog, rcvIndex);
+    if (!rcvDb.open("RCVLOG.BIN", "RCVIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t n = 0; n < numRecords; n++) {
+        uint32_t i = (n * 7919) % numRecords;
+        rec.height = i;
+        if (!rcvDb.append(baseKey + i, 1, &rec, sizeof(rec)) ||
+            (i % 10 == 3 && !rcvDb.deleteRecord(baseKey + i))) {
+            std::cerr << "    [Setup] FAIL: Append or delete failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    // Key 13 is reused after its deletion; key 20 gets a status.
+    uint32_t position = 0;
+    rec.height = 99999;
+    if (!rcvDb.append(baseKey + 13, 1, &rec, sizeof(rec)) || !rcvDb.deleteRecord(baseKey + 13) ||
+        !rcvDb.searchIndex(baseKey + 20, &position) || !rcvDb.updateStatus(position, STATUS_UPLOADED) ||
+        !checkRecoveredRecords(rcvDb, baseKey, numRecords)) {
+        std::cerr << "    [Setup] FAIL: Reuse or status update failed. " << RED_CROSS << std::endl;
+        return;
+    }
+    rcvDb.close();
+    long logSize = testFileSize("RCVLOG.BIN");
+
+    // Both header slots are damaged, so neither can stand in for the other.
+    FILE* f = fopen("RCVIDX.BIN", "r+b");
+    const uint8_t garbage[8] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xDE, 0xAD, 0xBE, 0xEF };
+    bool damaged = f && fwrite(garbage, 1, sizeof(garbage), f) == sizeof(garbage) &&
+        fseek(f, sizeof(DBIndexHeader), SEEK_SET) == 0 && fwrite(garbage, 1, sizeof(garbage), f) == sizeof(garbage);
+    if (f)
+        fclose(f);
+    f = fopen("RCVLOG.BIN", "ab");
+    damaged = damaged && f && fwrite(garbage, 1, 5, f) == 5;
+    if (f)
+        fclose(f);
+    if (!damaged) {
+        std::cerr << "    [Setup] FAIL: Unable to damage the files. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    bool ok = rcvDb.open("RCVLOG.BIN", "RCVIDX.BIN", DB_MODE_SAFE);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    if (!ok || testFileSize("RCVLOG.BIN") != logSize || !checkRecoveredRecords(rcvDb, baseKey, numRecords)) {
+        std::cerr << "    [Corrupt] FAIL: Index not recovered from the log. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Corrupt] SUCCESS: " << numRecords << " entries rebuilt in " << elapsed.count()
+        << " seconds; torn record truncated. " << GREEN_TICK << std::endl;
+    rcvDb.close();
+
+    std::remove("RCVIDX.BIN");
+    rec.height = numRecords;
+    ok = rcvDb.open("RCVLOG.BIN", "RCVIDX.BIN", DB_MODE_SESSION) &&
+        checkRecoveredRecords(rcvDb, baseKey, numRecords) &&
+        rcvDb.append(baseKey + numRecords, 1, &rec, sizeof(rec));
+    rcvDb.close();
+    ok = ok && rcvDb.open("RCVLOG.BIN", "RCVIDX.BIN", DB_MODE_SAFE) && rcvDb.indexCount() == numRecords + 1;
+    rcvDb.close();
+    std::remove("RCVLOG.BIN");
+    std::remove("RCVIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Missing] FAIL: Index not rebuilt after deleting it. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Missing] SUCCESS: Deleted index rebuilt; database usable afterwards. " << GREEN_TICK << std::endl;
+}
+
+// Test: Bulk Load
+//   - Loads scrambled keys into a fresh database once through append() and once
+//     between beginBulk() and endBulk(), partly through appendBatch(), with one
+//     key appended twice; the bulk-loaded index must hold the later record.
+//   - Starts a bulk load on a filled database and copies the files after sync(),
+//     as a power loss would leave them: opening the copy must rebuild the index.
+static bool copyTestFile(const char* from, const char* to) {
+    FILE* in = fopen(from, "rb");
+    FILE* out = fopen(to, "wb");
+    bool ok = in && out;
+    uint8_t buffer[512];
+    size_t n = 0;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        ok = fwrite(buffer, 1, n, out) == n;
+    if (in)
+        fclose(in);
+    if (out)
+        fclose(out);
+    return ok;
+}
+
+void testBulkLoad() {
+    const uint32_t numRecords = 10000;
+    const uint32_t baseKey = 12000000;
+    TemperatureRecord rec = { 4.0f, 75.0f, 0, 0, "Bulk record" };
+    TemperatureRecord out;
+
+    std::cout << "Test Bulk Load" << std::endl;
+
+    std::remove("BLKLOG.BIN");
+    std::remove("BLKIDX.BIN");
+    WindowsFileHandler blkLog;
+    WindowsFileHandler blkIndex;
+    DBEngine blkDb(blkLog, blkIndex);
+    bool ok = blkDb.open("BLKLOG.BIN", "BLKIDX.BIN", DB_MODE_SESSION);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t n = 0; ok && n < numRecords; n++) {
+        rec.height = (n * 7919) % numRecords;
+        ok = blkDb.append(baseKey + rec.height, 1, &rec, sizeof(rec));
+    }
+    ok = ok && blkDb.sync();
+    std::chrono::duration<double> appendTime = std::chrono::high_resolution_clock::now() - start;
+    blkDb.close();
+    std::remove("BLKLOG.BIN");
+    std::remove("BLKIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Setup] FAIL: Regular appends failed. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    // The first records go through appendBatch(); key 5 is appended again at the end.
+    const uint32_t batched = 40;
+    static TemperatureRecord batchRecs[batched];
+    BatchItem items[batched];
+    for (uint32_t n = 0; n < batched; n++) {
+        batchRecs[n] = rec;
+        batchRecs[n].height = (n * 7919) % numRecords;
+        items[n] = { baseKey + batchRecs[n].height, 1, &batchRecs[n], sizeof(batchRecs[n]) };
+    }
+    ok = blkDb.open("BLKLOG.BIN", "BLKIDX.BIN", DB_MODE_SESSION);
+    start = std::chrono::high_resolution_clock::now();
+    ok = ok && blkDb.beginBulk() && blkDb.isBulkLoading() && blkDb.appendBatch(items, batched);
+    for (uint32_t n = batched; ok && n < numRecords; n++) {
+        rec.height = (n * 7919) % numRecords;
+        ok = blkDb.append(baseKey + rec.height, 1, &rec, sizeof(rec));
+    }
+    rec.height = 77777;
+    ok = ok && blkDb.append(baseKey + 5, 1, &rec, sizeof(rec)) && blkDb.indexCount() == 0 &&
+        !blkDb.compact(10) && blkDb.endBulk();
+    std::chrono::duration<double> bulkTime = std::chrono::high_resolution_clock::now() - start;
+    ok = ok && !blkDb.isBulkLoading() && blkDb.indexCount() == numRecords;
+    uint32_t previousKey = 0;
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        IndexEntry entry;
+        ok = blkDb.getIndexEntry(i, entry) && (i == 0 || entry.key > previousKey) &&
+            blkDb.get(baseKey + i, &out, sizeof(out)) && out.height == (i == 5 ? 77777 : i);
+        previousKey = entry.key;
+    }
+    if (!ok) {
+        std::cerr << "    [Bulk] FAIL: Bulk-loaded records not indexed correctly. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Bulk] SUCCESS: " << numRecords << " records: append() " << appendTime.count()
+        << " s, bulk load " << bulkTime.count() << " s. " << GREEN_TICK << std::endl;
+
+    // Power loss in the middle of a bulk load: the copy still has the bulk flag set.
+    rec.height = numRecords;
+    ok = blkDb.beginBulk() && blkDb.append(baseKey + numRecords, 1, &rec, sizeof(rec)) && blkDb.sync() &&
+        copyTestFile("BLKLOG.BIN", "BLKLOG2.BIN") && copyTestFile("BLKIDX.BIN", "BLKIDX2.BIN");
+    blkDb.close();
+    WindowsFileHandler copyLog;
+    WindowsFileHandler copyIndex;
+    DBEngine copyDb(copyLog, copyIndex);
+    ok = ok && copyDb.open("BLKLOG2.BIN", "BLKIDX2.BIN", DB_MODE_SAFE) && !copyDb.isBulkLoading() &&
+        copyDb.indexCount() == numRecords + 1 && copyDb.get(baseKey + numRecords, &out, sizeof(out)) &&
+        out.height == numRecords;
+    copyDb.close();
+    // close() finished the bulk load of the original.
+    ok = ok && blkDb.open("BLKLOG.BIN", "BLKIDX.BIN", DB_MODE_SAFE) && blkDb.indexCount() == numRecords + 1 &&
+        blkDb.get(baseKey + numRecords, &out, sizeof(out)) && out.height == numRecords;
+    blkDb.close();
+    std::remove("BLKLOG.BIN");
+    std::remove("BLKIDX.BIN");
+    std::remove("BLKLOG2.BIN");
+    std::remove("BLKIDX2.BIN");
+    if (!ok) {
+        std::cerr << "    [Crash] FAIL: Interrupted bulk load not recovered. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Crash] SUCCESS: Interrupted bulk load rebuilt by open(); close() finishes one. "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Checksums
+//   - Checks dbCrc32() against the standard CRC-32 check value.
+//   - Damages the newer index header slot: open() must fall back to the other.
+//   - Marks the newest header as written ahead of its pages: open() must rebuild.
+//   - Damages a leaf and a log record: reads must be refused, not return bad data.
+//   - Opens a log written before record checksums existed (9-byte headers).
+static bool writeTestBytes(const char* fileName, long offset, const void* data, size_t size) {
+    FILE* f = fopen(fileName, "r+b");
+    bool ok = f && fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, size, f) == size;
+    if (f)
+        fclose(f);
+    return ok;
+}
+
+static bool readIndexHeaders(const char* fileName, DBIndexHeader headers[2]) {
+    FILE* f = fopen(fileName, "rb");
+    bool ok = f && fread(headers, sizeof(DBIndexHeader), 2, f) == 2;
+    if (f)
+        fclose(f);
+    return ok;
+}
+
+static bool checkChecksumRecords(DBEngine& crcDb, uint32_t baseKey, uint32_t numRecords) {
+    TemperatureRecord out;
+    if (crcDb.indexCount() != numRecords)
+        return false;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        if (!crcDb.get(baseKey + i, &out, sizeof(out)) || out.height != i)
+            return false;
+    }
+    return true;
+}
+
+void testChecksums() {
+    const uint32_t numRecords = 600;
+    const uint32_t baseKey = 13000000;
+    TemperatureRecord rec = { 5.0f, 70.0f, 0, 0, "Checksum record" };
+    TemperatureRecord out;
+
+    std::cout << "Test Checksums" << std::endl;
+
+    if (dbCrc32(0, "123456789", 9) != 0xCBF43926u || dbCrc32(dbCrc32(0, "1234", 4), "56789", 5) != 0xCBF43926u) {
+        std::cerr << "    [CRC] FAIL: dbCrc32() does not match the CRC-32 check value. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [CRC] SUCCESS: dbCrc32() matches the CRC-32 check value. " << GREEN_TICK << std::endl;
+
+    std::remove("CRCLOG.BIN");
+    std::remove("CRCIDX.BIN");
+    WindowsFileHandler crcLog;
+    WindowsFileHandler crcIndex;
+    DBEngine crcDb(crcLog, crcIndex);
+    bool ok = crcDb.open("CRCLOG.BIN", "CRCIDX.BIN", DB_MODE_SESSION);
+    for (uint32_t n = 0; ok && n < numRecords; n++) {
+        rec.height = (n * 7919) % numRecords;
+        ok = crcDb.append(baseKey + rec.height, 1, &rec, sizeof(rec));
+    }
+    crcDb.close();
+    if (!ok) {
+        std::cerr << "    [Setup] FAIL: Unable to fill the database. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    // A header write torn by a power loss: the previous header is still in the other slot.
+    DBIndexHeader headers[2];
+    const uint8_t garbage[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xDE, 0xAD };
+    ok = readIndexHeaders("CRCIDX.BIN", headers);
+    uint32_t newer = (headers[1].sequence > headers[0].sequence) ? 1 : 0;
+    ok = ok && writeTestBytes("CRCIDX.BIN", static_cast<long>(newer * sizeof(DBIndexHeader) + 10), garbage, sizeof(garbage)) &&
+        crcDb.open("CRCLOG.BIN", "CRCIDX.BIN", DB_MODE_SESSION) && checkChecksumRecords(crcDb, baseKey, numRecords);
+    crcDb.close();
+    if (!ok) {
+        std::cerr << "    [Header] FAIL: Damaged header slot not replaced by the other one. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Header] SUCCESS: Damaged header slot ignored; " << numRecords << " records intact. "
+        << GREEN_TICK << std::endl;
+
+    // Pages overwritten after the last commit: the header announcing them is the newest.
+    ok = readIndexHeaders("CRCIDX.BIN", headers);
+    newer = (headers[1].sequence > headers[0].sequence) ? 1 : 0;
+    DBIndexHeader ahead = headers[newer];
+    ahead.flags |= DB_IDX_FLAG_AHEAD;
+    ahead.sequence++;
+    ahead.crc = dbCrc32(0, &ahead, offsetof(DBIndexHeader, crc));
+    long leafOffset = static_cast<long>(2 * sizeof(DBIndexHeader) + ahead.firstLeaf * sizeof(IndexPage) +
+        sizeof(IndexPageHeader));
+    ok = ok && writeTestBytes("CRCIDX.BIN", static_cast<long>((1 - newer) * sizeof(DBIndexHeader)), &ahead, sizeof(ahead)) &&
+        writeTestBytes("CRCIDX.BIN", leafOffset, garbage, sizeof(garbage)) &&
+        crcDb.open("CRCLOG.BIN", "CRCIDX.BIN", DB_MODE_SAFE) && checkChecksumRecords(crcDb, baseKey, numRecords);
+    crcDb.close();
+    if (!ok) {
+        std::cerr << "    [Ahead] FAIL: Index not rebuilt after an interrupted commit. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Ahead] SUCCESS: Interrupted commit detected and the index rebuilt. " << GREEN_TICK << std::endl;
+
+    // A damaged leaf and a damaged record are refused when read. open() checks the
+    // root and both end leaves, so the leaf damaged is the second one; the rebuilt
+    // leaves are packed, so it starts with entry MAX_INDEX_ENTRIES.
+    IndexEntry middle;
+    IndexPageHeader firstLeaf;
+    ok = readIndexHeaders("CRCIDX.BIN", headers);
+    newer = (headers[1].sequence > headers[0].sequence) ? 1 : 0;
+    FILE* f = fopen("CRCIDX.BIN", "rb");
+    ok = ok && f && fseek(f, static_cast<long>(2 * sizeof(DBIndexHeader) + headers[newer].firstLeaf * sizeof(IndexPage)), SEEK_SET) == 0 &&
+        fread(&firstLeaf, sizeof(firstLeaf), 1, f) == 1;
+    if (f)
+        fclose(f);
+    leafOffset = static_cast<long>(2 * sizeof(DBIndexHeader) + firstLeaf.next * sizeof(IndexPage) +
+        sizeof(IndexPageHeader));
+    ok = ok && writeTestBytes("CRCIDX.BIN", leafOffset + 8, garbage, 1) &&
+        crcDb.open("CRCLOG.BIN", "CRCIDX.BIN", DB_MODE_SESSION) && !crcDb.get(baseKey + MAX_INDEX_ENTRIES, &out, sizeof(out)) &&
+        crcDb.rebuildIndex() && crcDb.getIndexEntry(MAX_INDEX_ENTRIES, middle) && middle.key == baseKey + MAX_INDEX_ENTRIES &&
+        checkChecksumRecords(crcDb, baseKey, numRecords);
+    crcDb.close();
+    long payloadOffset = static_cast<long>(sizeof(DBHeader) + sizeof(LogEntryHeader) + offsetof(TemperatureRecord, name));
+    ok = ok && writeTestBytes("CRCLOG.BIN", payloadOffset, garbage, 1) &&
+        crcDb.open("CRCLOG.BIN", "CRCIDX.BIN", DB_MODE_SESSION) && !crcDb.get(baseKey, &out, sizeof(out)) &&
+        crcDb.get(baseKey + 1, &out, sizeof(out)) && out.height == 1;
+    crcDb.close();
+    std::remove("CRCLOG.BIN");
+    std::remove("CRCIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Damage] FAIL: Damaged page or record was not detected. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Damage] SUCCESS: Damaged leaf and record refused; leaf repaired by rebuildIndex(). "
+        << GREEN_TICK << std::endl;
+
+    // A log from before record checksums: version 1 header, records without the crc field.
+    const uint32_t legacyRecords = 50;
+    std::remove("OLDLOG.BIN");
+    std::remove("OLDIDX.BIN");
+    f = fopen("OLDLOG.BIN", "wb");
+    DBHeader logHeader = { DB_MAGIC_NUMBER, DB_VERSION_PLAIN };
+    ok = f && fwrite(&logHeader, sizeof(logHeader), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < legacyRecords; i++) {
+        LogEntryHeader header = { 1, sizeof(rec), baseKey + i, 0, 0, 0 };
+        rec.height = i;
+        ok = fwrite(&header, offsetof(LogEntryHeader, crc), 1, f) == 1 && fwrite(&rec, sizeof(rec), 1, f) == 1;
+    }
+    if (f)
+        fclose(f);
+    rec.height = legacyRecords;
+    ok = ok && crcDb.open("OLDLOG.BIN", "OLDIDX.BIN", DB_MODE_SESSION) &&
+        crcDb.append(baseKey + legacyRecords, 1, &rec, sizeof(rec));
+    crcDb.close();
+    ok = ok && crcDb.open("OLDLOG.BIN", "OLDIDX.BIN", DB_MODE_SAFE) &&
+        checkChecksumRecords(crcDb, baseKey, legacyRecords + 1) && crcDb.rebuildIndex() &&
+        checkChecksumRecords(crcDb, baseKey, legacyRecords + 1);
+    crcDb.close();
+    ok = ok && testFileSize("OLDLOG.BIN") == static_cast<long>(sizeof(DBHeader) +
+        (legacyRecords + 1) * (offsetof(LogEntryHeader, crc) + sizeof(rec)));
+    std::remove("OLDLOG.BIN");
+    std::remove("OLDIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Legacy] FAIL: Log without record checksums not usable. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Legacy] SUCCESS: Log without record checksums read, indexed and appended to. "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Asynchronous Appends
+//   - Opens a database whose log handler is a QueuedFileHandler, which only
+//     writes when polled, and queues records with appendAsync().
+//   - Verifies that the records are still queued after appendAsync() returned,
+//     that get() waits for them, and that pollAsync() writes the rest.
+//   - Mixes appendAsync() with append() and refuses duplicate and oversized records.
+//   - Reopens the files with plain handlers and verifies every record.
+void testAsyncAppend() {
+    const uint32_t numRecords = 200;
+    const uint32_t baseKey = 15000000;
+
+    std::cout << "Test Asynchronous Appends" << std::endl;
+
+    WindowsFileHandler asyncInner;
+    WindowsFileHandler asyncIndex;
+    QueuedFileHandler asyncLog(asyncInner);
+    static uint8_t asyncBuffer[1024];
+    DBEngine asyncDb(asyncLog, asyncIndex, asyncBuffer, sizeof(asyncBuffer));
+    std::remove("ASYLOG.BIN");
+    std::remove("ASYIDX.BIN");
+    if (!asyncDb.open("ASYLOG.BIN", "ASYIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to open the database. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    TemperatureRecord rec = { 19.0f, 55.0f, 0, 0, "Queued record" };
+    size_t mostPending = 0;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!asyncDb.appendAsync(baseKey + i, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Queue] FAIL: appendAsync " << i << " failed. " << RED_CROSS << std::endl;
+            return;
+        }
+        if (asyncDb.pendingAsyncBytes() > mostPending)
+            mostPending = asyncDb.pendingAsyncBytes();
+        if (i % 4 == 3)
+            asyncDb.pollAsync();
+    }
+    if (mostPending == 0 || asyncLog.outstanding() == 0 || asyncDb.indexCount() != numRecords) {
+        std::cerr << "    [Queue] FAIL: Records were not queued (" << mostPending << " bytes pending). "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    TemperatureRecord out;
+    if (!asyncDb.get(baseKey + numRecords - 1, &out, sizeof(out)) || out.height != numRecords - 1 ||
+        asyncDb.pendingAsyncBytes() != 0) {
+        std::cerr << "    [Queue] FAIL: get() did not wait for the queued record. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Queue] SUCCESS: " << numRecords << " records queued, up to " << mostPending
+        << " bytes pending; get() waited for the last one. " << GREEN_TICK << std::endl;
+
+    // Queued, blocking and queued again: offsets must follow each other.
+    bool ok = true;
+    for (uint32_t i = numRecords; i < numRecords + 30 && ok; i++) {
+        rec.height = i;
+        ok = (i % 3 == 0) ? asyncDb.append(baseKey + i, 1, &rec, sizeof(rec))
+            : asyncDb.appendAsync(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    int polls = 0;
+    while (ok && polls < 1000) {
+        polls++;
+        if (!asyncDb.pollAsync())
+            break;
+    }
+    if (!ok || asyncDb.pendingAsyncBytes() != 0 || !asyncDb.sync()) {
+        std::cerr << "    [Mixed] FAIL: Mixed appends not written. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Mixed] SUCCESS: appendAsync() and append() interleaved; queue drained after "
+        << polls << " polls. " << GREEN_TICK << std::endl;
+
+    static uint8_t large[600];
+    if (asyncDb.appendAsync(baseKey, 1, &rec, sizeof(rec)) ||
+        asyncDb.appendAsync(baseKey + 1000, 1, large, sizeof(large)) ||
+        db.appendAsync(baseKey, 1, &rec, sizeof(rec))) {
+        std::cerr << "    [Refuse] FAIL: Invalid asynchronous append accepted. " << RED_CROSS << std::endl;
+        return;
+    }
+    asyncDb.close();
+
+    WindowsFileHandler plainLog;
+    WindowsFileHandler plainIndex;
+    DBEngine plainDb(plainLog, plainIndex);
+    if (!plainDb.open("ASYLOG.BIN", "ASYIDX.BIN", DB_MODE_SESSION) || plainDb.indexCount() != numRecords + 30) {
+        std::cerr << "    [Refuse] FAIL: Records missing after reopening. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords + 30; i++) {
+        if (!plainDb.get(baseKey + i, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Refuse] FAIL: Record " << i << " differs. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    plainDb.close();
+    std::remove("ASYLOG.BIN");
+    std::remove("ASYIDX.BIN");
+    std::cout << "    [Refuse] SUCCESS: Duplicate and oversized records refused; all records intact. "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Record Codec
+//   - Enables the codec for one record type and appends slowly changing sensor
+//     records, then compares the log with the size of the records in full.
+//   - Verifies every record through get() and a cursor, and that getView()
+//     refuses an encoded record but maps a reference record.
+//   - Deletes reference records, compacts and reopens the database, verifying
+//     every live record each time; refuses a codec beyond DB_CODEC_TYPES.
+static void expectedCodecRecord(uint32_t i, TemperatureRecord& rec) {
+    memset(&rec, 0, sizeof(rec));
+    rec.temperature = 21.0f + 0.01f * static_cast<float>(i);
+    rec.humidity = 48.0f - 0.005f * static_cast<float>(i % 50);
+    rec.height = i;
+    rec.width = 640;
+    strcpy(rec.name, "Codec sensor");
+}
+
+static bool checkCodecRecords(DBEngine& cdcDb, uint32_t baseKey, uint32_t numRecords, uint32_t deletedEvery) {
+    for (uint32_t i = 0; i < numRecords; i++) {
+        TemperatureRecord expected;
+        TemperatureRecord out;
+        expectedCodecRecord(i, expected);
+        bool live = deletedEvery == 0 || i % deletedEvery != 0;
+        bool found = cdcDb.get(baseKey + i, &out, sizeof(out));
+        if (found != live || (live && memcmp(&out, &expected, sizeof(out)) != 0))
+            return false;
+    }
+    return true;
+}
+
+void testRecordCodec() {
+    const uint32_t numRecords = 300;
+    const uint32_t baseKey = 16000000;
+    const uint8_t sensorType = 2;
+    const long rawBytes = static_cast<long>(numRecords * (sizeof(LogEntryHeader) + sizeof(TemperatureRecord)));
+
+    std::cout << "Test Record Codec" << std::endl;
+
+    std::remove("CDCLOG.BIN");
+    std::remove("CDCIDX.BIN");
+    std::remove("CDCTMP.BIN");
+    MappingFileHandler cdcLog;
+    WindowsFileHandler cdcIndex;
+    WindowsFileHandler cdcTemp;
+    DBEngine cdcDb(cdcLog, cdcIndex);
+    cdcDb.setCompactionFile(cdcTemp, "CDCTMP.BIN");
+    if (!cdcDb.setRecordCodec(sensorType, true) ||
+        !cdcDb.open("CDCLOG.BIN", "CDCIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to create database. " << RED_CROSS << std::endl;
+        return;
+    }
+    TemperatureRecord rec;
+    for (uint32_t i = 0; i < numRecords; i++) {
+        expectedCodecRecord(i, rec);
+        if (!cdcDb.append(baseKey + i, sensorType, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append failed for record " << i << " " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    cdcDb.sync();
+    long logBytes = testFileSize("CDCLOG.BIN") - static_cast<long>(sizeof(DBHeader));
+    if (logBytes <= 0 || logBytes * 3 > rawBytes) {
+        std::cerr << "    [Size] FAIL: Log holds " << logBytes << " of " << rawBytes << " bytes. "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Size] SUCCESS: " << numRecords << " records take " << logBytes << " instead of "
+        << rawBytes << " bytes. " << GREEN_TICK << std::endl;
+
+    bool ok = checkCodecRecords(cdcDb, baseKey, numRecords, 0);
+    DBCursor cursor(cdcDb);
+    uint32_t scanned = 0;
+    for (bool more = cursor.seek(baseKey); ok && more; more = cursor.next()) {
+        TemperatureRecord expected;
+        uint16_t size = 0;
+        expectedCodecRecord(scanned, expected);
+        ok = cursor.readPayload(&rec, sizeof(rec), &size) && size == sizeof(rec) &&
+            memcmp(&rec, &expected, sizeof(rec)) == 0;
+        scanned++;
+    }
+    const LogEntryHeader* viewHeader = nullptr;
+    const uint8_t* viewPayload = nullptr;
+    ok = ok && scanned == numRecords && !cdcDb.getView(baseKey + 1, viewHeader, viewPayload) &&
+        cdcDb.getView(baseKey, viewHeader, viewPayload) && viewHeader->length == sizeof(rec);
+    if (!ok) {
+        std::cerr << "    [Decode] FAIL: Records differ after decoding. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Decode] SUCCESS: get() and the cursor decode every record; getView() maps only full ones. "
+        << GREEN_TICK << std::endl;
+
+    // A full record is followed by DB_CODEC_KEYFRAME_INTERVAL encoded ones;
+    // deleting the full ones must not lose the others.
+    const uint32_t refEvery = DB_CODEC_KEYFRAME_INTERVAL + 1;
+    for (uint32_t i = 0; i < numRecords && ok; i += refEvery)
+        ok = cdcDb.deleteRecord(baseKey + i);
+    bool finished = false;
+    while (ok && !finished)
+        ok = cdcDb.compact(64, &finished);
+    ok = ok && checkCodecRecords(cdcDb, baseKey, numRecords, refEvery);
+    cdcDb.close();
+    ok = ok && cdcDb.open("CDCLOG.BIN", "CDCIDX.BIN", DB_MODE_SESSION) &&
+        checkCodecRecords(cdcDb, baseKey, numRecords, refEvery);
+    if (!ok) {
+        std::cerr << "    [Compact] FAIL: Records lost by compaction or reopening. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Compact] SUCCESS: References deleted and compacted; all live records intact after reopening. "
+        << GREEN_TICK << std::endl;
+
+    ok = cdcDb.setRecordCodec(3, true) && !cdcDb.setRecordCodec(4, true) &&
+        cdcDb.setRecordCodec(3, false) && cdcDb.setRecordCodec(4, true);
+    cdcDb.close();
+    std::remove("CDCLOG.BIN");
+    std::remove("CDCIDX.BIN");
+    std::remove("CDCTMP.BIN");
+    if (!ok) {
+        std::cerr << "    [Slots] FAIL: Codec slots not limited to DB_CODEC_TYPES. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Slots] SUCCESS: A codec beyond DB_CODEC_TYPES is refused until a slot is free. "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Narrow Index Leaves
+//   - Appends the same even keys in ascending order to a database with narrow
+//     leaves and to one without, and compares the sizes of their index files.
+//   - Inserts the odd keys in scattered order, which splits narrow leaves.
+//   - Deletes and re-appends keys, so that leaves need wider offsets, and
+//     updates statuses through the index positions.
+//   - Verifies every record, position and status after each step, after
+//     reopening with the setting off and after rebuildIndex().
+static bool checkNarrowRecords(DBEngine& narDb, uint32_t baseKey, uint32_t numKeys, uint32_t step, uint32_t updatedEvery) {
+    if (narDb.indexCount() != numKeys / step)
+        return false;
+    for (uint32_t i = 0; i < numKeys; i += step) {
+        TemperatureRecord out;
+        IndexEntry entry;
+        uint32_t expected = (updatedEvery != 0 && i % updatedEvery == 0) ? i + numKeys : i;
+        if (!narDb.get(baseKey + i, &out, sizeof(out)) || out.height != expected ||
+            !narDb.getIndexEntry(i / step, entry) || entry.key != baseKey + i)
+            return false;
+    }
+    return true;
+}
+
+void testNarrowLeaves() {
+    const uint32_t numKeys = 12000;
+    const uint32_t baseKey = 17000000;
+    const uint32_t updatedEvery = 97;
+    TemperatureRecord rec = { 2.0f, 50.0f, 0, 0, "Narrow leaf" };
+
+    std::cout << "Test Narrow Index Leaves" << std::endl;
+
+    std::remove("NARLOG.BIN");
+    std::remove("NARIDX.BIN");
+    std::remove("WIDLOG.BIN");
+    std::remove("WIDIDX.BIN");
+    WindowsFileHandler narLog;
+    WindowsFileHandler narIndex;
+    WindowsFileHandler widLog;
+    WindowsFileHandler widIndex;
+    DBEngine narDb(narLog, narIndex);
+    DBEngine widDb(widLog, widIndex);
+    narDb.setNarrowLeaves(true);
+    bool ok = narDb.open("NARLOG.BIN", "NARIDX.BIN", DB_MODE_SESSION) &&
+        widDb.open("WIDLOG.BIN", "WIDIDX.BIN", DB_MODE_SESSION);
+    for (uint32_t i = 0; ok && i < numKeys; i += 2) {
+        rec.height = i;
+        ok = narDb.append(baseKey + i, 1, &rec, sizeof(rec)) && widDb.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && narDb.sync() && widDb.sync();
+    long narrowBytes = testFileSize("NARIDX.BIN");
+    long wideBytes = testFileSize("WIDIDX.BIN");
+    widDb.close();
+    std::remove("WIDLOG.BIN");
+    std::remove("WIDIDX.BIN");
+    if (!ok || !checkNarrowRecords(narDb, baseKey, numKeys, 2, 0)) {
+        std::cerr << "    [Setup] FAIL: Ascending appends failed. " << RED_CROSS << std::endl;
+        narDb.close();
+        return;
+    }
+    if (narrowBytes <= 0 || narrowBytes * 5 > wideBytes * 4) {
+        std::cerr << "    [Packing] FAIL: Index takes " << narrowBytes << " bytes, " << wideBytes
+            << " with wide leaves. " << RED_CROSS << std::endl;
+        narDb.close();
+        return;
+    }
+    std::cout << "    [Packing] SUCCESS: " << numKeys / 2 << " entries take " << narrowBytes << " index bytes instead of "
+        << wideBytes << ". " << GREEN_TICK << std::endl;
+
+    for (uint32_t n = 0; ok && n < numKeys / 2; n++) {
+        rec.height = 2 * ((n * 7919) % (numKeys / 2)) + 1;
+        ok = narDb.append(baseKey + rec.height, 1, &rec, sizeof(rec));
+    }
+    if (!ok || !checkNarrowRecords(narDb, baseKey, numKeys, 1, 0)) {
+        std::cerr << "    [Inserts] FAIL: Scattered inserts into narrow leaves failed. " << RED_CROSS << std::endl;
+        narDb.close();
+        return;
+    }
+    std::cout << "    [Inserts] SUCCESS: Scattered keys inserted; every record and position found. " << GREEN_TICK << std::endl;
+
+    // A re-appended record lies far behind the others of its leaf.
+    for (uint32_t i = 0; ok && i < numKeys; i += updatedEvery) {
+        rec.height = i + numKeys;
+        ok = narDb.deleteRecord(baseKey + i) && narDb.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    size_t marked = 0;
+    for (uint32_t position = 0; ok && position < numKeys; position += 3, marked++)
+        ok = narDb.updateStatus(position, STATUS_UPLOADED);
+    static uint32_t uploaded[numKeys];
+    size_t found = ok ? narDb.findByStatus(STATUS_UPLOADED, uploaded, numKeys) : 0;
+    for (size_t k = 0; ok && k < found; k++)
+        ok = uploaded[k] == 3 * k;
+    if (!ok || found != marked || !checkNarrowRecords(narDb, baseKey, numKeys, 1, updatedEvery)) {
+        std::cerr << "    [Update] FAIL: Offsets or statuses lost in narrow leaves. " << RED_CROSS << std::endl;
+        narDb.close();
+        return;
+    }
+    std::cout << "    [Update] SUCCESS: Re-appended records and " << marked << " status updates found. "
+        << GREEN_TICK << std::endl;
+
+    narDb.setNarrowLeaves(false);
+    narDb.close();
+    ok = narDb.open("NARLOG.BIN", "NARIDX.BIN", DB_MODE_SESSION) &&
+        checkNarrowRecords(narDb, baseKey, numKeys, 1, updatedEvery) &&
+        narDb.findByStatus(STATUS_UPLOADED, uploaded, numKeys) == marked;
+    narDb.setNarrowLeaves(true);
+    ok = ok && narDb.rebuildIndex() && checkNarrowRecords(narDb, baseKey, numKeys, 1, updatedEvery) &&
+        narDb.findByStatus(STATUS_UPLOADED, uploaded, numKeys) == marked;
+    narDb.close();
+    ok = ok && narDb.open("NARLOG.BIN", "NARIDX.BIN", DB_MODE_SESSION) &&
+        checkNarrowRecords(narDb, baseKey, numKeys, 1, updatedEvery);
+    narDb.close();
+    std::remove("NARLOG.BIN");
+    std::remove("NARIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Reopen] FAIL: Narrow leaves not readable after reopening or rebuildIndex(). "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reopen] SUCCESS: Index intact after reopening with the setting off and after rebuildIndex(). "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Bulk Status Updates
+//   - Marks 500 records uploaded with updateStatusRange() and every third one
+//     confirmed with updateStatusMany() (positions in descending order).
+//   - Checks the statuses through findByStatus(), that the log saw a few
+//     writes instead of one per record, and that rebuildIndex() finds the same
+//     statuses in the log.
+//   - With setStatusInLog(false), checks that an update writes nothing to the
+//     log and that rebuildIndex() brings back the statuses of the log.
+//   - Checks that updateStatusMany() writes the log status of a key appended
+//     again after its deletion, whose index entry still has the old status.
+static size_t countStatus(DBEngine& db, uint8_t status) {
+    static uint32_t found[1000];
+    return db.findByStatus(status, found, 1000);
+}
+
+void testBulkStatusUpdates() {
+    const uint32_t numRecords = 500;
+    const uint32_t baseKey = 19000000;
+    TemperatureRecord rec = { 4.0f, 45.0f, 0, 0, "Bulk status" };
+
+    std::cout << "Test Bulk Status Updates" << std::endl;
+
+    std::remove("BSTLOG.BIN");
+    std::remove("BSTIDX.BIN");
+    WindowsFileHandler logFile;
+    WindowsFileHandler indexFile;
+    CountingFileHandler logHandler(logFile);
+    DBEngine db(logHandler, indexFile);
+    bool ok = db.open("BSTLOG.BIN", "BSTIDX.BIN", DB_MODE_SESSION);
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        rec.height = i;
+        ok = db.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && db.sync();
+    if (!ok) {
+        std::cerr << "    [Setup] FAIL: Appends failed. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+
+    logHandler.resetStats();
+    ok = db.updateStatusRange(0, numRecords, STATUS_UPLOADED);
+    static uint32_t confirm[numRecords];
+    size_t confirmed = 0;
+    for (uint32_t position = numRecords; position-- > 0;) {
+        if (position % 3 == 0)
+            confirm[confirmed++] = position;
+    }
+    ok = ok && db.updateStatusMany(confirm, confirmed, STATUS_CONFIRMED);
+    FileIOStats logIO;
+    logHandler.getStats(logIO);
+    ok = ok && countStatus(db, STATUS_UPLOADED) == numRecords - confirmed && countStatus(db, STATUS_CONFIRMED) == confirmed;
+    // One write per DB_BATCH_BUFFER_SIZE run, not one per record.
+    if (!ok || logIO.writes * 8 > numRecords + confirmed) {
+        std::cerr << "    [Bulk] FAIL: " << countStatus(db, STATUS_UPLOADED) << " uploaded and " << countStatus(db, STATUS_CONFIRMED)
+            << " confirmed with " << logIO.writes << " log writes. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Bulk] SUCCESS: " << numRecords + confirmed << " status changes took " << logIO.writes << " log writes. "
+        << GREEN_TICK << std::endl;
+
+    ok = db.rebuildIndex() && countStatus(db, STATUS_UPLOADED) == numRecords - confirmed &&
+        countStatus(db, STATUS_CONFIRMED) == confirmed;
+    if (!ok) {
+        std::cerr << "    [Log Copy] FAIL: Statuses differ after rebuildIndex(). " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Log Copy] SUCCESS: rebuildIndex() read the same statuses from the log. " << GREEN_TICK << std::endl;
+
+    db.setStatusInLog(false);
+    logHandler.resetStats();
+    ok = db.updateStatusRange(0, numRecords, STATUS_CONFIRMED) && db.updateStatus(1, STATUS_UPLOADED);
+    logHandler.getStats(logIO);
+    ok = ok && logIO.writes == 0 && countStatus(db, STATUS_CONFIRMED) == numRecords - 1;
+    ok = ok && db.rebuildIndex() && countStatus(db, STATUS_CONFIRMED) == confirmed;
+    if (!ok) {
+        std::cerr << "    [Index Only] FAIL: " << logIO.writes << " log writes with setStatusInLog(false). " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Index Only] SUCCESS: Updates left the log alone; rebuildIndex() restored its statuses. "
+        << GREEN_TICK << std::endl;
+
+    db.setStatusInLog(true);
+    const uint32_t againKey = baseKey + numRecords;
+    uint32_t position = 0;
+    IndexEntry entry;
+    ok = db.append(againKey, 1, &rec, sizeof(rec)) && db.searchIndex(againKey, &position) &&
+        db.updateStatus(position, STATUS_CONFIRMED) && db.deleteRecord(againKey) &&
+        db.append(againKey, 1, &rec, sizeof(rec)) && db.searchIndex(againKey, &position) &&
+        db.updateStatusMany(&position, 1, STATUS_CONFIRMED) && db.rebuildIndex() &&
+        db.searchIndex(againKey, &position) && db.getIndexEntry(position, entry) && entry.status == STATUS_CONFIRMED;
+    db.close();
+    std::remove("BSTLOG.BIN");
+    std::remove("BSTIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Appended Again] FAIL: The status of a re-appended key was lost by rebuildIndex(). "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Appended Again] SUCCESS: updateStatusMany() wrote the log status of a re-appended key. "
+        << GREEN_TICK << std::endl;
+}
+
+// Test: Change Stream
+//   - Exports a database holding delta encoded records and a record larger
+//     than DB_BATCH_BUFFER_SIZE, and imports the stream piece by piece into a
+//     second database.
+//   - Changes statuses, deletes records and appends more, then checks that the
+//     export since the mark holds only the new records and small delta frames,
+//     and that the imported copy matches again.
+//   - Checks that an export without changes is empty and that a mark past the
+//     end of the log is refused.
+//   - Replaces records spanning several batches and lets the host's log writes
+//     fail partway through the import; checks that the records of the failed
+//     batch are still live and that importing the rest again completes the copy.
+//   - With setStatusInLog(false), changes the status of a record appended
+//     after the mark and checks that the export still passes it on.
+static bool collectStream(void* context, const void* data, size_t size) {
+    std::vector<uint8_t>* stream = static_cast<std::vector<uint8_t>*>(context);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    stream->insert(stream->end(), bytes, bytes + size);
+    return true;
+}
+
+// Accepts writes until writeBudget bytes have been written, then fails them.
+class BudgetFileHandler : public WindowsFileHandler {
+public:
+    bool write(const uint8_t* buffer, size_t size, size_t& bytesWritten) override {
+        if (size > writeBudget) {
+            bytesWritten = 0;
+            return false;
+        }
+        writeBudget -= size;
+        return WindowsFileHandler::write(buffer, size, bytesWritten);
+    }
+    size_t writeBudget = SIZE_MAX;
+};
+
+static bool importInPieces(DBEngine& db, const std::vector<uint8_t>& stream, size_t piece) {
+    std::vector<uint8_t> pending;
+    for (size_t at = 0; at < stream.size(); at += piece) {
+        size_t n = (stream.size() - at < piece) ? stream.size() - at : piece;
+        pending.insert(pending.end(), stream.begin() + at, stream.begin() + at + n);
+        size_t consumed = 0;
+        if (!db.importStream(pending.data(), pending.size(), &consumed))
+            return false;
+        pending.erase(pending.begin(), pending.begin() + consumed);
+    }
+    return pending.empty();
+}
+
+static bool sameRecords(DBEngine& a, DBEngine& b, uint32_t firstKey, uint32_t lastKey) {
+    static uint8_t bufferA[3000];
+    static uint8_t bufferB[3000];
+    for (uint32_t key = firstKey; key <= lastKey; key++) {
+        uint16_t sizeA = 0, sizeB = 0;
+        bool foundA = a.get(key, bufferA, sizeof(bufferA), &sizeA);
+        bool foundB = b.get(key, bufferB, sizeof(bufferB), &sizeB);
+        if (foundA != foundB || (foundA && (sizeA != sizeB || memcmp(bufferA, bufferB, sizeA) != 0)))
+            return false;
+        uint32_t positionA, positionB;
+        IndexEntry entryA, entryB;
+        if (foundA && (!a.searchIndex(key, &positionA) || !b.searchIndex(key, &positionB) ||
+            !a.getIndexEntry(positionA, entryA) || !b.getIndexEntry(positionB, entryB) ||
+            entryA.status != entryB.status ||
+            ((entryA.internal_status ^ entryB.internal_status) & INTERNAL_STATUS_DELETED) != 0))
+            return false;
+    }
+    return true;
+}
+
+void testChangeStream() {
+    const uint32_t numRecords = 300;
+    const uint32_t moreRecords = 50;
+    const uint32_t baseKey = 20000000;
+    const uint32_t largeKey = baseKey + 1000;
+    const uint8_t sensorType = 2;
+    static uint8_t large[3000];
+
+    std::cout << "Test Change Stream" << std::endl;
+
+    std::remove("CSDLOG.BIN");
+    std::remove("CSDIDX.BIN");
+    std::remove("CSHLOG.BIN");
+    std::remove("CSHIDX.BIN");
+    WindowsFileHandler deviceLog, deviceIndex, hostIndex;
+    BudgetFileHandler hostLog;
+    DBEngine device(deviceLog, deviceIndex);
+    DBEngine host(hostLog, hostIndex);
+    device.setRecordCodec(sensorType, true);
+    bool ok = device.open("CSDLOG.BIN", "CSDIDX.BIN") && host.open("CSHLOG.BIN", "CSHIDX.BIN", DB_MODE_SESSION);
+    TemperatureRecord rec = { 20.0f, 50.0f, 0, 0, "Change stream" };
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        rec.temperature = 20.0f + 0.01f * static_cast<float>(i);
+        rec.height = i;
+        ok = device.append(baseKey + i, sensorType, &rec, sizeof(rec));
+    }
+    for (size_t i = 0; i < sizeof(large); i++)
+        large[i] = static_cast<uint8_t>(i * 7);
+    ok = ok && device.append(largeKey, 9, large, sizeof(large));
+    std::vector<uint8_t> stream;
+    uint32_t mark = 0;
+    ok = ok && device.exportSince(0, collectStream, &stream, &mark) && importInPieces(host, stream, 1000) &&
+        host.indexCount() == numRecords + 1 && sameRecords(device, host, baseKey, largeKey);
+    if (!ok) {
+        std::cerr << "    [Full] FAIL: The imported copy differs. " << RED_CROSS << std::endl;
+        device.close();
+        host.close();
+        return;
+    }
+    std::cout << "    [Full] SUCCESS: " << numRecords + 1 << " records in a " << stream.size()
+        << "-byte stream, imported in 1000-byte pieces. " << GREEN_TICK << std::endl;
+
+    ok = device.updateStatusRange(0, 100, STATUS_UPLOADED) && device.updateStatus(150, STATUS_CONFIRMED);
+    uint32_t deleted = 0;
+    for (uint32_t i = 0; ok && i < numRecords; i += 7, deleted++)
+        ok = device.deleteRecord(baseKey + i);
+    for (uint32_t i = numRecords; ok && i < numRecords + moreRecords; i++) {
+        rec.height = i;
+        ok = device.append(baseKey + i, sensorType, &rec, sizeof(rec));
+    }
+    // Deltas for 100 + 1 status changes and the deletions, which overlap.
+    const size_t maxBytes = moreRecords * (sizeof(LogEntryHeader) + sizeof(rec)) +
+        (101 + deleted) * sizeof(LogEntryHeader);
+    stream.clear();
+    uint32_t nextMark = 0;
+    ok = ok && device.exportSince(mark, collectStream, &stream, &nextMark) && stream.size() <= maxBytes &&
+        importInPieces(host, stream, 777) && sameRecords(device, host, baseKey, largeKey) &&
+        host.recordCount(0, INTERNAL_STATUS_DELETED) == device.recordCount(0, INTERNAL_STATUS_DELETED);
+    if (!ok) {
+        std::cerr << "    [Delta] FAIL: " << stream.size() << " bytes (at most " << maxBytes
+            << " expected), or the imported copy differs. " << RED_CROSS << std::endl;
+        device.close();
+        host.close();
+        return;
+    }
+    std::cout << "    [Delta] SUCCESS: " << moreRecords << " new records, status changes and " << deleted
+        << " deletions in " << stream.size() << " bytes. " << GREEN_TICK << std::endl;
+
+    stream.clear();
+    uint32_t lastMark = 0;
+    ok = device.exportSince(nextMark, collectStream, &stream, &lastMark) && stream.empty() && lastMark == nextMark &&
+        !device.exportSince(nextMark + 1000, collectStream, &stream);
+    if (!ok) {
+        std::cerr << "    [Mark] FAIL: Export without changes not empty, or a mark past the end accepted. "
+            << RED_CROSS << std::endl;
+        device.close();
+        host.close();
+        return;
+    }
+    std::cout << "    [Mark] SUCCESS: Nothing to export after the mark; a mark past the end is refused. "
+        << GREEN_TICK << std::endl;
+
+    // Replace records stored on both sides; the host runs out of log writes in the second batch.
+    const uint32_t replaced = 3 * DB_MAX_BATCH_ITEMS - 20;
+    uint32_t position = 0;
+    uint32_t lastKey = baseKey;
+    ok = true;
+    for (uint32_t i = 1, n = 0; ok && n < replaced; i++) {
+        if (i % 7 == 0)
+            continue;
+        rec.height = 5000 + i;
+        ok = device.deleteRecord(baseKey + i) && device.append(baseKey + i, sensorType, &rec, sizeof(rec));
+        lastKey = baseKey + i;
+        n++;
+    }
+    stream.clear();
+    ok = ok && device.exportSince(lastMark, collectStream, &stream, &lastMark);
+    hostLog.writeBudget = stream.size() / 2;
+    size_t consumed = 0;
+    bool failed = ok && !host.importStream(stream.data(), stream.size(), &consumed);
+    hostLog.writeBudget = SIZE_MAX;
+    bool live = true;
+    IndexEntry entry;
+    for (uint32_t key = baseKey + 1; live && key <= lastKey; key++) {
+        live = (key - baseKey) % 7 == 0 || (host.searchIndex(key, &position) && host.getIndexEntry(position, entry) &&
+            (entry.internal_status & INTERNAL_STATUS_DELETED) == 0);
+    }
+    ok = failed && consumed > 0 && consumed < stream.size() && live &&
+        host.importStream(stream.data() + consumed, stream.size() - consumed) &&
+        sameRecords(device, host, baseKey, largeKey);
+    if (!ok) {
+        std::cerr << "    [Failed Import] FAIL: Records lost by the failed batch, or the retry differs. " << RED_CROSS
+            << std::endl;
+        device.close();
+        host.close();
+        return;
+    }
+    std::cout << "    [Failed Import] SUCCESS: " << replaced << " replaced records; the import stopped after "
+        << consumed << " of " << stream.size() << " bytes and the retry completed it. " << GREEN_TICK << std::endl;
+
+    // The log keeps status 0 for these records; only the index has the change.
+    const uint32_t indexOnlyKey = largeKey + 1;
+    device.setStatusInLog(false);
+    ok = true;
+    for (uint32_t i = 0; ok && i < 3; i++)
+        ok = device.append(indexOnlyKey + i, sensorType, &rec, sizeof(rec));
+    stream.clear();
+    ok = ok && device.searchIndex(indexOnlyKey + 1, &position) && device.updateStatus(position, 7) &&
+        device.exportSince(lastMark, collectStream, &stream) && importInPieces(host, stream, 100) &&
+        sameRecords(device, host, indexOnlyKey, indexOnlyKey + 2);
+    device.close();
+    host.close();
+    std::remove("CSDLOG.BIN");
+    std::remove("CSDIDX.BIN");
+    std::remove("CSHLOG.BIN");
+    std::remove("CSHIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Index Status] FAIL: A status kept only in the index was not exported. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Index Status] SUCCESS: With setStatusInLog(false) the status of a new record followed as a delta. "
+        << GREEN_TICK << std::endl;
+}
+
+#if DB_RESIDENT_INDEX
+// Test: Resident Index
+//   - Bulk loads enough records for a scan on four threads, changes statuses
+//     and deletes some, and takes findByStatus() and recordCount() results
+//     with the page cache.
+//   - Reopens with setResidentIndex() and checks that open() read the index,
+//     that lookups then load no page, and that the scans split between the
+//     threads give the same results, also when findByStatus() is cut short.
+//   - Checks that status updates write nothing to the index file before sync(),
+//     and that the paged engine reads what the resident one wrote.
+//   - Where PosixFileHandler is available, reopens through it and checks that
+//     open() copies the pages out of its mapping instead of reading them.
+void testResidentIndex() {
+    const uint32_t numRecords = 4 * DB_SCAN_CHUNK_ENTRIES;
+    const uint32_t moreRecords = 10;
+    const uint32_t baseKey = 21000000;
+    TemperatureRecord rec = { 15.0f, 55.0f, 0, 0, "Resident" };
+    TemperatureRecord out;
+
+    std::cout << "Test Resident Index" << std::endl;
+
+    std::remove("RESLOG.BIN");
+    std::remove("RESIDX.BIN");
+    WindowsFileHandler logFile;
+    WindowsFileHandler indexFile;
+    CountingFileHandler indexHandler(indexFile);
+    DBEngine db(logFile, indexHandler);
+    bool ok = db.open("RESLOG.BIN", "RESIDX.BIN", DB_MODE_SESSION) && db.beginBulk();
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        rec.height = i;
+        ok = db.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && db.endBulk();
+    std::vector<uint32_t> confirm;
+    for (uint32_t i = 0; i < numRecords; i += 3)
+        confirm.push_back(i);
+    ok = ok && db.updateStatusMany(confirm.data(), confirm.size(), STATUS_CONFIRMED);
+    for (uint32_t i = 5; ok && i < numRecords; i += 11)
+        ok = db.deleteRecord(baseKey + i);
+    ok = ok && db.sync();
+    std::vector<uint32_t> paged(numRecords);
+    auto start = std::chrono::high_resolution_clock::now();
+    paged.resize(db.findByStatus(STATUS_CONFIRMED, paged.data(), paged.size()));
+    size_t pagedChanged = db.recordCount(INTERNAL_STATUS_CHANGED, INTERNAL_STATUS_DELETED);
+    std::chrono::duration<double> pagedTime = std::chrono::high_resolution_clock::now() - start;
+    db.close();
+    if (!ok || paged.size() != confirm.size() || pagedChanged == 0) {
+        std::cerr << "    [Setup] FAIL: Loading or updating " << numRecords << " records failed. " << RED_CROSS << std::endl;
+        std::remove("RESLOG.BIN");
+        std::remove("RESIDX.BIN");
+        return;
+    }
+
+    db.setResidentIndex(true, 4);
+    ok = db.open("RESLOG.BIN", "RESIDX.BIN", DB_MODE_SESSION);
+    DBStats stats;
+    db.getStats(stats);
+    uint32_t openLoads = stats.pageLoads;
+    uint32_t lookups = 0;
+    for (uint32_t i = 0; ok && i < numRecords; i += 97, lookups++)
+        ok = db.get(baseKey + i, &out, sizeof(out)) && out.height == i;
+    db.getStats(stats);
+    if (!ok || openLoads == 0 || stats.pageLoads != openLoads) {
+        std::cerr << "    [Load] FAIL: " << openLoads << " pages read by open(), " << stats.pageLoads
+            << " after the lookups. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Load] SUCCESS: open() read " << openLoads << " pages; " << lookups << " lookups loaded none. "
+        << GREEN_TICK << std::endl;
+
+    std::vector<uint32_t> resident(numRecords);
+    start = std::chrono::high_resolution_clock::now();
+    resident.resize(db.findByStatus(STATUS_CONFIRMED, resident.data(), resident.size()));
+    size_t residentChanged = db.recordCount(INTERNAL_STATUS_CHANGED, INTERNAL_STATUS_DELETED);
+    std::chrono::duration<double> residentTime = std::chrono::high_resolution_clock::now() - start;
+    uint32_t first[100];
+    size_t firstFound = db.findByStatus(STATUS_CONFIRMED, first, 100);
+    ok = resident == paged && residentChanged == pagedChanged && firstFound == 100 &&
+        memcmp(first, paged.data(), sizeof(first)) == 0;
+    if (!ok) {
+        std::cerr << "    [Scan] FAIL: " << resident.size() << " of " << paged.size() << " positions, " << residentChanged
+            << " of " << pagedChanged << " counted. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Scan] SUCCESS: " << resident.size() << " positions and " << residentChanged << " counted on 4 threads in "
+        << residentTime.count() * 1000 << " ms (" << pagedTime.count() * 1000 << " ms paged). " << GREEN_TICK << std::endl;
+
+    FileIOStats indexIO;
+    indexHandler.resetStats();
+    ok = db.updateStatusRange(0, 1000, STATUS_UPLOADED);
+    indexHandler.getStats(indexIO);
+    uint32_t writesBeforeSync = indexIO.writes;
+    for (uint32_t i = numRecords; ok && i < numRecords + moreRecords; i++) {
+        rec.height = i;
+        ok = db.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && db.sync();
+    indexHandler.getStats(indexIO);
+    db.close();
+    db.setResidentIndex(false);
+    std::vector<uint32_t> uploaded(numRecords);
+    ok = ok && writesBeforeSync == 0 && indexIO.writes > 0 && db.open("RESLOG.BIN", "RESIDX.BIN", DB_MODE_SESSION) &&
+        db.indexCount() == numRecords + moreRecords &&
+        db.findByStatus(STATUS_UPLOADED, uploaded.data(), uploaded.size()) == 1000 &&
+        db.get(baseKey + numRecords + moreRecords - 1, &out, sizeof(out)) && out.height == numRecords + moreRecords - 1;
+    db.close();
+    if (!ok) {
+        std::cerr << "    [Write Back] FAIL: " << writesBeforeSync << " index writes before sync(), or the paged engine "
+            << "misses the changes. " << RED_CROSS << std::endl;
+        std::remove("RESLOG.BIN");
+        std::remove("RESIDX.BIN");
+        return;
+    }
+    std::cout << "    [Write Back] SUCCESS: Status updates stayed in RAM until sync(); the paged engine reads them. "
+        << GREEN_TICK << std::endl;
+
+#ifndef _WIN32
+    std::vector<uint32_t> stillConfirmed;
+    for (size_t i = 0; i < paged.size(); i++) {
+        if (paged[i] >= 1000)
+            stillConfirmed.push_back(paged[i]);
+    }
+    WindowsFileHandler mapLog;
+    PosixFileHandler mapFile(PosixFileHandler::ACCESS_SEQUENTIAL);
+    CountingFileHandler mapIndex(mapFile);
+    DBEngine mapDb(mapLog, mapIndex);
+    mapDb.setResidentIndex(true, 4);
+    ok = mapDb.open("RESLOG.BIN", "RESIDX.BIN", DB_MODE_SESSION);
+    mapDb.getStats(stats);
+    mapIndex.getStats(indexIO);
+    std::vector<uint32_t> mapped(numRecords);
+    mapped.resize(mapDb.findByStatus(STATUS_CONFIRMED, mapped.data(), mapped.size()));
+    ok = ok && stats.pageLoads > openLoads / 2 && indexIO.reads < stats.pageLoads / 2 && mapped == stillConfirmed;
+    mapDb.close();
+    if (!ok) {
+        std::cerr << "    [Mapped] FAIL: " << stats.pageLoads << " pages loaded with " << indexIO.reads << " reads, "
+            << mapped.size() << " of " << stillConfirmed.size() << " positions. " << RED_CROSS << std::endl;
+        std::remove("RESLOG.BIN");
+        std::remove("RESIDX.BIN");
+        return;
+    }
+    std::cout << "    [Mapped] SUCCESS: open() took " << stats.pageLoads << " pages from the mapping with " << indexIO.reads
+        << " reads. " << GREEN_TICK << std::endl;
+#endif
+    std::remove("RESLOG.BIN");
+    std::remove("RESIDX.BIN");
+}
+#endif
+
+// Test: I/O Accounting
+//   - Appends ascending keys through CountingFileHandlers and checks the split,
+//     flush and header counters of getStats() and the bytes the log received.
+//   - Checks that a lookup of a cached leaf loads no page and reads only the log.
+//   - Reopens in safe mode and checks that every lookup opens the log and each
+//     page load the index.
+void testIOAccounting() {
+    const uint32_t numRecords = 3 * MAX_INDEX_ENTRIES + 1;
+    const uint32_t baseKey = 18000000;
+    TemperatureRecord rec = { 1.0f, 40.0f, 0, 0, "Counted" };
+    TemperatureRecord out;
+
+    std::cout << "Test I/O Accounting" << std::endl;
+
+    std::remove("IOLOG.BIN");
+    std::remove("IOIDX.BIN");
+    WindowsFileHandler ioLogFile;
+    WindowsFileHandler ioIndexFile;
+    CountingFileHandler ioLog(ioLogFile);
+    CountingFileHandler ioIndex(ioIndexFile);
+    DBEngine ioDb(ioLog, ioIndex);
+    bool ok = ioDb.open("IOLOG.BIN", "IOIDX.BIN", DB_MODE_SESSION);
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        rec.height = i;
+        ok = ioDb.append(baseKey + i, 1, &rec, sizeof(rec));
+    }
+    ok = ok && ioDb.sync();
+    DBStats stats;
+    FileIOStats logIO, indexIO;
+    ioDb.getStats(stats);
+    ioLog.getStats(logIO);
+    ioIndex.getStats(indexIO);
+    if (!ok || stats.leafSplits != 3 || stats.interiorSplits != 0 || stats.pageFlushes < 5 ||
+        stats.indexHeaderWrites == 0 || stats.logHeaderWrites == 0 ||
+        logIO.bytesWritten < numRecords * (sizeof(LogEntryHeader) + sizeof(rec)) || indexIO.writes < stats.pageFlushes) {
+        std::cerr << "    [Appends] FAIL: " << stats.leafSplits << " leaf splits, " << stats.pageFlushes << " page flushes, "
+            << logIO.bytesWritten << " log bytes. " << RED_CROSS << std::endl;
+        ioDb.close();
+        return;
+    }
+    std::cout << "    [Appends] SUCCESS: " << stats.leafSplits << " leaf splits, " << stats.pageFlushes << " page flushes, "
+        << logIO.writes << " log writes of " << logIO.bytesWritten << " bytes. " << GREEN_TICK << std::endl;
+
+    // The last leaf stays cached after sync().
+    ioDb.resetStats();
+    ioLog.resetStats();
+    ioIndex.resetStats();
+    ok = ioDb.get(baseKey + numRecords - 1, &out, sizeof(out)) && out.height == numRecords - 1;
+    ioDb.getStats(stats);
+    ioLog.getStats(logIO);
+    ioIndex.getStats(indexIO);
+    if (!ok || stats.pageLoads != 0 || stats.cacheHits == 0 || indexIO.reads != 0 || indexIO.bytesRead != 0 ||
+        logIO.reads == 0 || logIO.bytesRead < sizeof(rec)) {
+        std::cerr << "    [Cached] FAIL: " << stats.pageLoads << " page loads, " << indexIO.reads << " index reads. "
+            << RED_CROSS << std::endl;
+        ioDb.close();
+        return;
+    }
+    std::cout << "    [Cached] SUCCESS: A lookup in a cached leaf reads " << logIO.bytesRead << " log bytes and no page. "
+        << GREEN_TICK << std::endl;
+
+    ioDb.close();
+    ok = ioDb.open("IOLOG.BIN", "IOIDX.BIN", DB_MODE_SAFE);
+    ioDb.resetStats();
+    ioLog.resetStats();
+    ioIndex.resetStats();
+    const uint32_t lookups = 4;
+    for (uint32_t n = 0; ok && n < lookups; n++)
+        ok = ioDb.get(baseKey + n * MAX_INDEX_ENTRIES, &out, sizeof(out)) && out.height == n * MAX_INDEX_ENTRIES;
+    ioDb.getStats(stats);
+    ioLog.getStats(logIO);
+    ioIndex.getStats(indexIO);
+    ioDb.close();
+    std::remove("IOLOG.BIN");
+    std::remove("IOIDX.BIN");
+    // One key per leaf; open() has already loaded the end leaves.
+    ok = ok && stats.pageLoads > 0 && stats.pageLoads == stats.cacheMisses && logIO.opens >= lookups &&
+        indexIO.opens >= stats.pageLoads && logIO.seeks >= lookups;
+    if (!ok) {
+        std::cerr << "    [Safe] FAIL: " << logIO.opens << " log opens, " << stats.pageLoads << " page loads for "
+            << lookups << " lookups. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Safe] SUCCESS: " << lookups << " lookups opened the log " << logIO.opens << " and the index "
+        << indexIO.opens << " times for " << stats.pageLoads << " page loads. " << GREEN_TICK << std::endl;
+}
+
+// Test: Scope Timers
+//   - Times a few calls at two sites that share a label and one with its own.
+//   - Checks that the report merges the shared label, that the histogram holds
+//     every call and that min <= avg <= max.
+static void timedWork(uint32_t rounds, volatile uint32_t& sink) {
+    DB_SCOPE_TIMER("testapp::timedWork");
+    for (uint32_t i = 0; i < rounds; i++)
+        sink = sink + i;
+}
+
+void testScopeTimers() {
+    std::cout << "Test Scope Timers" << std::endl;
+
+    volatile uint32_t sink = 0;
+    for (uint32_t n = 0; n < 10; n++)
+        timedWork(100 * (n + 1), sink);
+    for (uint32_t n = 0; n < 5; n++) {
+        DB_SCOPE_TIMER("testapp::timedWork");
+        sink = sink + n;
+    }
+    {
+        DB_SCOPE_TIMER("testapp::other");
+        sink = sink + 1;
+    }
+
+    TimerTotals work, other, missing;
+    bool ok = CollectTimer("testapp::timedWork", work) && CollectTimer("testapp::other", other) &&
+        !CollectTimer("testapp::missing", missing);
+    uint64_t inBuckets = 0;
+    for (unsigned b = 0; b < TIMER_BUCKETS; b++)
+        inBuckets += work.buckets[b];
+    ok = ok && work.count == 15 && other.count == 1 && inBuckets == work.count &&
+        work.minCycles <= work.totalCycles / work.count && work.totalCycles / work.count <= work.maxCycles &&
+        TimerQuantile(work, 0.5) <= TimerQuantile(work, 0.99) && TimerQuantile(work, 0.99) >= work.maxCycles / 2;
+    if (!ok) {
+        std::cerr << "    [Slots] FAIL: " << work.count << " calls merged, " << inBuckets << " in the histogram. "
+            << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Slots] SUCCESS: 15 calls from two sites merged; min " << work.minCycles << ", max "
+        << work.maxCycles << " cycles. " << GREEN_TICK << std::endl;
+
+    ResetInstrumentation();
+    ok = CollectTimer("testapp::timedWork", work) && work.count == 0 && work.maxCycles == 0;
+    if (!ok) {
+        std::cerr << "    [Reset] FAIL: Slots not cleared. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reset] SUCCESS: Slots cleared and still registered. " << GREEN_TICK << std::endl;
+}
+
+// Test: In-Page Search
+//   - Builds indexes of 1, 2, 3, 5 and 3000 keys spaced 3 apart, with wide and
+//     narrow leaves, so leaves of every small size and both key encodings occur.
+//   - Probes every key and every gap around them (also below the first and
+//     above the last key) and checks locateKey() and findKey() against the
+//     position the key must have.
+static bool checkKeyPositions(DBEngine& db, uint32_t baseKey, uint32_t count) {
+    for (uint32_t key = baseKey - 4; key <= baseKey + 3 * count + 1; key++) {
+        uint32_t expected = (key <= baseKey) ? 0 : (key - baseKey + 2) / 3;
+        if (expected > count)
+            expected = count;
+        uint32_t position = DB_NO_OFFSET;
+        bool located = db.locateKey(key, &position);
+        if (located != (expected < count) || (located && position != expected))
+            return false;
+        bool exact = key >= baseKey && (key - baseKey) % 3 == 0 && expected < count;
+        position = DB_NO_OFFSET;
+        if (db.findKey(key, &position) != exact || (exact && position != expected))
+            return false;
+    }
+    return true;
+}
+
+void testInPageSearch() {
+    const uint32_t baseKey = 1000;
+    const uint32_t counts[] = { 1, 2, 3, 5, 3000 };
+    TemperatureRecord rec = { 3.0f, 30.0f, 0, 0, "Search" };
+
+    std::cout << "Test In-Page Search" << std::endl;
+
+    bool ok = true;
+    uint32_t probes = 0;
+    for (int narrow = 0; ok && narrow < 2; narrow++) {
+        for (size_t c = 0; ok && c < sizeof(counts) / sizeof(counts[0]); c++) {
+            std::remove("SRCLOG.BIN");
+            std::remove("SRCIDX.BIN");
+            WindowsFileHandler logHandler;
+            WindowsFileHandler indexHandler;
+            DBEngine db(logHandler, indexHandler);
+            db.setNarrowLeaves(narrow != 0);
+            ok = db.open("SRCLOG.BIN", "SRCIDX.BIN", DB_MODE_SESSION);
+            // Odd positions first, so the leaves also split in the middle.
+            for (uint32_t i = 1; ok && i < counts[c]; i += 2)
+                ok = db.append(baseKey + 3 * i, 1, &rec, sizeof(rec));
+            for (uint32_t i = 0; ok && i < counts[c]; i += 2)
+                ok = db.append(baseKey + 3 * i, 1, &rec, sizeof(rec));
+            ok = ok && db.indexCount() == counts[c] && checkKeyPositions(db, baseKey, counts[c]);
+            probes += 3 * counts[c] + 6;
+            if (!ok)
+                std::cerr << "    [Positions] FAIL: " << counts[c] << " keys in " << (narrow ? "narrow" : "wide")
+                    << " leaves. " << RED_CROSS << std::endl;
+            db.close();
+        }
+    }
+    std::remove("SRCLOG.BIN");
+    std::remove("SRCIDX.BIN");
+    if (ok)
+        std::cout << "    [Positions] SUCCESS: " << probes << " keys and gaps found at their positions in wide and narrow leaves. "
+            << GREEN_TICK << std::endl;
+}
+
+// Test: Engine Configurations
+//   - Stores the same scattered keys with the default engine and with dbtiny
+//     (testapp.tiny.h: 16-entry pages, 2 cache slots, no record codec), both
+//     linked into this program.
+//   - Checks that every record reads back from dbtiny, that its pages are the
+//     smaller ones and that it needed more leaf splits.
+void testEngineConfigurations() {
+    const uint32_t numKeys = 2000;
+
+    std::cout << "Test Engine Configurations" << std::endl;
+
+    std::remove("CFGLOG.BIN");
+    std::remove("CFGIDX.BIN");
+    std::remove("TNYLOG.BIN");
+    std::remove("TNYIDX.BIN");
+    WindowsFileHandler logHandler;
+    WindowsFileHandler indexHandler;
+    DBEngine db(logHandler, indexHandler);
+    bool ok = db.open("CFGLOG.BIN", "CFGIDX.BIN", DB_MODE_SESSION);
+    for (uint32_t i = 0; ok && i < numKeys; i++) {
+        uint32_t key = (i * 7919) % numKeys;
+        ok = db.append(key, 1, &key, sizeof(key));
+    }
+    DBStats stats;
+    db.getStats(stats);
+    db.close();
+    size_t tinyPageBytes = 0;
+    uint32_t tinySplits = 0;
+    bool tinyOk = runTinyEngine("TNYLOG.BIN", "TNYIDX.BIN", numKeys, tinyPageBytes, tinySplits);
+    std::remove("CFGLOG.BIN");
+    std::remove("CFGIDX.BIN");
+    std::remove("TNYLOG.BIN");
+    std::remove("TNYIDX.BIN");
+    if (!ok || !tinyOk || tinyPageBytes >= sizeof(IndexPage) || tinySplits <= stats.leafSplits) {
+        std::cerr << "    [Configs] FAIL: dbtiny " << (tinyOk ? "stored" : "lost") << " the records with "
+            << tinyPageBytes << "-byte pages and " << tinySplits << " leaf splits (default " << sizeof(IndexPage)
+            << " bytes, " << stats.leafSplits << " splits). " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Configs] SUCCESS: " << numKeys << " records in both engines; pages of " << tinyPageBytes
+        << " and " << sizeof(IndexPage) << " bytes, " << tinySplits << " and " << stats.leafSplits
+        << " leaf splits. " << GREEN_TICK << std::endl;
+}
+
+#if DB_AGGREGATES > 0
+// Test: Range Aggregates
+//   - Appends ascending even keys (every tenth record of a type that only has
+//     a temperature) with an extractor for temperature and humidity.
+//   - Checks aggregateRange() against the records and that a window of several
+//     leaves reads the log only for the leaves at its ends.
+//   - Inserts odd keys (leaves split in the middle) and deletes some records,
+//     checks the results again, then that after refreshAggregates() the whole
+//     range reads no record, also after a reopen.
+//   - Checks that rebuildIndex() (stale summaries) gives the same results.
+static float aggregateTemperature(uint32_t k) {
+    return static_cast<float>(static_cast<int>((k * 37) % 101) - 50);
+}
+
+static float aggregateHumidity(uint32_t k) {
+    return static_cast<float>(k % 13) + 0.5f;
+}
+
+static uint8_t aggregateType(uint32_t k) {
+    return (k % 10 == 0) ? 2 : 1;
+}
+
+static uint32_t extractTemperatureFields(uint8_t recordType, const void* record, uint16_t recordSize, float values[]) {
+    if (recordSize != sizeof(TemperatureRecord))
+        return 0;
+    TemperatureRecord rec;
+    memcpy(&rec, record, sizeof(rec));
+    values[0] = rec.temperature;
+    values[1] = rec.humidity;
+    return (recordType == 1) ? 3u : 1u;
+}
+
+// Compares aggregateRange() over keys [baseKey + first, baseKey + last] with the live records in 'present'.
+static bool checkAggregates(DBEngine& db, uint32_t baseKey, const bool* present, uint32_t first, uint32_t last) {
+    DBAggregate results[DB_AGGREGATES];
+    if (!db.aggregateRange(baseKey + first, baseKey + last, results))
+        return false;
+    uint32_t counts[2] = { 0, 0 };
+    double sums[2] = { 0, 0 };
+    float mins[2] = { 0, 0 };
+    float maxs[2] = { 0, 0 };
+    for (uint32_t k = first; k <= last; k++) {
+        if (!present[k])
+            continue;
+        float values[2] = { aggregateTemperature(k), aggregateHumidity(k) };
+        for (uint32_t f = 0; f < 2; f++) {
+            if (f == 1 && aggregateType(k) != 1)
+                continue;
+            if (counts[f] == 0 || values[f] < mins[f])
+                mins[f] = values[f];
+            if (counts[f] == 0 || values[f] > maxs[f])
+                maxs[f] = values[f];
+            counts[f]++;
+            sums[f] += values[f];
+        }
+    }
+    for (uint32_t f = 0; f < 2; f++) {
+        if (results[f].count != counts[f] || results[f].sum != sums[f] ||
+            (counts[f] > 0 && (results[f].min != mins[f] || results[f].max != maxs[f])))
+            return false;
+    }
+    return true;
+}
+
+void testRangeAggregates() {
+    const uint32_t numRecords = 6 * MAX_INDEX_ENTRIES;
+    const uint32_t baseKey = 22000000;
+    static bool present[2 * numRecords];
+    TemperatureRecord rec = { 0.0f, 0.0f, 0, 0, "Aggregated" };
+
+    std::cout << "Test Range Aggregates" << std::endl;
+
+    std::remove("AGGLOG.BIN");
+    std::remove("AGGIDX.BIN");
+    WindowsFileHandler logFile;
+    WindowsFileHandler indexFile;
+    CountingFileHandler logHandler(logFile);
+    DBEngine db(logHandler, indexFile);
+    db.setAggregateExtractor(extractTemperatureFields);
+    bool ok = db.open("AGGLOG.BIN", "AGGIDX.BIN", DB_MODE_SESSION);
+    memset(present, 0, sizeof(present));
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        uint32_t k = 2 * i;
+        rec.temperature = aggregateTemperature(k);
+        rec.humidity = aggregateHumidity(k);
+        rec.height = k;
+        ok = db.append(baseKey + k, aggregateType(k), &rec, sizeof(rec));
+        present[k] = true;
+    }
+    ok = ok && db.sync();
+    if (!ok) {
+        std::cerr << "    [Setup] FAIL: Appends failed. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+
+    // Keys from the middle of the second leaf to the middle of the sixth.
+    uint32_t first = 3 * MAX_INDEX_ENTRIES - 1;
+    uint32_t last = 11 * MAX_INDEX_ENTRIES;
+    logHandler.resetStats();
+    ok = checkAggregates(db, baseKey, present, first, last);
+    FileIOStats logIO;
+    logHandler.getStats(logIO);
+    // Each record read is a header and a payload read.
+    uint32_t windowRecords = (last - first) / 2;
+    if (!ok || logIO.reads > 2 * 2 * MAX_INDEX_ENTRIES) {
+        std::cerr << "    [Window] FAIL: " << (ok ? "correct" : "wrong") << " aggregates of " << windowRecords
+            << " records with " << logIO.reads << " log reads. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Window] SUCCESS: " << windowRecords << " records aggregated with " << logIO.reads
+        << " log reads. " << GREEN_TICK << std::endl;
+
+    // Odd keys land in the middle of full leaves; deletes make their paths stale.
+    for (uint32_t i = numRecords / 3; ok && i < numRecords / 3 + MAX_INDEX_ENTRIES; i++) {
+        uint32_t k = 2 * i + 1;
+        rec.temperature = aggregateTemperature(k);
+        rec.humidity = aggregateHumidity(k);
+        rec.height = k;
+        ok = db.append(baseKey + k, aggregateType(k), &rec, sizeof(rec));
+        present[k] = true;
+    }
+    for (uint32_t k = 0; ok && k < 2 * numRecords; k += 14) {
+        ok = db.deleteRecord(baseKey + k);
+        present[k] = false;
+    }
+    ok = ok && checkAggregates(db, baseKey, present, first, last) &&
+        checkAggregates(db, baseKey, present, 0, 2 * numRecords - 1) &&
+        checkAggregates(db, baseKey, present, 2 * numRecords / 3 + 1, 2 * numRecords / 3 + 1);
+    if (!ok) {
+        std::cerr << "    [Changes] FAIL: Aggregates differ after inserts and deletes. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Changes] SUCCESS: Aggregates follow middle inserts and deletes. " << GREEN_TICK << std::endl;
+
+    ok = db.refreshAggregates();
+    logHandler.resetStats();
+    ok = ok && checkAggregates(db, baseKey, present, 0, 2 * numRecords - 1);
+    logHandler.getStats(logIO);
+    uint32_t refreshedReads = logIO.reads;
+    db.close();
+    ok = ok && db.open("AGGLOG.BIN", "AGGIDX.BIN", DB_MODE_SESSION);
+    logHandler.resetStats();
+    ok = ok && checkAggregates(db, baseKey, present, 0, 2 * numRecords - 1);
+    logHandler.getStats(logIO);
+    if (!ok || refreshedReads != 0 || logIO.reads != 0) {
+        std::cerr << "    [Refresh] FAIL: " << refreshedReads << " and " << logIO.reads
+            << " log reads for the whole range after refreshAggregates() and a reopen. " << RED_CROSS << std::endl;
+        db.close();
+        return;
+    }
+    std::cout << "    [Refresh] SUCCESS: The whole range came from the summaries, also after a reopen. " << GREEN_TICK << std::endl;
+
+    ok = db.rebuildIndex() && checkAggregates(db, baseKey, present, first, last) &&
+        checkAggregates(db, baseKey, present, 0, 2 * numRecords - 1);
+    db.close();
+    std::remove("AGGLOG.BIN");
+    std::remove("AGGIDX.BIN");
+    if (!ok) {
+        std::cerr << "    [Rebuild] FAIL: Aggregates differ after rebuildIndex(). " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Rebuild] SUCCESS: Records were read for the stale summaries of the rebuilt index. "
+        << GREEN_TICK << std::endl;
+}
+#endif
+
+#if DB_THREAD_SAFE
+// Test: Concurrent Readers
+//   - Fills a separate database in session mode, then times the same number of
+//     lookups done by one thread and by several threads.
+//   - Lets the readers verify records and count them while one writer thread
+//     appends new keys and updates statuses.
+//   - Verifies afterwards that every record is intact.
+static void readConcurrently(DBEngine& thrDb, uint32_t baseKey, uint32_t numRecords, uint32_t seed,
+    uint32_t lookups, bool checkCounts, std::atomic<uint32_t>& failures) {
+    uint32_t lastCount = 0;
+    for (uint32_t n = 0; n < lookups; n++) {
+        uint32_t i = (seed + n * 7919) % numRecords;
+        TemperatureRecord out;
+        if (!thrDb.get(baseKey + i, &out, sizeof(out)) || out.height != i)
+            failures++;
+        if (checkCounts && n % 64 == 0) {
+            // The writer only adds records.
+            uint32_t count = static_cast<uint32_t>(thrDb.indexCount());
+            if (count < lastCount)
+                failures++;
+            lastCount = count;
+            // New keys go to the end, so uploaded positions stay uploaded.
+            uint32_t uploaded[16];
+            size_t found = thrDb.findByStatus(STATUS_UPLOADED, uploaded, 16);
+            for (size_t k = 0; k < found; k++) {
+                IndexEntry entry;
+                if (!thrDb.getIndexEntry(uploaded[k], entry) || entry.status != STATUS_UPLOADED)
+                    failures++;
+            }
+        }
+    }
+}
+
+void testConcurrentReaders() {
+    const uint32_t numRecords = 2000;
+    const uint32_t numAppends = 1000;
+    const uint32_t baseKey = 14000000;
+    const uint32_t lookups = 40000;
+    const uint32_t numReaders = 4;
+
+    std::cout << "Test Concurrent Readers" << std::endl;
+
+#ifndef _WIN32
+    PosixFileHandler thrLog;
+    PosixFileHandler thrIndex(PosixFileHandler::ACCESS_RANDOM);
+#else
+    WindowsFileHandler thrLog;
+    WindowsFileHandler thrIndex;
+#endif
+    DBEngine thrDb(thrLog, thrIndex);
+    std::remove("THRLOG.BIN");
+    std::remove("THRIDX.BIN");
+    if (!thrDb.open("THRLOG.BIN", "THRIDX.BIN", DB_MODE_SESSION)) {
+        std::cerr << "    [Setup] FAIL: Unable to open the database. " << RED_CROSS << std::endl;
+        return;
+    }
+    TemperatureRecord rec = { 21.0f, 45.0f, 0, 0, "Shared record" };
+    for (uint32_t i = 0; i < numRecords; i++) {
+        rec.height = i;
+        if (!thrDb.append(baseKey + i, 1, &rec, sizeof(rec))) {
+            std::cerr << "    [Setup] FAIL: Append " << i << " failed. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+
+    std::atomic<uint32_t> failures(0);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    readConcurrently(thrDb, baseKey, numRecords, 0, lookups, false, failures);
+    std::chrono::duration<double> oneSeconds = std::chrono::high_resolution_clock::now() - startTime;
+
+    startTime = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> readers;
+    for (uint32_t r = 0; r < numReaders; r++)
+        readers.emplace_back(readConcurrently, std::ref(thrDb), baseKey, numRecords, r * 101,
+            lookups / numReaders, false, std::ref(failures));
+    for (std::thread& reader : readers)
+        reader.join();
+    std::chrono::duration<double> manySeconds = std::chrono::high_resolution_clock::now() - startTime;
+    if (failures != 0) {
+        std::cerr << "    [Readers] FAIL: " << failures << " lookups failed. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Readers] SUCCESS: " << lookups << " lookups: 1 thread " << oneSeconds.count()
+        << " s, " << numReaders << " threads " << manySeconds.count() << " s. " << GREEN_TICK << std::endl;
+
+    // The readers do not wait for the writer: std::shared_mutex may let a
+    // steady stream of readers hold off a writer.
+    bool writerOk = true;
+    readers.clear();
+    for (uint32_t r = 0; r < numReaders; r++)
+        readers.emplace_back(readConcurrently, std::ref(thrDb), baseKey, numRecords, r * 101,
+            lookups / numReaders, true, std::ref(failures));
+    std::thread writer([&]() {
+        TemperatureRecord added = { 22.0f, 40.0f, 0, 0, "Added record" };
+        for (uint32_t i = 0; i < numAppends && writerOk; i++) {
+            added.height = numRecords + i;
+            uint32_t position;
+            writerOk = thrDb.append(baseKey + numRecords + i, 1, &added, sizeof(added)) &&
+                thrDb.findKey(baseKey + (i * 13) % numRecords, &position) &&
+                thrDb.updateStatus(position, STATUS_UPLOADED);
+        }
+    });
+    writer.join();
+    for (std::thread& reader : readers)
+        reader.join();
+    if (!writerOk || failures != 0) {
+        std::cerr << "    [Writer] FAIL: Writer " << (writerOk ? "succeeded" : "failed") << ", "
+            << failures << " reads failed. " << RED_CROSS << std::endl;
+        return;
+    }
+
+    thrDb.close();
+    if (!thrDb.open("THRLOG.BIN", "THRIDX.BIN", DB_MODE_SESSION) ||
+        thrDb.indexCount() != numRecords + numAppends) {
+        std::cerr << "    [Writer] FAIL: Records missing after reopening. " << RED_CROSS << std::endl;
+        return;
+    }
+    for (uint32_t i = 0; i < numRecords + numAppends; i++) {
+        TemperatureRecord out;
+        if (!thrDb.get(baseKey + i, &out, sizeof(out)) || out.height != i) {
+            std::cerr << "    [Writer] FAIL: Record " << i << " differs. " << RED_CROSS << std::endl;
+            return;
+        }
+    }
+    thrDb.close();
+    std::remove("THRLOG.BIN");
+    std::remove("THRIDX.BIN");
+    std::cout << "    [Writer] SUCCESS: " << numAppends << " appends and status updates alongside "
+        << numReaders << " readers; all records intact. " << GREEN_TICK << std::endl;
+}
+
+// Test: Sharded Database
+//   - Checks the 8.3 file names of the shards.
+//   - Ingests the same records through appendBatch() into one shard and into
+//     four (one writer thread each) and prints both times.
+//   - Checks that the hashed keys are spread evenly, that every record is
+//     found, that a ShardedCursor returns the keys of all shards in order, and
+//     that a batch with a stored key is refused.
+//   - Partitions by key range and checks the shard of each key and a cursor
+//     walk across the range bounds.
+static bool ingestSharded(ShardedDB& sharded, uint32_t baseKey, uint32_t numRecords, double& seconds) {
+    const uint32_t batchSize = 512;
+    static TemperatureRecord recs[batchSize];
+    static BatchItem items[batchSize];
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (uint32_t first = 0; first < numRecords; first += batchSize) {
+        uint32_t n = (numRecords - first < batchSize) ? numRecords - first : batchSize;
+        for (uint32_t i = 0; i < n; i++) {
+            recs[i] = { 18.0f, 55.0f, first + i, 0, "Sharded record" };
+            items[i].key = baseKey + first + i;
+            items[i].recordType = 1;
+            items[i].record = &recs[i];
+            items[i].recordSize = sizeof(recs[i]);
+        }
+        if (!sharded.appendBatch(items, n))
+            return false;
+    }
+    bool ok = sharded.sync();
+    std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - startTime;
+    seconds = diff.count();
+    return ok;
+}
+
+static void removeShardFiles(const char* logName, const char* indexName, uint8_t shards) {
+    for (uint8_t s = 0; s < shards; s++) {
+        char name[MAX_FILENAME_LENGTH];
+        ShardedDB::shardFileName(logName, s, name);
+        std::remove(name);
+        ShardedDB::shardFileName(indexName, s, name);
+        std::remove(name);
+    }
+}
+
+void testShardedDB() {
+    const uint32_t numRecords = 8000;
+    const uint32_t baseKey = 23000000;
+    const uint8_t numShards = 4;
+
+    std::cout << "Test Sharded Database" << std::endl;
+
+    char name[MAX_FILENAME_LENGTH];
+    char other[MAX_FILENAME_LENGTH];
+    ShardedDB::shardFileName("LOGFILE.BIN", 3, name);
+    ShardedDB::shardFileName("IDX.BIN", 12, other);
+    if (strcmp(name, "LOGFIL03.BIN") != 0 || strcmp(other, "IDX12.BIN") != 0) {
+        std::cerr << "    [Names] FAIL: Shard files " << name << " and " << other << ". " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Names] SUCCESS: Shard files " << name << " and " << other << ". " << GREEN_TICK << std::endl;
+
+#ifndef _WIN32
+    PosixFileHandler logFiles[numShards];
+    PosixFileHandler indexFiles[numShards] = { PosixFileHandler(PosixFileHandler::ACCESS_RANDOM),
+        PosixFileHandler(PosixFileHandler::ACCESS_RANDOM), PosixFileHandler(PosixFileHandler::ACCESS_RANDOM),
+        PosixFileHandler(PosixFileHandler::ACCESS_RANDOM) };
+#else
+    WindowsFileHandler logFiles[numShards];
+    WindowsFileHandler indexFiles[numShards];
+#endif
+    IFileHandler* logHandlers[numShards];
+    IFileHandler* indexHandlers[numShards];
+    for (uint8_t s = 0; s < numShards; s++) {
+        logHandlers[s] = &logFiles[s];
+        indexHandlers[s] = &indexFiles[s];
+    }
+
+    double oneSeconds = 0, manySeconds = 0;
+    removeShardFiles("SHDLOG.BIN", "SHDIDX.BIN", numShards);
+    bool ok = true;
+    {
+        ShardedDB single(logHandlers, indexHandlers, 1);
+        ok = single.open("SHDLOG.BIN", "SHDIDX.BIN") && ingestSharded(single, baseKey, numRecords, oneSeconds);
+        single.close();
+    }
+    removeShardFiles("SHDLOG.BIN", "SHDIDX.BIN", numShards);
+    ShardedDB sharded(logHandlers, indexHandlers, numShards);
+    ok = ok && sharded.open("SHDLOG.BIN", "SHDIDX.BIN") && ingestSharded(sharded, baseKey, numRecords, manySeconds);
+    if (!ok || sharded.indexCount() != numRecords) {
+        std::cerr << "    [Ingest] FAIL: " << sharded.indexCount() << " of " << numRecords << " records stored. "
+            << RED_CROSS << std::endl;
+        sharded.close();
+        return;
+    }
+    std::cout << "    [Ingest] SUCCESS: " << numRecords << " records: 1 shard " << oneSeconds << " s, "
+        << static_cast<unsigned>(numShards) << " shards " << manySeconds << " s. " << GREEN_TICK << std::endl;
+
+    for (uint8_t s = 0; s < numShards; s++) {
+        size_t count = sharded.shard(s).indexCount();
+        ok = ok && count > numRecords / numShards / 2 && count < 2 * numRecords / numShards;
+    }
+    for (uint32_t i = 0; ok && i < numRecords; i++) {
+        TemperatureRecord out;
+        ok = sharded.get(baseKey + i, &out, sizeof(out)) && out.height == i;
+    }
+    if (!ok) {
+        std::cerr << "    [Lookup] FAIL: Records missing or spread unevenly. " << RED_CROSS << std::endl;
+        sharded.close();
+        return;
+    }
+    std::cout << "    [Lookup] SUCCESS: Every record found; shards hold " << sharded.shard(0).indexCount() << ", "
+        << sharded.shard(1).indexCount() << ", " << sharded.shard(2).indexCount() << " and "
+        << sharded.shard(3).indexCount() << ". " << GREEN_TICK << std::endl;
+
+    uint32_t expected = 1000;
+    {
+        ShardedCursor cursor(sharded);
+        for (bool more = cursor.seek(baseKey + expected); more && ok; more = cursor.next()) {
+            TemperatureRecord out;
+            ok = cursor.entry().key == baseKey + expected && cursor.shard() == sharded.shardFor(cursor.entry().key) &&
+                cursor.readPayload(&out, sizeof(out)) && out.height == expected;
+            expected++;
+        }
+    }
+    // Both keys hash to shard 3, so that shard refuses the whole group.
+    TemperatureRecord again = { 0.0f, 0.0f, 0, 0, "Duplicate" };
+    BatchItem duplicate[2] = { { baseKey + numRecords, 1, &again, sizeof(again) }, { baseKey + 5, 1, &again, sizeof(again) } };
+    ok = ok && expected == numRecords && sharded.shardFor(baseKey + numRecords) == sharded.shardFor(baseKey + 5) &&
+        !sharded.appendBatch(duplicate, 2) && !sharded.get(baseKey + numRecords, &again, sizeof(again)) &&
+        sharded.indexCount() == numRecords;
+    sharded.close();
+    removeShardFiles("SHDLOG.BIN", "SHDIDX.BIN", numShards);
+    if (!ok) {
+        std::cerr << "    [Cursor] FAIL: Merged walk stopped at offset " << expected << ". " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Cursor] SUCCESS: " << numRecords - 1000 << " keys of " << static_cast<unsigned>(numShards)
+        << " shards in order; the batch with a stored key was refused. " << GREEN_TICK << std::endl;
+
+    // Three shards by range: keys below 2000, below 5000 and the rest.
+    const uint32_t bounds[2] = { baseKey + 2000, baseKey + 5000 };
+    removeShardFiles("RNGLOG.BIN", "RNGIDX.BIN", 3);
+    ShardedDB ranged(logHandlers, indexHandlers, 3);
+    ok = ranged.setRangeBounds(bounds) && ranged.open("RNGLOG.BIN", "RNGIDX.BIN") &&
+        ingestSharded(ranged, baseKey, numRecords, oneSeconds) &&
+        ranged.shard(0).indexCount() == 2000 && ranged.shard(1).indexCount() == 3000 &&
+        ranged.shard(2).indexCount() == numRecords - 5000 &&
+        ranged.shardFor(baseKey + 1999) == 0 && ranged.shardFor(baseKey + 2000) == 1 && ranged.shardFor(0xFFFFFFFFu) == 2;
+    expected = 1990;
+    {
+        ShardedCursor cursor(ranged);
+        for (bool more = cursor.seek(baseKey + expected); ok && more && expected < 5010; more = cursor.next())
+            ok = cursor.entry().key == baseKey + expected++;
+    }
+    ranged.close();
+    removeShardFiles("RNGLOG.BIN", "RNGIDX.BIN", 3);
+    if (!ok || expected != 5010) {
+        std::cerr << "    [Ranges] FAIL: Range partitioning misplaced keys near offset " << expected << ". " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Ranges] SUCCESS: Keys went to their ranges; the cursor crossed both bounds. " << GREEN_TICK << std::endl;
+}
+#endif
+
+// Test: Session Close and Reopen
+//   - Records the index count and the payload of the first live record.
+//   - Closes the session-mode database, which must commit all pending index changes.
+//   - Reopens the database in safe (open/close per operation) mode.
+//   - Verifies that the index count and the record payload survived the reopen.
+//   - Reopens in session mode again so that later tests keep using persistent handles.
+void testSessionReopen() {
+    std::cout << "Test Session Close and Reopen" << std::endl;
+
+    size_t countBefore = db.indexCount();
+    IndexEntry firstLive;
+    uint32_t firstPos = 0;
+    if (!db.getFirstActiveIndexEntry(firstLive, firstPos)) {
+        std::cerr << "    [Setup] FAIL: No live record available. " << RED_CROSS << std::endl;
+        return;
+    }
+    TemperatureRecord before;
+    if (!db.get(firstLive.key, &before, sizeof(before))) {
+        std::cerr << "    [Setup] FAIL: Unable to read record with key " << firstLive.key << " " << RED_CROSS << std::endl;
+        return;
+    }
+
+    db.close();
+    if (!db.open("LOGFILE.BIN", "INDEX.BIN", DB_MODE_SAFE)) {
+        std::cerr << "    [Reopen Safe] FAIL: Unable to reopen database in safe mode. " << RED_CROSS << std::endl;
+        return;
+    }
+    if (db.indexCount() != countBefore) {
+        std::cerr << "    [Reopen Safe] FAIL: Expected index count " << countBefore
+            << " but got " << db.indexCount() << " " << RED_CROSS << std::endl;
+        return;
+    }
+    TemperatureRecord after;
+    if (!db.get(firstLive.key, &after, sizeof(after)) || memcmp(&before, &after, sizeof(before)) != 0) {
+        std::cerr << "    [Reopen Safe] FAIL: Record with key " << firstLive.key
+            << " does not match after reopen " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reopen Safe] SUCCESS: " << countBefore << " index entries and record data intact. "
+        << GREEN_TICK << std::endl;
+
+    db.close();
+    if (!db.open("LOGFILE.BIN", "INDEX.BIN", DB_MODE_SESSION) || db.indexCount() != countBefore) {
+        std::cerr << "    [Reopen Session] FAIL: Unable to reopen database in session mode. " << RED_CROSS << std::endl;
+        return;
+    }
+    std::cout << "    [Reopen Session] SUCCESS: Database reopened in session mode. " << GREEN_TICK << std::endl;
+}
+
 int main() {
     std::cout << "Starting DBEngine Test Application" << std::endl;
 
@@ -664,7 +3702,7 @@ int main() {
 
     //DBEngine db(/* appropriate logHandler */, /* appropriate indexHandler */);
 
-    if (!db.open("LOGFILE.BIN", "INDEX.BIN")) {
+    if (!db.open("LOGFILE.BIN", "INDEX.BIN", DB_MODE_SESSION)) {
         std::cerr << "Error opening database files." << std::endl;
         return 1;
     }
@@ -675,9 +3713,47 @@ int main() {
     testRetrieveRecords();
     testUpdateRecordStatus();
     testBTreeSearch();
+    testIndexPageCache();
+    testTreeLeafLookup();
     testIndexOffsets();
     testDeleteRecordsComprehensive();
     testIndexFilteringAndCounting();
+    testIndexTreeInserts();
+    testIndexUpgradeV1();
+    testAscendingAppends();
+    testAppendBatch();
+    testBufferedFileHandler();
+    testGetView();
+    testStatusSummaries();
+    testCursorScan();
+    testCompaction();
+    testSegmentedLog();
+    testIndexRecovery();
+    testBulkLoad();
+    testChecksums();
+    testAsyncAppend();
+    testRecordCodec();
+    testNarrowLeaves();
+    testIOAccounting();
+    testBulkStatusUpdates();
+    testChangeStream();
+#if DB_RESIDENT_INDEX
+    testResidentIndex();
+#endif
+    testScopeTimers();
+    testInPageSearch();
+    testEngineConfigurations();
+#if DB_AGGREGATES > 0
+    testRangeAggregates();
+#endif
+#if DB_THREAD_SAFE
+    testConcurrentReaders();
+    testShardedDB();
+#endif
+#ifndef _WIN32
+    testPosixFileHandler();
+#endif
+    testSessionReopen();
 
     PrintInstrumentationReport();
 
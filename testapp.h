@@ -4,5 +4,11 @@
 #pragma once
 
 #include <iostream>
+#include <stddef.h>
+#include <stdint.h>
 
 // TODO: Reference additional headers your program requires here.
+
+// Appends and reads back 'records' keys with dbtiny::DBEngine (testapp.tiny.cpp).
+bool runTinyEngine(const char* logFile, const char* indexFile, uint32_t records,
+    size_t& pageBytes, uint32_t& leafSplits);
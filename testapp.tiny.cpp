@@ -0,0 +1,30 @@
+﻿// testapp.tiny.cpp : The part of testapp that runs dbtiny::DBEngine. It is
+// compiled with the engine sources of testapp.tiny.h (dbengine_tiny).
+
+#include "dbengine.h"
+#include "FileHandler_Windows.h"
+#include "testapp.h"
+
+bool runTinyEngine(const char* logFile, const char* indexFile, uint32_t records,
+    size_t& pageBytes, uint32_t& leafSplits) {
+    WindowsFileHandler logHandler;
+    WindowsFileHandler indexHandler;
+    dbtiny::DBEngine db(logHandler, indexHandler);
+    bool ok = db.open(logFile, indexFile, DB_MODE_SESSION);
+    // Scattered keys, so leaves split in the middle as well as at the end.
+    for (uint32_t i = 0; ok && i < records; i++) {
+        uint32_t key = (i * 7919) % records;
+        ok = db.append(key, 1, &key, sizeof(key));
+    }
+    for (uint32_t key = 0; ok && key < records; key++) {
+        uint32_t value = 0;
+        uint16_t size = 0;
+        ok = db.get(key, &value, sizeof(value), &size) && size == sizeof(value) && value == key;
+    }
+    dbtiny::DBStats stats;
+    db.getStats(stats);
+    pageBytes = sizeof(dbtiny::IndexPage);
+    leafSplits = stats.leafSplits;
+    db.close();
+    return ok;
+}
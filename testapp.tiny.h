@@ -0,0 +1,12 @@
+// testapp.tiny.h : Engine configuration "dbtiny" of testapp, built next to the
+// default engine (see "Engine Configurations" in dbengine.h).
+
+#pragma once
+
+#define DB_NAMESPACE dbtiny
+#define MAX_INDEX_ENTRIES 16
+// Eight references per interior page need more levels to address every key.
+#define DB_MAX_TREE_HEIGHT 12
+#define INDEX_CACHE_PAGES 2
+#define DB_CODEC_TYPES 0
+#define DB_CURSOR_BUFFER_SIZE 128